@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2022 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _PLINK_NODE_H_
+#define _PLINK_NODE_H_
+
+#include "process_linker_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Limits of one node */
+#define PLINK_NODE_MAX_INPUTS   32
+#define PLINK_NODE_MAX_OUTPUTS  4
+#define PLINK_NODE_MAX_BUFFERS  16  /* buffers in the pool of an output */
+#define PLINK_NODE_MAX_CONSUMERS 3  /* consumers of an output, the connections of a plink server */
+#define PLINK_NODE_MAX_THREADS  32
+
+/* Return value of PlinkNodeProcess: the output frames are not sent, their buffers are used again */
+#define PLINK_NODE_SKIP 1
+
+typedef void *PlinkNode;
+
+/* A mapped picture: a frame received by an input, or a buffer of the pool of an output */
+typedef struct _PlinkNodeFrame
+{
+    int id;                         /* id of the buffer, greater than 0 */
+    PlinkColorFormat format;
+    PlinkBayerPattern pattern;      /* Raw formats */
+    int width;
+    int height;
+    unsigned int offset[3];         /* planes: Y, U (or UV), V; R, G, B (packed RGB: [0] only); Raw samples: [0] */
+    unsigned int stride[3];
+    unsigned int tile_width;        /* tiled formats: size of a tile in bytes x rows, 0 when linear */
+    unsigned int tile_height;
+    unsigned int size;              /* bytes of the buffer */
+    unsigned char *data;            /* mapped buffer, plane k starts at data + offset[k] */
+    unsigned long long bus_address; /* of data */
+    long long pts;                  /* capture time in us, based on CLOCK_MONOTONIC */
+    unsigned int sequence;          /* inputs: number of the frame since the producer connected, from 1 */
+} PlinkNodeFrame;
+
+/* Options of a node, see PLINK_NODE_setOption */
+typedef enum _PlinkNodeOption
+{
+    PLINK_NODE_OPTION_THREADS = 0,  /* threads of PLINK_NODE_parallel, including the caller (default: number of CPUs) */
+    PLINK_NODE_OPTION_KEEP,         /* 1: keep running when all the inputs have left, waiting for new ones */
+    PLINK_NODE_OPTION_RATE,         /* rate mode: calls per second of the processing callback, driven by a clock
+                                       instead of the driving input (default: 0, off) */
+    PLINK_NODE_OPTION_LATENCY,      /* rate mode: ms, the inputs give the frames captured this long before a tick */
+    PLINK_NODE_OPTION_WINDOWS,      /* 1: windows mode, the producers render into windows of the buffer of output 0
+                                       instead of sending frames, see PLINK_NODE_setWindow */
+    PLINK_NODE_OPTION_CONSUMERS,    /* consumers of each output, all sent the same buffers (default: 1,
+                                       max PLINK_NODE_MAX_CONSUMERS) */
+    PLINK_NODE_OPTION_MAX_AGE,      /* ms, the outputs drop frames captured longer ago, see PLINK_OPTION_MAX_AGE
+                                       (default: 0, off) */
+    PLINK_NODE_OPTION_MAX
+} PlinkNodeOption;
+
+typedef struct _PlinkNodeStats
+{
+    unsigned long long processed;   /* calls of the processing callback */
+    unsigned long long sent;        /* output frames sent to a consumer at least, with or without their buffer */
+    unsigned long long skipped;     /* input frames replaced by a newer one before being processed */
+    unsigned long long waited_us;   /* time spent waiting for a free output buffer */
+    unsigned long long dropped;     /* output frames dropped by the policy of a channel, once per consumer,
+                                       see PLINK_setOption */
+} PlinkNodeStats;
+
+/* State of an input when its frame was given to the processing callback, see PLINK_NODE_getInput */
+typedef struct _PlinkNodeInput
+{
+    int connected;          /* a producer is connected */
+    int order;              /* connected inputs: from 0 in the order they joined, the driving input is 0 */
+    unsigned int joined;    /* changed whenever a producer connects */
+} PlinkNodeInput;
+
+/**
+ * \brief Processing callback of a node
+ *
+ * Called by PLINK_NODE_run for each frame of the driving input, the input which joined first.
+ * The other inputs give the latest frame they received, the same one again if none arrived since.
+ * Without inputs, the callback is called whenever every output has a free buffer.
+ * In rate mode it is called on each tick of a clock instead, once an input has a frame, and every input
+ * gives the frame captured nearest to the tick minus the latency. In windows mode it is called while
+ * an input is connected, the inputs give no frame, and the callback sets their windows.
+ *
+ * \param node The node.
+ * \param inputs One frame per input, in the order of PLINK_NODE_addInput; NULL when the input has no frame.
+ *        The frames stay mapped until the callback returns.
+ * \param outputs One free buffer per output, in the order of PLINK_NODE_addOutput.
+ *        pts is preset to the one of the driving input. The description, e.g. the resolution,
+ *        may be changed within the size of the buffer, it is kept for the next frames.
+ * \param arg The argument given to PLINK_NODE_create.
+ * \return 0 to send the outputs, PLINK_NODE_SKIP to send nothing, a negative value to stop the node.
+ */
+typedef int (*PlinkNodeProcess)(PlinkNode node, PlinkNodeFrame *inputs[], PlinkNodeFrame *outputs[], void *arg);
+
+/* A band of the work split by PLINK_NODE_parallel, band from 0 to bands - 1 */
+typedef void (*PlinkNodeBand)(int band, void *arg);
+
+/**
+ * \brief Receive callback of a node
+ *
+ * Called on the thread of an input for every packet received, before the node takes its frame,
+ * e.g. to read descriptors the node does not use. Also called with pkt NULL when a producer connects,
+ * before its first packet, so that what was kept of the previous producer can be dropped.
+ *
+ * \param input Number of the input.
+ * \param pkt The packet received.
+ * \param data The mapped buffer of a packet without frame, NULL otherwise; returned to the producer after the call.
+ * \param size Bytes of data.
+ * \param arg The argument given to PLINK_NODE_create.
+ */
+typedef void (*PlinkNodeReceive)(int input, PlinkPacket *pkt, const void *data, unsigned int size, void *arg);
+
+/**
+ * \brief Create a node
+ *
+ * A node receives frames from its inputs, each a client of an upstream plink server, and sends
+ * frames of its own buffers to its outputs, each a plink server with one consumer
+ * (or more, see PLINK_NODE_OPTION_CONSUMERS).
+ * The input threads, the mapping and the return of the buffers, the pools of the outputs and
+ * the exit messages are handled by the node; the application only processes frames.
+ * The application should ignore SIGPIPE, a peer may leave while a message is sent.
+ *
+ * \param node Point to the node created.
+ * \param process Processing callback.
+ * \param arg Argument of the callback.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_create(PlinkNode *node, PlinkNodeProcess process, void *arg);
+
+/**
+ * \brief Set the receive callback of the inputs, before PLINK_NODE_run
+ *
+ * \param node The node.
+ * \param receive Receive callback, NULL for none.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_setReceive(PlinkNode node, PlinkNodeReceive receive);
+
+/**
+ * \brief Add an input
+ *
+ * The input connects to the server whenever it is available, and again after the producer leaves.
+ * Inputs are numbered from 0 in the order of the calls.
+ *
+ * \param node The node.
+ * \param name Socket file name of the upstream server.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_addInput(PlinkNode node, const char *name);
+
+/**
+ * \brief Add an output
+ *
+ * Create the plink server of the output and allocate its pool of buffers, in video memory,
+ * or with memfd when the video memory driver is not available; the consumers then map them with mmap.
+ * Outputs are numbered from 0 in the order of the calls.
+ *
+ * \param node The node.
+ * \param name Socket file name of the server.
+ * \param frame Description of the frames, see PLINK_NODE_initFrame; size is the size of a buffer.
+ * \param buffers Number of buffers in the pool, from 2 to PLINK_NODE_MAX_BUFFERS.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_addOutput(PlinkNode node, const char *name, const PlinkNodeFrame *frame, int buffers);
+
+/**
+ * \brief Describe frames of the format with planes one after the other
+ *
+ * \param frame The frame to describe.
+ * \param format Color format, any but the tiled formats.
+ * \param width Width in pixels.
+ * \param height Height in pixels.
+ * \param stride Bytes per row of the first plane, 0 for the minimum; the chroma of planar formats is half of it.
+ * \return PLINK_STATUS_OK successful,
+ * \return PLINK_STATUS_WRONG_PARAMS if the format is not supported.
+ */
+PlinkStatus PLINK_NODE_initFrame(PlinkNodeFrame *frame, PlinkColorFormat format, int width, int height, int stride);
+
+/**
+ * \brief Set an option of the node, before PLINK_NODE_run
+ *
+ * \param node The node.
+ * \param option The option to set. See PlinkNodeOption.
+ * \param value Value of the option.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_setOption(PlinkNode node, PlinkNodeOption option, int value);
+
+/**
+ * \brief Run the node
+ *
+ * Start the inputs, wait for the consumers of every output, then call the processing callback
+ * until the node is stopped, all the inputs have left (unless PLINK_NODE_OPTION_KEEP is set),
+ * a consumer leaves or the callback returns a negative value.
+ * The producers and the consumers are sent an exit message before returning.
+ *
+ * \param node The node.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_run(PlinkNode node);
+
+/**
+ * \brief Stop the node
+ *
+ * The threads of the node notice it within 100ms, once the processing callback in progress has returned.
+ * PLINK_NODE_run then waits up to 1s in total for the consumers to return the buffers sent, so it
+ * returns within about 1.1s plus the time of the callback. Can be called from any thread or from a signal handler.
+ *
+ * \param node The node.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_stop(PlinkNode node);
+
+/**
+ * \brief Split work into bands processed in parallel
+ *
+ * Call band(i, arg) for i from 0 to bands - 1 on the threads of the node, the caller included,
+ * and return when all the bands are done. Meant to be called from the processing callback.
+ *
+ * \param node The node.
+ * \param bands Number of bands.
+ * \param band Function processing one band.
+ * \param arg Argument of the function.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_parallel(PlinkNode node, int bands, PlinkNodeBand band, void *arg);
+
+/**
+ * \brief Get the state of an input, from the processing callback
+ *
+ * \param node The node.
+ * \param input Number of the input.
+ * \param state Point to the state to be filled, as of the frames given to the callback.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_getInput(PlinkNode node, int input, PlinkNodeInput *state);
+
+/**
+ * \brief Set the window of an input, from the processing callback in windows mode
+ *
+ * Once the callback returns 0, the producer of the input is sent the window, a rectangle of the buffer
+ * of output 0, and renders its next frame into it; the output is sent when every producer is done or
+ * has left. Windows mode needs video memory, which the producers import, and an NV12 output.
+ *
+ * \param node The node.
+ * \param input Number of the input.
+ * \param x Left of the window in pixels, even.
+ * \param y Top of the window in pixels, even.
+ * \param width Width in pixels, even.
+ * \param height Height in pixels, even.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_setWindow(PlinkNode node, int input, int x, int y, int width, int height);
+
+/**
+ * \brief Get statistics of the node
+ *
+ * \param node The node.
+ * \param stats Point to the statistics to be filled.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_getStats(PlinkNode node, PlinkNodeStats *stats);
+
+/**
+ * \brief Destroy the node
+ *
+ * Free the buffers of the outputs and close the servers. The node must not be running.
+ *
+ * \param node The node.
+ * \return PLINK_STATUS_OK successful,
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_NODE_destroy(PlinkNode node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !_PLINK_NODE_H_ */
@@ -24,8 +24,8 @@ extern "C" {
 #endif
 
 #define PLINK_VERSION_MAJOR     0
-#define PLINK_VERSION_MINOR     1
-#define PLINK_VERSION_REVISION  1
+#define PLINK_VERSION_MINOR     2
+#define PLINK_VERSION_REVISION  0
 
 /* Maximum data descriptors in one packet */
 #define PLINK_MAX_DATA_DESCS 10
@@ -50,6 +50,7 @@ typedef enum _PlinkStatus
     PLINK_STATUS_MORE_DATA = 1,     /* have more data to parse in the receive buffer */
     PLINK_STATUS_TIMEOUT = 2,       /* wait timeout, which means no data received within the time */
     PLINK_STATUS_NO_DATA = 3,       /* no data recieved */
+    PLINK_STATUS_DROPPED = 4,       /* frame is dropped by the channel policy, see PlinkOption */
     PLINK_STATUS_ERROR = -1,        /* general error */
     PLINK_STATUS_WRONG_PARAMS = -2, /* wrong parameters */
     PLINK_STATUS_NO_MEMORY = -3,    /* not enough memory */
@@ -63,6 +64,28 @@ typedef enum _PlinkMode
     PLINK_MODE_MAX
 } PlinkMode;
 
+/* per-channel options, see PLINK_setOption */
+typedef enum _PlinkOption
+{
+    PLINK_OPTION_MAILBOX = 0,   /* 1: deliver only the latest frame on receive and release the skipped ones */
+    PLINK_OPTION_MAX_AGE,       /* drop frames whose capture time is older than this many ms; 0 disables */
+    PLINK_OPTION_DECIMATION,    /* subscription: receive only every Nth frame; 0 or 1 disables */
+    PLINK_OPTION_MAX_FPS,       /* subscription: receive at most this many frames per second; 0 disables */
+    PLINK_OPTION_DESC_TYPES,    /* subscription: mask of PlinkDescType to receive, see PLINK_DESC_TYPE_MASK; 0 for all */
+    PLINK_OPTION_MAX
+} PlinkOption;
+
+/* per-channel statistics, see PLINK_getStats */
+typedef struct _PlinkStats
+{
+    unsigned long long sent;        /* packets sent */
+    unsigned long long received;    /* packets received */
+    unsigned long long skipped;     /* frames released without delivery in mailbox mode */
+    unsigned long long dropped;     /* frames dropped for exceeding PLINK_OPTION_MAX_AGE */
+    unsigned long long decimated;   /* frames not sent due to the subscription of the receiver */
+    unsigned long long stripped;    /* packets sent without fd, or not at all, due to PLINK_OPTION_DESC_TYPES */
+} PlinkStats;
+
 typedef union _PlinkVersion
 {
     struct process_linker
@@ -137,6 +160,7 @@ PlinkStatus PLINK_connect(PlinkHandle plink, PlinkChannelID *channel);
  *
  * Server calls this function to wait for connection and accept with timeout.
  * Client calls this function to connect to server with timeout.
+ * The client is woken up as soon as the server is created, it does not poll.
  *
  * \param plink Pointer of plink instance.
  * \param channel id of the new connection. Valid for server only. Should be 0 for client
@@ -156,6 +180,8 @@ PlinkStatus PLINK_connect_ex(PlinkHandle plink, PlinkChannelID *channel, int tim
  * \param channel The channel to send this packet. Valid for server only. Should be 0 for client
  * \param pkt Point to the packet to be sent.
  * \return PLINK_STATUS_OK successful, 
+ * \return PLINK_STATUS_DROPPED if the frame is not sent due to the channel options, or sent without its fd
+ *         because the receiver did not subscribe to the buffer; either way the buffer is not passed,
  * \return other unsuccessful.
  */
 PlinkStatus PLINK_send(PlinkHandle plink, PlinkChannelID channel, PlinkPacket *pkt);
@@ -185,6 +211,8 @@ PlinkStatus PLINK_wait(PlinkHandle plink, PlinkChannelID channel, int timeout_ms
  * \param channel The channel to receive data. Valid for server only. Should be 0 for client
  * \param pkt Point to the received packet.
  * \return PLINK_STATUS_OK successful, 
+ * \return PLINK_STATUS_DROPPED if a frame is received but dropped due to the channel options;
+ *         its buffer is released to the sender and pkt holds the remaining messages only,
  * \return other unsuccessful.
  */
 PlinkStatus PLINK_recv(PlinkHandle plink, PlinkChannelID channel, PlinkPacket *pkt);
@@ -210,6 +238,7 @@ PlinkStatus PLINK_recv_ex(PlinkHandle plink, PlinkChannelID channel, PlinkPacket
  * \brief Close connections
  *
  * Close connections. Server can set channel to PLINK_CLOSE_ALL to close all connections.
+ * A server closing one channel keeps listening, the channel can be used again by a new client.
  *
  * \param plink Pointer of plink instance.
  * \param channel The connection to be closed. Valid for server only. Should be 0 for client
@@ -218,6 +247,34 @@ PlinkStatus PLINK_recv_ex(PlinkHandle plink, PlinkChannelID channel, PlinkPacket
  */
 PlinkStatus PLINK_close(PlinkHandle plink, PlinkChannelID channel);
 
+/**
+ * \brief Set an option of the channel
+ *
+ * Options are kept per channel and can be changed at any time.
+ * A client can set options before PLINK_connect.
+ * Subscription options tell what the caller wants to receive. They are sent to the peer,
+ * which enforces them in PLINK_send, so skipped frames never leave the sender.
+ *
+ * \param plink Pointer of plink instance.
+ * \param channel The channel to configure. Valid for server only. Should be 0 for client
+ * \param option The option to set. See PlinkOption.
+ * \param value Value of the option.
+ * \return PLINK_STATUS_OK successful, 
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_setOption(PlinkHandle plink, PlinkChannelID channel, PlinkOption option, int value);
+
+/**
+ * \brief Get statistics of the channel
+ *
+ * \param plink Pointer of plink instance.
+ * \param channel The channel to query. Valid for server only. Should be 0 for client
+ * \param stats Point to the statistics to be filled.
+ * \return PLINK_STATUS_OK successful, 
+ * \return other unsuccessful.
+ */
+PlinkStatus PLINK_getStats(PlinkHandle plink, PlinkChannelID channel, PlinkStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -47,6 +47,9 @@ typedef enum _PlinkColorFormat
     PLINK_COLOR_FormatRawBayer8bit,
     PLINK_COLOR_FormatRawBayer10bit,
     PLINK_COLOR_FormatRawBayer12bit,
+    PLINK_COLOR_FormatYUV420SemiPlanarTile4x4,      /* NV12, both planes in tiles of 4x4 bytes */
+    PLINK_COLOR_FormatYUV420SemiPlanarTile8x4,      /* NV12, both planes in tiles of 8x4 bytes */
+    PLINK_COLOR_FormatYUV420SemiPlanarTile64x32,    /* NV12, both planes in macro-tiles of 64x32 bytes */
     PLINK_COLOR_FormatMax
 } PlinkColorFormat;
 
@@ -69,14 +72,19 @@ typedef enum _PlinkDescType
     PLINK_TYPE_MESSAGE,         /* PlinkMsg */
     PLINK_TYPE_TIME,            /* PlinkTimeInfo */
     PLINK_TYPE_2D_RAW,          /* PlinkRawInfo */
+    PLINK_TYPE_SUBSCRIPTION,    /* PlinkSubscription, handled inside plink library */
     PLINK_TYPE_MAX
 } PlinkDescType;
 
+/* Bit of a descriptor type in the mask of PLINK_OPTION_DESC_TYPES */
+#define PLINK_DESC_TYPE_MASK(type) (1 << (type))
+
 /* time type */
 typedef enum _PlinkTimeType
 {
     PLINK_TIME_START = 0,       /* start time */
     PLINK_TIME_CALIBRATION,     /* time delta for calibration */
+    PLINK_TIME_CAPTURE,         /* capture time of the frame, based on CLOCK_MONOTONIC */
     PLINK_TIME_MAX
 } PlinkTimeType;
 
@@ -105,6 +113,8 @@ typedef struct _PlinkYuvInfo
     unsigned int stride_y;
     unsigned int stride_u;
     unsigned int stride_v;
+    unsigned int tile_width;    /* tiled formats: width of a tile in bytes, 0 for the size given by the format */
+    unsigned int tile_height;   /* tiled formats: height of a tile in rows, 0 for the size given by the format */
 } PlinkYuvInfo;
 
 /* 2D RGB surface */
@@ -180,6 +190,14 @@ typedef struct _PlinkMsg
                             /* Other values are reserved */
 } PlinkMsg;
 
+/* Used by receiver to ask the sender to filter frames, see PLINK_setOption */
+typedef struct _PlinkSubscription
+{
+    PlinkDescHdr header;
+    int option;             /* PlinkOption to be applied by the sender */
+    int value;              /* value of the option */
+} PlinkSubscription;
+
 /* time information */
 typedef struct _PlinkTimeInfo
 {
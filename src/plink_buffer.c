@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2022 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "plink_buffer.h"
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define MAX_FILE_SPAN       0xFFFFF000LL    // bytes of a file-backed buffer the 32-bit offsets can address
+
+static unsigned long long padRows(unsigned long long rows, unsigned int tile_height)
+{
+    return tile_height > 0 ? (rows + tile_height - 1) / tile_height * tile_height : rows;
+}
+
+/* Add plane [offset, offset + size) to the span */
+static void addPlane(unsigned long long offset, unsigned long long size,
+                     unsigned long long *begin, unsigned long long *end)
+{
+    if (offset < *begin)
+        *begin = offset;
+    if (offset + size > *end)
+        *end = offset + size;
+}
+
+/* Bytes of the buffer from the first plane of the picture to the end of the last one.
+ * Offsets of 0 but the first plane's stand for planes one after the other, as the consumers read them. */
+static int getSpan(PlinkDescHdr *picture, unsigned long long *begin, unsigned long long *end)
+{
+    *begin = ~0ULL;
+    *end = 0;
+    if (picture->type == PLINK_TYPE_2D_YUV)
+    {
+        PlinkYuvInfo *info = (PlinkYuvInfo *)picture;
+        unsigned int tile_height = 0;
+        if (info->format >= PLINK_COLOR_FormatYUV420SemiPlanarTile4x4 &&
+            info->format <= PLINK_COLOR_FormatYUV420SemiPlanarTile64x32)
+            tile_height = info->tile_height > 0 ? info->tile_height :
+                (info->format == PLINK_COLOR_FormatYUV420SemiPlanarTile64x32 ? 32 : 4);
+        unsigned long long rows = padRows(info->pic_height, tile_height);
+        addPlane(info->offset_y, rows * info->stride_y, begin, end);
+        if (info->format == PLINK_COLOR_FormatMonochrome)
+            return 0;
+
+        int planar = info->format == PLINK_COLOR_FormatYUV420Planar || info->format == PLINK_COLOR_FormatYUV422Planar;
+        int full = info->format == PLINK_COLOR_FormatYUV422Planar || info->format == PLINK_COLOR_FormatYUV422SemiPlanar;
+        unsigned long long rows_uv = full ? rows : padRows((rows + 1) / 2, tile_height);
+        unsigned long long offset_u = info->offset_u > 0 ? info->offset_u : info->offset_y + rows * info->stride_y;
+        unsigned long long stride_u = info->stride_u > 0 ? info->stride_u : (planar ? info->stride_y / 2 : info->stride_y);
+        addPlane(offset_u, rows_uv * stride_u, begin, end);
+        if (planar)
+        {
+            unsigned long long offset_v = info->offset_v > 0 ? info->offset_v : offset_u + rows_uv * stride_u;
+            addPlane(offset_v, rows_uv * (info->stride_v > 0 ? info->stride_v : stride_u), begin, end);
+        }
+        return 0;
+    }
+    else if (picture->type == PLINK_TYPE_2D_RGB)
+    {
+        PlinkRGBInfo *info = (PlinkRGBInfo *)picture;
+        unsigned long long rows = info->img_height;
+        unsigned long long offset[3] = { info->offset_r, info->offset_g, info->offset_b };
+        unsigned long long stride[3] = { info->stride_r, info->stride_g, info->stride_b };
+        for (int k = 1; k < 3; k++)
+        {
+            if (stride[k] == 0)
+                stride[k] = stride[0];
+        }
+        // planes one after the other, in the order of the name
+        unsigned long long plane = stride[0] * rows;
+        if (info->format == PLINK_COLOR_Format24BitRGB888Planar && info->offset_g == 0 && info->offset_b == 0)
+        {
+            offset[1] = offset[0] + plane;
+            offset[2] = offset[0] + plane * 2;
+        }
+        else if (info->format == PLINK_COLOR_Format24BitBGR888Planar && info->offset_r == 0 && info->offset_g == 0)
+        {
+            offset[1] = offset[2] + plane;
+            offset[0] = offset[2] + plane * 2;
+        }
+        int planes = info->format == PLINK_COLOR_Format24BitRGB888Planar ||
+                     info->format == PLINK_COLOR_Format24BitBGR888Planar ? 3 : 1;
+        for (int k = 0; k < planes; k++)
+            addPlane(offset[k], stride[k] * rows, begin, end);
+        return 0;
+    }
+    else if (picture->type == PLINK_TYPE_2D_RAW)
+    {
+        PlinkRawInfo *info = (PlinkRawInfo *)picture;
+        addPlane(info->offset, (unsigned long long)info->stride * info->img_height, begin, end);
+        return 0;
+    }
+    return -1;
+}
+
+/* Make the offsets of the planes relative to a mapping starting at base, the ones standing for the default stay 0 */
+static void rebase(PlinkDescHdr *picture, unsigned int base)
+{
+    unsigned int *offsets[3] = { NULL, NULL, NULL };
+    if (picture->type == PLINK_TYPE_2D_YUV)
+    {
+        PlinkYuvInfo *info = (PlinkYuvInfo *)picture;
+        offsets[0] = &info->offset_y;
+        offsets[1] = &info->offset_u;
+        offsets[2] = &info->offset_v;
+    }
+    else if (picture->type == PLINK_TYPE_2D_RGB)
+    {
+        PlinkRGBInfo *info = (PlinkRGBInfo *)picture;
+        offsets[0] = &info->offset_r;
+        offsets[1] = &info->offset_g;
+        offsets[2] = &info->offset_b;
+    }
+    else if (picture->type == PLINK_TYPE_2D_RAW)
+        offsets[0] = &((PlinkRawInfo *)picture)->offset;
+
+    // base is at most the lowest offset, an offset of 0 is then either the default or base is 0
+    for (int k = 0; k < 3; k++)
+    {
+        if (offsets[k] != NULL && *offsets[k] > 0)
+            *offsets[k] -= base;
+    }
+}
+
+PlinkDescHdr *BUFFER_getPicture(PlinkPacket *pkt)
+{
+    for (int i = 0; i < pkt->num; i++)
+    {
+        PlinkDescHdr *hdr = (PlinkDescHdr *)(pkt->list[i]);
+        if (hdr->type == PLINK_TYPE_2D_YUV || hdr->type == PLINK_TYPE_2D_RGB || hdr->type == PLINK_TYPE_2D_RAW)
+            return hdr;
+    }
+    return NULL;
+}
+
+int BUFFER_map(void *vmem, VmemParams *params, PlinkDescHdr *picture)
+{
+    if (vmem != NULL && VMEM_import(vmem, params) == VMEM_STATUS_OK)
+    {
+        if (VMEM_mmap(vmem, params) == VMEM_STATUS_OK)
+            return 0;
+        params->vir_address = NULL;
+        VMEM_release(vmem, params);
+    }
+
+    struct stat st;
+    if (fstat(params->fd, &st) != 0 || st.st_size == 0)
+        return -1;
+    unsigned long long file_size = st.st_size;
+    unsigned long long begin = 0;
+    unsigned long long end = file_size < MAX_FILE_SPAN ? file_size : MAX_FILE_SPAN;
+    unsigned long long first, last;
+    if (picture != NULL && getSpan(picture, &first, &last) == 0)
+    {
+        begin = first;
+        end = last < file_size ? last : file_size;
+    }
+    else
+        picture = NULL;
+    if (begin >= end)
+        return -1;
+
+    // a frame of a recorded file is a small part of it, the mapping and its page tables stay small
+    unsigned long long base = begin & ~((unsigned long long)sysconf(_SC_PAGESIZE) - 1);
+    params->size = end - base;
+    params->vir_address = mmap(NULL, params->size, PROT_READ, MAP_SHARED, params->fd, base);
+    if (params->vir_address == MAP_FAILED)
+    {
+        params->vir_address = NULL;
+        return -1;
+    }
+    if (picture != NULL)
+        rebase(picture, base);
+    return 1;
+}
+
+int BUFFER_unmap(void *vmem, VmemParams *params, int direct)
+{
+    if (direct)
+        return munmap(params->vir_address, params->size) == 0 ? 0 : -1;
+    if (vmem != NULL && params->vir_address != NULL)
+        return VMEM_release(vmem, params) == VMEM_STATUS_OK ? 0 : -1;
+    return 0;
+}
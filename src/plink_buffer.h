@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2022 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _PLINK_BUFFER_H_
+#define _PLINK_BUFFER_H_
+
+#include "process_linker_types.h"
+#include "video_mem.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Mapping of the buffers received by the consumers: libplinknode, plinkclient and plinkstitcher */
+
+/* The picture descriptor of a packet, 2D YUV, RGB or Raw; NULL when there is none */
+PlinkDescHdr *BUFFER_getPicture(PlinkPacket *pkt);
+
+/**
+ * \brief Map a received buffer
+ *
+ * Video memory is imported and mapped whole. Any other file, e.g. the input file of plinkserver -r,
+ * or shared memory of a producer without video memory, is mapped read-only: only the pages of the
+ * picture, and the offsets of the planes in the descriptor are made relative to the mapping.
+ * The mapped range is params->vir_address, params->size bytes.
+ *
+ * \param vmem VMEM handle, NULL without video memory.
+ * \param params params->fd is the file descriptor of the buffer.
+ * \param picture Descriptor of the picture in the buffer, updated; NULL to map the whole buffer.
+ * \return 1 when the file is mapped with mmap, 0 when it is video memory, -1 on error.
+ */
+int BUFFER_map(void *vmem, VmemParams *params, PlinkDescHdr *picture);
+
+/* Unmap a buffer mapped by BUFFER_map, direct is its return value. Returns 0, or -1 on error. */
+int BUFFER_unmap(void *vmem, VmemParams *params, int direct);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !_PLINK_BUFFER_H_ */
@@ -0,0 +1,1726 @@
+/*
+ * Copyright (c) 2022 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include "plink_node.h"
+#include "video_mem.h"
+#include "plink_buffer.h"
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define MAX_QUEUED          3   // rate mode: frames queued per input, less than the buffers of plinkserver
+#define NUM_OF_SLOTS        (MAX_QUEUED + 2)    // frames held per input: the queued ones, the one being processed and a free one
+#define SLOT_NONE           -1
+#define POLL_MS             100 // how often the threads check whether the node is stopping
+#define RATE_POLL_MS        10  // rate mode: how often an input returns the frames the processing loop is done with
+#define RECONNECT_DELAY_MS  100 // an input reached a server which is shutting down
+#define EXIT_TIMEOUT_MS     1000    // for the consumers to return the buffers, all the outputs together
+
+/* Window of an input in windows mode */
+#define WINDOW_NONE         0
+#define WINDOW_SET          1   // by PLINK_NODE_setWindow, requested once the processing callback returns 0
+#define WINDOW_REQUESTED    2   // to be rendered by the producer
+#define WINDOW_FILLED       3
+
+#define NODE_PRINT(level, ...) \
+    { \
+        if (log_level >= NODE_LOG_##level) \
+        { \
+            struct timeval ts; \
+            gettimeofday(&ts, 0); \
+            printf("PLINK_NODE[%d][%ld.%06ld] %s: ", pid, ts.tv_sec, ts.tv_usec, #level); \
+            printf(__VA_ARGS__); \
+        } \
+    }
+
+#define NODE_PRINT_RETURN(retcode, level, ...) \
+    { \
+        NODE_PRINT(level, __VA_ARGS__) \
+        return retcode; \
+    }
+
+/* Same levels as PLINK_LOG_LEVEL */
+typedef enum _NodeLogLevel
+{
+    NODE_LOG_QUIET = 0,
+    NODE_LOG_ERROR,
+    NODE_LOG_WARNING,
+    NODE_LOG_INFO,
+    NODE_LOG_DEBUG,
+    NODE_LOG_TRACE,
+    NODE_LOG_MAX
+} NodeLogLevel;
+
+/* A frame received by an input, held until the processing loop is done with it */
+typedef struct _NodePicture
+{
+    PlinkNodeFrame frame;
+    VmemParams params;
+    int fd;
+    int direct;                 // a file mapped with mmap, not video memory
+} NodePicture;
+
+typedef struct _NodeInput
+{
+    struct _NodeContext *ctx;
+    int index;
+    char *name;
+    pthread_t thread;
+    NodePicture slots[NUM_OF_SLOTS];    // owned by the input thread, but the current one
+    int queued[MAX_QUEUED]; // frames not taken by the processing loop yet, oldest first, under mutex
+    int num_queued;         // at most 1 but in rate mode, under mutex
+    int current;            // frame taken by the processing loop, under mutex
+    unsigned int done;      // slots the processing loop is done with, to be returned to the producer, under mutex
+    int connected;          // under mutex
+    unsigned int joined;    // order of connection, the connected input which joined first drives the node
+    unsigned int sequence;
+    PlinkNodeInput state;   // as given to the processing callback, taken with the frames
+    int window;             // windows mode: WINDOW_*, under mutex
+    PlinkYuvInfo window_info;
+    int window_fd;
+} NodeInput;
+
+typedef struct _NodeOutput
+{
+    char *name;
+    PlinkHandle plink;
+    PlinkChannelID id[PLINK_NODE_MAX_CONSUMERS];    // channel of each consumer, -1 when not connected
+    int buffers;
+    PlinkNodeFrame frames[PLINK_NODE_MAX_BUFFERS];
+    VmemParams params[PLINK_NODE_MAX_BUFFERS];
+    unsigned int busy[PLINK_NODE_MAX_CONSUMERS];    // buffers sent to each consumer and not returned yet
+    unsigned int order[PLINK_NODE_MAX_BUFFERS];     // value of sent when the buffer was sent
+    unsigned int sent;
+    int next;               // buffer given to the processing callback
+} NodeOutput;
+
+typedef struct _NodeContext
+{
+    PlinkNodeProcess process;
+    PlinkNodeReceive receive;
+    void *arg;
+    void *vmem;             // NULL without video memory, the buffers of the outputs are then memfd
+    NodeInput in[PLINK_NODE_MAX_INPUTS];
+    int inputs;
+    NodeOutput out[PLINK_NODE_MAX_OUTPUTS];
+    int outputs;
+    int option[PLINK_NODE_OPTION_MAX];
+    volatile int exit;      // set by PLINK_NODE_stop, maybe from a signal handler
+    int running;
+    unsigned int joins;     // inputs connected since the node started, under mutex
+    long long next_tick;    // rate mode: time of the next call of the processing callback
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    // an input joined, left or received a frame, or the processing loop took the frames
+    PlinkNodeStats stats;   // under mutex
+    pthread_t workers[PLINK_NODE_MAX_THREADS];
+    int num_workers;
+    pthread_mutex_t pool_mutex;
+    pthread_cond_t cond_work;
+    pthread_cond_t cond_done;
+    PlinkNodeBand band;     // work of PLINK_NODE_parallel, under pool_mutex
+    void *band_arg;
+    int bands;
+    int next_band;
+    int pending;            // bands not finished yet
+    unsigned int generation;    // changed with the work
+    int quit;
+} NodeContext;
+
+static int log_level = NODE_LOG_ERROR;
+static int pid = 0;
+
+static int getLogLevel()
+{
+    char *env = getenv("PLINK_LOG_LEVEL");
+    if (env == NULL)
+        return NODE_LOG_ERROR;
+    else
+    {
+        int level = atoi(env);
+        if (level >= NODE_LOG_MAX || level < NODE_LOG_QUIET)
+            return NODE_LOG_ERROR;
+        else
+            return level;
+    }
+}
+
+static long long getTimeUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int isStopping(NodeContext *ctx)
+{
+    return __atomic_load_n(&ctx->exit, __ATOMIC_SEQ_CST);
+}
+
+/* Wait on cond for at most POLL_MS, as the node may be stopped without signaling it */
+static void waitEvent(NodeContext *ctx)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += POLL_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&ctx->cond, &ctx->mutex, &ts);
+}
+
+static int isRgbFormat(PlinkColorFormat format)
+{
+    return format >= PLINK_COLOR_Format32bitBGRA8888 && format <= PLINK_COLOR_Format24BitBGR888Planar;
+}
+
+static int isRawFormat(PlinkColorFormat format)
+{
+    return format >= PLINK_COLOR_FormatRawBayer8bit && format <= PLINK_COLOR_FormatRawBayer12bit;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Inputs */
+
+static void returnBuffer(PlinkHandle plink, int id, int fd)
+{
+    PlinkPacket sendpkt = {0};
+    PlinkMsg msg = {0};
+
+    msg.header.type = PLINK_TYPE_MESSAGE;
+    msg.header.size = DATA_SIZE(PlinkMsg);
+    msg.msg = id;
+    sendpkt.list[0] = &msg;
+    sendpkt.num = 1;
+    sendpkt.fd = fd;
+    PLINK_send(plink, 0, &sendpkt);
+    if (fd != PLINK_INVALID_FD)
+        close(fd);
+}
+
+static void releasePicture(NodeContext *ctx, PlinkHandle plink, NodePicture *pic)
+{
+    if (pic->fd != PLINK_INVALID_FD && BUFFER_unmap(ctx->vmem, &pic->params, pic->direct) != 0)
+        NODE_PRINT(ERROR, "Failed to release buffer %d\n", pic->frame.id);
+    returnBuffer(plink, pic->frame.id, pic->fd);
+}
+
+/* Describe the frame of the packet, and map its buffer. Returns 1 when the packet has a frame. */
+static int readPicture(NodeInput *in, PlinkHandle plink, PlinkPacket *pkt, NodePicture *pic, int *exitcode)
+{
+    PlinkNodeFrame *frame = &pic->frame;
+    int received = 0;
+    int first_id = 0;
+    memset(pic, 0, sizeof(*pic));
+    pic->fd = PLINK_INVALID_FD;
+
+    // map first, the offsets of a picture in a file are then relative to the pages mapped
+    PlinkDescHdr *picture = BUFFER_getPicture(pkt);
+    if (picture != NULL && pkt->fd != PLINK_INVALID_FD)
+    {
+        pic->params.fd = pkt->fd;
+        pic->direct = BUFFER_map(in->ctx->vmem, &pic->params, picture);
+        if (pic->direct < 0)
+        {
+            pic->direct = 0;
+            NODE_PRINT(ERROR, "Input %s: failed to map buffer %d\n", in->name, picture->id);
+            returnBuffer(plink, picture->id, pkt->fd);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < pkt->num; i++)
+    {
+        PlinkDescHdr *hdr = (PlinkDescHdr *)(pkt->list[i]);
+        if (first_id == 0 && hdr->id > 0)
+            first_id = hdr->id;
+        if (hdr->type == PLINK_TYPE_2D_YUV)
+        {
+            PlinkYuvInfo *info = (PlinkYuvInfo *)(pkt->list[i]);
+            frame->id = hdr->id;
+            frame->format = info->format;
+            frame->width = info->pic_width;
+            frame->height = info->pic_height;
+            frame->bus_address = info->bus_address_y - info->offset_y;
+            frame->offset[0] = info->offset_y;
+            frame->stride[0] = info->stride_y;
+            if (info->format >= PLINK_COLOR_FormatYUV420SemiPlanarTile4x4 &&
+                info->format <= PLINK_COLOR_FormatYUV420SemiPlanarTile64x32)
+            {
+                frame->tile_width = info->tile_width > 0 ? info->tile_width :
+                    (info->format == PLINK_COLOR_FormatYUV420SemiPlanarTile4x4 ? 4 :
+                     info->format == PLINK_COLOR_FormatYUV420SemiPlanarTile8x4 ? 8 : 64);
+                frame->tile_height = info->tile_height > 0 ? info->tile_height :
+                    (info->format == PLINK_COLOR_FormatYUV420SemiPlanarTile64x32 ? 32 : 4);
+            }
+            // the planes of tiled formats are padded to whole rows of tiles
+            unsigned int rows = frame->tile_height > 0 ?
+                (info->pic_height + frame->tile_height - 1) / frame->tile_height * frame->tile_height : info->pic_height;
+            int planar = info->format == PLINK_COLOR_FormatYUV420Planar || info->format == PLINK_COLOR_FormatYUV422Planar;
+            frame->offset[1] = info->offset_u > 0 ? info->offset_u : (info->offset_y + rows * info->stride_y);
+            frame->stride[1] = info->stride_u > 0 ? info->stride_u : (planar ? info->stride_y / 2 : info->stride_y);
+            unsigned int height_uv = info->format == PLINK_COLOR_FormatYUV420Planar ? info->pic_height / 2 : info->pic_height;
+            frame->offset[2] = info->offset_v > 0 ? info->offset_v : (frame->offset[1] + height_uv * frame->stride[1]);
+            frame->stride[2] = info->stride_v > 0 ? info->stride_v : frame->stride[1];
+            received = 1;
+        }
+        else if (hdr->type == PLINK_TYPE_2D_RGB)
+        {
+            PlinkRGBInfo *info = (PlinkRGBInfo *)(pkt->list[i]);
+            frame->id = hdr->id;
+            frame->format = info->format;
+            frame->width = info->img_width;
+            frame->height = info->img_height;
+            frame->bus_address = info->bus_address_r - info->offset_r;
+            frame->offset[0] = info->offset_r;
+            frame->offset[1] = info->offset_g;
+            frame->offset[2] = info->offset_b;
+            frame->stride[0] = info->stride_r;
+            frame->stride[1] = info->stride_g > 0 ? info->stride_g : info->stride_r;
+            frame->stride[2] = info->stride_b > 0 ? info->stride_b : info->stride_r;
+            // planes one after the other, in the order of the name
+            unsigned int plane = info->stride_r * info->img_height;
+            if (info->format == PLINK_COLOR_Format24BitRGB888Planar && info->offset_g == 0 && info->offset_b == 0)
+            {
+                frame->offset[1] = frame->offset[0] + plane;
+                frame->offset[2] = frame->offset[0] + plane * 2;
+            }
+            else if (info->format == PLINK_COLOR_Format24BitBGR888Planar && info->offset_r == 0 && info->offset_g == 0)
+            {
+                frame->offset[1] = frame->offset[2] + plane;
+                frame->offset[0] = frame->offset[2] + plane * 2;
+            }
+            received = 1;
+        }
+        else if (hdr->type == PLINK_TYPE_2D_RAW)
+        {
+            PlinkRawInfo *info = (PlinkRawInfo *)(pkt->list[i]);
+            frame->id = hdr->id;
+            frame->format = info->format;
+            frame->pattern = info->pattern < PLINK_BAYER_PATTERN_MAX ? info->pattern : PLINK_BAYER_PATTERN_RGGB;
+            frame->width = info->img_width;
+            frame->height = info->img_height;
+            frame->bus_address = info->bus_address - info->offset;
+            frame->offset[0] = info->offset;
+            frame->stride[0] = info->stride;
+            received = 1;
+        }
+        else if (hdr->type == PLINK_TYPE_TIME)
+        {
+            PlinkTimeInfo *info = (PlinkTimeInfo *)(pkt->list[i]);
+            if (info->type == PLINK_TIME_CAPTURE)
+                frame->pts = info->seconds * 1000000LL + info->useconds;
+        }
+        else if (hdr->type == PLINK_TYPE_MESSAGE)
+        {
+            PlinkMsg *msg = (PlinkMsg *)(pkt->list[i]);
+            if (msg->msg == PLINK_EXIT_CODE)
+            {
+                *exitcode = 1;
+                NODE_PRINT(INFO, "Input %s: exit\n", in->name);
+            }
+        }
+    }
+
+    if (received == 0)
+    {
+        // e.g. the buffer of object detections, not used by the node
+        if (pkt->fd != PLINK_INVALID_FD)
+            returnBuffer(plink, first_id, pkt->fd);
+        return 0;
+    }
+
+    pic->fd = pkt->fd;
+    if (frame->pts == 0)
+        frame->pts = getTimeUs();
+    frame->sequence = ++in->sequence;
+    if (pic->fd != PLINK_INVALID_FD)
+    {
+        frame->data = pic->params.vir_address;
+        frame->size = pic->params.size;
+    }
+    return 1;
+}
+
+/* Pass the packet to the receive callback, with its buffer mapped when the packet has no frame */
+static void notifyReceive(NodeInput *in, PlinkPacket *pkt)
+{
+    NodeContext *ctx = in->ctx;
+    VmemParams params;
+    int direct = -1;
+
+    memset(&params, 0, sizeof(params));
+    if (pkt->fd != PLINK_INVALID_FD && BUFFER_getPicture(pkt) == NULL)
+    {
+        params.fd = pkt->fd;
+        direct = BUFFER_map(ctx->vmem, &params, NULL);
+        if (direct < 0)
+            params.vir_address = NULL;
+    }
+    ctx->receive(in->index, pkt, params.vir_address, params.vir_address != NULL ? params.size : 0, ctx->arg);
+    if (direct >= 0 && BUFFER_unmap(ctx->vmem, &params, direct) != 0)
+        NODE_PRINT(ERROR, "Input %s: failed to release buffer\n", in->name);
+}
+
+/* The connected input which joined first, called with mutex locked */
+static NodeInput *getDriver(NodeContext *ctx)
+{
+    NodeInput *driver = NULL;
+    for (int i = 0; i < ctx->inputs; i++)
+    {
+        NodeInput *in = &ctx->in[i];
+        if (in->connected && (driver == NULL || in->joined < driver->joined))
+            driver = in;
+    }
+    return driver;
+}
+
+/* Whether the slot holds a frame the processing loop has or may take, called with mutex locked */
+static int isHeld(NodeInput *in, int slot)
+{
+    if (slot == in->current)
+        return 1;
+    for (int i = 0; i < in->num_queued; i++)
+    {
+        if (in->queued[i] == slot)
+            return 1;
+    }
+    return 0;
+}
+
+/* Remove the oldest frames of the queue, called with mutex locked */
+static void dequeue(NodeInput *in, int count)
+{
+    in->num_queued -= count;
+    memmove(in->queued, in->queued + count, in->num_queued * sizeof(in->queued[0]));
+}
+
+/* Take the pictures the processing loop is done with, called with mutex locked */
+static int takeDone(NodeInput *in, NodePicture *pics)
+{
+    int count = 0;
+    for (int s = 0; s < NUM_OF_SLOTS; s++)
+    {
+        if (in->done & (1 << s))
+            pics[count++] = in->slots[s];
+    }
+    in->done = 0;
+    return count;
+}
+
+static void releasePictures(NodeContext *ctx, PlinkHandle plink, NodePicture *pics, int count)
+{
+    for (int i = 0; i < count; i++)
+        releasePicture(ctx, plink, &pics[i]);
+}
+
+/* Hand the picture to the processing loop. The driving input hands over every picture,
+ * the others only their latest one, the older ones are returned right away.
+ * In rate mode the pictures are queued, the oldest is returned when the processing loop falls behind. */
+static void publishPicture(NodeInput *in, PlinkHandle plink, NodePicture *pic)
+{
+    NodeContext *ctx = in->ctx;
+    NodePicture released[NUM_OF_SLOTS + 1];
+    int rate = ctx->option[PLINK_NODE_OPTION_RATE] > 0;
+    int count = 0;
+
+    pthread_mutex_lock(&ctx->mutex);
+    while (rate == 0 && in->num_queued > 0 && getDriver(ctx) == in && !isStopping(ctx))
+        waitEvent(ctx);
+    count = takeDone(in, released);
+
+    if (in->num_queued == (rate ? MAX_QUEUED : 1))
+    {
+        released[count++] = in->slots[in->queued[0]];
+        dequeue(in, 1);
+        ctx->stats.skipped++;
+    }
+    int slot = 0;
+    while (isHeld(in, slot))
+        slot++;
+    in->slots[slot] = *pic;
+    in->queued[in->num_queued++] = slot;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    releasePictures(ctx, plink, released, count);
+}
+
+static void returnDone(NodeInput *in, PlinkHandle plink)
+{
+    NodeContext *ctx = in->ctx;
+    NodePicture released[NUM_OF_SLOTS];
+
+    pthread_mutex_lock(&ctx->mutex);
+    int count = takeDone(in, released);
+    pthread_mutex_unlock(&ctx->mutex);
+    releasePictures(ctx, plink, released, count);
+}
+
+static void joinInput(NodeInput *in)
+{
+    NodeContext *ctx = in->ctx;
+
+    // state kept for the previous producer is reset before the first packet
+    if (ctx->receive != NULL)
+        ctx->receive(in->index, NULL, NULL, 0, ctx->arg);
+
+    pthread_mutex_lock(&ctx->mutex);
+    in->connected = 1;
+    in->joined = ++ctx->joins;
+    in->sequence = 0;
+    in->window = WINDOW_NONE;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+    NODE_PRINT(INFO, "Input %s: joined\n", in->name);
+}
+
+/* Return all the pictures once the processing loop is done with them */
+static void leaveInput(NodeInput *in, PlinkHandle plink)
+{
+    NodeContext *ctx = in->ctx;
+    NodePicture released[NUM_OF_SLOTS];
+    int rate = ctx->option[PLINK_NODE_OPTION_RATE] > 0;
+    int count = 0;
+
+    pthread_mutex_lock(&ctx->mutex);
+    // the last picture of the driving input is processed too
+    while (rate == 0 && in->num_queued > 0 && getDriver(ctx) == in && !isStopping(ctx))
+        waitEvent(ctx);
+    in->connected = 0;
+    in->window = WINDOW_NONE;
+    pthread_cond_broadcast(&ctx->cond);
+    while (in->current != SLOT_NONE)
+        waitEvent(ctx);
+    count = takeDone(in, released);
+    for (int i = 0; i < in->num_queued; i++)
+        released[count++] = in->slots[in->queued[i]];
+    in->num_queued = 0;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    releasePictures(ctx, plink, released, count);
+    NODE_PRINT(INFO, "Input %s: left\n", in->name);
+}
+
+static void receivePictures(NodeInput *in, PlinkHandle plink)
+{
+    NodeContext *ctx = in->ctx;
+    PlinkStatus sts = PLINK_STATUS_OK;
+    PlinkPacket pkt = {0};
+    int poll_ms = ctx->option[PLINK_NODE_OPTION_RATE] > 0 ? RATE_POLL_MS : POLL_MS;
+    int exitcode = 0;
+
+    while (exitcode == 0 && !isStopping(ctx))
+    {
+        // descriptors left from the last packet are not seen by PLINK_wait
+        pkt.num = 0;
+        pkt.fd = PLINK_INVALID_FD;
+        if (sts == PLINK_STATUS_MORE_DATA)
+            sts = PLINK_recv(plink, 0, &pkt);
+        else
+            sts = PLINK_recv_ex(plink, 0, &pkt, poll_ms);
+        if (sts < 0)
+            break;
+        returnDone(in, plink);
+        if (sts == PLINK_STATUS_TIMEOUT)
+            continue;
+
+        if (ctx->receive != NULL)
+            notifyReceive(in, &pkt);
+        NodePicture pic;
+        int received = readPicture(in, plink, &pkt, &pic, &exitcode);
+        if (received < 0)
+            break;
+        if (received > 0)
+            publishPicture(in, plink, &pic);
+    }
+}
+
+/* Windows mode: pass the windows of the output buffer to the producer, and report when it has rendered them */
+static void fillWindows(NodeInput *in, PlinkHandle plink)
+{
+    NodeContext *ctx = in->ctx;
+    PlinkPacket pkt = {0};
+    PlinkYuvInfo window;
+    PlinkStatus sts = PLINK_STATUS_OK;
+    int exitcode = 0;
+
+    while (exitcode == 0 && !isStopping(ctx))
+    {
+        pthread_mutex_lock(&ctx->mutex);
+        while (in->window != WINDOW_REQUESTED && !isStopping(ctx))
+            waitEvent(ctx);
+        window = in->window_info;
+        pkt.fd = in->window_fd;
+        pthread_mutex_unlock(&ctx->mutex);
+        if (isStopping(ctx))
+            break;
+
+        pkt.list[0] = &window;
+        pkt.num = 1;
+        int filled = PLINK_send(plink, 0, &pkt) != PLINK_STATUS_OK;
+        while (filled == 0 && exitcode == 0 && !isStopping(ctx))
+        {
+            if (sts == PLINK_STATUS_MORE_DATA)
+                sts = PLINK_recv(plink, 0, &pkt);
+            else
+                sts = PLINK_recv_ex(plink, 0, &pkt, POLL_MS);
+            if (sts < 0)
+                exitcode = 1;
+            if (sts == PLINK_STATUS_TIMEOUT || sts < 0)
+                continue;
+            for (int i = 0; i < pkt.num; i++)
+            {
+                PlinkMsg *msg = (PlinkMsg *)(pkt.list[i]);
+                if (msg->header.type != PLINK_TYPE_MESSAGE)
+                    continue;
+                if (msg->msg == window.header.id)
+                    filled = 1;
+                else if (msg->msg == PLINK_EXIT_CODE)
+                {
+                    exitcode = 1;
+                    NODE_PRINT(INFO, "Input %s: exit\n", in->name);
+                }
+            }
+        }
+
+        pthread_mutex_lock(&ctx->mutex);
+        in->window = WINDOW_FILLED;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+}
+
+static void *input_thread(void *args)
+{
+    NodeInput *in = (NodeInput *)args;
+    NodeContext *ctx = in->ctx;
+    PlinkPacket sendpkt = {0};
+    PlinkMsg msg = {0};
+
+    // connect again whenever the producer leaves
+    while (!isStopping(ctx))
+    {
+        PlinkHandle plink = NULL;
+        PlinkStatus sts = PLINK_STATUS_OK;
+        if (PLINK_create(&plink, in->name, PLINK_MODE_CLIENT) != PLINK_STATUS_OK)
+            break;
+
+        do
+        {
+            sts = PLINK_connect_ex(plink, NULL, POLL_MS);
+        } while (sts == PLINK_STATUS_TIMEOUT && !isStopping(ctx));
+        if (sts != PLINK_STATUS_OK)
+        {
+            PLINK_close(plink, 0);
+            if (sts != PLINK_STATUS_TIMEOUT)
+                usleep(RECONNECT_DELAY_MS * 1000);
+            continue;
+        }
+
+        joinInput(in);
+        if (ctx->option[PLINK_NODE_OPTION_WINDOWS])
+            fillWindows(in, plink);
+        else
+            receivePictures(in, plink);
+        leaveInput(in, plink);
+
+        msg.header.type = PLINK_TYPE_MESSAGE;
+        msg.header.size = DATA_SIZE(PlinkMsg);
+        msg.msg = PLINK_EXIT_CODE;
+        sendpkt.list[0] = &msg;
+        sendpkt.num = 1;
+        sendpkt.fd = PLINK_INVALID_FD;
+        PLINK_send(plink, 0, &sendpkt);
+        PLINK_close(plink, 0);
+    }
+
+    return NULL;
+}
+
+/* The inputs which left get their pictures back, called with mutex locked */
+static void returnLeft(NodeContext *ctx)
+{
+    for (int i = 0; i < ctx->inputs; i++)
+    {
+        NodeInput *in = &ctx->in[i];
+        if (in->connected == 0 && in->current != SLOT_NONE)
+        {
+            in->done |= 1 << in->current;
+            in->current = SLOT_NONE;
+            pthread_cond_broadcast(&ctx->cond);
+        }
+    }
+}
+
+/* Whether the processing callback can be called, with mutex locked: on each picture of the driving input,
+ * in rate mode once an input has a picture, in windows mode while an input is connected */
+static int isReady(NodeContext *ctx, NodeInput *driver)
+{
+    if (ctx->inputs == 0)
+        return 1;
+    if (ctx->option[PLINK_NODE_OPTION_WINDOWS])
+        return driver != NULL;
+    if (ctx->option[PLINK_NODE_OPTION_RATE] > 0)
+    {
+        for (int i = 0; i < ctx->inputs; i++)
+        {
+            NodeInput *in = &ctx->in[i];
+            if (in->connected && (in->num_queued > 0 || in->current != SLOT_NONE))
+                return 1;
+        }
+        return 0;
+    }
+    return driver != NULL && driver->num_queued > 0;
+}
+
+/* Rate mode: sleep until the next tick of the clock, skipping the ticks already missed.
+ * Returns the time of the tick, or -1 when the node stops. */
+static long long waitForTick(NodeContext *ctx)
+{
+    long long period = 1000000 / ctx->option[PLINK_NODE_OPTION_RATE];
+    long long now = getTimeUs();
+    if (ctx->next_tick == 0)
+        ctx->next_tick = now;
+    else
+        ctx->next_tick += period;
+    if (ctx->next_tick + period <= now)
+        ctx->next_tick = now;
+
+    // POLL_MS at most at once, the node may be stopped meanwhile
+    while ((now = getTimeUs()) < ctx->next_tick)
+    {
+        if (isStopping(ctx))
+            return -1;
+        long long wake = ctx->next_tick < now + POLL_MS * 1000LL ? ctx->next_tick : now + POLL_MS * 1000LL;
+        struct timespec ts;
+        ts.tv_sec = wake / 1000000;
+        ts.tv_nsec = (wake % 1000000) * 1000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    return ctx->next_tick;
+}
+
+/* Rate mode: take the picture captured nearest to the target time, called with mutex locked.
+ * An input without a newer picture keeps the current one, so it never holds the node back. */
+static void selectPicture(NodeContext *ctx, NodeInput *in, long long target)
+{
+    int best = -1;
+    long long best_dist = 0;
+    if (in->current != SLOT_NONE)
+        best_dist = llabs(in->slots[in->current].frame.pts - target);
+    for (int i = 0; i < in->num_queued; i++)
+    {
+        // the queue is in capture order, prefer the newer picture on a tie
+        long long dist = llabs(in->slots[in->queued[i]].frame.pts - target);
+        if ((best < 0 && in->current == SLOT_NONE) || dist <= best_dist)
+        {
+            best = i;
+            best_dist = dist;
+        }
+    }
+    if (best < 0)
+        return;
+
+    // the target only moves forward, the older pictures will never be taken
+    if (in->current != SLOT_NONE)
+        in->done |= 1 << in->current;
+    for (int i = 0; i < best; i++)
+    {
+        in->done |= 1 << in->queued[i];
+        ctx->stats.skipped++;
+    }
+    in->current = in->queued[best];
+    dequeue(in, best + 1);
+}
+
+/* Wait until the processing callback can be called, and take the picture of every input: the latest one,
+ * or in rate mode the one nearest to the tick. Returns -1 when the node stops. */
+static int takePictures(NodeContext *ctx, PlinkNodeFrame *frames[], long long *pts)
+{
+    NodeInput *driver = NULL;
+    long long target = 0;
+
+    pthread_mutex_lock(&ctx->mutex);
+    for (;;)
+    {
+        returnLeft(ctx);
+        driver = getDriver(ctx);
+        if (ctx->inputs > 0 && ctx->joins > 0 && driver == NULL && ctx->option[PLINK_NODE_OPTION_KEEP] == 0)
+        {
+            NODE_PRINT(INFO, "All the inputs have left\n");
+            __atomic_store_n(&ctx->exit, 1, __ATOMIC_SEQ_CST);
+        }
+        if (isStopping(ctx))
+        {
+            pthread_mutex_unlock(&ctx->mutex);
+            return -1;
+        }
+        if (isReady(ctx, driver))
+            break;
+        waitEvent(ctx);
+    }
+
+    if (ctx->option[PLINK_NODE_OPTION_RATE] > 0)
+    {
+        // the inputs keep queueing pictures until the tick
+        pthread_mutex_unlock(&ctx->mutex);
+        target = waitForTick(ctx);
+        if (target < 0)
+            return -1;
+        target -= ctx->option[PLINK_NODE_OPTION_LATENCY] * 1000LL;
+        pthread_mutex_lock(&ctx->mutex);
+        returnLeft(ctx);
+    }
+
+    for (int i = 0; i < ctx->inputs; i++)
+    {
+        NodeInput *in = &ctx->in[i];
+        if (ctx->option[PLINK_NODE_OPTION_RATE] > 0)
+            selectPicture(ctx, in, target);
+        else if (in->num_queued > 0)
+        {
+            if (in->current != SLOT_NONE)
+                in->done |= 1 << in->current;
+            in->current = in->queued[in->num_queued - 1];
+            dequeue(in, in->num_queued);
+        }
+        frames[i] = in->current != SLOT_NONE ? &in->slots[in->current].frame : NULL;
+
+        in->state.connected = in->connected;
+        in->state.joined = in->joined;
+        in->state.order = 0;
+        for (int j = 0; j < ctx->inputs; j++)
+        {
+            if (ctx->in[j].connected && ctx->in[j].joined < in->joined)
+                in->state.order++;
+        }
+    }
+    if (ctx->option[PLINK_NODE_OPTION_RATE] > 0)
+        *pts = target;
+    else
+        *pts = driver != NULL && driver->current != SLOT_NONE ? driver->slots[driver->current].frame.pts : getTimeUs();
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+    return 0;
+}
+
+/* The processing loop has stopped, the inputs can return all their pictures */
+static void dropPictures(NodeContext *ctx)
+{
+    pthread_mutex_lock(&ctx->mutex);
+    for (int i = 0; i < ctx->inputs; i++)
+    {
+        NodeInput *in = &ctx->in[i];
+        if (in->current != SLOT_NONE)
+            in->done |= 1 << in->current;
+        in->current = SLOT_NONE;
+    }
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+/* Windows mode: have the producers render into the windows set by the processing callback, when it
+ * returned 0, and wait until they are done or have left. Returns -1 when the node stops. */
+static int renderWindows(NodeContext *ctx, int send)
+{
+    pthread_mutex_lock(&ctx->mutex);
+    for (int i = 0; i < ctx->inputs; i++)
+    {
+        if (ctx->in[i].window == WINDOW_SET)
+            ctx->in[i].window = send ? WINDOW_REQUESTED : WINDOW_NONE;
+    }
+    pthread_cond_broadcast(&ctx->cond);
+    for (;;)
+    {
+        int pending = 0;
+        for (int i = 0; i < ctx->inputs; i++)
+            pending |= ctx->in[i].window == WINDOW_REQUESTED && ctx->in[i].connected;
+        if (pending == 0 || isStopping(ctx))
+            break;
+        waitEvent(ctx);
+    }
+    for (int i = 0; i < ctx->inputs; i++)
+        ctx->in[i].window = WINDOW_NONE;
+    pthread_mutex_unlock(&ctx->mutex);
+    return isStopping(ctx) ? -1 : 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Outputs */
+
+static int getConsumers(NodeContext *ctx)
+{
+    return ctx->option[PLINK_NODE_OPTION_CONSUMERS] > 0 ? ctx->option[PLINK_NODE_OPTION_CONSUMERS] : 1;
+}
+
+/* Buffers held by any consumer */
+static unsigned int getBusy(NodeOutput *out)
+{
+    unsigned int busy = 0;
+    for (int c = 0; c < PLINK_NODE_MAX_CONSUMERS; c++)
+        busy |= out->busy[c];
+    return busy;
+}
+
+/* A consumer holding the buffer sent first of those held, the next one to be free */
+static int getHolder(NodeOutput *out)
+{
+    unsigned int busy = getBusy(out);
+    int oldest = -1;
+    for (int b = 0; b < out->buffers; b++)
+    {
+        if ((busy & (1 << b)) && (oldest < 0 || (int)(out->order[b] - out->order[oldest]) < 0))
+            oldest = b;
+    }
+    for (int c = 0; c < PLINK_NODE_MAX_CONSUMERS; c++)
+    {
+        if (oldest >= 0 && (out->busy[c] & (1 << oldest)))
+            return c;
+    }
+    return 0;
+}
+
+/* Take the buffers returned by consumer c, waiting up to timeout_ms for the first message.
+ * Returns -1 when the consumer leaves. */
+static int collectBuffers(NodeOutput *out, int c, int timeout_ms)
+{
+    PlinkStatus sts = PLINK_STATUS_OK;
+    PlinkPacket pkt = {0};
+    int ret = 0;
+
+    if (PLINK_wait(out->plink, out->id[c], timeout_ms) != PLINK_STATUS_OK)
+        return 0;
+    do
+    {
+        sts = PLINK_recv(out->plink, out->id[c], &pkt);
+        if (sts < 0)
+            return -1;
+        for (int i = 0; i < pkt.num; i++)
+        {
+            PlinkMsg *msg = (PlinkMsg *)(pkt.list[i]);
+            if (msg->header.type != PLINK_TYPE_MESSAGE)
+                continue;
+            if (msg->msg == PLINK_EXIT_CODE)
+            {
+                NODE_PRINT(INFO, "Output %s: consumer exit\n", out->name);
+                ret = -1;
+            }
+            else if (msg->msg > 0 && msg->msg <= out->buffers)
+                out->busy[c] &= ~(1 << (msg->msg - 1));
+            else if (msg->msg == 0 && out->busy[c] != 0)
+            {
+                // id unknown: the oldest buffer sent
+                int oldest = -1;
+                for (int b = 0; b < out->buffers; b++)
+                {
+                    if ((out->busy[c] & (1 << b)) && (oldest < 0 || (int)(out->order[b] - out->order[oldest]) < 0))
+                        oldest = b;
+                }
+                out->busy[c] &= ~(1 << oldest);
+            }
+        }
+    } while (sts == PLINK_STATUS_MORE_DATA);
+    return ret;
+}
+
+/* Get a free buffer of every output, waiting for the consumers to return them.
+ * Returns -1 when the node stops. */
+static int acquireBuffers(NodeContext *ctx, PlinkNodeFrame *frames[], long long pts)
+{
+    for (int o = 0; o < ctx->outputs; o++)
+    {
+        NodeOutput *out = &ctx->out[o];
+        long long start = 0;
+        for (int c = 0; c < getConsumers(ctx); c++)
+        {
+            if (collectBuffers(out, c, 0) != 0)
+                return -1;
+        }
+        while (getBusy(out) == (1u << out->buffers) - 1)
+        {
+            if (start == 0)
+                start = getTimeUs();
+            if (isStopping(ctx) || collectBuffers(out, getHolder(out), POLL_MS) != 0)
+                return -1;
+        }
+        if (start != 0)
+        {
+            pthread_mutex_lock(&ctx->mutex);
+            ctx->stats.waited_us += getTimeUs() - start;
+            pthread_mutex_unlock(&ctx->mutex);
+        }
+
+        // the least recently sent
+        unsigned int busy = getBusy(out);
+        int next = -1;
+        for (int b = 0; b < out->buffers; b++)
+        {
+            if ((busy & (1 << b)) == 0 && (next < 0 || (int)(out->order[b] - out->order[next]) < 0))
+                next = b;
+        }
+        out->next = next;
+        frames[o] = &out->frames[next];
+        frames[o]->pts = pts;
+    }
+    return 0;
+}
+
+static void constructYuvInfo(PlinkYuvInfo *info, PlinkNodeFrame *frame)
+{
+    memset(info, 0, sizeof(*info));
+    info->header.type = PLINK_TYPE_2D_YUV;
+    info->header.size = DATA_SIZE(*info);
+    info->header.id = frame->id;
+
+    info->format = frame->format;
+    info->bus_address_y = frame->bus_address + frame->offset[0];
+    info->bus_address_u = frame->bus_address + frame->offset[1];
+    info->bus_address_v = frame->bus_address + frame->offset[2];
+    info->offset_y = frame->offset[0];
+    info->offset_u = frame->offset[1];
+    info->offset_v = frame->offset[2];
+    info->pic_width = frame->width;
+    info->pic_height = frame->height;
+    info->stride_y = frame->stride[0];
+    info->stride_u = frame->stride[1];
+    info->stride_v = frame->stride[2];
+}
+
+static void constructRgbInfo(PlinkRGBInfo *info, PlinkNodeFrame *frame)
+{
+    memset(info, 0, sizeof(*info));
+    info->header.type = PLINK_TYPE_2D_RGB;
+    info->header.size = DATA_SIZE(*info);
+    info->header.id = frame->id;
+
+    info->format = frame->format;
+    info->bus_address_r = frame->bus_address + frame->offset[0];
+    info->bus_address_g = frame->bus_address + frame->offset[1];
+    info->bus_address_b = frame->bus_address + frame->offset[2];
+    info->offset_r = frame->offset[0];
+    info->offset_g = frame->offset[1];
+    info->offset_b = frame->offset[2];
+    info->img_width = frame->width;
+    info->img_height = frame->height;
+    info->stride_r = frame->stride[0];
+    info->stride_g = frame->stride[1];
+    info->stride_b = frame->stride[2];
+}
+
+static void constructRawInfo(PlinkRawInfo *info, PlinkNodeFrame *frame)
+{
+    memset(info, 0, sizeof(*info));
+    info->header.type = PLINK_TYPE_2D_RAW;
+    info->header.size = DATA_SIZE(*info);
+    info->header.id = frame->id;
+
+    info->format = frame->format;
+    info->pattern = frame->pattern;
+    info->bus_address = frame->bus_address + frame->offset[0];
+    info->offset = frame->offset[0];
+    info->img_width = frame->width;
+    info->img_height = frame->height;
+    info->stride = frame->stride[0];
+}
+
+/* Send the buffers given to the processing callback. Returns -1 when a consumer has left. */
+static int sendBuffers(NodeContext *ctx)
+{
+    PlinkYuvInfo yuv;
+    PlinkRGBInfo rgb;
+    PlinkRawInfo raw;
+    PlinkTimeInfo time;
+    PlinkPacket pkt = {0};
+
+    for (int o = 0; o < ctx->outputs; o++)
+    {
+        NodeOutput *out = &ctx->out[o];
+        PlinkNodeFrame *frame = &out->frames[out->next];
+        if (isRgbFormat(frame->format))
+        {
+            constructRgbInfo(&rgb, frame);
+            pkt.list[0] = &rgb;
+        }
+        else if (isRawFormat(frame->format))
+        {
+            constructRawInfo(&raw, frame);
+            pkt.list[0] = &raw;
+        }
+        else
+        {
+            constructYuvInfo(&yuv, frame);
+            pkt.list[0] = &yuv;
+        }
+        time.header.type = PLINK_TYPE_TIME;
+        time.header.size = DATA_SIZE(PlinkTimeInfo);
+        time.header.id = 0;
+        time.type = PLINK_TIME_CAPTURE;
+        time.seconds = frame->pts / 1000000;
+        time.useconds = frame->pts % 1000000;
+        pkt.list[1] = &time;
+        pkt.num = 2;
+        pkt.fd = out->params[out->next].fd;
+
+        // every consumer is sent the same buffer, which is free again once all of them returned it
+        int sent = 0, dropped = 0;
+        for (int c = 0; c < getConsumers(ctx); c++)
+        {
+            PlinkStats before, after;
+            PLINK_getStats(out->plink, out->id[c], &before);
+            PlinkStatus sts = PLINK_send(out->plink, out->id[c], &pkt);
+            if (sts == PLINK_STATUS_OK)
+            {
+                out->busy[c] |= 1 << out->next;
+                sent = 1;
+            }
+            else if (sts == PLINK_STATUS_DROPPED)
+            {
+                // not passed to the consumer, or without the buffer to a consumer of the metadata only
+                PLINK_getStats(out->plink, out->id[c], &after);
+                if (after.sent != before.sent)
+                    sent = 1;
+                else
+                {
+                    NODE_PRINT(INFO, "Output %s: frame %d dropped by channel %d\n", out->name, frame->id, c);
+                    dropped++;
+                }
+            }
+            else
+            {
+                NODE_PRINT(ERROR, "Output %s: failed to send frame %d\n", out->name, frame->id);
+                return -1;
+            }
+        }
+        out->order[out->next] = ++out->sent;
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->stats.sent += sent;
+        ctx->stats.dropped += dropped;
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+    return 0;
+}
+
+/* Tell the consumers to exit, and wait for them to return the buffers */
+static void closeOutputs(NodeContext *ctx)
+{
+    PlinkPacket pkt = {0};
+    PlinkMsg msg = {0};
+
+    msg.header.type = PLINK_TYPE_MESSAGE;
+    msg.header.size = DATA_SIZE(PlinkMsg);
+    msg.msg = PLINK_EXIT_CODE;
+    pkt.list[0] = &msg;
+    pkt.num = 1;
+    pkt.fd = PLINK_INVALID_FD;
+    long long deadline = getTimeUs() + EXIT_TIMEOUT_MS * 1000LL;
+    for (int o = 0; o < ctx->outputs; o++)
+    {
+        NodeOutput *out = &ctx->out[o];
+        for (int c = 0; c < PLINK_NODE_MAX_CONSUMERS; c++)
+        {
+            if (out->id[c] < 0)
+                continue;
+            PLINK_send(out->plink, out->id[c], &pkt);
+            while (out->busy[c] != 0 && getTimeUs() < deadline && collectBuffers(out, c, POLL_MS) == 0)
+                ;
+            PLINK_close(out->plink, out->id[c]);
+            out->id[c] = -1;
+            out->busy[c] = 0;
+        }
+    }
+}
+
+/* Wait for the consumers of every output. Returns -1 when the node stops. */
+static int connectOutputs(NodeContext *ctx)
+{
+    for (int o = 0; o < ctx->outputs; o++)
+    {
+        NodeOutput *out = &ctx->out[o];
+        for (int c = 0; c < getConsumers(ctx); c++)
+        {
+            PlinkStatus sts = PLINK_STATUS_OK;
+            do
+            {
+                sts = PLINK_connect_ex(out->plink, &out->id[c], POLL_MS);
+            } while (sts == PLINK_STATUS_TIMEOUT && !isStopping(ctx));
+            if (sts != PLINK_STATUS_OK)
+            {
+                out->id[c] = -1;
+                return -1;
+            }
+            if (ctx->option[PLINK_NODE_OPTION_MAX_AGE] > 0)
+                PLINK_setOption(out->plink, out->id[c], PLINK_OPTION_MAX_AGE, ctx->option[PLINK_NODE_OPTION_MAX_AGE]);
+            NODE_PRINT(INFO, "Output %s: consumer %d connected\n", out->name, c);
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Band workers */
+
+/* Run the bands not taken yet, called with pool_mutex locked */
+static void runBands(NodeContext *ctx)
+{
+    while (ctx->next_band < ctx->bands)
+    {
+        int band = ctx->next_band++;
+        pthread_mutex_unlock(&ctx->pool_mutex);
+        ctx->band(band, ctx->band_arg);
+        pthread_mutex_lock(&ctx->pool_mutex);
+        if (--ctx->pending == 0)
+            pthread_cond_signal(&ctx->cond_done);
+    }
+}
+
+static void *worker_thread(void *args)
+{
+    NodeContext *ctx = (NodeContext *)args;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&ctx->pool_mutex);
+    while (ctx->quit == 0)
+    {
+        if (ctx->generation == generation)
+        {
+            pthread_cond_wait(&ctx->cond_work, &ctx->pool_mutex);
+            continue;
+        }
+        generation = ctx->generation;
+        runBands(ctx);
+    }
+    pthread_mutex_unlock(&ctx->pool_mutex);
+    return NULL;
+}
+
+static void startWorkers(NodeContext *ctx)
+{
+    int threads = ctx->option[PLINK_NODE_OPTION_THREADS];
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > PLINK_NODE_MAX_THREADS)
+        threads = PLINK_NODE_MAX_THREADS;
+
+    ctx->quit = 0;
+    ctx->num_workers = 0;
+    // the caller of PLINK_NODE_parallel is one of the threads
+    for (int i = 0; i < threads - 1; i++)
+    {
+        if (pthread_create(&ctx->workers[ctx->num_workers], NULL, worker_thread, ctx) != 0)
+        {
+            NODE_PRINT(WARNING, "Failed to create worker %d\n", i);
+            break;
+        }
+        ctx->num_workers++;
+    }
+}
+
+static void stopWorkers(NodeContext *ctx)
+{
+    pthread_mutex_lock(&ctx->pool_mutex);
+    ctx->quit = 1;
+    pthread_cond_broadcast(&ctx->cond_work);
+    pthread_mutex_unlock(&ctx->pool_mutex);
+    for (int i = 0; i < ctx->num_workers; i++)
+        pthread_join(ctx->workers[i], NULL);
+    ctx->num_workers = 0;
+}
+
+/* A buffer of an output, in video memory exported as dma-buf, or else memfd which the consumers map with mmap.
+ * Returns -1 on failure, with params->fd and vir_address set to what has to be freed. */
+static int allocateBuffer(NodeContext *ctx, VmemParams *params, unsigned int size)
+{
+    memset(params, 0, sizeof(*params));
+    params->size = (size + 0xFFF) & ~0xFFF;
+    if (ctx->vmem == NULL)
+    {
+        params->fd = memfd_create("plinknode", MFD_CLOEXEC);
+        if (params->fd < 0 || ftruncate(params->fd, params->size) != 0)
+            return -1;
+        void *data = mmap(NULL, params->size, PROT_READ | PROT_WRITE, MAP_SHARED, params->fd, 0);
+        if (data == MAP_FAILED)
+            return -1;
+        params->vir_address = data;
+        return 0;
+    }
+
+    params->flags = VMEM_FLAG_CONTIGUOUS | VMEM_FLAG_4GB_ADDR;
+    if (VMEM_allocate(ctx->vmem, params) != VMEM_STATUS_OK ||
+        VMEM_mmap(ctx->vmem, params) != VMEM_STATUS_OK ||
+        VMEM_export(ctx->vmem, params) != VMEM_STATUS_OK)
+        return -1;
+    return 0;
+}
+
+static void freeBuffer(NodeContext *ctx, VmemParams *params)
+{
+    if (params->fd > 0)
+        close(params->fd);
+    if (ctx->vmem == NULL)
+    {
+        if (params->vir_address != NULL)
+            munmap(params->vir_address, params->size);
+    }
+    else
+        VMEM_free(ctx->vmem, params);
+}
+
+/* ------------------------------------------------------------------------ */
+
+PlinkStatus
+PLINK_NODE_create(PlinkNode *node, PlinkNodeProcess process, void *arg)
+{
+    NodeContext *ctx = NULL;
+    pthread_condattr_t attr;
+
+    log_level = getLogLevel();
+    pid = getpid();
+
+    if (node == NULL || process == NULL)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p, process = %p\n", node, process);
+
+    ctx = (NodeContext *)malloc(sizeof(*ctx));
+    if (ctx == NULL)
+        NODE_PRINT_RETURN(PLINK_STATUS_NO_MEMORY, ERROR,
+            "Failed to allocate memory for node\n");
+    memset(ctx, 0, sizeof(*ctx));
+
+    if (VMEM_create(&ctx->vmem) != VMEM_STATUS_OK)
+    {
+        ctx->vmem = NULL;
+        NODE_PRINT(WARNING, "No video memory, buffers are allocated with memfd\n");
+    }
+
+    ctx->process = process;
+    ctx->arg = arg;
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&ctx->pool_mutex, NULL);
+    pthread_cond_init(&ctx->cond_work, NULL);
+    pthread_cond_init(&ctx->cond_done, NULL);
+    *node = (PlinkNode)ctx;
+
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_setReceive(PlinkNode node, PlinkNodeReceive receive)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL || ctx->running)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p\n", node);
+
+    ctx->receive = receive;
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_addInput(PlinkNode node, const char *name)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL || name == NULL || ctx->running)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p, name = %s\n", node, name);
+    if (ctx->inputs >= PLINK_NODE_MAX_INPUTS)
+        NODE_PRINT_RETURN(PLINK_STATUS_ERROR, ERROR,
+            "Too many inputs, max %d\n", PLINK_NODE_MAX_INPUTS);
+
+    NodeInput *in = &ctx->in[ctx->inputs];
+    memset(in, 0, sizeof(*in));
+    in->name = strdup(name);
+    if (in->name == NULL)
+        NODE_PRINT_RETURN(PLINK_STATUS_NO_MEMORY, ERROR,
+            "Failed to allocate memory for input %s\n", name);
+    in->ctx = ctx;
+    in->index = ctx->inputs;
+    in->current = SLOT_NONE;
+    ctx->inputs++;
+
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_addOutput(PlinkNode node, const char *name, const PlinkNodeFrame *frame, int buffers)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL || name == NULL || frame == NULL || frame->size == 0 || ctx->running ||
+        buffers < 2 || buffers > PLINK_NODE_MAX_BUFFERS)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p, name = %s, frame = %p, buffers = %d\n", node, name, frame, buffers);
+    if (ctx->outputs >= PLINK_NODE_MAX_OUTPUTS)
+        NODE_PRINT_RETURN(PLINK_STATUS_ERROR, ERROR,
+            "Too many outputs, max %d\n", PLINK_NODE_MAX_OUTPUTS);
+
+    NodeOutput *out = &ctx->out[ctx->outputs];
+    memset(out, 0, sizeof(*out));
+    for (int c = 0; c < PLINK_NODE_MAX_CONSUMERS; c++)
+        out->id[c] = -1;
+    if (PLINK_create(&out->plink, name, PLINK_MODE_SERVER) != PLINK_STATUS_OK)
+        NODE_PRINT_RETURN(PLINK_STATUS_ERROR, ERROR,
+            "Failed to create server %s\n", name);
+    out->name = strdup(name);
+
+    for (int b = 0; b < buffers; b++)
+    {
+        if (allocateBuffer(ctx, &out->params[b], frame->size) != 0)
+        {
+            out->buffers = b + 1;
+            ctx->outputs++;
+            NODE_PRINT_RETURN(PLINK_STATUS_NO_MEMORY, ERROR,
+                "Failed to allocate buffer %d of %d bytes for output %s\n", b, frame->size, name);
+        }
+        VmemParams *params = &out->params[b];
+        out->frames[b] = *frame;
+        out->frames[b].id = b + 1;
+        out->frames[b].size = params->size;
+        out->frames[b].data = params->vir_address;
+        out->frames[b].bus_address = params->phy_address;
+        NODE_PRINT(INFO, "Output %s: buffer %d at 0x%x, %d bytes, fd %d\n",
+            name, b, params->phy_address, params->size, params->fd);
+    }
+    out->buffers = buffers;
+    ctx->outputs++;
+
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_initFrame(PlinkNodeFrame *frame, PlinkColorFormat format, int width, int height, int stride)
+{
+    if (frame == NULL || width <= 0 || height <= 0 || stride < 0)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: frame = %p, %dx%d, stride %d\n", frame, width, height, stride);
+
+    int bytes = 1;
+    if (format == PLINK_COLOR_FormatYUV420SemiPlanarP010 ||
+        format == PLINK_COLOR_FormatRawBayer10bit || format == PLINK_COLOR_FormatRawBayer12bit)
+        bytes = 2;
+    else if (format == PLINK_COLOR_Format24BitRGB888 || format == PLINK_COLOR_Format24BitBGR888)
+        bytes = 3;
+    else if (format == PLINK_COLOR_Format32bitBGRA8888 || format == PLINK_COLOR_Format32bitARGB8888)
+        bytes = 4;
+    if (stride < width * bytes)
+        stride = width * bytes;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    unsigned int plane = stride * height;
+    for (int k = 0; k < 3; k++)
+        frame->stride[k] = stride;
+    switch (format)
+    {
+        case PLINK_COLOR_FormatYUV420Planar:
+            frame->stride[1] = frame->stride[2] = stride / 2;
+            frame->offset[1] = plane;
+            frame->offset[2] = plane + plane / 4;
+            frame->size = plane * 3 / 2;
+            break;
+        case PLINK_COLOR_FormatYUV420SemiPlanar:
+        case PLINK_COLOR_FormatYUV420SemiPlanarP010:
+            frame->offset[1] = frame->offset[2] = plane;
+            frame->size = plane * 3 / 2;
+            break;
+        case PLINK_COLOR_FormatYUV422Planar:
+            frame->stride[1] = frame->stride[2] = stride / 2;
+            frame->offset[1] = plane;
+            frame->offset[2] = plane + plane / 2;
+            frame->size = plane * 2;
+            break;
+        case PLINK_COLOR_FormatYUV422SemiPlanar:
+            frame->offset[1] = frame->offset[2] = plane;
+            frame->size = plane * 2;
+            break;
+        case PLINK_COLOR_Format24BitRGB888Planar:
+            frame->offset[1] = plane;
+            frame->offset[2] = plane * 2;
+            frame->size = plane * 3;
+            break;
+        case PLINK_COLOR_Format24BitBGR888Planar:
+            // blue first
+            frame->offset[0] = plane * 2;
+            frame->offset[1] = plane;
+            frame->size = plane * 3;
+            break;
+        case PLINK_COLOR_FormatMonochrome:
+        case PLINK_COLOR_Format32bitBGRA8888:
+        case PLINK_COLOR_Format32bitARGB8888:
+        case PLINK_COLOR_Format24BitRGB888:
+        case PLINK_COLOR_Format24BitBGR888:
+        case PLINK_COLOR_FormatRawBayer8bit:
+        case PLINK_COLOR_FormatRawBayer10bit:
+        case PLINK_COLOR_FormatRawBayer12bit:
+            frame->size = plane;
+            break;
+        default:
+            NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+                "Unsupported format %d\n", format);
+    }
+
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_setOption(PlinkNode node, PlinkNodeOption option, int value)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL || option < 0 || option >= PLINK_NODE_OPTION_MAX || ctx->running)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p, option = %d\n", node, option);
+
+    ctx->option[option] = value;
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_run(PlinkNode node)
+{
+    NodeContext *ctx = (NodeContext *)node;
+    PlinkNodeFrame *inputs[PLINK_NODE_MAX_INPUTS];
+    PlinkNodeFrame *outputs[PLINK_NODE_MAX_OUTPUTS];
+    PlinkStatus sts = PLINK_STATUS_OK;
+
+    if (ctx == NULL || ctx->running)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p\n", node);
+    // the producers import the windows as video memory
+    if (ctx->option[PLINK_NODE_OPTION_WINDOWS] && (ctx->vmem == NULL || ctx->outputs == 0 ||
+        ctx->out[0].frames[0].format != PLINK_COLOR_FormatYUV420SemiPlanar))
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Windows need video memory and an NV12 output\n");
+    if (ctx->option[PLINK_NODE_OPTION_CONSUMERS] > PLINK_NODE_MAX_CONSUMERS)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Too many consumers per output, max %d\n", PLINK_NODE_MAX_CONSUMERS);
+
+    ctx->running = 1;
+    ctx->joins = 0;
+    ctx->next_tick = 0;
+    startWorkers(ctx);
+    for (int i = 0; i < ctx->inputs; i++)
+    {
+        if (pthread_create(&ctx->in[i].thread, NULL, input_thread, &ctx->in[i]) != 0)
+        {
+            NODE_PRINT(ERROR, "Failed to create thread for input %s\n", ctx->in[i].name);
+            __atomic_store_n(&ctx->exit, 1, __ATOMIC_SEQ_CST);
+            for (int j = 0; j < i; j++)
+                pthread_join(ctx->in[j].thread, NULL);
+            stopWorkers(ctx);
+            ctx->running = 0;
+            return PLINK_STATUS_ERROR;
+        }
+    }
+
+    if (connectOutputs(ctx) == 0)
+    {
+        while (!isStopping(ctx))
+        {
+            long long pts = 0;
+            if (takePictures(ctx, inputs, &pts) != 0 || acquireBuffers(ctx, outputs, pts) != 0)
+                break;
+
+            int ret = ctx->process(node, inputs, outputs, ctx->arg);
+            pthread_mutex_lock(&ctx->mutex);
+            ctx->stats.processed++;
+            pthread_mutex_unlock(&ctx->mutex);
+            if (ctx->option[PLINK_NODE_OPTION_WINDOWS] && renderWindows(ctx, ret == 0) != 0)
+                break;
+            if (ret < 0)
+                break;
+            if (ret == 0 && sendBuffers(ctx) != 0)
+            {
+                sts = PLINK_STATUS_ERROR;
+                break;
+            }
+        }
+    }
+
+    // the producers are told to exit by the input threads, once they have their buffers back
+    __atomic_store_n(&ctx->exit, 1, __ATOMIC_SEQ_CST);
+    dropPictures(ctx);
+    closeOutputs(ctx);
+    for (int i = 0; i < ctx->inputs; i++)
+        pthread_join(ctx->in[i].thread, NULL);
+    stopWorkers(ctx);
+    ctx->running = 0;
+
+    return sts;
+}
+
+PlinkStatus
+PLINK_NODE_stop(PlinkNode node)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL)
+        return PLINK_STATUS_WRONG_PARAMS;
+
+    // no locking, this can be a signal handler
+    __atomic_store_n(&ctx->exit, 1, __ATOMIC_SEQ_CST);
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_parallel(PlinkNode node, int bands, PlinkNodeBand band, void *arg)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL || band == NULL || bands < 0)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p, bands = %d, band = %p\n", node, bands, band);
+
+    if (ctx->num_workers == 0 || bands == 1)
+    {
+        for (int i = 0; i < bands; i++)
+            band(i, arg);
+        return PLINK_STATUS_OK;
+    }
+
+    pthread_mutex_lock(&ctx->pool_mutex);
+    ctx->band = band;
+    ctx->band_arg = arg;
+    ctx->bands = bands;
+    ctx->next_band = 0;
+    ctx->pending = bands;
+    ctx->generation++;
+    pthread_cond_broadcast(&ctx->cond_work);
+    runBands(ctx);
+    while (ctx->pending > 0)
+        pthread_cond_wait(&ctx->cond_done, &ctx->pool_mutex);
+    pthread_mutex_unlock(&ctx->pool_mutex);
+
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_getInput(PlinkNode node, int input, PlinkNodeInput *state)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL || input < 0 || input >= ctx->inputs || state == NULL)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p, input = %d, state = %p\n", node, input, state);
+
+    // taken with the frames, by the thread of the processing callback
+    *state = ctx->in[input].state;
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_setWindow(PlinkNode node, int input, int x, int y, int width, int height)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL || ctx->option[PLINK_NODE_OPTION_WINDOWS] == 0 || ctx->outputs == 0 ||
+        input < 0 || input >= ctx->inputs || x < 0 || y < 0 || width <= 0 || height <= 0 ||
+        ((x | y | width | height) & 1) != 0)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p, input = %d, %dx%d at (%d, %d)\n", node, input, width, height, x, y);
+
+    NodeOutput *out = &ctx->out[0];
+    PlinkNodeFrame *frame = &out->frames[out->next];
+    if (x + width > frame->width || y + height > frame->height)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Window %dx%d at (%d, %d) outside of %dx%d\n", width, height, x, y, frame->width, frame->height);
+
+    NodeInput *in = &ctx->in[input];
+    pthread_mutex_lock(&ctx->mutex);
+    PlinkYuvInfo *info = &in->window_info;
+    constructYuvInfo(info, frame);
+    info->offset_y += y * frame->stride[0] + x;
+    info->offset_u += y / 2 * frame->stride[1] + x;
+    info->offset_v = info->offset_u;
+    info->bus_address_y = frame->bus_address + info->offset_y;
+    info->bus_address_u = frame->bus_address + info->offset_u;
+    info->bus_address_v = info->bus_address_u;
+    info->pic_width = width;
+    info->pic_height = height;
+    in->window_fd = out->params[out->next].fd;
+    in->window = WINDOW_SET;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_getStats(PlinkNode node, PlinkNodeStats *stats)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL || stats == NULL)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p, stats = %p\n", node, stats);
+
+    pthread_mutex_lock(&ctx->mutex);
+    *stats = ctx->stats;
+    pthread_mutex_unlock(&ctx->mutex);
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_NODE_destroy(PlinkNode node)
+{
+    NodeContext *ctx = (NodeContext *)node;
+
+    if (ctx == NULL || ctx->running)
+        NODE_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: node = %p\n", node);
+
+    for (int o = 0; o < ctx->outputs; o++)
+    {
+        NodeOutput *out = &ctx->out[o];
+        for (int b = 0; b < out->buffers; b++)
+            freeBuffer(ctx, &out->params[b]);
+        PLINK_close(out->plink, PLINK_CLOSE_ALL);
+        free(out->name);
+    }
+    for (int i = 0; i < ctx->inputs; i++)
+        free(ctx->in[i].name);
+    if (ctx->vmem != NULL)
+        VMEM_destroy(ctx->vmem);
+    pthread_mutex_destroy(&ctx->mutex);
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->pool_mutex);
+    pthread_cond_destroy(&ctx->cond_work);
+    pthread_cond_destroy(&ctx->cond_done);
+    free(ctx);
+
+    return PLINK_STATUS_OK;
+}
@@ -23,11 +23,13 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/inotify.h>
+#include <time.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
-#include "process_linker.h"
+#include "process_linker_types.h"
 
 #ifndef NULL
 #define NULL    ((void *)0)
@@ -35,6 +37,7 @@
 
 #define MAX_CONNECTIONS 3
 #define MAX_BUFFER_SIZE (4 * 1024 * 1024)
+#define CONNECT_RETRY_MS 10         // time between connection attempts while the server is not listening yet
 
 #define PLINK_PRINT(level, ...) \
     { \
@@ -64,6 +67,15 @@ typedef enum _PlinkLogLevel
     PLINK_LOG_MAX
 } PlinkLogLevel;
 
+typedef struct _PlinkChannel
+{
+    int option[PLINK_OPTION_MAX];
+    int filter[PLINK_OPTION_MAX];   // subscription of the peer, applied on send
+    unsigned int frames;            // frames passed to PLINK_send, for decimation
+    long long next_us;              // earliest time to send the next frame, for PLINK_OPTION_MAX_FPS
+    PlinkStats stats;
+} PlinkChannel;
+
 typedef struct _PlinkContext
 {
     PlinkMode mode;
@@ -75,14 +87,32 @@ typedef struct _PlinkContext
     int connect[MAX_CONNECTIONS];
     int count; // connected client number
     char *buffer;
-    int offset;
+    int offset;     // start of the data not parsed yet in buffer
+    int remaining;  // size of the data not parsed yet in buffer
     int pid;
+    PlinkChannel chn[MAX_CONNECTIONS];
+    char *mailbox; // descriptors of the frame held by mailbox mode
 } PlinkContext;
 
 int log_level = PLINK_LOG_ERROR;
 int pid = 0;
 
-static PlinkStatus parseData(PlinkContext *ctx, PlinkPacket *pkt, int total);
+static PlinkStatus parseData(PlinkContext *ctx, PlinkPacket *pkt);
+static PlinkStatus recvPacket(PlinkContext *ctx, PlinkChannelID channel, PlinkPacket *pkt);
+static PlinkStatus recvLatest(PlinkContext *ctx, PlinkChannelID channel, PlinkPacket *pkt);
+static int hasParsableData(PlinkContext *ctx);
+static int isFrame(PlinkPacket *pkt);
+static int isExpired(PlinkPacket *pkt, int max_age_ms);
+static void dropFrame(PlinkContext *ctx, PlinkChannelID channel, PlinkPacket *pkt);
+static int isSubscription(PlinkOption option);
+static int isWanted(int types, PlinkDescHdr *hdr);
+static int usesFd(PlinkDescHdr *hdr);
+static int isFiltered(PlinkChannel *chn);
+static PlinkStatus sendSubscription(PlinkContext *ctx, PlinkChannelID channel, int option);
+static int recvSubscription(PlinkContext *ctx, PlinkChannelID channel);
+static void applySubscription(PlinkContext *ctx, PlinkChannelID channel, PlinkPacket *pkt);
+static long long getTimeUs();
+static int watchServer(PlinkContext *ctx);
 static PlinkStatus wait(int sockfd, int timeout_ms);
 static int getLogLevel();
 
@@ -182,6 +212,7 @@ PLINK_connect(PlinkHandle plink, PlinkChannelID *channel)
             if (ctx->connect[i] == 0)
             {
                 ctx->connect[i] = 1;
+                memset(&ctx->chn[i], 0, sizeof(ctx->chn[i]));
                 *channel = i;
                 break;
             }
@@ -206,6 +237,8 @@ PLINK_connect(PlinkHandle plink, PlinkChannelID *channel)
                "Failed to connect to server %s: %s\n", ctx->addr.sun_path, strerror(errno));
 
         PLINK_PRINT(INFO, "Connected to server: %d\n", ctx->sockfd);
+        ctx->connect[0] = 1;
+        return sendSubscription(ctx, 0, PLINK_OPTION_MAX);
     }
 
     return PLINK_STATUS_OK;
@@ -224,21 +257,55 @@ PLINK_send(PlinkHandle plink, PlinkChannelID channel, PlinkPacket *pkt)
         PLINK_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
             "Too many data nodes to send: %d\n", pkt->num);
 
-    char buf[CMSG_SPACE(sizeof(int))];
-    memset(buf, 0, sizeof(buf));
+    PlinkChannel *chn = &ctx->chn[ctx->mode == PLINK_MODE_SERVER ? channel : 0];
+    if (isFrame(pkt) && ctx->mode == PLINK_MODE_SERVER)
+        recvSubscription(ctx, channel);
+    if (isFrame(pkt) && isExpired(pkt, chn->option[PLINK_OPTION_MAX_AGE]))
+    {
+        chn->stats.dropped++;
+        PLINK_PRINT_RETURN(PLINK_STATUS_DROPPED, INFO,
+            "Drop frame with fd %d: older than %dms\n", pkt->fd, chn->option[PLINK_OPTION_MAX_AGE]);
+    }
+
+    if (isFrame(pkt) && isFiltered(chn))
+    {
+        chn->stats.decimated++;
+        PLINK_PRINT_RETURN(PLINK_STATUS_DROPPED, INFO,
+            "Skip frame with fd %d: not subscribed by receiver\n", pkt->fd);
+    }
+
+    // strip descriptors the receiver did not subscribe to, and the fd if none of the rest needs it
+    int types = chn->filter[PLINK_OPTION_DESC_TYPES];
+    int num = 0;
+    int needfd = types == 0;
     for (int i = 0; i < pkt->num; i++)
     {
         PlinkDescHdr *hdr = (PlinkDescHdr *)(pkt->list[i]);
-        ctx->ioOut[i].iov_base = pkt->list[i];
-        ctx->ioOut[i].iov_len = hdr->size + DATA_HEADER_SIZE;
-        PLINK_PRINT(INFO, "Sending Out %ld bytes\n", ctx->ioOut[i].iov_len);
+        if (!isWanted(types, hdr))
+            continue;
+
+        needfd |= usesFd(hdr);
+        ctx->ioOut[num].iov_base = pkt->list[i];
+        ctx->ioOut[num].iov_len = hdr->size + DATA_HEADER_SIZE;
+        PLINK_PRINT(INFO, "Sending Out %ld bytes\n", ctx->ioOut[num].iov_len);
+        num++;
     }
 
+    int fd = needfd ? pkt->fd : PLINK_INVALID_FD;
+    if (num == 0)
+    {
+        chn->stats.stripped++;
+        PLINK_PRINT_RETURN(PLINK_STATUS_DROPPED, INFO,
+            "Skip packet: no descriptor subscribed by receiver\n");
+    }
+
+    char buf[CMSG_SPACE(sizeof(int))];
+    memset(buf, 0, sizeof(buf));
     struct msghdr msg = {0};
     msg.msg_iov = ctx->ioOut;
-    msg.msg_iovlen = pkt->num;
+    msg.msg_iovlen = num;
 
-    if (pkt->fd > PLINK_INVALID_FD)
+    if (fd > PLINK_INVALID_FD)
     {
         msg.msg_control = buf;
         msg.msg_controllen = sizeof(buf);
@@ -248,8 +315,8 @@ PLINK_send(PlinkHandle plink, PlinkChannelID channel, PlinkPacket *pkt)
         cmsg->cmsg_level = SOL_SOCKET;
         cmsg->cmsg_type = SCM_RIGHTS;
         cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-        *((int *)CMSG_DATA(cmsg)) = pkt->fd;
-        PLINK_PRINT(INFO, "Sent fd %d\n", pkt->fd);
+        *((int *)CMSG_DATA(cmsg)) = fd;
+        PLINK_PRINT(INFO, "Sent fd %d\n", fd);
     }
 
     int sockfd = ctx->mode == PLINK_MODE_SERVER ? ctx->cfd[channel] : ctx->sockfd;
@@ -257,6 +324,15 @@ PLINK_send(PlinkHandle plink, PlinkChannelID channel, PlinkPacket *pkt)
         PLINK_PRINT_RETURN(PLINK_STATUS_ERROR, ERROR,
             "sendmsg() failed: %s\n", strerror(errno));
     PLINK_PRINT(INFO, "Sent data to %d\n", sockfd);
+    chn->stats.sent++;
+
+    // the receiver does not hold the buffer, so the caller can reuse it right away
+    if (fd != pkt->fd)
+    {
+        chn->stats.stripped++;
+        PLINK_PRINT_RETURN(PLINK_STATUS_DROPPED, INFO,
+            "Sent packet without fd %d: no buffer subscribed by receiver\n", pkt->fd);
+    }
 
     return PLINK_STATUS_OK;
 }
@@ -270,42 +346,24 @@ PLINK_recv(PlinkHandle plink, PlinkChannelID channel, PlinkPacket *pkt)
         PLINK_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
             "Wrong parameters: plink = %p, pkt = %p\n", plink, pkt);
 
-    pkt->num = 0;
-
-    char buf[CMSG_SPACE(sizeof(int))];
-    memset(buf, 0, sizeof(buf));
-    ctx->ioIn[0].iov_base = ctx->buffer + ctx->offset;
-    ctx->ioIn[0].iov_len = MAX_BUFFER_SIZE - ctx->offset;
-
-    struct msghdr msg = {0};
-    msg.msg_iov = ctx->ioIn;
-    msg.msg_iovlen = 1;
-    msg.msg_control = buf;
-    msg.msg_controllen = sizeof(buf);
-
-    int sockfd = ctx->mode == PLINK_MODE_SERVER ? ctx->cfd[channel] : ctx->sockfd;
-    PLINK_PRINT(INFO, "Receiving data from %d\n", sockfd);
-    int total = recvmsg (sockfd, &msg, 0);
-    if (total > 0)
-        PLINK_PRINT(INFO, "Received %d bytes\n", total)
-    else if (total == 0)
-        PLINK_PRINT_RETURN(PLINK_STATUS_NO_DATA, WARNING,
-            "recvmsg() returns %d\n", total)
-    else
-        PLINK_PRINT_RETURN(PLINK_STATUS_ERROR, ERROR,
-            "Failed to recieve data from %d: %s\n", sockfd, strerror(errno))
+    PlinkChannel *chn = &ctx->chn[ctx->mode == PLINK_MODE_SERVER ? channel : 0];
+    PlinkStatus sts = recvPacket(ctx, channel, pkt);
+    if (sts == PLINK_STATUS_OK || sts == PLINK_STATUS_MORE_DATA)
+        applySubscription(ctx, channel, pkt);
+    if (sts == PLINK_STATUS_OK && chn->option[PLINK_OPTION_MAILBOX] != 0)
+        sts = recvLatest(ctx, channel, pkt);
 
-    if (msg.msg_controllen >= CMSG_SPACE(sizeof(int)))
+    if ((sts == PLINK_STATUS_OK || sts == PLINK_STATUS_MORE_DATA) &&
+        isFrame(pkt) && isExpired(pkt, chn->option[PLINK_OPTION_MAX_AGE]))
     {
-        struct cmsghdr *cmsg;
-        cmsg = CMSG_FIRSTHDR(&msg);
-        pkt->fd = *((int *)CMSG_DATA(cmsg));
-        PLINK_PRINT(INFO, "Received fd %d\n", pkt->fd);
+        PLINK_PRINT(INFO, "Drop frame with fd %d: older than %dms\n", pkt->fd, chn->option[PLINK_OPTION_MAX_AGE]);
+        dropFrame(ctx, channel, pkt);
+        chn->stats.dropped++;
+        if (sts == PLINK_STATUS_OK)
+            sts = PLINK_STATUS_DROPPED;
     }
-    else
-        pkt->fd = PLINK_INVALID_FD;
 
-    return parseData(ctx, pkt, ctx->offset + total);
+    return sts;
 }
 
 PlinkStatus 
@@ -317,8 +375,22 @@ PLINK_wait(PlinkHandle plink, PlinkChannelID channel, int timeout_ms)
         PLINK_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
             "Wrong parameters: plink = %p\n", plink);
 
-    int sockfd = ctx->mode == PLINK_MODE_SERVER ? ctx->cfd[channel] : ctx->sockfd;
-    return wait(sockfd, timeout_ms);
+    if (ctx->mode != PLINK_MODE_SERVER)
+        return wait(ctx->sockfd, timeout_ms);
+
+    // subscriptions are applied as they arrive, and are not data for the caller
+    long long deadline = getTimeUs() + timeout_ms * 1000LL;
+    int remaining_ms = timeout_ms;
+    PlinkStatus sts;
+    while ((sts = wait(ctx->cfd[channel], remaining_ms)) == PLINK_STATUS_OK && recvSubscription(ctx, channel) > 0)
+    {
+        if (wait(ctx->cfd[channel], 0) == PLINK_STATUS_OK)
+            break;
+        remaining_ms = (int)((deadline - getTimeUs()) / 1000);
+        if (remaining_ms <= 0)
+            return PLINK_STATUS_TIMEOUT;
+    }
+    return sts;
 }
 
 PlinkStatus 
@@ -351,11 +423,15 @@ PLINK_close(PlinkHandle plink, PlinkChannelID channel)
             close(ctx->sockfd);
             if (ctx->buffer != NULL)
                 free(ctx->buffer);
+            if (ctx->mailbox != NULL)
+                free(ctx->mailbox);
 
             free(ctx);
         }
         else if (channel < MAX_CONNECTIONS && ctx->connect[channel] != 0)
         {
+            // the channel can be used again by PLINK_connect
+            ctx->connect[channel] = 0;
             close(ctx->cfd[channel]);
             ctx->count--;
             PLINK_PRINT(INFO, "Closed channel %d\n", channel);
@@ -364,14 +440,14 @@ PLINK_close(PlinkHandle plink, PlinkChannelID channel)
         {
             PLINK_PRINT(ERROR, "Invalid channel: %d\n", channel);
         }
-
-        unlink(ctx->addr.sun_path);
     }
     else
     {
         close(ctx->sockfd);
         if (ctx->buffer != NULL)
             free(ctx->buffer);
+        if (ctx->mailbox != NULL)
+            free(ctx->mailbox);
 
         free(ctx);
     }
@@ -405,6 +481,7 @@ PLINK_connect_ex(PlinkHandle plink, PlinkChannelID *channel, int timeout_ms)
             if (ctx->connect[i] == 0)
             {
                 ctx->connect[i] = 1;
+                memset(&ctx->chn[i], 0, sizeof(ctx->chn[i]));
                 *channel = i;
                 break;
             }
@@ -412,12 +489,16 @@ PLINK_connect_ex(PlinkHandle plink, PlinkChannelID *channel, int timeout_ms)
 
         // wait for connection from client
         PLINK_PRINT(INFO, "Waiting for connection...\n");
-        if (wait(ctx->sockfd, timeout_ms) == PLINK_STATUS_OK)
+        PlinkStatus sts = wait(ctx->sockfd, timeout_ms);
+        if (sts == PLINK_STATUS_OK)
         {
             int fd = accept(ctx->sockfd, NULL, NULL);
             if (fd == -1)
+            {
+                ctx->connect[i] = 0;
                 PLINK_PRINT_RETURN(PLINK_STATUS_ERROR, ERROR,
                     "Failed to accept connection\n");
+            }
 
             ctx->cfd[i] = fd;
             ctx->count++;
@@ -425,30 +506,105 @@ PLINK_connect_ex(PlinkHandle plink, PlinkChannelID *channel, int timeout_ms)
                     i, ctx->count, MAX_CONNECTIONS, fd);
         }
         else
+        {
+            // the slot is free again for the next attempt
+            ctx->connect[i] = 0;
+            if (sts == PLINK_STATUS_TIMEOUT)
+                PLINK_PRINT_RETURN(PLINK_STATUS_TIMEOUT, WARNING,
+                    "No connection request within %dms\n", timeout_ms);
             PLINK_PRINT_RETURN(PLINK_STATUS_ERROR, ERROR,
-                "No connection request within %dms\n", timeout_ms);
+                "Failed to wait for connection\n");
+        }
     }
     else
     {
-        int max_tries = (timeout_ms + 1000 - 1) / 1000;
-        for (i = 0; i < max_tries; i++)
+        // watch before the first attempt, so a server created in between is not missed
+        int notifyfd = watchServer(ctx);
+        long long deadline = getTimeUs() + timeout_ms * 1000LL;
+        while (connect(ctx->sockfd, (struct sockaddr *)&ctx->addr, sizeof(struct sockaddr_un)) == -1)
         {
-            if (connect(ctx->sockfd, (struct sockaddr *)&ctx->addr, sizeof(struct sockaddr_un)) == -1)
-                sleep(1);
+            int missing = errno == ENOENT;
+            int remaining_ms = (int)((deadline - getTimeUs()) / 1000);
+            if (remaining_ms <= 0)
+            {
+                if (notifyfd >= 0)
+                    close(notifyfd);
+                PLINK_PRINT_RETURN(PLINK_STATUS_TIMEOUT, WARNING,
+                   "Failed to connect to server %s\n", ctx->addr.sun_path);
+            }
+
+            // sleep until the socket file is created, or retry soon if it exists but nobody listens yet
+            if (missing && notifyfd >= 0)
+            {
+                if (wait(notifyfd, remaining_ms) == PLINK_STATUS_OK)
+                {
+                    char events[4096];
+                    if (read(notifyfd, events, sizeof(events)) < 0)
+                        PLINK_PRINT(WARNING, "Failed to read inotify events\n");
+                }
+            }
             else
-                break;
+                usleep((remaining_ms < CONNECT_RETRY_MS ? remaining_ms : CONNECT_RETRY_MS) * 1000);
         }
-
-        if (i >= max_tries)
-            PLINK_PRINT_RETURN(PLINK_STATUS_TIMEOUT, WARNING,
-               "Failed to connect to server %s\n", ctx->addr.sun_path);
+        if (notifyfd >= 0)
+            close(notifyfd);
 
         PLINK_PRINT(INFO, "Connected to server: %d\n", ctx->sockfd);
+        ctx->connect[0] = 1;
+        return sendSubscription(ctx, 0, PLINK_OPTION_MAX);
     }
 
     return PLINK_STATUS_OK;
 }
 
+PlinkStatus
+PLINK_setOption(PlinkHandle plink, PlinkChannelID channel, PlinkOption option, int value)
+{
+    PlinkContext *ctx = (PlinkContext *)plink;
+
+    if (ctx == NULL || channel < 0 || channel >= MAX_CONNECTIONS ||
+        option < 0 || option >= PLINK_OPTION_MAX)
+        PLINK_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: plink = %p, channel = %d, option = %d\n", plink, channel, option);
+
+    if (ctx->mode != PLINK_MODE_SERVER)
+        channel = 0;
+
+    if (option == PLINK_OPTION_MAILBOX && value != 0 && ctx->mailbox == NULL)
+    {
+        ctx->mailbox = malloc(MAX_BUFFER_SIZE);
+        if (ctx->mailbox == NULL)
+            PLINK_PRINT_RETURN(PLINK_STATUS_NO_MEMORY, ERROR,
+                "Failed to allocate memory for mailbox\n");
+    }
+
+    ctx->chn[channel].option[option] = value;
+    PLINK_PRINT(INFO, "Set option %d of channel %d to %d\n", option, channel, value);
+
+    // subscriptions are enforced by the peer, forward it if already connected
+    if (isSubscription(option) && ctx->connect[channel] != 0)
+        return sendSubscription(ctx, channel, option);
+
+    return PLINK_STATUS_OK;
+}
+
+PlinkStatus
+PLINK_getStats(PlinkHandle plink, PlinkChannelID channel, PlinkStats *stats)
+{
+    PlinkContext *ctx = (PlinkContext *)plink;
+
+    if (ctx == NULL || stats == NULL || channel < 0 || channel >= MAX_CONNECTIONS)
+        PLINK_PRINT_RETURN(PLINK_STATUS_WRONG_PARAMS, ERROR,
+            "Wrong parameters: plink = %p, channel = %d, stats = %p\n", plink, channel, stats);
+
+    if (ctx->mode != PLINK_MODE_SERVER)
+        channel = 0;
+
+    *stats = ctx->chn[channel].stats;
+
+    return PLINK_STATUS_OK;
+}
+
 PlinkStatus 
 PLINK_recv_ex(PlinkHandle plink, PlinkChannelID channel, PlinkPacket *pkt, int timeout_ms)
 {
@@ -463,34 +619,431 @@ PLINK_recv_ex(PlinkHandle plink, PlinkChannelID channel, PlinkPacket *pkt, int t
 
 
 static PlinkStatus 
-parseData(PlinkContext *ctx, PlinkPacket *pkt, int remaining)
+recvPacket(PlinkContext *ctx, PlinkChannelID channel, PlinkPacket *pkt)
 {
+    pkt->num = 0;
+    pkt->fd = PLINK_INVALID_FD;
+
+    // parse complete descriptors left by the previous call before receiving more
+    if (hasParsableData(ctx))
+        return parseData(ctx, pkt);
+
+    // move the incomplete descriptor to the beginning of the buffer
+    if (ctx->remaining > 0)
+        memmove(ctx->buffer, ctx->buffer + ctx->offset, ctx->remaining);
+    ctx->offset = 0;
+
+    char buf[CMSG_SPACE(sizeof(int))];
+    memset(buf, 0, sizeof(buf));
+    ctx->ioIn[0].iov_base = ctx->buffer + ctx->remaining;
+    ctx->ioIn[0].iov_len = MAX_BUFFER_SIZE - ctx->remaining;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = ctx->ioIn;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+
+    int sockfd = ctx->mode == PLINK_MODE_SERVER ? ctx->cfd[channel] : ctx->sockfd;
+    PLINK_PRINT(INFO, "Receiving data from %d\n", sockfd);
+    int total = recvmsg (sockfd, &msg, 0);
+    if (total > 0)
+        PLINK_PRINT(INFO, "Received %d bytes\n", total)
+    else if (total == 0)
+        PLINK_PRINT_RETURN(PLINK_STATUS_NO_DATA, WARNING,
+            "recvmsg() returns %d\n", total)
+    else
+        PLINK_PRINT_RETURN(PLINK_STATUS_ERROR, ERROR,
+            "Failed to recieve data from %d: %s\n", sockfd, strerror(errno))
+
+    if (msg.msg_controllen >= CMSG_SPACE(sizeof(int)))
+    {
+        struct cmsghdr *cmsg;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        pkt->fd = *((int *)CMSG_DATA(cmsg));
+        PLINK_PRINT(INFO, "Received fd %d\n", pkt->fd);
+    }
+
+    ctx->remaining += total;
+    PlinkStatus sts = parseData(ctx, pkt);
+    ctx->chn[ctx->mode == PLINK_MODE_SERVER ? channel : 0].stats.received++;
+
+    return sts;
+}
+
+static int hasParsableData(PlinkContext *ctx)
+{
+    return ctx->remaining >= (int)DATA_HEADER_SIZE &&
+        ctx->remaining >= (int)(DATA_HEADER_SIZE + ((PlinkDescHdr *)(ctx->buffer + ctx->offset))->size);
+}
+
+static int isBufferDesc(PlinkDescHdr *hdr)
+{
+    return (hdr->type == PLINK_TYPE_1D_BUFFER ||
+            hdr->type == PLINK_TYPE_2D_YUV ||
+            hdr->type == PLINK_TYPE_2D_RGB ||
+            hdr->type == PLINK_TYPE_2D_RAW) && hdr->id > 0;
+}
+
+/* A frame is a packet passing a buffer: it comes with fd and at least one buffer descriptor */
+static int isFrame(PlinkPacket *pkt)
+{
+    if (pkt->fd == PLINK_INVALID_FD)
+        return 0;
+
+    for (int i = 0; i < pkt->num; i++)
+    {
+        if (isBufferDesc((PlinkDescHdr *)pkt->list[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/* Return the buffers of a frame to the sender, just like the receiver does with PlinkMsg */
+static void releaseFrame(PlinkContext *ctx, PlinkChannelID channel, PlinkPacket *pkt)
+{
+    PlinkPacket sendpkt = {0};
+    PlinkMsg msg;
+
+    for (int i = 0; i < pkt->num; i++)
+    {
+        PlinkDescHdr *hdr = (PlinkDescHdr *)pkt->list[i];
+        if (!isBufferDesc(hdr))
+            continue;
+
+        msg.header.type = PLINK_TYPE_MESSAGE;
+        msg.header.size = DATA_SIZE(PlinkMsg);
+        msg.header.id = 0;
+        msg.msg = hdr->id;
+        sendpkt.list[0] = &msg;
+        sendpkt.num = 1;
+        sendpkt.fd = PLINK_INVALID_FD;
+        if (PLINK_send(ctx, channel, &sendpkt) != PLINK_STATUS_OK)
+            PLINK_PRINT(ERROR, "Failed to release buffer %d\n", hdr->id);
+    }
+
+    if (pkt->fd != PLINK_INVALID_FD)
+        close(pkt->fd);
+}
+
+/* Release the frame to the sender and keep only the messages in pkt */
+static void dropFrame(PlinkContext *ctx, PlinkChannelID channel, PlinkPacket *pkt)
+{
+    int num = pkt->num;
+
+    releaseFrame(ctx, channel, pkt);
+    pkt->fd = PLINK_INVALID_FD;
+    pkt->num = 0;
+    for (int i = 0; i < num; i++)
+    {
+        PlinkDescHdr *hdr = (PlinkDescHdr *)pkt->list[i];
+        if (hdr->type == PLINK_TYPE_MESSAGE)
+            pkt->list[pkt->num++] = pkt->list[i];
+    }
+}
+
+/* Get notified when a file is created in the directory of the server socket; returns -1 if not supported */
+static int watchServer(PlinkContext *ctx)
+{
+    char dir[sizeof(ctx->addr.sun_path)];
+    strncpy(dir, ctx->addr.sun_path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        slash[1] = '\0';
+    else
+        slash[0] = '\0';
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO) < 0)
+    {
+        PLINK_PRINT(WARNING, "Failed to watch %s, polling for the server\n", dir);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static long long getTimeUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int isSubscription(PlinkOption option)
+{
+    return option == PLINK_OPTION_DECIMATION ||
+           option == PLINK_OPTION_MAX_FPS ||
+           option == PLINK_OPTION_DESC_TYPES;
+}
+
+/* Messages are always delivered, so that buffers can be released and the connection closed */
+static int isWanted(int types, PlinkDescHdr *hdr)
+{
+    return types == 0 ||
+           hdr->type == PLINK_TYPE_MESSAGE ||
+           hdr->type == PLINK_TYPE_SUBSCRIPTION ||
+           (hdr->type >= 0 && hdr->type < 32 && (types & PLINK_DESC_TYPE_MASK(hdr->type)) != 0);
+}
+
+/* Descriptors which describe the content of the buffer passed by fd */
+static int usesFd(PlinkDescHdr *hdr)
+{
+    return hdr->type == PLINK_TYPE_1D_BUFFER ||
+           hdr->type == PLINK_TYPE_2D_YUV ||
+           hdr->type == PLINK_TYPE_2D_RGB ||
+           hdr->type == PLINK_TYPE_2D_RAW ||
+           hdr->type == PLINK_TYPE_OBJECT;
+}
+
+/* Send a subscription option of the channel to the peer, or with PLINK_OPTION_MAX all the options
+ * which are not the default, so a peer without subscription receives nothing */
+static PlinkStatus 
+sendSubscription(PlinkContext *ctx, PlinkChannelID channel, int changed)
+{
+    PlinkSubscription sub[PLINK_OPTION_MAX];
+    PlinkPacket pkt = {0};
+
+    pkt.fd = PLINK_INVALID_FD;
+    for (int option = 0; option < PLINK_OPTION_MAX; option++)
+    {
+        if (!isSubscription(option) ||
+            (changed == PLINK_OPTION_MAX ? ctx->chn[channel].option[option] == 0 : option != changed))
+            continue;
+
+        sub[pkt.num].header.type = PLINK_TYPE_SUBSCRIPTION;
+        sub[pkt.num].header.size = DATA_SIZE(PlinkSubscription);
+        sub[pkt.num].header.id = 0;
+        sub[pkt.num].option = option;
+        sub[pkt.num].value = ctx->chn[channel].option[option];
+        pkt.list[pkt.num] = &sub[pkt.num];
+        pkt.num++;
+    }
+
+    if (pkt.num == 0)
+        return PLINK_STATUS_OK;
+    return PLINK_send(ctx, channel, &pkt);
+}
+
+static void 
+applyOption(PlinkContext *ctx, PlinkChannelID channel, PlinkSubscription *sub)
+{
+    PlinkChannel *chn = &ctx->chn[ctx->mode == PLINK_MODE_SERVER ? channel : 0];
+
+    if (sub->option < 0 || sub->option >= PLINK_OPTION_MAX || !isSubscription(sub->option))
+    {
+        PLINK_PRINT(WARNING, "Unknown subscription option %d\n", sub->option);
+        return;
+    }
+
+    PLINK_PRINT(INFO, "Channel %d subscribed option %d = %d\n", channel, sub->option, sub->value);
+    chn->filter[sub->option] = sub->value;
+    if (sub->option == PLINK_OPTION_MAX_FPS)
+        chn->next_us = 0;
+}
+
+/* Apply subscriptions from the peer and remove them from the received packet */
+static void 
+applySubscription(PlinkContext *ctx, PlinkChannelID channel, PlinkPacket *pkt)
+{
+    int num = pkt->num;
+
+    pkt->num = 0;
+    for (int i = 0; i < num; i++)
+    {
+        PlinkDescHdr *hdr = (PlinkDescHdr *)pkt->list[i];
+        if (hdr->type == PLINK_TYPE_SUBSCRIPTION)
+            applyOption(ctx, channel, (PlinkSubscription *)hdr);
+        else
+            pkt->list[pkt->num++] = pkt->list[i];
+    }
+}
+
+/* Apply the subscriptions a client has sent ahead of any other data, without blocking and leaving
+ * the rest to PLINK_recv. Returns the number of options applied. */
+static int 
+recvSubscription(PlinkContext *ctx, PlinkChannelID channel)
+{
+    int fd = ctx->cfd[channel];
+    PlinkSubscription sub;
+    int count = 0;
+
+    while (recv(fd, &sub, sizeof(sub), MSG_PEEK | MSG_DONTWAIT) == sizeof(sub) &&
+           sub.header.type == PLINK_TYPE_SUBSCRIPTION &&
+           sub.header.size == DATA_SIZE(PlinkSubscription))
+    {
+        if (recv(fd, &sub, sizeof(sub), MSG_WAITALL) != sizeof(sub))
+            break;
+        applyOption(ctx, channel, &sub);
+        count++;
+    }
+    return count;
+}
+
+/* Enforce the subscription of the receiver: decimation first, then the frame rate limit */
+static int isFiltered(PlinkChannel *chn)
+{
+    int decimation = chn->filter[PLINK_OPTION_DECIMATION];
+    int max_fps = chn->filter[PLINK_OPTION_MAX_FPS];
+
+    if (decimation > 1 && (chn->frames++ % decimation) != 0)
+        return 1;
+
+    if (max_fps > 0)
+    {
+        // token bucket of one frame: advance the schedule by one period per frame sent,
+        // so the average rate is max_fps even if the source rate is not a multiple of it
+        long long period = 1000000 / max_fps;
+        long long now = getTimeUs();
+        if (now < chn->next_us)
+            return 1;
+        chn->next_us += period;
+        if (chn->next_us <= now)
+            chn->next_us = now + period; // idle for a while, no burst
+    }
+
+    return 0;
+}
+
+/* Check the capture time of the frame, which is carried by PlinkTimeInfo of type PLINK_TIME_CAPTURE */
+static int isExpired(PlinkPacket *pkt, int max_age_ms)
+{
+    if (max_age_ms <= 0)
+        return 0;
+
+    for (int i = 0; i < pkt->num; i++)
+    {
+        PlinkTimeInfo *info = (PlinkTimeInfo *)pkt->list[i];
+        if (info->header.type != PLINK_TYPE_TIME || info->type != PLINK_TIME_CAPTURE)
+            continue;
+
+        long long now = getTimeUs();
+        long long capture = info->seconds * 1000000 + info->useconds;
+        return now - capture > (long long)max_age_ms * 1000;
+    }
+
+    return 0;
+}
+
+/* Append descriptors of src to pkt, copying them to the mailbox storage */
+static void holdDescs(PlinkContext *ctx, PlinkPacket *pkt, int *size, PlinkPacket *src)
+{
+    for (int i = 0; i < src->num; i++)
+    {
+        PlinkDescHdr *hdr = (PlinkDescHdr *)src->list[i];
+        int len = DATA_HEADER_SIZE + hdr->size;
+        if (pkt->num >= PLINK_MAX_DATA_DESCS || *size + len > MAX_BUFFER_SIZE)
+        {
+            PLINK_PRINT(ERROR, "No room in mailbox, descriptor of type %d is dropped\n", hdr->type);
+            continue;
+        }
+
+        memcpy(ctx->mailbox + *size, hdr, len);
+        pkt->list[pkt->num++] = ctx->mailbox + *size;
+        *size += len;
+    }
+}
+
+/* Keep only the messages of the held packet; the skipped frame and its metadata are discarded */
+static void keepMessages(PlinkContext *ctx, PlinkPacket *pkt, int *size)
+{
+    int num = pkt->num;
+    pkt->num = 0;
+    *size = 0;
+    for (int i = 0; i < num; i++)
+    {
+        PlinkDescHdr *hdr = (PlinkDescHdr *)pkt->list[i];
+        int len = DATA_HEADER_SIZE + hdr->size;
+        if (hdr->type != PLINK_TYPE_MESSAGE)
+            continue;
+
+        memmove(ctx->mailbox + *size, hdr, len);
+        pkt->list[pkt->num++] = ctx->mailbox + *size;
+        *size += len;
+    }
+}
+
+/* Mailbox mode: drain all pending packets and deliver only the latest frame */
+static PlinkStatus 
+recvLatest(PlinkContext *ctx, PlinkChannelID channel, PlinkPacket *pkt)
+{
+    int sockfd = ctx->mode == PLINK_MODE_SERVER ? ctx->cfd[channel] : ctx->sockfd;
     PlinkStatus sts = PLINK_STATUS_OK;
+    PlinkPacket next;
+    PlinkPacket held = {0};
+    int size = 0;
 
-    if (ctx == NULL)
-        return PLINK_STATUS_ERROR;
+    if (!isFrame(pkt))
+        return PLINK_STATUS_OK;
 
-    int index = 0;
-    void *buffer = ctx->buffer;
-    while (remaining >= DATA_HEADER_SIZE)
+    held.fd = pkt->fd;
+    holdDescs(ctx, &held, &size, pkt);
+    while (held.num < PLINK_MAX_DATA_DESCS &&
+           (hasParsableData(ctx) || wait(sockfd, 0) == PLINK_STATUS_OK))
     {
-        if (index >= PLINK_MAX_DATA_DESCS)
+        sts = recvPacket(ctx, channel, &next);
+        if (sts != PLINK_STATUS_OK && sts != PLINK_STATUS_MORE_DATA)
         {
-            // not enough buffer to store received data, need another recv call
-            sts = PLINK_STATUS_MORE_DATA;
-            PLINK_PRINT(ERROR, "sts:%d Received %d bytes,index exceed max:%d!\n",
-			    sts, remaining, PLINK_MAX_DATA_DESCS);
+            // report it in the next call, after the held frame is delivered
+            sts = PLINK_STATUS_OK;
             break;
         }
+        applySubscription(ctx, channel, &next);
+
+        if (isFrame(&next))
+        {
+            PLINK_PRINT(INFO, "Mailbox: skip frame with fd %d\n", held.fd);
+            releaseFrame(ctx, channel, &held);
+            keepMessages(ctx, &held, &size);
+            held.fd = next.fd;
+            ctx->chn[ctx->mode == PLINK_MODE_SERVER ? channel : 0].stats.skipped++;
+        }
+        holdDescs(ctx, &held, &size, &next);
+
+        if (sts == PLINK_STATUS_MORE_DATA)
+            break;
+    }
+
+    *pkt = held;
+    return sts;
+}
+
+static PlinkStatus 
+parseData(PlinkContext *ctx, PlinkPacket *pkt)
+{
+    PlinkStatus sts = PLINK_STATUS_OK;
 
+    if (ctx == NULL)
+        return PLINK_STATUS_ERROR;
+
+    int index = 0;
+    char *buffer = ctx->buffer + ctx->offset;
+    int remaining = ctx->remaining;
+    while (remaining >= (int)DATA_HEADER_SIZE)
+    {
         PlinkDescHdr *hdr = (PlinkDescHdr *)buffer;
-        if (remaining < (unsigned int)hdr->size)
+        if (remaining < (int)(DATA_HEADER_SIZE + hdr->size))
         {
             PLINK_PRINT(WARNING, "Not enough data received. Expect %d while only %d available\n", hdr->size, remaining);
             // return to get more data in next recvmsg call
             break;
         }
 
+        if (index >= PLINK_MAX_DATA_DESCS)
+        {
+            // not enough room in pkt to store received data, need another recv call
+            sts = PLINK_STATUS_MORE_DATA;
+            PLINK_PRINT(INFO, "sts:%d Received %d bytes,index exceed max:%d!\n",
+			    sts, remaining, PLINK_MAX_DATA_DESCS);
+            break;
+        }
+
         pkt->list[index] = buffer;
 
         buffer += DATA_HEADER_SIZE + hdr->size;
@@ -498,14 +1051,11 @@ parseData(PlinkContext *ctx, PlinkPacket *pkt, int remaining)
         index++;
     }
 
-    // move the remaining data to the beginning of the buffer
-    if (remaining > 0)
-    {
-        memmove(ctx->buffer, buffer, remaining);
-        ctx->offset = remaining;
-    }
+    // keep the remaining data in place, it is parsed in the next call
+    ctx->offset = buffer - ctx->buffer;
+    ctx->remaining = remaining;
 
-    pkt->num = sts == PLINK_STATUS_MORE_DATA ? index-1 : index;
+    pkt->num = index;
 
     return sts;
 }
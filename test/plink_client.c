@@ -16,15 +16,20 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <pthread.h>
 #include <memory.h>
+#include <time.h>
 #include "process_linker_types.h"
 #include "video_mem.h"
+#include "plink_buffer.h"
 
 #ifndef NULL
 #define NULL    ((void *)0)
@@ -34,6 +39,327 @@
 #define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
                         } while (0)
 
+#define DUMP_ALIGNMENT      4096        // O_DIRECT: alignment of the memory, the sizes and the file offsets
+#define DUMP_CHUNK          (4 << 20)   // the writer waits for this much data, or half of the queue
+#define DEFAULT_DUMP_DEPTH  8           // frames the dump queue can hold
+#define MAX_LATENCY_SAMPLES (1 << 20)   // frames whose latency is kept for the percentiles
+
+/* Frames are packed without the stride padding into a ring of bytes, which a writer thread drains
+ * in large writes. Positions in the ring are offsets in the file: as the ring is a multiple of
+ * DUMP_ALIGNMENT, every write but the last one is aligned, as O_DIRECT requires. */
+typedef struct _DumpWriter
+{
+    int fd;
+    int direct;                 // opened with O_DIRECT
+    int depth;                  // 0: the receiving thread writes each frame itself
+    unsigned char *ring;
+    unsigned long long size;    // bytes of the ring
+    unsigned long long head;    // end of the frames queued, under mutex
+    unsigned long long tail;    // end of the bytes written to the file, under mutex
+    unsigned long long pos;     // end of the frame being packed
+    unsigned long long limit;   // the frame being packed must end before this
+    int overflow;               // the frame being packed does not fit
+    int failed;
+    int exit;
+    unsigned long long frames;
+    unsigned long long dropped;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} DumpWriter;
+
+/* Frames received and their latency from the capture time sent by the producer, reported at exit */
+typedef struct _ReceiveStats
+{
+    int frames;
+    int late;                   // later than deadline_us after their capture
+    long long deadline_us;      // 0: no deadline
+    long long first_us;
+    long long last_us;
+    int *latency_us;
+    int capacity;
+    int count;                  // frames with a capture time
+} ReceiveStats;
+
+/* Write the queued bytes, all of them when final, otherwise the whole blocks only.
+ * Called by the writer thread, or by the receiving thread without queue. */
+static int writeQueued(DumpWriter *w, int final)
+{
+    pthread_mutex_lock(&w->mutex);
+    unsigned long long start = w->tail;
+    unsigned long long end = w->head;
+    pthread_mutex_unlock(&w->mutex);
+    if (final == 0)
+        end = start + ((end - start) & ~(unsigned long long)(DUMP_ALIGNMENT - 1));
+
+    while (start < end && w->failed == 0)
+    {
+        // two pieces when the data wraps around the end of the ring
+        struct iovec iov[2];
+        unsigned long long offset = start % w->size;
+        iov[0].iov_base = w->ring + offset;
+        iov[0].iov_len = end - start < w->size - offset ? end - start : w->size - offset;
+        iov[1].iov_base = w->ring;
+        iov[1].iov_len = end - start - iov[0].iov_len;
+        if (w->direct && (end - start) % DUMP_ALIGNMENT != 0)
+        {
+            // the end of the file is not a whole block
+            fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+            w->direct = 0;
+        }
+
+        ssize_t written = writev(w->fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            perror("[CLIENT] ERROR: Failed to write dump file");
+            w->failed = 1;
+            break;
+        }
+        start += written;
+        pthread_mutex_lock(&w->mutex);
+        w->tail = start;
+        pthread_mutex_unlock(&w->mutex);
+    }
+    return w->failed ? -1 : 0;
+}
+
+static void *dump_thread(void *args)
+{
+    DumpWriter *w = (DumpWriter *)args;
+    unsigned long long batch = w->size / 2 < DUMP_CHUNK ? w->size / 2 : DUMP_CHUNK;
+    int exit = 0;
+
+    while (exit == 0 && w->failed == 0)
+    {
+        pthread_mutex_lock(&w->mutex);
+        while (w->exit == 0 && w->head - w->tail < batch)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        exit = w->exit;
+        pthread_mutex_unlock(&w->mutex);
+        writeQueued(w, exit);
+    }
+    return NULL;
+}
+
+static int openDump(DumpWriter *w, const char *name, int depth)
+{
+    memset(w, 0, sizeof(*w));
+    w->depth = depth;
+    w->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    w->direct = w->fd >= 0;
+    if (w->fd < 0 && errno == EINVAL)   // e.g. tmpfs
+        w->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0)
+        return -1;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    return 0;
+}
+
+/* The queue holds depth frames of the size of the first one, plus the partial block left unwritten */
+static int createQueue(DumpWriter *w, unsigned int frame_size)
+{
+    unsigned long long frame = frame_size > 0 ? frame_size : DUMP_CHUNK;
+    unsigned long long size = frame * (w->depth > 0 ? w->depth : 1) + DUMP_ALIGNMENT;
+    w->size = (size + DUMP_ALIGNMENT - 1) & ~(unsigned long long)(DUMP_ALIGNMENT - 1);
+    if (posix_memalign((void **)&w->ring, DUMP_ALIGNMENT, w->size) != 0)
+    {
+        w->ring = NULL;
+        return -1;
+    }
+    if (w->depth > 0 && pthread_create(&w->thread, NULL, dump_thread, w) != 0)
+    {
+        free(w->ring);
+        w->ring = NULL;
+        return -1;
+    }
+    printf("[CLIENT] Dump queue of %llu KB, %s writes\n", w->size >> 10, w->direct ? "direct" : "buffered");
+    return 0;
+}
+
+/* frame_size: at least the bytes of the frame to dump */
+static void beginFrame(DumpWriter *w, unsigned int frame_size)
+{
+    if (w->ring == NULL && w->failed == 0 && createQueue(w, frame_size) != 0)
+    {
+        fprintf(stderr, "[CLIENT] ERROR: Failed to create the dump queue\n");
+        w->failed = 1;
+    }
+    pthread_mutex_lock(&w->mutex);
+    w->limit = w->tail + w->size;
+    pthread_mutex_unlock(&w->mutex);
+    w->pos = w->head;
+    w->overflow = w->failed;
+}
+
+static void dumpBytes(DumpWriter *w, const unsigned char *src, unsigned int size)
+{
+    if (w->overflow || w->pos + size > w->limit)
+    {
+        w->overflow = 1;
+        return;
+    }
+    unsigned long long offset = w->pos % w->size;
+    unsigned int first = size < w->size - offset ? size : w->size - offset;
+    memcpy(w->ring + offset, src, first);
+    memcpy(w->ring, src + first, size - first);
+    w->pos += size;
+}
+
+/* Queue the frame, or drop it when the queue is full rather than holding the buffer */
+static void commitFrame(DumpWriter *w)
+{
+    if (w->overflow)
+    {
+        w->dropped++;
+        return;
+    }
+    pthread_mutex_lock(&w->mutex);
+    w->head = w->pos;
+    w->frames++;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    if (w->depth == 0)
+        writeQueued(w, 0);
+}
+
+static void closeDump(DumpWriter *w)
+{
+    if (w->ring != NULL)
+    {
+        if (w->depth > 0)
+        {
+            pthread_mutex_lock(&w->mutex);
+            w->exit = 1;
+            pthread_cond_signal(&w->cond);
+            pthread_mutex_unlock(&w->mutex);
+            pthread_join(w->thread, NULL);
+        }
+        else
+            writeQueued(w, 1);
+        free(w->ring);
+    }
+    printf("[CLIENT] Dumped %llu frames, dropped %llu\n", w->frames, w->dropped);
+    close(w->fd);
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+}
+
+static void dumpPlane(DumpWriter *w, unsigned char *buffer, int size, int rows, int stride)
+{
+    for (int i = 0; i < rows; i++)
+    {
+        dumpBytes(w, buffer, size);
+        buffer += stride;
+    }
+}
+
+/* Save the planes one after the other without padding */
+static void dumpYuv(DumpWriter *w, unsigned char *buffer, PlinkYuvInfo *pic)
+{
+    int width = pic->pic_width;
+    int height = pic->pic_height;
+    int offset_u = pic->offset_u > 0 ? pic->offset_u : pic->offset_y + height * pic->stride_y;
+
+    switch (pic->format)
+    {
+        case PLINK_COLOR_FormatYUV420Planar:
+        case PLINK_COLOR_FormatYUV422Planar:
+        {
+            int stride_uv = pic->stride_u > 0 ? pic->stride_u : pic->stride_y / 2;
+            int rows = pic->format == PLINK_COLOR_FormatYUV420Planar ? height / 2 : height;
+            int offset_v = pic->offset_v > 0 ? (int)pic->offset_v : offset_u + rows * stride_uv;
+            dumpPlane(w, buffer + pic->offset_y, width, height, pic->stride_y);
+            dumpPlane(w, buffer + offset_u, width / 2, rows, stride_uv);
+            dumpPlane(w, buffer + offset_v, width / 2, rows, stride_uv);
+            break;
+        }
+        case PLINK_COLOR_FormatYUV422SemiPlanar:
+            dumpPlane(w, buffer + pic->offset_y, width, height, pic->stride_y);
+            dumpPlane(w, buffer + offset_u, width, height, pic->stride_u > 0 ? pic->stride_u : pic->stride_y);
+            break;
+        case PLINK_COLOR_FormatYUV420SemiPlanarP010:
+            dumpPlane(w, buffer + pic->offset_y, width * 2, height, pic->stride_y);
+            dumpPlane(w, buffer + offset_u, width * 2, height / 2, pic->stride_u > 0 ? pic->stride_u : pic->stride_y);
+            break;
+        default:
+            dumpPlane(w, buffer + pic->offset_y, width, height, pic->stride_y);
+            dumpPlane(w, buffer + offset_u, width, height / 2, pic->stride_u > 0 ? pic->stride_u : pic->stride_y);
+    }
+}
+
+static int isRgbDumped(PlinkColorFormat format)
+{
+    return format == PLINK_COLOR_Format24BitRGB888Planar || format == PLINK_COLOR_Format24BitBGR888Planar ||
+           format == PLINK_COLOR_Format24BitRGB888 || format == PLINK_COLOR_Format24BitBGR888;
+}
+
+/* Planar RGB in the order of the name, packed RGB as is */
+static void dumpRgb(DumpWriter *w, unsigned char *buffer, PlinkRGBInfo *pic)
+{
+    if (pic->format == PLINK_COLOR_Format24BitRGB888 || pic->format == PLINK_COLOR_Format24BitBGR888)
+        dumpPlane(w, buffer + pic->offset_r, pic->img_width * 3, pic->img_height, pic->stride_r);
+    else if (pic->offset_r == 0 && pic->offset_g == 0 && pic->offset_b == 0)
+        dumpPlane(w, buffer, pic->img_width, pic->img_height * 3, pic->stride_r);
+    else
+    {
+        int rgb = pic->format == PLINK_COLOR_Format24BitRGB888Planar;
+        unsigned int first = rgb ? pic->offset_r : pic->offset_b;
+        unsigned int last = rgb ? pic->offset_b : pic->offset_r;
+        dumpPlane(w, buffer + first, pic->img_width, pic->img_height, rgb ? pic->stride_r : pic->stride_b);
+        dumpPlane(w, buffer + pic->offset_g, pic->img_width, pic->img_height, pic->stride_g);
+        dumpPlane(w, buffer + last, pic->img_width, pic->img_height, rgb ? pic->stride_b : pic->stride_r);
+    }
+}
+
+static long long getTimeUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int compareInt(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* A frame received now, capture_us is 0 when the producer sent no capture time */
+static void countFrame(ReceiveStats *stats, long long capture_us)
+{
+    long long now = getTimeUs();
+    if (stats->frames++ == 0)
+        stats->first_us = now;
+    stats->last_us = now;
+    if (capture_us <= 0)
+        return;
+
+    long long latency = now - capture_us;
+    if (stats->deadline_us > 0 && latency > stats->deadline_us)
+        stats->late++;
+    if (stats->latency_us == NULL && stats->capacity > 0)
+        stats->latency_us = malloc(stats->capacity * sizeof(int));
+    if (stats->latency_us != NULL && stats->count < stats->capacity)
+        stats->latency_us[stats->count++] = latency;
+}
+
+static void printStats(ReceiveStats *stats)
+{
+    double seconds = (stats->last_us - stats->first_us) / 1e6;
+    printf("[CLIENT] Received %d frames in %.2f s, %.2f fps\n", stats->frames, seconds,
+           seconds > 0 ? (stats->frames - 1) / seconds : 0);
+    if (stats->count == 0)
+        return;
+
+    qsort(stats->latency_us, stats->count, sizeof(int), compareInt);
+    printf("[CLIENT] Latency from capture: p50 %.2f ms, p99 %.2f ms, max %.2f ms, %d frames late\n",
+           stats->latency_us[stats->count / 2] / 1000.0, stats->latency_us[stats->count * 99 / 100] / 1000.0,
+           stats->latency_us[stats->count - 1] / 1000.0, stats->late);
+    free(stats->latency_us);
+}
+
 int main(int argc, char **argv) {
     PlinkStatus sts = PLINK_STATUS_OK;
     PlinkPacket sendpkt, recvpkt;
@@ -41,40 +367,78 @@ int main(int argc, char **argv) {
     PlinkHandle plink = NULL;
     VmemParams params;
     void *vmem = NULL;
-    FILE *fp = NULL;
+    int direct = 0;
+    DumpWriter dump;
+    int dumping = 0;
     int exitcode = 0;
 
-    int frames = argc > 1 ? atoi(argv[1]) : 1000;
-    char *plinkname = argc > 2 ? argv[2] : "/tmp/plink.test";
-    char *dumpname = argc > 3 ? argv[3] : NULL;
+    // the positional arguments come first, then the options of the channel
+    int count = 1;
+    while (count < argc && !(argv[count][0] == '-' && strlen(argv[count]) >= 2))
+        count++;
+    int frames = count > 1 ? atoi(argv[1]) : 1000;
+    char *plinkname = count > 2 ? argv[2] : "/tmp/plink.test";
+    char *dumpname = count > 3 && argv[3][0] != '\0' ? argv[3] : NULL;
+    int depth = count > 4 ? atoi(argv[4]) : DEFAULT_DUMP_DEPTH;
+    ReceiveStats stats = {0};
+    stats.deadline_us = count > 5 ? atoi(argv[5]) * 1000LL : 0;
+    int mailbox = 0, max_age = 0, decimation = 0, max_fps = 0, metadata = 0;
+    for (int i = count; i < argc; i++)
+    {
+        if (argv[i][1] == 'b')
+            mailbox = 1;
+        else if (argv[i][1] == 'a' && i + 1 < argc)
+            max_age = atoi(argv[++i]);
+        else if (argv[i][1] == 'e' && i + 1 < argc)
+            decimation = atoi(argv[++i]);
+        else if (argv[i][1] == 'f' && i + 1 < argc)
+            max_fps = atoi(argv[++i]);
+        else if (argv[i][1] == 'o')
+            metadata = 1;
+    }
+    stats.capacity = frames < MAX_LATENCY_SAMPLES ? frames : MAX_LATENCY_SAMPLES;
 
     if (dumpname != NULL)
     {
-        fp = fopen(dumpname, "wb");
-        if (fp == NULL)
-            errExit("fopen");
+        if (openDump(&dump, dumpname, depth > 0 ? depth : 0) != 0)
+            errExit("open");
+        dumping = 1;
     }
 
     if (VMEM_create(&vmem) != VMEM_STATUS_OK)
-        errExit("Failed to create VMEM.");
+    {
+        printf("[CLIENT] No video memory, only file-backed buffers can be mapped\n");
+        vmem = NULL;
+    }
 
     if (PLINK_create(&plink, plinkname, PLINK_MODE_CLIENT) != PLINK_STATUS_OK)
         errExit("Failed to create PLINK.");
+    if (mailbox)
+        PLINK_setOption(plink, 0, PLINK_OPTION_MAILBOX, 1);
+    if (max_age > 0)
+        PLINK_setOption(plink, 0, PLINK_OPTION_MAX_AGE, max_age);
+    // subscriptions are sent on connect and enforced by the server
+    if (decimation > 1)
+        PLINK_setOption(plink, 0, PLINK_OPTION_DECIMATION, decimation);
+    if (max_fps > 0)
+        PLINK_setOption(plink, 0, PLINK_OPTION_MAX_FPS, max_fps);
+    if (metadata)
+        PLINK_setOption(plink, 0, PLINK_OPTION_DESC_TYPES, PLINK_DESC_TYPE_MASK(PLINK_TYPE_TIME));
 
     if (PLINK_connect(plink, NULL) != PLINK_STATUS_OK)
         errExit("Failed to connect to server.");
 
     int frmcnt = 0;
     do {
+        long long capture_us = 0;
         sts = PLINK_recv(plink, 0, &recvpkt);
         memset(&params, 0, sizeof(params));
         if (recvpkt.fd != PLINK_INVALID_FD)
         {
             params.fd = recvpkt.fd;
-            if (VMEM_import(vmem, &params) != VMEM_STATUS_OK)
-                errExit("Failed to import fd.");
-            if (VMEM_mmap(vmem, &params) != VMEM_STATUS_OK)
-                errExit("Failed to mmap buffer.");
+            direct = BUFFER_map(vmem, &params, BUFFER_getPicture(&recvpkt));
+            if (direct < 0)
+                errExit("Failed to map buffer.");
         }
 
         for (int i = 0; i < recvpkt.num; i++)
@@ -88,15 +452,12 @@ int main(int argc, char **argv) {
                         pic->pic_width, pic->pic_height,
                         pic->stride_y, pic->stride_u);
 
-                // Save YUV data to file
-                if (fp != NULL && params.vir_address != NULL)
+                // Queue YUV data for the dump file, the buffer is returned right after the copy
+                if (dumping && params.vir_address != NULL)
                 {
-                    void *buffer = params.vir_address;
-                    for (int i = 0; i < pic->pic_height * 3 / 2; i++)
-                    {
-                        fwrite(buffer, pic->pic_width, 1, fp);
-                        buffer += pic->stride_y;
-                    }
+                    beginFrame(&dump, pic->stride_y * pic->pic_height * 2);
+                    dumpYuv(&dump, params.vir_address, pic);
+                    commitFrame(&dump);
                 }
 
                 // return the buffer to source
@@ -117,15 +478,12 @@ int main(int argc, char **argv) {
                         pic->img_width, pic->img_height,
                         pic->stride_r, pic->stride_g, pic->stride_b, pic->stride_a);
 
-                // Save RGB data to file
-                if (fp != NULL && params.vir_address != NULL && pic->format == PLINK_COLOR_Format24BitBGR888Planar)
+                // Queue RGB data for the dump file
+                if (dumping && params.vir_address != NULL && isRgbDumped(pic->format))
                 {
-                    void *buffer = params.vir_address;
-                    for (int i = 0; i < pic->img_height * 3; i++)
-                    {
-                        fwrite(buffer, pic->img_width, 1, fp);
-                        buffer += pic->stride_r;
-                    }
+                    beginFrame(&dump, pic->stride_r * pic->img_height * 3);
+                    dumpRgb(&dump, params.vir_address, pic);
+                    commitFrame(&dump);
                 }
 
                 // return the buffer to source
@@ -145,9 +503,13 @@ int main(int argc, char **argv) {
                         pic->header.id, pic->bus_address, recvpkt.fd,
                         pic->img_width, pic->img_height, pic->stride);
 
-                // Save RAW data to file
-                if (fp != NULL && params.vir_address != NULL)
-                    fwrite(params.vir_address, pic->stride * pic->img_height, 1, fp);
+                // Queue RAW data for the dump file
+                if (dumping && params.vir_address != NULL)
+                {
+                    beginFrame(&dump, pic->stride * pic->img_height);
+                    dumpBytes(&dump, (unsigned char *)params.vir_address + pic->offset, pic->stride * pic->img_height);
+                    commitFrame(&dump);
+                }
 
                 // return the buffer to source
                 msg.header.type = PLINK_TYPE_MESSAGE;
@@ -159,6 +521,12 @@ int main(int argc, char **argv) {
                 if (PLINK_send(plink, 0, &sendpkt) == PLINK_STATUS_ERROR)
                     errExit("Failed to send data.");
             }
+            else if (hdr->type == PLINK_TYPE_TIME)
+            {
+                PlinkTimeInfo *info = (PlinkTimeInfo *)(recvpkt.list[i]);
+                if (info->type == PLINK_TIME_CAPTURE)
+                    capture_us = info->seconds * 1000000LL + info->useconds;
+            }
             else if (hdr->type == PLINK_TYPE_MESSAGE)
             {
                 PlinkMsg *msg = (PlinkMsg *)(recvpkt.list[i]);
@@ -170,9 +538,13 @@ int main(int argc, char **argv) {
                 }
             }
         }
+        // a consumer of the metadata only is sent the capture time of each frame
+        if (BUFFER_getPicture(&recvpkt) != NULL || (metadata && capture_us > 0))
+            countFrame(&stats, capture_us);
 
-        if (VMEM_release(vmem, &params) != VMEM_STATUS_OK)
+        if (BUFFER_unmap(vmem, &params, direct) != 0)
             errExit("Failed to release buffer.");
+        direct = 0;
 
         if (recvpkt.fd != PLINK_INVALID_FD)
             close(recvpkt.fd);
@@ -194,10 +566,16 @@ int main(int argc, char **argv) {
     } while (exitcode == 0);
 
 cleanup:
+    printStats(&stats);
+    PlinkStats plinkstats;
+    if ((mailbox || max_age > 0) && PLINK_getStats(plink, 0, &plinkstats) == PLINK_STATUS_OK)
+        printf("[CLIENT] Skipped %llu frames in mailbox mode, dropped %llu older than %d ms\n",
+               plinkstats.skipped, plinkstats.dropped, max_age);
     sleep(1); // Sleep one second to make sure server is ready for exit
     PLINK_close(plink, 0);
-    VMEM_destroy(vmem);
-    if (fp != NULL)
-        fclose(fp);
+    if (vmem != NULL)
+        VMEM_destroy(vmem);
+    if (dumping)
+        closeDump(&dump);
     exit(EXIT_SUCCESS);
 }
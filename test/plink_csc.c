@@ -0,0 +1,578 @@
+/*
+ * Copyright (c) 2022 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory.h>
+#include <time.h>
+#include <signal.h>
+#include "plink_node.h"
+#include "plink_kernels.h"
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_NUM_OF_BUFFERS  4
+#define MIN_BAND_HEIGHT     16
+#define MAX_NUM_OF_BANDS    (2 * PLINK_NODE_MAX_THREADS)
+#define QUANT_MAX_SCALE     32767       // of the 16-bit multiplier of quantizeRow
+#define QUANT_MAX_OFFSET    2000000000.0
+#define CSC_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef enum _CscColor
+{
+    CSC_COLOR_BT601 = 0,        // limited range
+    CSC_COLOR_BT601Full,
+    CSC_COLOR_BT709,
+    CSC_COLOR_BT709Full,
+    CSC_COLOR_Max
+} CscColor;
+
+typedef struct _CscParams
+{
+    char *in_name;
+    char *out_name;
+    PlinkColorFormat format;
+    int width;
+    int height;
+    int stride;
+    KernelScaleMode scale;
+    CscColor color;
+    float mean[3];      // red, green and blue, in 8-bit units
+    float factor[3];    // multiplied after the mean is subtracted
+    int quantize;       // int8 output
+    float qscale;       // int8 = normalized / qscale + zero
+    int zero;
+    int threads;
+    int buffers;
+    int keep;
+} CscParams;
+
+/* Fixed-point form of out = a * c + b for a 10-bit component c, see quantizeRow */
+typedef struct _CscQuantizer
+{
+    int scale;
+    int offset;
+    int shift;
+} CscQuantizer;
+
+typedef struct _CscContext
+{
+    CscParams *params;
+    const KernelOps *kernels;
+    KernelColorMatrix to_rgb;
+    CscQuantizer quant[3];      // red, green and blue
+    PlinkColorFormat in_format; // input when the scalers were computed
+    int in_width;
+    int in_height;
+    KernelScaler scaler[2];     // luma, chroma
+    unsigned char *luma;        // resized luma, NULL when the input has the output resolution
+    unsigned char *chroma[2];   // chroma resized to the output resolution: interleaved UV, or U and V
+    void *scratch[MAX_NUM_OF_BANDS];    // of the scalers, one for each band
+    unsigned short *rows[MAX_NUM_OF_BANDS]; // of convertBand, one for each band
+    int bands;
+    PlinkNodeFrame *in;         // frame being converted
+    PlinkNodeFrame *out;
+    unsigned long long frames;
+    long long time_us;
+} CscContext;
+
+static PlinkNode node = NULL;
+
+static void printUsage(char *name)
+{
+    printf("usage: %s [options]\n"
+           "\n"
+           "  Convert YUV frames into RGB for inference: resize, color conversion, normalization and quantization.\n"
+           "  Available options:\n"
+           "    -i      plink file name of input port (default: /tmp/plink.test)\n"
+           "    -o      plink file name of output port (default: /tmp/plink.csc)\n"
+           "    -f      output color format (default: 12)\n"
+           "                9 - RGB888 packed\n"
+           "                10 - RGB888 planar\n"
+           "                11 - BGR888 packed\n"
+           "                12 - BGR888 planar\n"
+           "    -w      output video width (default: 640)\n"
+           "    -h      output video height (default: 640)\n"
+           "    -s      output video buffer stride in bytes (default: video width, three times when packed)\n"
+           "    -m      scale mode (default: 0)\n"
+           "                0 - bilinear\n"
+           "                1 - area average, better for downscaling\n"
+           "    -c      color space of the input (default: 0)\n"
+           "                0 - BT.601 limited range\n"
+           "                1 - BT.601 full range\n"
+           "                2 - BT.709 limited range\n"
+           "                3 - BT.709 full range\n"
+           "    -M      mean subtracted from each component, <red>,<green>,<blue> in 0 to 255 (default: 0,0,0)\n"
+           "    -S      scale applied after the mean, <red>,<green>,<blue> (default: 1,1,1)\n"
+           "    -q      int8 output, <scale>[,<zero point>]: int8 = normalized / scale + zero point (default: off)\n"
+           "    -t      number of threads to convert a frame (default: number of CPUs, max %d)\n"
+           "    -b      number of output buffers (default: %d, max %d)\n"
+           "    -k      keep running when the input has left, waiting for a new one\n"
+           "    --help  print this message\n"
+           "\n"
+           "  Inputs can be NV12, NV16, I420 or I422.\n"
+           "\n", name, PLINK_NODE_MAX_THREADS, DEFAULT_NUM_OF_BUFFERS, PLINK_NODE_MAX_BUFFERS);
+}
+
+static void parseParams(int argc, char **argv, CscParams *params)
+{
+    int i = 1;
+    memset(params, 0, sizeof(*params));
+    params->in_name = "/tmp/plink.test";
+    params->out_name = "/tmp/plink.csc";
+    params->format = PLINK_COLOR_Format24BitBGR888Planar;
+    params->width = 640;
+    params->height = 640;
+    params->factor[0] = params->factor[1] = params->factor[2] = 1.0f;
+    params->qscale = 1.0f;
+    params->buffers = DEFAULT_NUM_OF_BUFFERS;
+    while (i < argc)
+    {
+        if (argv[i][0] != '-' || strlen(argv[i]) < 2)
+        {
+            i++;
+            continue;
+        }
+
+        if (argv[i][1] == 'i')
+        {
+            if (++i < argc)
+                params->in_name = argv[i++];
+        }
+        else if (argv[i][1] == 'o')
+        {
+            if (++i < argc)
+                params->out_name = argv[i++];
+        }
+        else if (argv[i][1] == 'f')
+        {
+            if (++i < argc)
+                params->format = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'w')
+        {
+            if (++i < argc)
+                params->width = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'h')
+        {
+            if (++i < argc)
+                params->height = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 's')
+        {
+            if (++i < argc)
+                params->stride = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'm')
+        {
+            if (++i < argc)
+                params->scale = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'c')
+        {
+            if (++i < argc)
+                params->color = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'M')
+        {
+            if (++i < argc)
+            {
+                if (sscanf(argv[i++], "%f,%f,%f", &params->mean[0], &params->mean[1], &params->mean[2]) != 3)
+                    params->mean[0] = -1.0f;
+            }
+        }
+        else if (argv[i][1] == 'S')
+        {
+            if (++i < argc)
+            {
+                if (sscanf(argv[i++], "%f,%f,%f", &params->factor[0], &params->factor[1], &params->factor[2]) != 3)
+                    params->factor[0] = 0.0f;
+            }
+        }
+        else if (argv[i][1] == 'q')
+        {
+            if (++i < argc)
+            {
+                params->quantize = 1;
+                if (sscanf(argv[i++], "%f,%d", &params->qscale, &params->zero) < 1)
+                    params->qscale = 0.0f;
+            }
+        }
+        else if (argv[i][1] == 't')
+        {
+            if (++i < argc)
+                params->threads = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'b')
+        {
+            if (++i < argc)
+                params->buffers = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'k')
+        {
+            params->keep = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--help") == 0)
+        {
+            params->format = PLINK_COLOR_FormatMax;
+            i++;
+        }
+        else
+            i++;
+    }
+
+    if (params->threads <= 0)
+        params->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (params->threads > PLINK_NODE_MAX_THREADS)
+        params->threads = PLINK_NODE_MAX_THREADS;
+
+    printf("[CSC] Input Name               : %s\n", params->in_name);
+    printf("[CSC] Output Name              : %s\n", params->out_name);
+    printf("[CSC] Output Format            : %d\n", params->format);
+    printf("[CSC] Output Resolution        : %dx%d\n", params->width, params->height);
+    printf("[CSC] Output Stride            : %d\n", params->stride);
+    printf("[CSC] Scale Mode               : %d\n", params->scale);
+    printf("[CSC] Color Space              : %d\n", params->color);
+    printf("[CSC] Mean                     : %.3f,%.3f,%.3f\n", params->mean[0], params->mean[1], params->mean[2]);
+    printf("[CSC] Scale                    : %.6f,%.6f,%.6f\n", params->factor[0], params->factor[1], params->factor[2]);
+    if (params->quantize)
+        printf("[CSC] Int8 Quantization        : scale %.6f, zero point %d\n", params->qscale, params->zero);
+    printf("[CSC] Convert Threads          : %d\n", params->threads);
+    printf("[CSC] Output Buffers           : %d\n", params->buffers);
+    printf("[CSC] Keep Running             : %d\n", params->keep);
+}
+
+static int isPackedFormat(PlinkColorFormat format)
+{
+    return format == PLINK_COLOR_Format24BitRGB888 || format == PLINK_COLOR_Format24BitBGR888;
+}
+
+static int isSupportedInput(PlinkColorFormat format)
+{
+    return format == PLINK_COLOR_FormatYUV420SemiPlanar || format == PLINK_COLOR_FormatYUV422SemiPlanar ||
+           format == PLINK_COLOR_FormatYUV420Planar || format == PLINK_COLOR_FormatYUV422Planar;
+}
+
+static int isSemiPlanar(PlinkColorFormat format)
+{
+    return format == PLINK_COLOR_FormatYUV420SemiPlanar || format == PLINK_COLOR_FormatYUV422SemiPlanar;
+}
+
+/* Find the largest shift which keeps a in 16 bits, with rounding to nearest.
+ * Returns -1 when a or b cannot be represented. */
+static int initQuantizer(CscQuantizer *quant, double a, double b)
+{
+    int shift = 16;
+    double abs_a = a < 0 ? -a : a;
+    while (shift > 1 && abs_a * (1 << shift) > QUANT_MAX_SCALE)
+        shift--;
+    if (abs_a * (1 << shift) > QUANT_MAX_SCALE)
+        return -1;
+
+    double scale = a * (1 << shift);
+    double offset = b * (1 << shift) + (1 << (shift - 1));
+    double max = (offset < 0 ? -offset : offset) + 1023.0 * (QUANT_MAX_SCALE + 1);
+    if (max > QUANT_MAX_OFFSET)
+        return -1;
+    quant->scale = (int)(scale + (scale < 0 ? -0.5 : 0.5));
+    quant->offset = (int)(offset + (offset < 0 ? -0.5 : 0.5));
+    quant->shift = shift;
+    return 0;
+}
+
+/* out = ((c / 4 - mean) * factor) / qscale + zero, for 10-bit components c */
+static int initQuantizers(CscContext *ctx)
+{
+    CscParams *params = ctx->params;
+    double qscale = params->quantize ? params->qscale : 1.0;
+    double zero = params->quantize ? params->zero : 0.0;
+    for (int k = 0; k < 3; k++)
+    {
+        double a = params->factor[k] / qscale / 4.0;
+        double b = zero - params->mean[k] * params->factor[k] / qscale;
+        if (initQuantizer(&ctx->quant[k], a, b) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int checkParams(CscParams *params)
+{
+    if (params->format != PLINK_COLOR_Format24BitRGB888 && params->format != PLINK_COLOR_Format24BitRGB888Planar &&
+        params->format != PLINK_COLOR_Format24BitBGR888 && params->format != PLINK_COLOR_Format24BitBGR888Planar)
+        return -1;
+    if (params->width <= 0 || params->height <= 0 || params->stride < 0)
+        return -1;
+    if (params->scale < 0 || params->scale >= KERNEL_SCALE_Max || params->color < 0 || params->color >= CSC_COLOR_Max)
+        return -1;
+    if (params->buffers < 2 || params->buffers > PLINK_NODE_MAX_BUFFERS)
+        return -1;
+    if (params->quantize && (params->qscale <= 0.0f || params->zero < -128 || params->zero > 127))
+        return -1;
+    for (int k = 0; k < 3; k++)
+    {
+        if (params->mean[k] < 0.0f || params->mean[k] > 255.0f)
+            return -1;
+    }
+
+    CscContext ctx = { .params = params };
+    if (initQuantizers(&ctx) != 0)
+    {
+        fprintf(stderr, "[CSC] ERROR: Scale or mean out of range\n");
+        return -1;
+    }
+    return 0;
+}
+
+static long long getTimeUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void freeScalers(CscContext *ctx)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        KERNEL_freeScaler(&ctx->scaler[i]);
+        free(ctx->chroma[i]);
+        ctx->chroma[i] = NULL;
+    }
+    for (int i = 0; i < ctx->bands; i++)
+    {
+        free(ctx->scratch[i]);
+        free(ctx->rows[i]);
+        ctx->scratch[i] = NULL;
+        ctx->rows[i] = NULL;
+    }
+    free(ctx->luma);
+    ctx->luma = NULL;
+    ctx->in_width = 0;
+}
+
+/* Compute the scalers and allocate the resized planes when the input changes.
+ * Chroma is always resized to the output resolution, which upsamples it to 4:4:4. */
+static int updateScalers(CscContext *ctx, PlinkNodeFrame *in)
+{
+    CscParams *params = ctx->params;
+    if (in->format == ctx->in_format && in->width == ctx->in_width && in->height == ctx->in_height)
+        return 0;
+    freeScalers(ctx);
+
+    int width = params->width;
+    int height = params->height;
+    int semi = isSemiPlanar(in->format);
+    int chroma_width = (in->width + 1) / 2;
+    int chroma_height = in->format == PLINK_COLOR_FormatYUV420SemiPlanar || in->format == PLINK_COLOR_FormatYUV420Planar ?
+                        (in->height + 1) / 2 : in->height;
+    // area average only when it reduces, it would replicate pixels otherwise
+    KernelScaleMode chroma_mode = chroma_width >= width && chroma_height >= height ? params->scale : KERNEL_SCALE_Bilinear;
+    int ret = 0;
+
+    if (in->width != width || in->height != height)
+    {
+        ctx->luma = malloc(width * height);
+        ret |= ctx->luma == NULL;
+        ret |= KERNEL_initScaler(&ctx->scaler[0], params->scale, in->width, in->height, width, height, 1) != 0;
+    }
+    ret |= KERNEL_initScaler(&ctx->scaler[1], chroma_mode, chroma_width, chroma_height, width, height, semi ? 2 : 1) != 0;
+    for (int i = 0; i < (semi ? 1 : 2); i++)
+    {
+        ctx->chroma[i] = malloc(width * height * (semi ? 2 : 1));
+        ret |= ctx->chroma[i] == NULL;
+    }
+    if (ret == 0)
+    {
+        int size = KERNEL_getScratchSize(&ctx->scaler[1]);
+        if (ctx->luma != NULL && KERNEL_getScratchSize(&ctx->scaler[0]) > size)
+            size = KERNEL_getScratchSize(&ctx->scaler[0]);
+        // three rows of 10-bit components, and the planes to be interleaved
+        int rows = width * 3 * sizeof(unsigned short) + (isPackedFormat(params->format) ? width * 3 : 0);
+        for (int i = 0; i < ctx->bands; i++)
+        {
+            ctx->scratch[i] = malloc(size);
+            ctx->rows[i] = malloc(rows);
+            ret |= ctx->scratch[i] == NULL || ctx->rows[i] == NULL;
+        }
+    }
+    if (ret != 0)
+    {
+        fprintf(stderr, "[CSC] ERROR: Failed to set up the scalers for %dx%d\n", in->width, in->height);
+        freeScalers(ctx);
+        return -1;
+    }
+
+    ctx->in_format = in->format;
+    ctx->in_width = in->width;
+    ctx->in_height = in->height;
+    printf("[CSC] Input format %d %dx%d, converted to %dx%d\n", in->format, in->width, in->height, width, height);
+    return 0;
+}
+
+/* Resize the rows of the band, then convert them one by one:
+ * 10-bit YUV 4:4:4, 10-bit RGB, normalized 8-bit planes, interleaved when packed */
+static void convertBand(int band, void *arg)
+{
+    CscContext *ctx = arg;
+    const KernelOps *kernels = ctx->kernels;
+    PlinkNodeFrame *in = ctx->in;
+    PlinkNodeFrame *out = ctx->out;
+    int width = out->width;
+    int first = out->height * band / ctx->bands;
+    int last = out->height * (band + 1) / ctx->bands;
+    int semi = isSemiPlanar(in->format);
+    int packed = isPackedFormat(out->format);
+    if (last <= first)
+        return;
+
+    const unsigned char *luma = in->data + in->offset[0];
+    int luma_stride = in->stride[0];
+    if (ctx->luma != NULL)
+    {
+        KERNEL_scaleRows(&ctx->scaler[0], ctx->luma + first * width, width, luma, luma_stride, first, last - first,
+                         ctx->scratch[band]);
+        luma = ctx->luma;
+        luma_stride = width;
+    }
+    int chroma_stride = semi ? width * 2 : width;
+    for (int i = 0; i < (semi ? 1 : 2); i++)
+        KERNEL_scaleRows(&ctx->scaler[1], ctx->chroma[i] + first * chroma_stride, chroma_stride,
+                         in->data + in->offset[1 + i], in->stride[1 + i], first, last - first, ctx->scratch[band]);
+
+    unsigned short *tmp = ctx->rows[band];
+    unsigned short *c[3] = { tmp, tmp + width, tmp + width * 2 };
+    unsigned char *line = (unsigned char *)(tmp + width * 3);
+
+    for (int y = first; y < last; y++)
+    {
+        kernels->unpack8to16(c[0], luma + y * luma_stride, width, 2);
+        if (semi)
+            kernels->unpackUV(c[1], c[2], ctx->chroma[0] + y * chroma_stride, width, 2);
+        else
+        {
+            kernels->unpack8to16(c[1], ctx->chroma[0] + y * chroma_stride, width, 2);
+            kernels->unpack8to16(c[2], ctx->chroma[1] + y * chroma_stride, width, 2);
+        }
+        kernels->convertColor(c[0], c[1], c[2], width, &ctx->to_rgb);
+
+        for (int k = 0; k < 3; k++)
+        {
+            // planes of the frame are red, green and blue whatever their order in the buffer
+            unsigned char *dst = packed ? line + k * width : out->data + out->offset[k] + y * out->stride[k];
+            CscQuantizer *q = &ctx->quant[k];
+            kernels->quantizeRow(dst, c[k], width, q->scale, q->offset, q->shift, ctx->params->quantize);
+        }
+        if (out->format == PLINK_COLOR_Format24BitRGB888)
+            kernels->interleave3(out->data + out->offset[0] + y * out->stride[0], line, line + width, line + width * 2, width);
+        else if (out->format == PLINK_COLOR_Format24BitBGR888)
+            kernels->interleave3(out->data + out->offset[0] + y * out->stride[0], line + width * 2, line + width, line, width);
+    }
+}
+
+static int convertFrame(PlinkNode node, PlinkNodeFrame *inputs[], PlinkNodeFrame *outputs[], void *arg)
+{
+    CscContext *ctx = arg;
+    PlinkNodeFrame *in = inputs[0];
+    if (in == NULL)
+        return PLINK_NODE_SKIP;
+    if (isSupportedInput(in->format) == 0 || in->tile_width > 0)
+    {
+        if (in->format != ctx->in_format)
+            fprintf(stderr, "[CSC] ERROR: Unsupported input format %d, frames are dropped\n", in->format);
+        ctx->in_format = in->format;
+        ctx->in_width = 0;
+        return PLINK_NODE_SKIP;
+    }
+    if (updateScalers(ctx, in) != 0)
+        return -1;
+
+    long long start = getTimeUs();
+    ctx->in = in;
+    ctx->out = outputs[0];
+    PLINK_NODE_parallel(node, ctx->bands, convertBand, ctx);
+    long long elapsed = getTimeUs() - start;
+    ctx->frames++;
+    ctx->time_us += elapsed;
+
+    printf("[CSC] Converted frame %u %d: %dx%d to %dx%d in %lldus\n",
+            in->sequence, outputs[0]->id, in->width, in->height, outputs[0]->width, outputs[0]->height, elapsed);
+    return 0;
+}
+
+static void onSignal(int signo)
+{
+    (void)signo;
+    PLINK_NODE_stop(node);
+}
+
+int main(int argc, char **argv) {
+    CscParams params;
+    CscContext ctx;
+    PlinkNodeFrame frame;
+    PlinkNodeStats stats;
+
+    parseParams(argc, argv, &params);
+    if (checkParams(&params) != 0)
+    {
+        printUsage(argv[0]);
+        return 0;
+    }
+
+    signal(SIGPIPE, SIG_IGN); // the producer or the consumer may leave while a message is sent
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.params = &params;
+    ctx.kernels = KERNEL_get();
+    ctx.in_format = PLINK_COLOR_FormatUnused;
+    ctx.bands = CSC_MIN(params.threads * 2, (params.height + MIN_BAND_HEIGHT - 1) / MIN_BAND_HEIGHT);
+    ctx.bands = CSC_MIN(ctx.bands, MAX_NUM_OF_BANDS);
+    KernelColorSpace space = params.color >= CSC_COLOR_BT709 ? KERNEL_COLOR_BT709 : KERNEL_COLOR_BT601;
+    int full_range = params.color == CSC_COLOR_BT601Full || params.color == CSC_COLOR_BT709Full;
+    KERNEL_initColorMatrix(&ctx.to_rgb, space, full_range, 1);
+    initQuantizers(&ctx);
+
+    if (PLINK_NODE_create(&node, convertFrame, &ctx) != PLINK_STATUS_OK ||
+        PLINK_NODE_addInput(node, params.in_name) != PLINK_STATUS_OK ||
+        PLINK_NODE_initFrame(&frame, params.format, params.width, params.height, params.stride) != PLINK_STATUS_OK ||
+        PLINK_NODE_addOutput(node, params.out_name, &frame, params.buffers) != PLINK_STATUS_OK)
+    {
+        fprintf(stderr, "[CSC] ERROR: Failed to create the node\n");
+        if (node != NULL)
+            PLINK_NODE_destroy(node);
+        return 1;
+    }
+    PLINK_NODE_setOption(node, PLINK_NODE_OPTION_THREADS, params.threads);
+    PLINK_NODE_setOption(node, PLINK_NODE_OPTION_KEEP, params.keep);
+
+    PlinkStatus sts = PLINK_NODE_run(node);
+
+    PLINK_NODE_getStats(node, &stats);
+    printf("[CSC] Converted %llu frames, sent %llu, average %lldus per frame, waited %llums for buffers\n",
+            ctx.frames, stats.sent, ctx.frames > 0 ? ctx.time_us / (long long)ctx.frames : 0LL, stats.waited_us / 1000);
+    PLINK_NODE_destroy(node);
+    freeScalers(&ctx);
+    return sts == PLINK_STATUS_OK ? 0 : 1;
+}
@@ -0,0 +1,1949 @@
+/*
+ * Copyright (c) 2022 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "plink_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNEL_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KERNEL_NEON
+#elif defined(__riscv_vector)
+#include <stddef.h>
+#include <riscv_vector.h>
+#include <sys/auxv.h>
+#define KERNEL_RVV
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* scalar */
+
+static void pack16to8_scalar(unsigned char *dst, const unsigned short *src, int count, int shift)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = (unsigned char)(src[i] >> shift);
+}
+
+static void blendRows_scalar(unsigned short *dst, const unsigned char *row0, const unsigned char *row1, int count, int weight)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = row0[i] * (256 - weight) + row1[i] * weight;
+}
+
+static void accumulateRow_scalar(unsigned short *acc, const unsigned char *row, int count)
+{
+    for (int i = 0; i < count; i++)
+        acc[i] += row[i];
+}
+
+static void unpack8to16_scalar(unsigned short *dst, const unsigned char *src, int count, int shift)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = src[i] << shift;
+}
+
+static void convertColor_scalar(unsigned short *c0, unsigned short *c1, unsigned short *c2, int count,
+                                const KernelColorMatrix *matrix)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int in[3] = { c0[i], c1[i], c2[i] };
+        int out[3];
+        for (int k = 0; k < 3; k++)
+        {
+            int v = (matrix->coef[k][0] * in[0] + matrix->coef[k][1] * in[1] +
+                     matrix->coef[k][2] * in[2] + matrix->offset[k]) >> 12;
+            out[k] = v < 0 ? 0 : (v > 1023 ? 1023 : v);
+        }
+        c0[i] = out[0];
+        c1[i] = out[1];
+        c2[i] = out[2];
+    }
+}
+
+static void detileRow_scalar(unsigned char *dst, const unsigned char *src, int count, int tile_width, int tile_height)
+{
+    int size = tile_width * tile_height;
+    for (int i = 0; i < count; i += tile_width)
+    {
+        memcpy(dst + i, src, count - i < tile_width ? count - i : tile_width);
+        src += size;
+    }
+}
+
+static void blendFill_scalar(unsigned char *dst, int count, unsigned short pattern, int alpha)
+{
+    const int value[2] = { pattern & 0xFF, pattern >> 8 };
+    for (int i = 0; i < count; i++)
+        dst[i] = (dst[i] * (256 - alpha) + value[i & 1] * alpha + 128) >> 8;
+}
+
+/* Green sites take the other colors from their row and column, the other sites take green from
+ * the 4 neighbours, or from the smoother direction when edge-aware, and the opposite color from the diagonals */
+static void demosaicRow_scalar(unsigned short *r, unsigned short *g, unsigned short *b,
+                               const unsigned short *above, const unsigned short *row, const unsigned short *below,
+                               int count, int layout, const unsigned short gain[3])
+{
+    unsigned short *own = layout & KERNEL_BAYER_BlueRow ? b : r;
+    unsigned short *other = layout & KERNEL_BAYER_BlueRow ? r : b;
+    unsigned short *out[3] = { r, g, b };
+    int green = layout & KERNEL_BAYER_GreenEven ? 0 : 1;
+    for (int i = 0; i < count; i++)
+    {
+        int hor = (row[i - 1] + row[i + 1] + 1) >> 1;
+        int ver = (above[i] + below[i] + 1) >> 1;
+        if ((i & 1) == green)
+        {
+            g[i] = row[i];
+            own[i] = hor;
+            other[i] = ver;
+        }
+        else
+        {
+            int cross = (hor + ver + 1) >> 1;
+            if (layout & KERNEL_BAYER_EdgeAware)
+            {
+                int dh = abs(row[i - 1] - row[i + 1]);
+                int dv = abs(above[i] - below[i]);
+                cross = dh < dv ? hor : (dv < dh ? ver : cross);
+            }
+            own[i] = row[i];
+            g[i] = cross;
+            other[i] = (((above[i - 1] + above[i + 1] + 1) >> 1) + ((below[i - 1] + below[i + 1] + 1) >> 1) + 1) >> 1;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            int v = (out[k][i] * gain[k]) >> 8;
+            out[k][i] = v > 1023 ? 1023 : v;
+        }
+    }
+}
+
+static void quantizeRow_scalar(unsigned char *dst, const unsigned short *src, int count,
+                               int scale, int offset, int shift, int is_signed)
+{
+    const int lo = is_signed ? -128 : 0;
+    const int hi = is_signed ? 127 : 255;
+    for (int i = 0; i < count; i++)
+    {
+        int v = (src[i] * scale + offset) >> shift;
+        dst[i] = (unsigned char)(v < lo ? lo : (v > hi ? hi : v));
+    }
+}
+
+static void unpackUV_scalar(unsigned short *u, unsigned short *v, const unsigned char *src, int count, int shift)
+{
+    for (int i = 0; i < count; i++)
+    {
+        u[i] = src[2 * i] << shift;
+        v[i] = src[2 * i + 1] << shift;
+    }
+}
+
+static void interleave3_scalar(unsigned char *dst, const unsigned char *c0, const unsigned char *c1,
+                               const unsigned char *c2, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dst[3 * i] = c0[i];
+        dst[3 * i + 1] = c1[i];
+        dst[3 * i + 2] = c2[i];
+    }
+}
+
+static void streamRow_scalar(unsigned char *dst, const unsigned char *src, int count)
+{
+    memcpy(dst, src, count);
+}
+
+static void interpolateRow_scalar(unsigned char *dst, const unsigned short *src, const int *ofs,
+                                  const unsigned short *coef, int count, int step)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int left = src[ofs[i]];
+        int right = src[ofs[i] + step];
+        dst[i] = (left * 256 + (right - left) * coef[i] + 32768) >> 16;
+    }
+}
+
+static void averageRow_scalar(unsigned char *dst, const unsigned int *sum, const int *ofs, const int *len,
+                              int count, int step, int rows)
+{
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int n = len[i] * rows;
+        dst[i] = (sum[ofs[i] + len[i] * step] - sum[ofs[i]] + n / 2) / n;
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* x86: SSE2 is part of x86-64, AVX2 is checked at runtime */
+
+#ifdef KERNEL_X86
+__attribute__((target("sse2")))
+static void pack16to8_sse2(unsigned char *dst, const unsigned short *src, int count, int shift)
+{
+    const __m128i mask = _mm_set1_epi16(0xFF);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        a = _mm_and_si128(_mm_srl_epi16(a, sh), mask);
+        b = _mm_and_si128(_mm_srl_epi16(b, sh), mask);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+    }
+    pack16to8_scalar(dst + i, src + i, count - i, shift);
+}
+
+__attribute__((target("sse2")))
+static void blendRows_sse2(unsigned short *dst, const unsigned char *row0, const unsigned char *row1, int count, int weight)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w0 = _mm_set1_epi16(256 - weight);
+    const __m128i w1 = _mm_set1_epi16(weight);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        // the products fit in 16 bits, so the low half of the multiplication is exact
+        __m128i a = _mm_loadu_si128((const __m128i *)(row0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(row1 + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+        _mm_storeu_si128((__m128i *)(dst + i), lo);
+        _mm_storeu_si128((__m128i *)(dst + i + 8), hi);
+    }
+    blendRows_scalar(dst + i, row0 + i, row1 + i, count - i, weight);
+}
+
+__attribute__((target("sse2")))
+static void accumulateRow_sse2(unsigned short *acc, const unsigned char *row, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i lo = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(acc + i + 8));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi16(lo, _mm_unpacklo_epi8(a, zero)));
+        _mm_storeu_si128((__m128i *)(acc + i + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(a, zero)));
+    }
+    accumulateRow_scalar(acc + i, row + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void unpack8to16_sse2(unsigned short *dst, const unsigned char *src, int count, int shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sll_epi16(_mm_unpacklo_epi8(a, zero), sh));
+        _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_sll_epi16(_mm_unpackhi_epi8(a, zero), sh));
+    }
+    unpack8to16_scalar(dst + i, src + i, count - i, shift);
+}
+
+/* The components are at most 1023, so pairs of them are multiplied and summed in 32 bits by madd:
+ * (c0, c1) with (coef0, coef1), and (c2, 0) with (coef2, 0) */
+__attribute__((target("sse2")))
+static void convertColor_sse2(unsigned short *c0, unsigned short *c1, unsigned short *c2, int count,
+                              const KernelColorMatrix *matrix)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(1023);
+    __m128i m01[3], m2[3], offset[3];
+    for (int k = 0; k < 3; k++)
+    {
+        m01[k] = _mm_set1_epi32((unsigned short)matrix->coef[k][0] | ((unsigned)(unsigned short)matrix->coef[k][1] << 16));
+        m2[k] = _mm_set1_epi32((unsigned short)matrix->coef[k][2]);
+        offset[k] = _mm_set1_epi32(matrix->offset[k]);
+    }
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(c0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(c1 + i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(c2 + i));
+        __m128i ab_lo = _mm_unpacklo_epi16(a, b);
+        __m128i ab_hi = _mm_unpackhi_epi16(a, b);
+        __m128i c_lo = _mm_unpacklo_epi16(c, zero);
+        __m128i c_hi = _mm_unpackhi_epi16(c, zero);
+        __m128i out[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(ab_lo, m01[k]), _mm_madd_epi16(c_lo, m2[k])), offset[k]);
+            __m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(ab_hi, m01[k]), _mm_madd_epi16(c_hi, m2[k])), offset[k]);
+            out[k] = _mm_packs_epi32(_mm_srai_epi32(lo, 12), _mm_srai_epi32(hi, 12));
+            out[k] = _mm_min_epi16(_mm_max_epi16(out[k], zero), max);
+        }
+        _mm_storeu_si128((__m128i *)(c0 + i), out[0]);
+        _mm_storeu_si128((__m128i *)(c1 + i), out[1]);
+        _mm_storeu_si128((__m128i *)(c2 + i), out[2]);
+    }
+    convertColor_scalar(c0 + i, c1 + i, c2 + i, count - i, matrix);
+}
+
+static inline __m128i load32_sse2(const unsigned char *src)
+{
+    int v;
+    memcpy(&v, src, sizeof(v));
+    return _mm_cvtsi32_si128(v);
+}
+
+/* 4 and 8 byte wide tiles gather the rows of 4 or 2 tiles into one vector, wider tiles are copied by vectors */
+__attribute__((target("sse2")))
+static void detileRow_sse2(unsigned char *dst, const unsigned char *src, int count, int tile_width, int tile_height)
+{
+    int size = tile_width * tile_height;
+    int i = 0;
+    if (tile_width == 4)
+    {
+        for (; i + 16 <= count; i += 16, src += size * 4)
+        {
+            __m128i a = _mm_unpacklo_epi32(load32_sse2(src), load32_sse2(src + size));
+            __m128i b = _mm_unpacklo_epi32(load32_sse2(src + size * 2), load32_sse2(src + size * 3));
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi64(a, b));
+        }
+    }
+    else if (tile_width == 8)
+    {
+        for (; i + 16 <= count; i += 16, src += size * 2)
+        {
+            __m128i a = _mm_loadl_epi64((const __m128i *)src);
+            __m128i b = _mm_loadl_epi64((const __m128i *)(src + size));
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi64(a, b));
+        }
+    }
+    else if (tile_width % 16 == 0)
+    {
+        for (; i + tile_width <= count; i += tile_width, src += size)
+        {
+            for (int j = 0; j < tile_width; j += 16)
+                _mm_storeu_si128((__m128i *)(dst + i + j), _mm_loadu_si128((const __m128i *)(src + j)));
+        }
+    }
+    detileRow_scalar(dst + i, src, count - i, tile_width, tile_height);
+}
+
+/* dst * (256 - alpha) + value * alpha + 128 is at most 255 * 256 + 128, so 16-bit lanes do not overflow */
+__attribute__((target("sse2")))
+static void blendFill_sse2(unsigned char *dst, int count, unsigned short pattern, int alpha)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weight = _mm_set1_epi16(256 - alpha);
+    const __m128i value = _mm_set1_epi16(pattern);
+    const __m128i value_lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(value, zero), _mm_set1_epi16(alpha)),
+                                           _mm_set1_epi16(128));
+    const __m128i value_hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(value, zero), _mm_set1_epi16(alpha)),
+                                           _mm_set1_epi16(128));
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), weight), value_lo);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), weight), value_hi);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+    blendFill_scalar(dst + i, count - i, pattern, alpha);
+}
+
+/* All the candidates are computed for every lane, and selected by the parity of the column */
+__attribute__((target("sse2")))
+static inline __m128i select_sse2(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* (v * gain) >> 8 as the high half of (v << 6) * (gain << 2), the gains are at most 8.0 */
+__attribute__((target("sse2")))
+static inline __m128i applyGain_sse2(__m128i v, __m128i gain)
+{
+    return _mm_min_epi16(_mm_mulhi_epu16(_mm_slli_epi16(v, 6), gain), _mm_set1_epi16(1023));
+}
+
+__attribute__((target("sse2")))
+static void demosaicRow_sse2(unsigned short *r, unsigned short *g, unsigned short *b,
+                             const unsigned short *above, const unsigned short *row, const unsigned short *below,
+                             int count, int layout, const unsigned short gain[3])
+{
+    unsigned short *own = layout & KERNEL_BAYER_BlueRow ? b : r;
+    unsigned short *other = layout & KERNEL_BAYER_BlueRow ? r : b;
+    const __m128i even = _mm_set_epi16(0, -1, 0, -1, 0, -1, 0, -1);
+    const __m128i green = layout & KERNEL_BAYER_GreenEven ? even : _mm_xor_si128(even, _mm_set1_epi16(-1));
+    const __m128i gain_own = _mm_set1_epi16(gain[layout & KERNEL_BAYER_BlueRow ? 2 : 0] << 2);
+    const __m128i gain_green = _mm_set1_epi16(gain[1] << 2);
+    const __m128i gain_other = _mm_set1_epi16(gain[layout & KERNEL_BAYER_BlueRow ? 0 : 2] << 2);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i left = _mm_loadu_si128((const __m128i *)(row + i - 1));
+        __m128i right = _mm_loadu_si128((const __m128i *)(row + i + 1));
+        __m128i up = _mm_loadu_si128((const __m128i *)(above + i));
+        __m128i down = _mm_loadu_si128((const __m128i *)(below + i));
+        __m128i hor = _mm_avg_epu16(left, right);
+        __m128i ver = _mm_avg_epu16(up, down);
+        __m128i cross = _mm_avg_epu16(hor, ver);
+        __m128i diag = _mm_avg_epu16(_mm_avg_epu16(_mm_loadu_si128((const __m128i *)(above + i - 1)),
+                                                   _mm_loadu_si128((const __m128i *)(above + i + 1))),
+                                     _mm_avg_epu16(_mm_loadu_si128((const __m128i *)(below + i - 1)),
+                                                   _mm_loadu_si128((const __m128i *)(below + i + 1))));
+        if (layout & KERNEL_BAYER_EdgeAware)
+        {
+            // the samples are 10-bit, signed compares are fine
+            __m128i dh = _mm_or_si128(_mm_subs_epu16(left, right), _mm_subs_epu16(right, left));
+            __m128i dv = _mm_or_si128(_mm_subs_epu16(up, down), _mm_subs_epu16(down, up));
+            cross = select_sse2(_mm_cmplt_epi16(dh, dv), hor, select_sse2(_mm_cmplt_epi16(dv, dh), ver, cross));
+        }
+        _mm_storeu_si128((__m128i *)(g + i), applyGain_sse2(select_sse2(green, c, cross), gain_green));
+        _mm_storeu_si128((__m128i *)(own + i), applyGain_sse2(select_sse2(green, hor, c), gain_own));
+        _mm_storeu_si128((__m128i *)(other + i), applyGain_sse2(select_sse2(green, ver, diag), gain_other));
+    }
+    demosaicRow_scalar(r + i, g + i, b + i, above + i, row + i, below + i, count - i, layout, gain);
+}
+
+/* 32-bit products from the low and high halves of the 16-bit ones; the saturating packs give the clamp */
+__attribute__((target("sse2")))
+static inline __m128i quantize8_sse2(__m128i v, __m128i scale, __m128i offset, __m128i shift)
+{
+    __m128i lo = _mm_mullo_epi16(v, scale);
+    __m128i hi = _mm_mulhi_epi16(v, scale);
+    __m128i p0 = _mm_sra_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), offset), shift);
+    __m128i p1 = _mm_sra_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), offset), shift);
+    return _mm_packs_epi32(p0, p1);
+}
+
+__attribute__((target("sse2")))
+static void quantizeRow_sse2(unsigned char *dst, const unsigned short *src, int count,
+                             int scale, int offset, int shift, int is_signed)
+{
+    const __m128i sc = _mm_set1_epi16(scale);
+    const __m128i off = _mm_set1_epi32(offset);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = quantize8_sse2(_mm_loadu_si128((const __m128i *)(src + i)), sc, off, sh);
+        __m128i b = quantize8_sse2(_mm_loadu_si128((const __m128i *)(src + i + 8)), sc, off, sh);
+        _mm_storeu_si128((__m128i *)(dst + i), is_signed ? _mm_packs_epi16(a, b) : _mm_packus_epi16(a, b));
+    }
+    quantizeRow_scalar(dst + i, src + i, count - i, scale, offset, shift, is_signed);
+}
+
+__attribute__((target("sse2")))
+static void unpackUV_sse2(unsigned short *u, unsigned short *v, const unsigned char *src, int count, int shift)
+{
+    const __m128i mask = _mm_set1_epi16(0xFF);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        _mm_storeu_si128((__m128i *)(u + i), _mm_sll_epi16(_mm_and_si128(a, mask), sh));
+        _mm_storeu_si128((__m128i *)(v + i), _mm_sll_epi16(_mm_srli_epi16(a, 8), sh));
+    }
+    unpackUV_scalar(u + i, v + i, src + 2 * i, count - i, shift);
+}
+
+/* Pixels are built as 32-bit c0 c1 c2 0, two of them are squeezed into 6 bytes of a 64-bit lane,
+ * and the lanes are stored 6 bytes apart, each store overwriting the 2 spare bytes of the previous one */
+__attribute__((target("sse2")))
+static void interleave3_sse2(unsigned char *dst, const unsigned char *c0, const unsigned char *c1,
+                             const unsigned char *c2, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i first = _mm_set1_epi64x(0xFFFFFF);
+    const __m128i second = _mm_set1_epi64x(0xFFFFFF000000LL);
+    int i = 0;
+    // the last store writes 2 bytes of the next pixel
+    for (; i + 16 < count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(c0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(c1 + i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(c2 + i));
+        __m128i ab[2] = { _mm_unpacklo_epi8(a, b), _mm_unpackhi_epi8(a, b) };
+        __m128i cz[2] = { _mm_unpacklo_epi8(c, zero), _mm_unpackhi_epi8(c, zero) };
+        unsigned char *out = dst + 3 * i;
+        for (int k = 0; k < 4; k++)
+        {
+            __m128i p = k & 1 ? _mm_unpackhi_epi16(ab[k >> 1], cz[k >> 1]) : _mm_unpacklo_epi16(ab[k >> 1], cz[k >> 1]);
+            p = _mm_or_si128(_mm_and_si128(p, first), _mm_and_si128(_mm_srli_epi64(p, 8), second));
+            _mm_storel_epi64((__m128i *)out, p);
+            _mm_storel_epi64((__m128i *)(out + 6), _mm_srli_si128(p, 8));
+            out += 12;
+        }
+    }
+    interleave3_scalar(dst + 3 * i, c0 + i, c1 + i, c2 + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void streamRow_sse2(unsigned char *dst, const unsigned char *src, int count)
+{
+    // streaming stores need an aligned destination
+    int head = (16 - ((size_t)dst & 15)) & 15;
+    if (head > count)
+        head = count;
+    memcpy(dst, src, head);
+    int i = head;
+    for (; i + 64 <= count; i += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+        _mm_stream_si128((__m128i *)(dst + i), a);
+        _mm_stream_si128((__m128i *)(dst + i + 16), b);
+        _mm_stream_si128((__m128i *)(dst + i + 32), c);
+        _mm_stream_si128((__m128i *)(dst + i + 48), d);
+    }
+    for (; i + 16 <= count; i += 16)
+        _mm_stream_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+    memcpy(dst + i, src + i, count - i);
+    _mm_sfence();
+}
+
+/* The gathers are scalar loads, the products are exact 32-bit from their low and high halves */
+__attribute__((target("sse2")))
+static void interpolateRow_sse2(unsigned char *dst, const unsigned short *src, const int *ofs,
+                                const unsigned short *coef, int count, int step)
+{
+    const __m128i round = _mm_set1_epi32(32768);
+    const __m128i full = _mm_set1_epi16(256);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i l = _mm_setr_epi16(src[ofs[i]], src[ofs[i + 1]], src[ofs[i + 2]], src[ofs[i + 3]],
+                                   src[ofs[i + 4]], src[ofs[i + 5]], src[ofs[i + 6]], src[ofs[i + 7]]);
+        __m128i r = _mm_setr_epi16(src[ofs[i] + step], src[ofs[i + 1] + step], src[ofs[i + 2] + step],
+                                   src[ofs[i + 3] + step], src[ofs[i + 4] + step], src[ofs[i + 5] + step],
+                                   src[ofs[i + 6] + step], src[ofs[i + 7] + step]);
+        __m128i w1 = _mm_loadu_si128((const __m128i *)(coef + i));
+        __m128i w0 = _mm_sub_epi16(full, w1);
+        __m128i l_lo = _mm_mullo_epi16(l, w0), l_hi = _mm_mulhi_epu16(l, w0);
+        __m128i r_lo = _mm_mullo_epi16(r, w1), r_hi = _mm_mulhi_epu16(r, w1);
+        __m128i a = _mm_add_epi32(_mm_unpacklo_epi16(l_lo, l_hi), _mm_unpacklo_epi16(r_lo, r_hi));
+        __m128i b = _mm_add_epi32(_mm_unpackhi_epi16(l_lo, l_hi), _mm_unpackhi_epi16(r_lo, r_hi));
+        a = _mm_srli_epi32(_mm_add_epi32(a, round), 16);
+        b = _mm_srli_epi32(_mm_add_epi32(b, round), 16);
+        __m128i c = _mm_packs_epi32(a, b);
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(c, c));
+    }
+    interpolateRow_scalar(dst + i, src, ofs + i, coef + i, count - i, step);
+}
+
+/* mullo_epi32 is SSE4.1: multiply the even and the odd lanes into 64 bits, and keep the low halves */
+__attribute__((target("sse2")))
+static inline __m128i mullo32_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, 0x08), _mm_shuffle_epi32(odd, 0x08));
+}
+
+/* The totals are below 2^24, so the float quotient is at most one above the integer one */
+__attribute__((target("sse2")))
+static void averageRow_sse2(unsigned char *dst, const unsigned int *sum, const int *ofs, const int *len,
+                            int count, int step, int rows)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i first = _mm_setr_epi32(sum[ofs[i]], sum[ofs[i + 1]], sum[ofs[i + 2]], sum[ofs[i + 3]]);
+        __m128i last = _mm_setr_epi32(sum[ofs[i] + len[i] * step], sum[ofs[i + 1] + len[i + 1] * step],
+                                      sum[ofs[i + 2] + len[i + 2] * step], sum[ofs[i + 3] + len[i + 3] * step]);
+        __m128i n = mullo32_sse2(_mm_loadu_si128((const __m128i *)(len + i)), _mm_set1_epi32(rows));
+        __m128i a = _mm_add_epi32(_mm_sub_epi32(last, first), _mm_srli_epi32(n, 1));
+        __m128i q = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(a), _mm_cvtepi32_ps(n)));
+        // q - 1 where q * n > a
+        q = _mm_add_epi32(q, _mm_cmpgt_epi32(mullo32_sse2(q, n), a));
+        __m128i c = _mm_packs_epi32(q, q);
+        *(int *)(dst + i) = _mm_cvtsi128_si32(_mm_packus_epi16(c, c));
+    }
+    averageRow_scalar(dst + i, sum, ofs + i, len + i, count - i, step, rows);
+}
+
+__attribute__((target("avx2")))
+static void pack16to8_avx2(unsigned char *dst, const unsigned short *src, int count, int shift)
+{
+    const __m256i mask = _mm256_set1_epi16(0xFF);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+        a = _mm256_and_si256(_mm256_srl_epi16(a, sh), mask);
+        b = _mm256_and_si256(_mm256_srl_epi16(b, sh), mask);
+        // packus works per 128-bit lane, restore the order of the quadwords
+        __m256i c = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + i), c);
+    }
+    pack16to8_sse2(dst + i, src + i, count - i, shift);
+}
+
+__attribute__((target("avx2")))
+static void blendRows_avx2(unsigned short *dst, const unsigned char *row0, const unsigned char *row1, int count, int weight)
+{
+    const __m256i w0 = _mm256_set1_epi16(256 - weight);
+    const __m256i w1 = _mm256_set1_epi16(weight);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row0 + i)));
+        __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row1 + i)));
+        __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(a, w0), _mm256_mullo_epi16(b, w1));
+        _mm256_storeu_si256((__m256i *)(dst + i), c);
+    }
+    blendRows_scalar(dst + i, row0 + i, row1 + i, count - i, weight);
+}
+
+__attribute__((target("avx2")))
+static void accumulateRow_avx2(unsigned short *acc, const unsigned char *row, int count)
+{
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + i)));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(acc + i));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi16(c, a));
+    }
+    accumulateRow_scalar(acc + i, row + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void unpack8to16_avx2(unsigned short *dst, const unsigned char *src, int count, int shift)
+{
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sll_epi16(a, sh));
+    }
+    unpack8to16_scalar(dst + i, src + i, count - i, shift);
+}
+
+/* Same as SSE2: unpack and pack work per 128-bit lane, so the order of the pixels is kept */
+__attribute__((target("avx2")))
+static void convertColor_avx2(unsigned short *c0, unsigned short *c1, unsigned short *c2, int count,
+                              const KernelColorMatrix *matrix)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(1023);
+    __m256i m01[3], m2[3], offset[3];
+    for (int k = 0; k < 3; k++)
+    {
+        m01[k] = _mm256_set1_epi32((unsigned short)matrix->coef[k][0] | ((unsigned)(unsigned short)matrix->coef[k][1] << 16));
+        m2[k] = _mm256_set1_epi32((unsigned short)matrix->coef[k][2]);
+        offset[k] = _mm256_set1_epi32(matrix->offset[k]);
+    }
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(c0 + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(c1 + i));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(c2 + i));
+        __m256i ab_lo = _mm256_unpacklo_epi16(a, b);
+        __m256i ab_hi = _mm256_unpackhi_epi16(a, b);
+        __m256i c_lo = _mm256_unpacklo_epi16(c, zero);
+        __m256i c_hi = _mm256_unpackhi_epi16(c, zero);
+        __m256i out[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m256i lo = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(ab_lo, m01[k]), _mm256_madd_epi16(c_lo, m2[k])), offset[k]);
+            __m256i hi = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(ab_hi, m01[k]), _mm256_madd_epi16(c_hi, m2[k])), offset[k]);
+            out[k] = _mm256_packs_epi32(_mm256_srai_epi32(lo, 12), _mm256_srai_epi32(hi, 12));
+            out[k] = _mm256_min_epi16(_mm256_max_epi16(out[k], zero), max);
+        }
+        _mm256_storeu_si256((__m256i *)(c0 + i), out[0]);
+        _mm256_storeu_si256((__m256i *)(c1 + i), out[1]);
+        _mm256_storeu_si256((__m256i *)(c2 + i), out[2]);
+    }
+    convertColor_sse2(c0 + i, c1 + i, c2 + i, count - i, matrix);
+}
+
+/* The rows of 8 or 4 narrow tiles are fetched by one gather */
+__attribute__((target("avx2")))
+static void detileRow_avx2(unsigned char *dst, const unsigned char *src, int count, int tile_width, int tile_height)
+{
+    int size = tile_width * tile_height;
+    int i = 0;
+    if (tile_width == 4)
+    {
+        const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(size));
+        for (; i + 32 <= count; i += 32, src += size * 8)
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_i32gather_epi32((const int *)src, index, 1));
+    }
+    else if (tile_width == 8)
+    {
+        const __m256i index = _mm256_setr_epi64x(0, size, size * 2, size * 3);
+        for (; i + 32 <= count; i += 32, src += size * 4)
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_i64gather_epi64((const long long *)src, index, 1));
+    }
+    else if (tile_width % 32 == 0)
+    {
+        for (; i + tile_width <= count; i += tile_width, src += size)
+        {
+            for (int j = 0; j < tile_width; j += 32)
+                _mm256_storeu_si256((__m256i *)(dst + i + j), _mm256_loadu_si256((const __m256i *)(src + j)));
+        }
+    }
+    detileRow_sse2(dst + i, src, count - i, tile_width, tile_height);
+}
+
+__attribute__((target("avx2")))
+static void blendFill_avx2(unsigned char *dst, int count, unsigned short pattern, int alpha)
+{
+    const __m256i weight = _mm256_set1_epi16(256 - alpha);
+    // 16 bytes of the pattern widened to 16-bit, the same for both halves
+    const __m256i value = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_set1_epi16(pattern)),
+                                                              _mm256_set1_epi16(alpha)),
+                                           _mm256_set1_epi16(128));
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(d));
+        __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(d, 1));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(lo, weight), value), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(hi, weight), value), 8);
+        // packus works per 128-bit lane, put the lanes back in order
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+    }
+    blendFill_sse2(dst + i, count - i, pattern, alpha);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i applyGain_avx2(__m256i v, __m256i gain)
+{
+    return _mm256_min_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(v, 6), gain), _mm256_set1_epi16(1023));
+}
+
+__attribute__((target("avx2")))
+static void demosaicRow_avx2(unsigned short *r, unsigned short *g, unsigned short *b,
+                             const unsigned short *above, const unsigned short *row, const unsigned short *below,
+                             int count, int layout, const unsigned short gain[3])
+{
+    unsigned short *own = layout & KERNEL_BAYER_BlueRow ? b : r;
+    unsigned short *other = layout & KERNEL_BAYER_BlueRow ? r : b;
+    const __m256i even = _mm256_set1_epi32(0xFFFF);
+    const __m256i green = layout & KERNEL_BAYER_GreenEven ? even : _mm256_xor_si256(even, _mm256_set1_epi16(-1));
+    const __m256i gain_own = _mm256_set1_epi16(gain[layout & KERNEL_BAYER_BlueRow ? 2 : 0] << 2);
+    const __m256i gain_green = _mm256_set1_epi16(gain[1] << 2);
+    const __m256i gain_other = _mm256_set1_epi16(gain[layout & KERNEL_BAYER_BlueRow ? 0 : 2] << 2);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(row + i));
+        __m256i left = _mm256_loadu_si256((const __m256i *)(row + i - 1));
+        __m256i right = _mm256_loadu_si256((const __m256i *)(row + i + 1));
+        __m256i up = _mm256_loadu_si256((const __m256i *)(above + i));
+        __m256i down = _mm256_loadu_si256((const __m256i *)(below + i));
+        __m256i hor = _mm256_avg_epu16(left, right);
+        __m256i ver = _mm256_avg_epu16(up, down);
+        __m256i cross = _mm256_avg_epu16(hor, ver);
+        __m256i diag = _mm256_avg_epu16(_mm256_avg_epu16(_mm256_loadu_si256((const __m256i *)(above + i - 1)),
+                                                         _mm256_loadu_si256((const __m256i *)(above + i + 1))),
+                                        _mm256_avg_epu16(_mm256_loadu_si256((const __m256i *)(below + i - 1)),
+                                                         _mm256_loadu_si256((const __m256i *)(below + i + 1))));
+        if (layout & KERNEL_BAYER_EdgeAware)
+        {
+            __m256i dh = _mm256_or_si256(_mm256_subs_epu16(left, right), _mm256_subs_epu16(right, left));
+            __m256i dv = _mm256_or_si256(_mm256_subs_epu16(up, down), _mm256_subs_epu16(down, up));
+            cross = _mm256_blendv_epi8(_mm256_blendv_epi8(cross, ver, _mm256_cmpgt_epi16(dh, dv)),
+                                       hor, _mm256_cmpgt_epi16(dv, dh));
+        }
+        _mm256_storeu_si256((__m256i *)(g + i), applyGain_avx2(_mm256_blendv_epi8(cross, c, green), gain_green));
+        _mm256_storeu_si256((__m256i *)(own + i), applyGain_avx2(_mm256_blendv_epi8(c, hor, green), gain_own));
+        _mm256_storeu_si256((__m256i *)(other + i), applyGain_avx2(_mm256_blendv_epi8(diag, ver, green), gain_other));
+    }
+    demosaicRow_sse2(r + i, g + i, b + i, above + i, row + i, below + i, count - i, layout, gain);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i quantize16_avx2(__m256i v, __m256i scale, __m256i offset, __m128i shift)
+{
+    __m256i lo = _mm256_mullo_epi16(v, scale);
+    __m256i hi = _mm256_mulhi_epi16(v, scale);
+    __m256i p0 = _mm256_sra_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(lo, hi), offset), shift);
+    __m256i p1 = _mm256_sra_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(lo, hi), offset), shift);
+    return _mm256_packs_epi32(p0, p1);
+}
+
+__attribute__((target("avx2")))
+static void quantizeRow_avx2(unsigned char *dst, const unsigned short *src, int count,
+                             int scale, int offset, int shift, int is_signed)
+{
+    const __m256i sc = _mm256_set1_epi16(scale);
+    const __m256i off = _mm256_set1_epi32(offset);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i a = quantize16_avx2(_mm256_loadu_si256((const __m256i *)(src + i)), sc, off, sh);
+        __m256i b = quantize16_avx2(_mm256_loadu_si256((const __m256i *)(src + i + 16)), sc, off, sh);
+        __m256i c = is_signed ? _mm256_packs_epi16(a, b) : _mm256_packus_epi16(a, b);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(c, 0xD8));
+    }
+    quantizeRow_sse2(dst + i, src + i, count - i, scale, offset, shift, is_signed);
+}
+
+__attribute__((target("avx2")))
+static void unpackUV_avx2(unsigned short *u, unsigned short *v, const unsigned char *src, int count, int shift)
+{
+    const __m256i mask = _mm256_set1_epi16(0xFF);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        _mm256_storeu_si256((__m256i *)(u + i), _mm256_sll_epi16(_mm256_and_si256(a, mask), sh));
+        _mm256_storeu_si256((__m256i *)(v + i), _mm256_sll_epi16(_mm256_srli_epi16(a, 8), sh));
+    }
+    unpackUV_sse2(u + i, v + i, src + 2 * i, count - i, shift);
+}
+
+/* Byte k of output block t takes component (16 * t + k) % 3 of pixel (16 * t + k) / 3 */
+static const signed char interleave3_masks[3][3][16] =
+{
+    {
+        { 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5 },
+        { -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1 },
+        { -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1 },
+    },
+    {
+        { -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1 },
+        { 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10 },
+        { -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1 },
+    },
+    {
+        { -1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1 },
+        { -1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1 },
+        { 10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15 },
+    },
+};
+
+/* pshufb comes with AVX2, 16 pixels give 3 blocks of 16 bytes */
+__attribute__((target("avx2")))
+static void interleave3_avx2(unsigned char *dst, const unsigned char *c0, const unsigned char *c1,
+                             const unsigned char *c2, int count)
+{
+    __m128i masks[3][3];
+    for (int k = 0; k < 3; k++)
+        for (int t = 0; t < 3; t++)
+            masks[k][t] = _mm_loadu_si128((const __m128i *)interleave3_masks[k][t]);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(c0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(c1 + i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(c2 + i));
+        for (int t = 0; t < 3; t++)
+        {
+            __m128i out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, masks[0][t]), _mm_shuffle_epi8(b, masks[1][t])),
+                                       _mm_shuffle_epi8(c, masks[2][t]));
+            _mm_storeu_si128((__m128i *)(dst + 3 * i + 16 * t), out);
+        }
+    }
+    interleave3_sse2(dst + 3 * i, c0 + i, c1 + i, c2 + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void streamRow_avx2(unsigned char *dst, const unsigned char *src, int count)
+{
+    int head = (32 - ((size_t)dst & 31)) & 31;
+    if (head > count)
+        head = count;
+    memcpy(dst, src, head);
+    int i = head;
+    for (; i + 64 <= count; i += 64)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        _mm256_stream_si256((__m256i *)(dst + i), a);
+        _mm256_stream_si256((__m256i *)(dst + i + 32), b);
+    }
+    for (; i + 32 <= count; i += 32)
+        _mm256_stream_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+    memcpy(dst + i, src + i, count - i);
+    _mm_sfence();
+}
+
+/* Gathers of 32 bits, the sample is the low half: src must be readable one sample past ofs[i] + step */
+__attribute__((target("avx2")))
+static void interpolateRow_avx2(unsigned char *dst, const unsigned short *src, const int *ofs,
+                                const unsigned short *coef, int count, int step)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFFFF);
+    const __m256i round = _mm256_set1_epi32(32768);
+    const __m256i right = _mm256_set1_epi32(step);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i index = _mm256_loadu_si256((const __m256i *)(ofs + i));
+        __m256i l = _mm256_and_si256(_mm256_i32gather_epi32((const int *)src, index, 2), mask);
+        __m256i r = _mm256_and_si256(_mm256_i32gather_epi32((const int *)src, _mm256_add_epi32(index, right), 2), mask);
+        __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(coef + i)));
+        __m256i v = _mm256_add_epi32(_mm256_slli_epi32(l, 8), _mm256_mullo_epi32(_mm256_sub_epi32(r, l), w));
+        v = _mm256_srli_epi32(_mm256_add_epi32(v, round), 16);
+        // both packs work per 128-bit lane: the bytes are the first dword of each lane
+        v = _mm256_packus_epi16(_mm256_packus_epi32(v, v), v);
+        v = _mm256_permutevar8x32_epi32(v, order);
+        _mm_storel_epi64((__m128i *)(dst + i), _mm256_castsi256_si128(v));
+    }
+    interpolateRow_sse2(dst + i, src, ofs + i, coef + i, count - i, step);
+}
+
+__attribute__((target("avx2")))
+static void averageRow_avx2(unsigned char *dst, const unsigned int *sum, const int *ofs, const int *len,
+                            int count, int step, int rows)
+{
+    const __m256i vstep = _mm256_set1_epi32(step);
+    const __m256i vrows = _mm256_set1_epi32(rows);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i index = _mm256_loadu_si256((const __m256i *)(ofs + i));
+        __m256i width = _mm256_loadu_si256((const __m256i *)(len + i));
+        __m256i first = _mm256_i32gather_epi32((const int *)sum, index, 4);
+        __m256i last = _mm256_i32gather_epi32((const int *)sum,
+                                              _mm256_add_epi32(index, _mm256_mullo_epi32(width, vstep)), 4);
+        __m256i n = _mm256_mullo_epi32(width, vrows);
+        __m256i a = _mm256_add_epi32(_mm256_sub_epi32(last, first), _mm256_srli_epi32(n, 1));
+        __m256i q = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(a), _mm256_cvtepi32_ps(n)));
+        q = _mm256_add_epi32(q, _mm256_cmpgt_epi32(_mm256_mullo_epi32(q, n), a));
+        q = _mm256_packus_epi16(_mm256_packus_epi32(q, q), q);
+        q = _mm256_permutevar8x32_epi32(q, order);
+        _mm_storel_epi64((__m128i *)(dst + i), _mm256_castsi256_si128(q));
+    }
+    averageRow_sse2(dst + i, sum, ofs + i, len + i, count - i, step, rows);
+}
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* NEON: always available on aarch64 */
+
+#ifdef KERNEL_NEON
+static void pack16to8_neon(unsigned char *dst, const unsigned short *src, int count, int shift)
+{
+    const int16x8_t sh = vdupq_n_s16(-shift);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        uint16x8_t a = vshlq_u16(vld1q_u16(src + i), sh);
+        uint16x8_t b = vshlq_u16(vld1q_u16(src + i + 8), sh);
+        // narrowing keeps the low 8 bits, which is the same as masking with 0xFF
+        vst1q_u8(dst + i, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+    }
+    pack16to8_scalar(dst + i, src + i, count - i, shift);
+}
+
+static void blendRows_neon(unsigned short *dst, const unsigned char *row0, const unsigned char *row1, int count, int weight)
+{
+    const uint16_t w0 = 256 - weight;
+    const uint16_t w1 = weight;
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        uint16x8_t a = vmovl_u8(vld1_u8(row0 + i));
+        uint16x8_t b = vmovl_u8(vld1_u8(row1 + i));
+        vst1q_u16(dst + i, vmlaq_n_u16(vmulq_n_u16(a, w0), b, w1));
+    }
+    blendRows_scalar(dst + i, row0 + i, row1 + i, count - i, weight);
+}
+
+static void accumulateRow_neon(unsigned short *acc, const unsigned char *row, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+        vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vld1_u8(row + i)));
+    accumulateRow_scalar(acc + i, row + i, count - i);
+}
+
+static void unpack8to16_neon(unsigned short *dst, const unsigned char *src, int count, int shift)
+{
+    const int16x8_t sh = vdupq_n_s16(shift);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+        vst1q_u16(dst + i, vshlq_u16(vmovl_u8(vld1_u8(src + i)), sh));
+    unpack8to16_scalar(dst + i, src + i, count - i, shift);
+}
+
+static inline int16x4_t convertHalf_neon(int16x4_t a, int16x4_t b, int16x4_t c, const KernelColorMatrix *matrix, int k)
+{
+    int32x4_t acc = vdupq_n_s32(matrix->offset[k]);
+    acc = vmlal_n_s16(acc, a, matrix->coef[k][0]);
+    acc = vmlal_n_s16(acc, b, matrix->coef[k][1]);
+    acc = vmlal_n_s16(acc, c, matrix->coef[k][2]);
+    return vqmovn_s32(vshrq_n_s32(acc, 12));
+}
+
+static void convertColor_neon(unsigned short *c0, unsigned short *c1, unsigned short *c2, int count,
+                              const KernelColorMatrix *matrix)
+{
+    const int16x8_t zero = vdupq_n_s16(0);
+    const int16x8_t max = vdupq_n_s16(1023);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        int16x8_t a = vreinterpretq_s16_u16(vld1q_u16(c0 + i));
+        int16x8_t b = vreinterpretq_s16_u16(vld1q_u16(c1 + i));
+        int16x8_t c = vreinterpretq_s16_u16(vld1q_u16(c2 + i));
+        int16x8_t out[3];
+        for (int k = 0; k < 3; k++)
+        {
+            out[k] = vcombine_s16(convertHalf_neon(vget_low_s16(a), vget_low_s16(b), vget_low_s16(c), matrix, k),
+                                  convertHalf_neon(vget_high_s16(a), vget_high_s16(b), vget_high_s16(c), matrix, k));
+            out[k] = vminq_s16(vmaxq_s16(out[k], zero), max);
+        }
+        vst1q_u16(c0 + i, vreinterpretq_u16_s16(out[0]));
+        vst1q_u16(c1 + i, vreinterpretq_u16_s16(out[1]));
+        vst1q_u16(c2 + i, vreinterpretq_u16_s16(out[2]));
+    }
+    convertColor_scalar(c0 + i, c1 + i, c2 + i, count - i, matrix);
+}
+
+static void detileRow_neon(unsigned char *dst, const unsigned char *src, int count, int tile_width, int tile_height)
+{
+    int size = tile_width * tile_height;
+    int i = 0;
+    if (tile_width == 4)
+    {
+        for (; i + 16 <= count; i += 16, src += size * 4)
+        {
+            uint32_t v[4];
+            for (int k = 0; k < 4; k++)
+                memcpy(&v[k], src + size * k, sizeof(v[k]));
+            vst1q_u8(dst + i, vreinterpretq_u8_u32(vld1q_u32(v)));
+        }
+    }
+    else if (tile_width == 8)
+    {
+        for (; i + 16 <= count; i += 16, src += size * 2)
+            vst1q_u8(dst + i, vcombine_u8(vld1_u8(src), vld1_u8(src + size)));
+    }
+    else if (tile_width % 16 == 0)
+    {
+        for (; i + tile_width <= count; i += tile_width, src += size)
+        {
+            for (int j = 0; j < tile_width; j += 16)
+                vst1q_u8(dst + i + j, vld1q_u8(src + j));
+        }
+    }
+    detileRow_scalar(dst + i, src, count - i, tile_width, tile_height);
+}
+
+/* The weights are 8-bit, so full opacity is a plain store of the pattern */
+static void blendFill_neon(unsigned char *dst, int count, unsigned short pattern, int alpha)
+{
+    const uint8x16_t value = vreinterpretq_u8_u16(vdupq_n_u16(pattern));
+    int i = 0;
+    if (alpha >= 256)
+    {
+        for (; i + 16 <= count; i += 16)
+            vst1q_u8(dst + i, value);
+    }
+    else if (alpha > 0)
+    {
+        const uint8x8_t weight = vdup_n_u8(256 - alpha);
+        const uint16x8_t value_lo = vmlal_u8(vdupq_n_u16(128), vget_low_u8(value), vdup_n_u8(alpha));
+        const uint16x8_t value_hi = vmlal_u8(vdupq_n_u16(128), vget_high_u8(value), vdup_n_u8(alpha));
+        for (; i + 16 <= count; i += 16)
+        {
+            uint8x16_t d = vld1q_u8(dst + i);
+            uint16x8_t lo = vmlal_u8(value_lo, vget_low_u8(d), weight);
+            uint16x8_t hi = vmlal_u8(value_hi, vget_high_u8(d), weight);
+            vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+        }
+    }
+    else
+        return;
+    blendFill_scalar(dst + i, count - i, pattern, alpha);
+}
+
+static inline uint16x8_t applyGain_neon(uint16x8_t v, uint16_t gain)
+{
+    uint16x8_t scaled = vcombine_u16(vshrn_n_u32(vmull_n_u16(vget_low_u16(v), gain), 8),
+                                     vshrn_n_u32(vmull_n_u16(vget_high_u16(v), gain), 8));
+    return vminq_u16(scaled, vdupq_n_u16(1023));
+}
+
+static void demosaicRow_neon(unsigned short *r, unsigned short *g, unsigned short *b,
+                             const unsigned short *above, const unsigned short *row, const unsigned short *below,
+                             int count, int layout, const unsigned short gain[3])
+{
+    unsigned short *own = layout & KERNEL_BAYER_BlueRow ? b : r;
+    unsigned short *other = layout & KERNEL_BAYER_BlueRow ? r : b;
+    const uint16x8_t even = vreinterpretq_u16_u32(vdupq_n_u32(0xFFFF));
+    const uint16x8_t green = layout & KERNEL_BAYER_GreenEven ? even : vmvnq_u16(even);
+    const uint16_t gain_own = gain[layout & KERNEL_BAYER_BlueRow ? 2 : 0];
+    const uint16_t gain_other = gain[layout & KERNEL_BAYER_BlueRow ? 0 : 2];
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        uint16x8_t c = vld1q_u16(row + i);
+        uint16x8_t left = vld1q_u16(row + i - 1);
+        uint16x8_t right = vld1q_u16(row + i + 1);
+        uint16x8_t up = vld1q_u16(above + i);
+        uint16x8_t down = vld1q_u16(below + i);
+        uint16x8_t hor = vrhaddq_u16(left, right);
+        uint16x8_t ver = vrhaddq_u16(up, down);
+        uint16x8_t cross = vrhaddq_u16(hor, ver);
+        uint16x8_t diag = vrhaddq_u16(vrhaddq_u16(vld1q_u16(above + i - 1), vld1q_u16(above + i + 1)),
+                                      vrhaddq_u16(vld1q_u16(below + i - 1), vld1q_u16(below + i + 1)));
+        if (layout & KERNEL_BAYER_EdgeAware)
+        {
+            uint16x8_t dh = vabdq_u16(left, right);
+            uint16x8_t dv = vabdq_u16(up, down);
+            cross = vbslq_u16(vcltq_u16(dh, dv), hor, vbslq_u16(vcltq_u16(dv, dh), ver, cross));
+        }
+        vst1q_u16(g + i, applyGain_neon(vbslq_u16(green, c, cross), gain[1]));
+        vst1q_u16(own + i, applyGain_neon(vbslq_u16(green, hor, c), gain_own));
+        vst1q_u16(other + i, applyGain_neon(vbslq_u16(green, ver, diag), gain_other));
+    }
+    demosaicRow_scalar(r + i, g + i, b + i, above + i, row + i, below + i, count - i, layout, gain);
+}
+
+static void quantizeRow_neon(unsigned char *dst, const unsigned short *src, int count,
+                             int scale, int offset, int shift, int is_signed)
+{
+    const int32x4_t off = vdupq_n_s32(offset);
+    const int32x4_t sh = vdupq_n_s32(-shift);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        int16x8_t a = vreinterpretq_s16_u16(vld1q_u16(src + i));
+        int32x4_t p0 = vshlq_s32(vmlal_n_s16(off, vget_low_s16(a), scale), sh);
+        int32x4_t p1 = vshlq_s32(vmlal_n_s16(off, vget_high_s16(a), scale), sh);
+        int16x8_t c = vcombine_s16(vqmovn_s32(p0), vqmovn_s32(p1));
+        if (is_signed)
+            vst1_s8((int8_t *)(dst + i), vqmovn_s16(c));
+        else
+            vst1_u8(dst + i, vqmovun_s16(c));
+    }
+    quantizeRow_scalar(dst + i, src + i, count - i, scale, offset, shift, is_signed);
+}
+
+static void unpackUV_neon(unsigned short *u, unsigned short *v, const unsigned char *src, int count, int shift)
+{
+    const int16x8_t sh = vdupq_n_s16(shift);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        uint8x8x2_t uv = vld2_u8(src + 2 * i);
+        vst1q_u16(u + i, vshlq_u16(vmovl_u8(uv.val[0]), sh));
+        vst1q_u16(v + i, vshlq_u16(vmovl_u8(uv.val[1]), sh));
+    }
+    unpackUV_scalar(u + i, v + i, src + 2 * i, count - i, shift);
+}
+
+static void interleave3_neon(unsigned char *dst, const unsigned char *c0, const unsigned char *c1,
+                             const unsigned char *c2, int count)
+{
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        uint8x16x3_t pixels = { { vld1q_u8(c0 + i), vld1q_u8(c1 + i), vld1q_u8(c2 + i) } };
+        vst3q_u8(dst + 3 * i, pixels);
+    }
+    interleave3_scalar(dst + 3 * i, c0 + i, c1 + i, c2 + i, count - i);
+}
+
+/* stnp has no intrinsic, plain stores of whole cache lines */
+static void streamRow_neon(unsigned char *dst, const unsigned char *src, int count)
+{
+    int i = 0;
+    for (; i + 64 <= count; i += 64)
+        vst1q_u8_x4(dst + i, vld1q_u8_x4(src + i));
+    memcpy(dst + i, src + i, count - i);
+}
+
+/* NEON has no gather: the samples are loaded one by one into the lanes */
+static void interpolateRow_neon(unsigned char *dst, const unsigned short *src, const int *ofs,
+                                const unsigned short *coef, int count, int step)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        uint16x8_t l = vdupq_n_u16(0);
+        uint16x8_t r = vdupq_n_u16(0);
+        l = vld1q_lane_u16(src + ofs[i], l, 0);
+        l = vld1q_lane_u16(src + ofs[i + 1], l, 1);
+        l = vld1q_lane_u16(src + ofs[i + 2], l, 2);
+        l = vld1q_lane_u16(src + ofs[i + 3], l, 3);
+        l = vld1q_lane_u16(src + ofs[i + 4], l, 4);
+        l = vld1q_lane_u16(src + ofs[i + 5], l, 5);
+        l = vld1q_lane_u16(src + ofs[i + 6], l, 6);
+        l = vld1q_lane_u16(src + ofs[i + 7], l, 7);
+        r = vld1q_lane_u16(src + ofs[i] + step, r, 0);
+        r = vld1q_lane_u16(src + ofs[i + 1] + step, r, 1);
+        r = vld1q_lane_u16(src + ofs[i + 2] + step, r, 2);
+        r = vld1q_lane_u16(src + ofs[i + 3] + step, r, 3);
+        r = vld1q_lane_u16(src + ofs[i + 4] + step, r, 4);
+        r = vld1q_lane_u16(src + ofs[i + 5] + step, r, 5);
+        r = vld1q_lane_u16(src + ofs[i + 6] + step, r, 6);
+        r = vld1q_lane_u16(src + ofs[i + 7] + step, r, 7);
+        uint16x8_t w1 = vld1q_u16(coef + i);
+        uint16x8_t w0 = vsubq_u16(vdupq_n_u16(256), w1);
+        uint32x4_t lo = vmlal_u16(vmull_u16(vget_low_u16(l), vget_low_u16(w0)), vget_low_u16(r), vget_low_u16(w1));
+        uint32x4_t hi = vmlal_u16(vmull_u16(vget_high_u16(l), vget_high_u16(w0)), vget_high_u16(r), vget_high_u16(w1));
+        // rounding narrow: (x + 32768) >> 16
+        vst1_u8(dst + i, vqmovn_u16(vcombine_u16(vrshrn_n_u32(lo, 16), vrshrn_n_u32(hi, 16))));
+    }
+    interpolateRow_scalar(dst + i, src, ofs + i, coef + i, count - i, step);
+}
+
+static void averageRow_neon(unsigned char *dst, const unsigned int *sum, const int *ofs, const int *len,
+                            int count, int step, int rows)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32x4_t first = vdupq_n_u32(0);
+        uint32x4_t last = vdupq_n_u32(0);
+        first = vld1q_lane_u32(sum + ofs[i], first, 0);
+        first = vld1q_lane_u32(sum + ofs[i + 1], first, 1);
+        first = vld1q_lane_u32(sum + ofs[i + 2], first, 2);
+        first = vld1q_lane_u32(sum + ofs[i + 3], first, 3);
+        last = vld1q_lane_u32(sum + ofs[i] + len[i] * step, last, 0);
+        last = vld1q_lane_u32(sum + ofs[i + 1] + len[i + 1] * step, last, 1);
+        last = vld1q_lane_u32(sum + ofs[i + 2] + len[i + 2] * step, last, 2);
+        last = vld1q_lane_u32(sum + ofs[i + 3] + len[i + 3] * step, last, 3);
+        uint32x4_t n = vmulq_n_u32(vreinterpretq_u32_s32(vld1q_s32(len + i)), rows);
+        uint32x4_t a = vaddq_u32(vsubq_u32(last, first), vshrq_n_u32(n, 1));
+        uint32x4_t q = vcvtq_u32_f32(vdivq_f32(vcvtq_f32_u32(a), vcvtq_f32_u32(n)));
+        // the mask is all ones, i.e. -1, where q * n > a
+        q = vaddq_u32(q, vcgtq_u32(vmulq_u32(q, n), a));
+        uint16x4_t c = vmovn_u32(q);
+        uint8x8_t b = vqmovn_u16(vcombine_u16(c, c));
+        vst1_lane_u32((uint32_t *)(dst + i), vreinterpret_u32_u8(b), 0);
+    }
+    averageRow_scalar(dst + i, sum, ofs + i, len + i, count - i, step, rows);
+}
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* RISC-V Vector: compiled in with -march=..v, used only if the kernel reports it */
+
+#ifdef KERNEL_RVV
+static void pack16to8_rvv(unsigned char *dst, const unsigned short *src, int count, int shift)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e16m2(count);
+        vuint16m2_t v = __riscv_vsrl_vx_u16m2(__riscv_vle16_v_u16m2(src, vl), shift, vl);
+        __riscv_vse8_v_u8m1(dst, __riscv_vncvt_x_x_w_u8m1(v, vl), vl);
+        src += vl;
+        dst += vl;
+        count -= vl;
+    }
+}
+
+static void blendRows_rvv(unsigned short *dst, const unsigned char *row0, const unsigned char *row1, int count, int weight)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e8m1(count);
+        vuint16m2_t a = __riscv_vzext_vf2_u16m2(__riscv_vle8_v_u8m1(row0, vl), vl);
+        vuint16m2_t b = __riscv_vzext_vf2_u16m2(__riscv_vle8_v_u8m1(row1, vl), vl);
+        vuint16m2_t c = __riscv_vmul_vx_u16m2(a, 256 - weight, vl);
+        c = __riscv_vmacc_vx_u16m2(c, weight, b, vl);
+        __riscv_vse16_v_u16m2(dst, c, vl);
+        row0 += vl;
+        row1 += vl;
+        dst += vl;
+        count -= vl;
+    }
+}
+
+static void accumulateRow_rvv(unsigned short *acc, const unsigned char *row, int count)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e8m1(count);
+        vuint16m2_t c = __riscv_vle16_v_u16m2(acc, vl);
+        __riscv_vse16_v_u16m2(acc, __riscv_vwaddu_wv_u16m2(c, __riscv_vle8_v_u8m1(row, vl), vl), vl);
+        row += vl;
+        acc += vl;
+        count -= vl;
+    }
+}
+
+static void unpack8to16_rvv(unsigned short *dst, const unsigned char *src, int count, int shift)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e8m1(count);
+        vuint16m2_t v = __riscv_vzext_vf2_u16m2(__riscv_vle8_v_u8m1(src, vl), vl);
+        __riscv_vse16_v_u16m2(dst, __riscv_vsll_vx_u16m2(v, shift, vl), vl);
+        src += vl;
+        dst += vl;
+        count -= vl;
+    }
+}
+
+static void convertColor_rvv(unsigned short *c0, unsigned short *c1, unsigned short *c2, int count,
+                             const KernelColorMatrix *matrix)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e16m2(count);
+        vint16m2_t a = __riscv_vreinterpret_v_u16m2_i16m2(__riscv_vle16_v_u16m2(c0, vl));
+        vint16m2_t b = __riscv_vreinterpret_v_u16m2_i16m2(__riscv_vle16_v_u16m2(c1, vl));
+        vint16m2_t c = __riscv_vreinterpret_v_u16m2_i16m2(__riscv_vle16_v_u16m2(c2, vl));
+        vint16m2_t out[3];
+        for (int k = 0; k < 3; k++)
+        {
+            vint32m4_t acc = __riscv_vmv_v_x_i32m4(matrix->offset[k], vl);
+            acc = __riscv_vwmacc_vx_i32m4(acc, matrix->coef[k][0], a, vl);
+            acc = __riscv_vwmacc_vx_i32m4(acc, matrix->coef[k][1], b, vl);
+            acc = __riscv_vwmacc_vx_i32m4(acc, matrix->coef[k][2], c, vl);
+            out[k] = __riscv_vnsra_wx_i16m2(acc, 12, vl);
+            out[k] = __riscv_vmin_vx_i16m2(__riscv_vmax_vx_i16m2(out[k], 0, vl), 1023, vl);
+        }
+        __riscv_vse16_v_u16m2(c0, __riscv_vreinterpret_v_i16m2_u16m2(out[0]), vl);
+        __riscv_vse16_v_u16m2(c1, __riscv_vreinterpret_v_i16m2_u16m2(out[1]), vl);
+        __riscv_vse16_v_u16m2(c2, __riscv_vreinterpret_v_i16m2_u16m2(out[2]), vl);
+        c0 += vl;
+        c1 += vl;
+        c2 += vl;
+        count -= vl;
+    }
+}
+
+/* Strided loads take the same row of consecutive narrow tiles, one tile per element */
+static void detileRow_rvv(unsigned char *dst, const unsigned char *src, int count, int tile_width, int tile_height)
+{
+    ptrdiff_t size = tile_width * tile_height;
+    if (tile_width == 4)
+    {
+        while (count >= 4)
+        {
+            size_t vl = __riscv_vsetvl_e32m4(count / 4);
+            vuint32m4_t v = __riscv_vlse32_v_u32m4((const uint32_t *)src, size, vl);
+            __riscv_vse8_v_u8m4(dst, __riscv_vreinterpret_v_u32m4_u8m4(v), vl * 4);
+            src += vl * size;
+            dst += vl * 4;
+            count -= vl * 4;
+        }
+    }
+    else if (tile_width == 8)
+    {
+        while (count >= 8)
+        {
+            size_t vl = __riscv_vsetvl_e64m4(count / 8);
+            vuint64m4_t v = __riscv_vlse64_v_u64m4((const uint64_t *)src, size, vl);
+            __riscv_vse8_v_u8m4(dst, __riscv_vreinterpret_v_u64m4_u8m4(v), vl * 8);
+            src += vl * size;
+            dst += vl * 8;
+            count -= vl * 8;
+        }
+    }
+    detileRow_scalar(dst, src, count, tile_width, tile_height);
+}
+
+static void blendFill_rvv(unsigned char *dst, int count, unsigned short pattern, int alpha)
+{
+    const vuint8m1_t value = __riscv_vreinterpret_v_u16m1_u8m1(__riscv_vmv_v_x_u16m1(pattern, __riscv_vsetvlmax_e16m1()));
+    if (alpha <= 0)
+        return;
+    while (count > 1)
+    {
+        // whole pairs of bytes
+        size_t vl = __riscv_vsetvl_e16m1(count / 2) * 2;
+        if (alpha >= 256)
+            __riscv_vse8_v_u8m1(dst, value, vl);
+        else
+        {
+            vuint16m2_t acc = __riscv_vwmulu_vx_u16m2(__riscv_vle8_v_u8m1(dst, vl), 256 - alpha, vl);
+            acc = __riscv_vwmaccu_vx_u16m2(acc, alpha, value, vl);
+            acc = __riscv_vadd_vx_u16m2(acc, 128, vl);
+            __riscv_vse8_v_u8m1(dst, __riscv_vnsrl_wx_u8m1(acc, 8, vl), vl);
+        }
+        dst += vl;
+        count -= vl;
+    }
+    blendFill_scalar(dst, count, pattern, alpha);
+}
+
+static inline vuint16m2_t average_rvv(vuint16m2_t a, vuint16m2_t b, size_t vl)
+{
+    return __riscv_vsrl_vx_u16m2(__riscv_vadd_vx_u16m2(__riscv_vadd_vv_u16m2(a, b, vl), 1, vl), 1, vl);
+}
+
+static inline vuint16m2_t applyGain_rvv(vuint16m2_t v, unsigned short gain, size_t vl)
+{
+    vuint16m2_t scaled = __riscv_vnsrl_wx_u16m2(__riscv_vwmulu_vx_u32m4(v, gain, vl), 8, vl);
+    return __riscv_vminu_vx_u16m2(scaled, 1023, vl);
+}
+
+static void demosaicRow_rvv(unsigned short *r, unsigned short *g, unsigned short *b,
+                            const unsigned short *above, const unsigned short *row, const unsigned short *below,
+                            int count, int layout, const unsigned short gain[3])
+{
+    unsigned short *own = layout & KERNEL_BAYER_BlueRow ? b : r;
+    unsigned short *other = layout & KERNEL_BAYER_BlueRow ? r : b;
+    const unsigned short gain_own = gain[layout & KERNEL_BAYER_BlueRow ? 2 : 0];
+    const unsigned short gain_other = gain[layout & KERNEL_BAYER_BlueRow ? 0 : 2];
+    const int parity = layout & KERNEL_BAYER_GreenEven ? 0 : 1;
+    int i = 0;
+    while (i + 1 < count)
+    {
+        // an even number of pixels, so the parity of the lanes is the parity of the columns
+        size_t vl = __riscv_vsetvl_e16m2((count - i) & ~1);
+        vbool8_t green = __riscv_vmseq_vx_u16m2_b8(__riscv_vand_vx_u16m2(__riscv_vid_v_u16m2(vl), 1, vl), parity, vl);
+        vuint16m2_t c = __riscv_vle16_v_u16m2(row + i, vl);
+        vuint16m2_t left = __riscv_vle16_v_u16m2(row + i - 1, vl);
+        vuint16m2_t right = __riscv_vle16_v_u16m2(row + i + 1, vl);
+        vuint16m2_t up = __riscv_vle16_v_u16m2(above + i, vl);
+        vuint16m2_t down = __riscv_vle16_v_u16m2(below + i, vl);
+        vuint16m2_t hor = average_rvv(left, right, vl);
+        vuint16m2_t ver = average_rvv(up, down, vl);
+        vuint16m2_t cross = average_rvv(hor, ver, vl);
+        vuint16m2_t diag = average_rvv(average_rvv(__riscv_vle16_v_u16m2(above + i - 1, vl),
+                                                   __riscv_vle16_v_u16m2(above + i + 1, vl), vl),
+                                       average_rvv(__riscv_vle16_v_u16m2(below + i - 1, vl),
+                                                   __riscv_vle16_v_u16m2(below + i + 1, vl), vl), vl);
+        if (layout & KERNEL_BAYER_EdgeAware)
+        {
+            vuint16m2_t dh = __riscv_vsub_vv_u16m2(__riscv_vmaxu_vv_u16m2(left, right, vl),
+                                                   __riscv_vminu_vv_u16m2(left, right, vl), vl);
+            vuint16m2_t dv = __riscv_vsub_vv_u16m2(__riscv_vmaxu_vv_u16m2(up, down, vl),
+                                                   __riscv_vminu_vv_u16m2(up, down, vl), vl);
+            cross = __riscv_vmerge_vvm_u16m2(cross, ver, __riscv_vmsltu_vv_u16m2_b8(dv, dh, vl), vl);
+            cross = __riscv_vmerge_vvm_u16m2(cross, hor, __riscv_vmsltu_vv_u16m2_b8(dh, dv, vl), vl);
+        }
+        __riscv_vse16_v_u16m2(g + i, applyGain_rvv(__riscv_vmerge_vvm_u16m2(cross, c, green, vl), gain[1], vl), vl);
+        __riscv_vse16_v_u16m2(own + i, applyGain_rvv(__riscv_vmerge_vvm_u16m2(c, hor, green, vl), gain_own, vl), vl);
+        __riscv_vse16_v_u16m2(other + i, applyGain_rvv(__riscv_vmerge_vvm_u16m2(diag, ver, green, vl), gain_other, vl), vl);
+        i += vl;
+    }
+    demosaicRow_scalar(r + i, g + i, b + i, above + i, row + i, below + i, count - i, layout, gain);
+}
+
+/* Clamped in 32 bits, then narrowed twice */
+static void quantizeRow_rvv(unsigned char *dst, const unsigned short *src, int count,
+                            int scale, int offset, int shift, int is_signed)
+{
+    const int lo = is_signed ? -128 : 0;
+    const int hi = is_signed ? 127 : 255;
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e16m2(count);
+        vint16m2_t a = __riscv_vreinterpret_v_u16m2_i16m2(__riscv_vle16_v_u16m2(src, vl));
+        vint32m4_t p = __riscv_vadd_vx_i32m4(__riscv_vwmul_vx_i32m4(a, (short)scale, vl), offset, vl);
+        p = __riscv_vsra_vx_i32m4(p, shift, vl);
+        p = __riscv_vmin_vx_i32m4(__riscv_vmax_vx_i32m4(p, lo, vl), hi, vl);
+        vint8m1_t c = __riscv_vncvt_x_x_w_i8m1(__riscv_vncvt_x_x_w_i16m2(p, vl), vl);
+        __riscv_vse8_v_i8m1((signed char *)dst, c, vl);
+        src += vl;
+        dst += vl;
+        count -= vl;
+    }
+}
+
+static void unpackUV_rvv(unsigned short *u, unsigned short *v, const unsigned char *src, int count, int shift)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e8m1(count);
+        vuint16m2_t a = __riscv_vzext_vf2_u16m2(__riscv_vlse8_v_u8m1(src, 2, vl), vl);
+        vuint16m2_t b = __riscv_vzext_vf2_u16m2(__riscv_vlse8_v_u8m1(src + 1, 2, vl), vl);
+        __riscv_vse16_v_u16m2(u, __riscv_vsll_vx_u16m2(a, shift, vl), vl);
+        __riscv_vse16_v_u16m2(v, __riscv_vsll_vx_u16m2(b, shift, vl), vl);
+        src += 2 * vl;
+        u += vl;
+        v += vl;
+        count -= vl;
+    }
+}
+
+static void interleave3_rvv(unsigned char *dst, const unsigned char *c0, const unsigned char *c1,
+                            const unsigned char *c2, int count)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e8m4(count);
+        __riscv_vsse8_v_u8m4(dst, 3, __riscv_vle8_v_u8m4(c0, vl), vl);
+        __riscv_vsse8_v_u8m4(dst + 1, 3, __riscv_vle8_v_u8m4(c1, vl), vl);
+        __riscv_vsse8_v_u8m4(dst + 2, 3, __riscv_vle8_v_u8m4(c2, vl), vl);
+        dst += 3 * vl;
+        c0 += vl;
+        c1 += vl;
+        c2 += vl;
+        count -= vl;
+    }
+}
+
+static void streamRow_rvv(unsigned char *dst, const unsigned char *src, int count)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e8m8(count);
+        __riscv_vse8_v_u8m8(dst, __riscv_vle8_v_u8m8(src, vl), vl);
+        dst += vl;
+        src += vl;
+        count -= vl;
+    }
+}
+
+/* Indexed loads take byte offsets */
+static void interpolateRow_rvv(unsigned char *dst, const unsigned short *src, const int *ofs,
+                               const unsigned short *coef, int count, int step)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e32m4(count);
+        vuint32m4_t index = __riscv_vsll_vx_u32m4(__riscv_vle32_v_u32m4((const unsigned int *)ofs, vl), 1, vl);
+        vuint16m2_t l = __riscv_vluxei32_v_u16m2(src, index, vl);
+        vuint16m2_t r = __riscv_vluxei32_v_u16m2(src + step, index, vl);
+        vuint16m2_t w1 = __riscv_vle16_v_u16m2(coef, vl);
+        vuint16m2_t w0 = __riscv_vrsub_vx_u16m2(w1, 256, vl);
+        vuint32m4_t v = __riscv_vwmulu_vv_u32m4(l, w0, vl);
+        v = __riscv_vwmaccu_vv_u32m4(v, r, w1, vl);
+        v = __riscv_vadd_vx_u32m4(v, 32768, vl);
+        vuint16m2_t c = __riscv_vnsrl_wx_u16m2(v, 16, vl);
+        __riscv_vse8_v_u8m1(dst, __riscv_vncvt_x_x_w_u8m1(c, vl), vl);
+        dst += vl;
+        ofs += vl;
+        coef += vl;
+        count -= vl;
+    }
+}
+
+static void averageRow_rvv(unsigned char *dst, const unsigned int *sum, const int *ofs, const int *len,
+                           int count, int step, int rows)
+{
+    while (count > 0)
+    {
+        size_t vl = __riscv_vsetvl_e32m4(count);
+        vuint32m4_t index = __riscv_vle32_v_u32m4((const unsigned int *)ofs, vl);
+        vuint32m4_t width = __riscv_vle32_v_u32m4((const unsigned int *)len, vl);
+        vuint32m4_t first = __riscv_vluxei32_v_u32m4(sum, __riscv_vsll_vx_u32m4(index, 2, vl), vl);
+        vuint32m4_t end = __riscv_vmacc_vx_u32m4(index, step, width, vl);
+        vuint32m4_t last = __riscv_vluxei32_v_u32m4(sum, __riscv_vsll_vx_u32m4(end, 2, vl), vl);
+        vuint32m4_t n = __riscv_vmul_vx_u32m4(width, rows, vl);
+        vuint32m4_t a = __riscv_vadd_vv_u32m4(__riscv_vsub_vv_u32m4(last, first, vl),
+                                              __riscv_vsrl_vx_u32m4(n, 1, vl), vl);
+        // integer division is exact and vectorized here
+        vuint32m4_t q = __riscv_vdivu_vv_u32m4(a, n, vl);
+        vuint16m2_t c = __riscv_vncvt_x_x_w_u16m2(q, vl);
+        __riscv_vse8_v_u8m1(dst, __riscv_vncvt_x_x_w_u8m1(c, vl), vl);
+        dst += vl;
+        ofs += vl;
+        len += vl;
+        count -= vl;
+    }
+}
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* dispatch */
+
+static const KernelOps kernels_scalar =
+{
+    "scalar",
+    pack16to8_scalar,
+    blendRows_scalar,
+    accumulateRow_scalar,
+    unpack8to16_scalar,
+    convertColor_scalar,
+    detileRow_scalar,
+    blendFill_scalar,
+    demosaicRow_scalar,
+    quantizeRow_scalar,
+    unpackUV_scalar,
+    interleave3_scalar,
+    streamRow_scalar,
+    interpolateRow_scalar,
+    averageRow_scalar,
+};
+
+#ifdef KERNEL_X86
+static const KernelOps kernels_sse2 =
+{
+    "sse2",
+    pack16to8_sse2,
+    blendRows_sse2,
+    accumulateRow_sse2,
+    unpack8to16_sse2,
+    convertColor_sse2,
+    detileRow_sse2,
+    blendFill_sse2,
+    demosaicRow_sse2,
+    quantizeRow_sse2,
+    unpackUV_sse2,
+    interleave3_sse2,
+    streamRow_sse2,
+    interpolateRow_sse2,
+    averageRow_sse2,
+};
+
+static const KernelOps kernels_avx2 =
+{
+    "avx2",
+    pack16to8_avx2,
+    blendRows_avx2,
+    accumulateRow_avx2,
+    unpack8to16_avx2,
+    convertColor_avx2,
+    detileRow_avx2,
+    blendFill_avx2,
+    demosaicRow_avx2,
+    quantizeRow_avx2,
+    unpackUV_avx2,
+    interleave3_avx2,
+    streamRow_avx2,
+    interpolateRow_avx2,
+    averageRow_avx2,
+};
+#endif
+
+#ifdef KERNEL_NEON
+static const KernelOps kernels_neon =
+{
+    "neon",
+    pack16to8_neon,
+    blendRows_neon,
+    accumulateRow_neon,
+    unpack8to16_neon,
+    convertColor_neon,
+    detileRow_neon,
+    blendFill_neon,
+    demosaicRow_neon,
+    quantizeRow_neon,
+    unpackUV_neon,
+    interleave3_neon,
+    streamRow_neon,
+    interpolateRow_neon,
+    averageRow_neon,
+};
+#endif
+
+#ifdef KERNEL_RVV
+static const KernelOps kernels_rvv =
+{
+    "rvv",
+    pack16to8_rvv,
+    blendRows_rvv,
+    accumulateRow_rvv,
+    unpack8to16_rvv,
+    convertColor_rvv,
+    detileRow_rvv,
+    blendFill_rvv,
+    demosaicRow_rvv,
+    quantizeRow_rvv,
+    unpackUV_rvv,
+    interleave3_rvv,
+    streamRow_rvv,
+    interpolateRow_rvv,
+    averageRow_rvv,
+};
+#endif
+
+static const KernelOps *kernels = &kernels_scalar;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void selectKernels()
+{
+    char *env = getenv("PLINK_KERNELS");
+    if (env != NULL && strcmp(env, "scalar") == 0)
+        kernels = &kernels_scalar;
+#if defined(KERNEL_X86)
+    else if (__builtin_cpu_supports("avx2"))
+        kernels = &kernels_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        kernels = &kernels_sse2;
+#elif defined(KERNEL_NEON)
+    else
+        kernels = &kernels_neon;
+#elif defined(KERNEL_RVV)
+    else if (getauxval(AT_HWCAP) & (1 << ('V' - 'A')))
+        kernels = &kernels_rvv;
+#endif
+
+    printf("[KERNEL] Using %s kernels\n", kernels->name);
+}
+
+const KernelOps *KERNEL_get()
+{
+    pthread_once(&kernels_once, selectKernels);
+    return kernels;
+}
+
+int KERNEL_getSupported(const KernelOps *ops[], int max)
+{
+    int count = 0;
+    if (count < max)
+        ops[count++] = &kernels_scalar;
+#if defined(KERNEL_X86)
+    if (count < max && __builtin_cpu_supports("sse2"))
+        ops[count++] = &kernels_sse2;
+    if (count < max && __builtin_cpu_supports("avx2"))
+        ops[count++] = &kernels_avx2;
+#elif defined(KERNEL_NEON)
+    if (count < max)
+        ops[count++] = &kernels_neon;
+#elif defined(KERNEL_RVV)
+    if (count < max && (getauxval(AT_HWCAP) & (1 << ('V' - 'A'))))
+        ops[count++] = &kernels_rvv;
+#endif
+    return count;
+}
+
+/* ------------------------------------------------------------------------ */
+/* scaler */
+
+/* Map output positions to the source: bilinear takes the two nearest pixels around the center,
+ * area takes all the pixels covered by the output pixel */
+static void initAxis(KernelScaleMode mode, int src, int dst, int *ofs, int *len, unsigned short *coef)
+{
+    for (int i = 0; i < dst; i++)
+    {
+        if (mode == KERNEL_SCALE_Area)
+        {
+            int first = (int)((long long)i * src / dst);
+            int last = (int)((long long)(i + 1) * src / dst);
+            ofs[i] = first;
+            len[i] = last > first ? last - first : 1;
+            continue;
+        }
+
+        // center of the output pixel in source coordinates, in 1/256 pixel
+        long long pos = ((2LL * i + 1) * src * 256 / dst - 256) / 2;
+        if (pos < 0)
+            pos = 0;
+        int left = (int)(pos >> 8);
+        int weight = (int)(pos & 0xFF);
+        if (left >= src - 1)
+        {
+            left = src > 1 ? src - 2 : 0;
+            weight = src > 1 ? 256 : 0;
+        }
+        ofs[i] = left;
+        coef[i] = weight;
+    }
+}
+
+int KERNEL_initScaler(KernelScaler *scaler, KernelScaleMode mode,
+                      int src_width, int src_height, int dst_width, int dst_height, int channels)
+{
+    memset(scaler, 0, sizeof(*scaler));
+    if (src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0 || channels <= 0 ||
+        mode >= KERNEL_SCALE_Max)
+        return -1;
+    // the area scaler accumulates rows in 16 bits
+    if (mode == KERNEL_SCALE_Area && (src_height > dst_height * 256 || src_width > dst_width * 256))
+        return -1;
+
+    scaler->mode = mode;
+    scaler->src_width = src_width;
+    scaler->src_height = src_height;
+    scaler->dst_width = dst_width;
+    scaler->dst_height = dst_height;
+    scaler->channels = channels;
+    scaler->xofs = calloc(dst_width, sizeof(int));
+    scaler->xlen = calloc(dst_width, sizeof(int));
+    scaler->xcoef = calloc(dst_width, sizeof(unsigned short));
+    scaler->yofs = calloc(dst_height, sizeof(int));
+    scaler->ylen = calloc(dst_height, sizeof(int));
+    scaler->ycoef = calloc(dst_height, sizeof(unsigned short));
+    scaler->sofs = calloc(dst_width * channels, sizeof(int));
+    scaler->slen = calloc(dst_width * channels, sizeof(int));
+    scaler->scoef = calloc(dst_width * channels, sizeof(unsigned short));
+    if (scaler->xofs == NULL || scaler->xlen == NULL || scaler->xcoef == NULL ||
+        scaler->yofs == NULL || scaler->ylen == NULL || scaler->ycoef == NULL ||
+        scaler->sofs == NULL || scaler->slen == NULL || scaler->scoef == NULL)
+    {
+        KERNEL_freeScaler(scaler);
+        return -1;
+    }
+
+    initAxis(mode, src_width, dst_width, scaler->xofs, scaler->xlen, scaler->xcoef);
+    initAxis(mode, src_height, dst_height, scaler->yofs, scaler->ylen, scaler->ycoef);
+    // the horizontal kernels work on samples, whatever the number of channels
+    for (int x = 0; x < dst_width; x++)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            scaler->sofs[x * channels + c] = scaler->xofs[x] * channels + c;
+            scaler->slen[x * channels + c] = scaler->xlen[x];
+            scaler->scoef[x * channels + c] = scaler->xcoef[x];
+        }
+    }
+    return 0;
+}
+
+void KERNEL_freeScaler(KernelScaler *scaler)
+{
+    free(scaler->xofs);
+    free(scaler->xlen);
+    free(scaler->xcoef);
+    free(scaler->yofs);
+    free(scaler->ylen);
+    free(scaler->ycoef);
+    free(scaler->sofs);
+    free(scaler->slen);
+    free(scaler->scoef);
+    memset(scaler, 0, sizeof(*scaler));
+}
+
+static void scaleRowsBilinear(const KernelScaler *scaler, const KernelOps *ops, unsigned short *tmp,
+                              unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride,
+                              int first, int rows)
+{
+    int channels = scaler->channels;
+    int count = scaler->src_width * channels;
+    for (int y = first; y < first + rows; y++)
+    {
+        int top = scaler->yofs[y];
+        int bottom = top + 1 < scaler->src_height ? top + 1 : top;
+        ops->blendRows(tmp, src + top * src_stride, src + bottom * src_stride, count, scaler->ycoef[y]);
+        ops->interpolateRow(dst + (y - first) * dst_stride, tmp, scaler->sofs, scaler->scoef,
+                            scaler->dst_width * channels, channels);
+    }
+}
+
+static void scaleRowsArea(const KernelScaler *scaler, const KernelOps *ops, unsigned short *acc,
+                          unsigned int *sum, unsigned char *dst, int dst_stride, const unsigned char *src,
+                          int src_stride, int first, int rows)
+{
+    int channels = scaler->channels;
+    int count = scaler->src_width * channels;
+    for (int y = first; y < first + rows; y++)
+    {
+        memset(acc, 0, count * sizeof(unsigned short));
+        for (int r = 0; r < scaler->ylen[y]; r++)
+            ops->accumulateRow(acc, src + (scaler->yofs[y] + r) * src_stride, count);
+
+        // running totals of each channel: a box is the difference of two of them
+        for (int i = 0; i < count; i++)
+            sum[i + channels] = sum[i] + acc[i];
+        ops->averageRow(dst + (y - first) * dst_stride, sum, scaler->sofs, scaler->slen,
+                        scaler->dst_width * channels, channels, scaler->ylen[y]);
+    }
+}
+
+int KERNEL_getScratchSize(const KernelScaler *scaler)
+{
+    // one row of 16-bit intermediate results with room for the right neighbour of the last pixel and
+    // the overread of the gathers, and for area the running totals behind one pixel of zeros
+    int samples = (scaler->src_width + 2) * scaler->channels;
+    if (scaler->mode == KERNEL_SCALE_Area)
+        return samples * (sizeof(unsigned short) + sizeof(unsigned int));
+    return samples * sizeof(unsigned short);
+}
+
+void KERNEL_scaleRows(const KernelScaler *scaler, unsigned char *dst, int dst_stride,
+                      const unsigned char *src, int src_stride, int first, int rows, void *scratch)
+{
+    const KernelOps *ops = KERNEL_get();
+    if (first < 0 || rows <= 0 || first + rows > scaler->dst_height || scratch == NULL)
+        return;
+
+    int samples = (scaler->src_width + 2) * scaler->channels;
+    if (scaler->mode == KERNEL_SCALE_Area)
+    {
+        unsigned int *sum = scratch;
+        memset(sum, 0, scaler->channels * sizeof(unsigned int));
+        scaleRowsArea(scaler, ops, (unsigned short *)(sum + samples), sum, dst, dst_stride, src, src_stride,
+                      first, rows);
+    }
+    else
+    {
+        unsigned short *tmp = scratch;
+        memset(tmp + scaler->src_width * scaler->channels, 0, 2 * scaler->channels * sizeof(unsigned short));
+        scaleRowsBilinear(scaler, ops, tmp, dst, dst_stride, src, src_stride, first, rows);
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* color conversion */
+
+void KERNEL_initColorMatrix(KernelColorMatrix *matrix, KernelColorSpace space, int full_range, int to_rgb)
+{
+    double kr = space == KERNEL_COLOR_BT709 ? 0.2126 : 0.299;
+    double kb = space == KERNEL_COLOR_BT709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    // 10-bit codes of black and of the luma and chroma ranges
+    double y_black = full_range ? 0.0 : 64.0;
+    double y_range = full_range ? 1023.0 : 876.0;
+    double c_range = full_range ? 1023.0 : 896.0;
+    double m[3][3];
+    double in_offset[3];
+    double out_offset[3];
+
+    if (to_rgb)
+    {
+        double ys = 1023.0 / y_range;
+        double cs = 1023.0 / c_range;
+        double rgb[3][3] =
+        {
+            { ys, 0.0, 2.0 * (1.0 - kr) * cs },
+            { ys, -2.0 * (1.0 - kb) * kb / kg * cs, -2.0 * (1.0 - kr) * kr / kg * cs },
+            { ys, 2.0 * (1.0 - kb) * cs, 0.0 },
+        };
+        memcpy(m, rgb, sizeof(m));
+        in_offset[0] = y_black;
+        in_offset[1] = in_offset[2] = 512.0;
+        out_offset[0] = out_offset[1] = out_offset[2] = 0.0;
+    }
+    else
+    {
+        double ys = y_range / 1023.0;
+        double cs = c_range / 1023.0;
+        double yuv[3][3] =
+        {
+            { kr * ys, kg * ys, kb * ys },
+            { -kr / (2.0 * (1.0 - kb)) * cs, -kg / (2.0 * (1.0 - kb)) * cs, 0.5 * cs },
+            { 0.5 * cs, -kg / (2.0 * (1.0 - kr)) * cs, -kb / (2.0 * (1.0 - kr)) * cs },
+        };
+        memcpy(m, yuv, sizeof(m));
+        in_offset[0] = in_offset[1] = in_offset[2] = 0.0;
+        out_offset[0] = y_black;
+        out_offset[1] = out_offset[2] = 512.0;
+    }
+
+    for (int k = 0; k < 3; k++)
+    {
+        double offset = out_offset[k];
+        for (int j = 0; j < 3; j++)
+        {
+            matrix->coef[k][j] = (short)(m[k][j] * 4096.0 + (m[k][j] < 0 ? -0.5 : 0.5));
+            offset -= matrix->coef[k][j] / 4096.0 * in_offset[j];
+        }
+        matrix->offset[k] = (int)(offset * 4096.0 + (offset < 0 ? -0.5 : 0.5)) + 2048;
+    }
+}
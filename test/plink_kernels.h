@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2022 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _PLINK_KERNELS_H_
+#define _PLINK_KERNELS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 3x3 matrix converting 10-bit components, in 1/4096:
+ * out[k] = clamp((coef[k][0] * in[0] + coef[k][1] * in[1] + coef[k][2] * in[2] + offset[k]) >> 12, 0, 1023) */
+typedef struct _KernelColorMatrix
+{
+    short coef[3][3];
+    int offset[3];              /* includes the offsets of the input and the output, and the rounding */
+} KernelColorMatrix;
+
+/* Pixel kernels shared by the sample applications.
+ * Each kernel has a scalar version and vectorized versions (SSE2/AVX2, NEON, RVV),
+ * the best one supported by the running CPU is selected on first use.
+ * Set environment variable PLINK_KERNELS=scalar to force the scalar versions. */
+typedef struct _KernelOps
+{
+    const char *name;
+
+    /* dst[i] = (src[i] >> shift) & 0xFF, for count samples.
+     * Converts one row of P010 (luma or interleaved chroma) or Raw10/Raw12 to 8-bit. */
+    void (*pack16to8)(unsigned char *dst, const unsigned short *src, int count, int shift);
+
+    /* dst[i] = row0[i] * (256 - weight) + row1[i] * weight, weight in [0, 256].
+     * Vertical pass of the bilinear scaler. */
+    void (*blendRows)(unsigned short *dst, const unsigned char *row0, const unsigned char *row1, int count, int weight);
+
+    /* acc[i] += row[i]. Vertical pass of the area scaler. */
+    void (*accumulateRow)(unsigned short *acc, const unsigned char *row, int count);
+
+    /* dst[i] = src[i] << shift. Widens 8-bit samples to the 10-bit components of convertColor. */
+    void (*unpack8to16)(unsigned short *dst, const unsigned char *src, int count, int shift);
+
+    /* Convert count pixels of three planar 10-bit components in place, YUV to RGB or RGB to YUV */
+    void (*convertColor)(unsigned short *c0, unsigned short *c1, unsigned short *c2, int count,
+                         const KernelColorMatrix *matrix);
+
+    /* Copy count bytes of one row out of a tiled plane, tile by tile.
+     * src is the row in its first tile, the same row of the next tile is tile_width * tile_height bytes further. */
+    void (*detileRow)(unsigned char *dst, const unsigned char *src, int count, int tile_width, int tile_height);
+
+    /* dst[i] = (dst[i] * (256 - alpha) + value * alpha + 128) >> 8, alpha in [0, 256], where value is
+     * the low byte of pattern for even i and the high byte for odd i. Draws lines and rectangles, on
+     * luma with both bytes the same, or on interleaved UV. */
+    void (*blendFill)(unsigned char *dst, int count, unsigned short pattern, int alpha);
+
+    /* Bilinear demosaic of one row of 10-bit Bayer samples into 10-bit R, G and B, each multiplied by
+     * gain / 256 (at most 8.0). row, above and below must be readable from index -1 to count.
+     * layout is a combination of KernelBayerLayout flags for this row. */
+    void (*demosaicRow)(unsigned short *r, unsigned short *g, unsigned short *b,
+                        const unsigned short *above, const unsigned short *row, const unsigned short *below,
+                        int count, int layout, const unsigned short gain[3]);
+
+    /* dst[i] = clamp((src[i] * scale + offset) >> shift) to [0, 255], or to [-128, 127] stored as int8 when
+     * is_signed is set. src up to 1023, scale from -32768 to 32767, offset small enough for the sum to fit
+     * in 32 bits. Normalizes and quantizes one row of 10-bit components for inference. */
+    void (*quantizeRow)(unsigned char *dst, const unsigned short *src, int count,
+                        int scale, int offset, int shift, int is_signed);
+
+    /* u[i] = src[2 * i] << shift, v[i] = src[2 * i + 1] << shift. Splits one row of interleaved UV. */
+    void (*unpackUV)(unsigned short *u, unsigned short *v, const unsigned char *src, int count, int shift);
+
+    /* dst[3 * i + k] = ck[i]. Packs three 8-bit planes into 24-bit pixels. */
+    void (*interleave3)(unsigned char *dst, const unsigned char *c0, const unsigned char *c1,
+                        const unsigned char *c2, int count);
+
+    /* Copy count bytes with non-temporal stores where available, the stores are fenced on return.
+     * Fills buffers handed to another process or device without evicting the cache of the CPU. */
+    void (*streamRow)(unsigned char *dst, const unsigned char *src, int count);
+
+    /* dst[i] = (src[ofs[i]] * (256 - coef[i]) + src[ofs[i] + step] * coef[i] + 32768) >> 16, coef[i] in [0, 256].
+     * Horizontal pass of the bilinear scaler, on a row of blendRows with step samples per pixel.
+     * src must be readable one sample past the largest ofs[i] + step. */
+    void (*interpolateRow)(unsigned char *dst, const unsigned short *src, const int *ofs,
+                           const unsigned short *coef, int count, int step);
+
+    /* dst[i] = (sum[ofs[i] + len[i] * step] - sum[ofs[i]] + n / 2) / n, with n = len[i] * rows.
+     * Horizontal pass of the area scaler: sum holds the running totals of each of the step channels
+     * of a row of accumulateRow, each below 2^24. */
+    void (*averageRow)(unsigned char *dst, const unsigned int *sum, const int *ofs, const int *len,
+                       int count, int step, int rows);
+} KernelOps;
+
+typedef enum _KernelScaleMode
+{
+    KERNEL_SCALE_Bilinear = 0,
+    KERNEL_SCALE_Area,          /* average of the covered source pixels, for downscaling */
+    KERNEL_SCALE_Max
+} KernelScaleMode;
+
+typedef enum _KernelColorSpace
+{
+    KERNEL_COLOR_BT601 = 0,
+    KERNEL_COLOR_BT709,
+    KERNEL_COLOR_Max
+} KernelColorSpace;
+
+/* Flags describing a row of a Bayer mosaic for demosaicRow */
+typedef enum _KernelBayerLayout
+{
+    KERNEL_BAYER_GreenEven = 1,     /* green at the even columns, the other color at the odd ones */
+    KERNEL_BAYER_BlueRow = 2,       /* the other color is blue, red otherwise */
+    KERNEL_BAYER_EdgeAware = 4,     /* green of red and blue sites along the direction with the smaller gradient */
+} KernelBayerLayout;
+
+/* Coefficients to resize one 8-bit plane, computed once per resolution change.
+ * A pixel has `channels` interleaved bytes, e.g. 2 for the UV plane of NV12. */
+typedef struct _KernelScaler
+{
+    KernelScaleMode mode;
+    int src_width;
+    int src_height;
+    int dst_width;
+    int dst_height;
+    int channels;
+    int *xofs;                  /* first source pixel of each output column */
+    int *xlen;                  /* area: source pixels covered by each output column */
+    unsigned short *xcoef;      /* bilinear: weight of the right pixel, 0 to 256 */
+    int *yofs;                  /* first source row of each output row */
+    int *ylen;                  /* area: source rows covered by each output row */
+    unsigned short *ycoef;      /* bilinear: weight of the lower row, 0 to 256 */
+    int *sofs;                  /* xofs of each output sample, in samples */
+    int *slen;                  /* xlen of each output sample */
+    unsigned short *scoef;      /* xcoef of each output sample */
+} KernelScaler;
+
+/* Get the kernels selected for the running CPU */
+const KernelOps *KERNEL_get();
+
+/* Get all the kernels the running CPU supports, the scalar ones first, for testing; returns their number */
+int KERNEL_getSupported(const KernelOps *ops[], int max);
+
+/* Compute the coefficients; returns 0 on success.
+ * Area mode supports downscaling by up to 256 in each direction. */
+int KERNEL_initScaler(KernelScaler *scaler, KernelScaleMode mode,
+                      int src_width, int src_height, int dst_width, int dst_height, int channels);
+
+void KERNEL_freeScaler(KernelScaler *scaler);
+
+/* Compute the matrix from YUV to RGB when to_rgb is set, from RGB to YUV otherwise.
+ * RGB is always full range, YUV is full range (0 to 1023) or limited range (64 to 940, chroma 64 to 960). */
+void KERNEL_initColorMatrix(KernelColorMatrix *matrix, KernelColorSpace space, int full_range, int to_rgb);
+
+/* Bytes of scratch memory KERNEL_scaleRows needs for the scaler */
+int KERNEL_getScratchSize(const KernelScaler *scaler);
+
+/* Resize output rows [first, first + rows) of the plane; can be called for different bands in parallel,
+ * each with its own scratch of KERNEL_getScratchSize bytes */
+void KERNEL_scaleRows(const KernelScaler *scaler, unsigned char *dst, int dst_stride,
+                      const unsigned char *src, int src_stride, int first, int rows, void *scratch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !_PLINK_KERNELS_H_ */
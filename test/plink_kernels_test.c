@@ -0,0 +1,744 @@
+/*
+ * Copyright (c) 2022 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "plink_kernels.h"
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define MAX_NUM_OF_TABLES   8
+#define MAX_COUNT           1100        // samples of the longest row tested
+#define MAX_MISALIGN        4           // elements the buffers are moved off their alignment
+#define GUARD               64          // bytes around each destination, to catch the writes past its end
+#define CANARY              0xA5
+#define MAX_STEP            4           // channels of the scaler rows
+#define MAX_SPAN            8           // source pixels covered by one destination pixel of the area scaler
+
+/* A destination filled by the scalar kernel and by the one under test */
+typedef struct _TestBuffer
+{
+    unsigned char *ref;
+    unsigned char *out;
+    int size;
+} TestBuffer;
+
+static unsigned int seed = 1;
+static int failures = 0;
+static int checks = 0;
+
+static void printUsage(char *name)
+{
+    printf("usage: %s [options]\n"
+           "\n"
+           "  Check the kernels against fixed vectors and the original stitcher loops, then compare\n"
+           "  every kernel the CPU supports with the scalar one, over odd lengths and misaligned buffers.\n"
+           "  Exits with 1 on any mismatch.\n"
+           "\n"
+           "Available options:\n"
+           "  -s    seed of the random inputs (default: 1)\n"
+           "  -n    rounds of random inputs for each length and alignment (default: 2)\n"
+           "  -h    print this message\n"
+           "\n", name);
+}
+
+static unsigned int getRandom()
+{
+    // xorshift, the same inputs on every platform for a seed
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static int getRange(int lo, int hi)
+{
+    return lo + (int)(getRandom() % (unsigned int)(hi - lo + 1));
+}
+
+static void fillRandom8(unsigned char *data, int count)
+{
+    for (int i = 0; i < count; i++)
+        data[i] = getRandom();
+}
+
+static void fillRandom16(unsigned short *data, int count, int max)
+{
+    for (int i = 0; i < count; i++)
+        data[i] = getRandom() % (max + 1);
+}
+
+static void *allocBuffer(int size)
+{
+    void *data = NULL;
+    if (posix_memalign(&data, 64, size) != 0)
+    {
+        fprintf(stderr, "[KERNEL] Failed to allocate %d bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+static void initBuffer(TestBuffer *buf, int size)
+{
+    buf->size = size + GUARD * 2;
+    buf->ref = allocBuffer(buf->size);
+    buf->out = allocBuffer(buf->size);
+}
+
+static void freeBuffer(TestBuffer *buf)
+{
+    free(buf->ref);
+    free(buf->out);
+}
+
+/* Fill both copies with the canary, or with the same random bytes when the kernel reads its destination */
+static void resetBuffer(TestBuffer *buf, int random)
+{
+    if (random)
+        fillRandom8(buf->ref, buf->size);
+    else
+        memset(buf->ref, CANARY, buf->size);
+    memcpy(buf->out, buf->ref, buf->size);
+}
+
+/* Start of the destination in each copy, bytes bytes after the guard */
+static void *getRef(TestBuffer *buf, int bytes)
+{
+    return buf->ref + GUARD + bytes;
+}
+
+static void *getOut(TestBuffer *buf, int bytes)
+{
+    return buf->out + GUARD + bytes;
+}
+
+/* Compare the whole buffers, guards included. Returns 0 when they match. */
+static int checkBuffer(const KernelOps *ops, const char *kernel, TestBuffer *buf, int count, int misalign, const char *args)
+{
+    checks++;
+    for (int i = 0; i < buf->size; i++)
+    {
+        if (buf->ref[i] != buf->out[i])
+        {
+            failures++;
+            printf("[KERNEL] %s %s: mismatch at byte %d of the destination, %02x instead of %02x "
+                   "(count %d, misalign %d%s%s)\n", ops->name, kernel, i - GUARD, buf->out[i], buf->ref[i],
+                   count, misalign, args != NULL ? ", " : "", args != NULL ? args : "");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static const KernelOps *scalar;
+
+/* Inputs shared by the kernels, big enough for the longest row at the worst misalignment */
+static unsigned char *src8[3];
+static unsigned short *src16[3];
+static TestBuffer dst[3];
+
+static void testPack16to8(const KernelOps *ops, int count, int misalign)
+{
+    const unsigned short *src = src16[0] + misalign;
+    fillRandom16(src16[0], MAX_COUNT + MAX_MISALIGN, 0xFFFF);
+    for (int shift = 0; shift <= 8; shift += 2)
+    {
+        char args[32];
+        resetBuffer(&dst[0], 0);
+        scalar->pack16to8(getRef(&dst[0], misalign), src, count, shift);
+        ops->pack16to8(getOut(&dst[0], misalign), src, count, shift);
+        snprintf(args, sizeof(args), "shift %d", shift);
+        if (checkBuffer(ops, "pack16to8", &dst[0], count, misalign, args) != 0)
+            return;
+    }
+}
+
+static void testBlendRows(const KernelOps *ops, int count, int misalign)
+{
+    static const int weights[] = { 0, 1, 128, 255, 256 };
+    fillRandom8(src8[0], MAX_COUNT + MAX_MISALIGN);
+    fillRandom8(src8[1], MAX_COUNT + MAX_MISALIGN);
+    for (int k = 0; k <= 5; k++)
+    {
+        char args[32];
+        int weight = k < 5 ? weights[k] : getRange(0, 256);
+        resetBuffer(&dst[0], 0);
+        scalar->blendRows(getRef(&dst[0], misalign * 2), src8[0] + misalign, src8[1] + misalign * 3, count, weight);
+        ops->blendRows(getOut(&dst[0], misalign * 2), src8[0] + misalign, src8[1] + misalign * 3, count, weight);
+        snprintf(args, sizeof(args), "weight %d", weight);
+        if (checkBuffer(ops, "blendRows", &dst[0], count, misalign, args) != 0)
+            return;
+    }
+}
+
+static void testAccumulateRow(const KernelOps *ops, int count, int misalign)
+{
+    fillRandom8(src8[0], MAX_COUNT + MAX_MISALIGN);
+    resetBuffer(&dst[0], 1);
+    // the sums of the area scaler stay below 65536
+    unsigned short *ref = getRef(&dst[0], misalign * 2);
+    unsigned short *out = getOut(&dst[0], misalign * 2);
+    for (int i = 0; i < count; i++)
+    {
+        ref[i] %= 65536 - 255;
+        out[i] = ref[i];
+    }
+    scalar->accumulateRow(ref, src8[0] + misalign, count);
+    ops->accumulateRow(out, src8[0] + misalign, count);
+    checkBuffer(ops, "accumulateRow", &dst[0], count, misalign, NULL);
+}
+
+static void testUnpack8to16(const KernelOps *ops, int count, int misalign)
+{
+    fillRandom8(src8[0], MAX_COUNT + MAX_MISALIGN);
+    for (int shift = 0; shift <= 8; shift += 2)
+    {
+        char args[32];
+        resetBuffer(&dst[0], 0);
+        scalar->unpack8to16(getRef(&dst[0], misalign * 2), src8[0] + misalign, count, shift);
+        ops->unpack8to16(getOut(&dst[0], misalign * 2), src8[0] + misalign, count, shift);
+        snprintf(args, sizeof(args), "shift %d", shift);
+        if (checkBuffer(ops, "unpack8to16", &dst[0], count, misalign, args) != 0)
+            return;
+    }
+}
+
+static void testConvertColor(const KernelOps *ops, int count, int misalign)
+{
+    for (int space = 0; space < KERNEL_COLOR_Max; space++)
+    {
+        for (int mode = 0; mode < 4; mode++)
+        {
+            KernelColorMatrix matrix;
+            KERNEL_initColorMatrix(&matrix, space, mode & 1, mode >> 1);
+            unsigned short *ref[3], *out[3];
+            for (int k = 0; k < 3; k++)
+            {
+                resetBuffer(&dst[k], 0);
+                ref[k] = getRef(&dst[k], (misalign + k) % MAX_MISALIGN * 2);
+                out[k] = getOut(&dst[k], (misalign + k) % MAX_MISALIGN * 2);
+                fillRandom16(ref[k], count, 1023);
+                memcpy(out[k], ref[k], count * 2);
+            }
+            scalar->convertColor(ref[0], ref[1], ref[2], count, &matrix);
+            ops->convertColor(out[0], out[1], out[2], count, &matrix);
+
+            char args[48];
+            snprintf(args, sizeof(args), "space %d, full range %d, to rgb %d", space, mode & 1, mode >> 1);
+            for (int k = 0; k < 3; k++)
+            {
+                if (checkBuffer(ops, "convertColor", &dst[k], count, misalign, args) != 0)
+                    return;
+            }
+        }
+    }
+}
+
+static void testDetileRow(const KernelOps *ops, int count, int misalign)
+{
+    static const int tiles[][2] = { { 4, 4 }, { 8, 4 }, { 16, 4 }, { 32, 4 }, { 64, 32 } };
+    for (int t = 0; t < (int)(sizeof(tiles) / sizeof(tiles[0])); t++)
+    {
+        int tile_width = tiles[t][0];
+        int tile_height = tiles[t][1];
+        int tiles_in_row = (count + tile_width - 1) / tile_width;
+        unsigned char *src = allocBuffer(tiles_in_row * tile_width * tile_height + MAX_MISALIGN);
+        fillRandom8(src, tiles_in_row * tile_width * tile_height + MAX_MISALIGN);
+
+        char args[32];
+        resetBuffer(&dst[0], 0);
+        scalar->detileRow(getRef(&dst[0], misalign), src + misalign, count, tile_width, tile_height);
+        ops->detileRow(getOut(&dst[0], misalign), src + misalign, count, tile_width, tile_height);
+        free(src);
+        snprintf(args, sizeof(args), "tile %dx%d", tile_width, tile_height);
+        if (checkBuffer(ops, "detileRow", &dst[0], count, misalign, args) != 0)
+            return;
+    }
+}
+
+static void testBlendFill(const KernelOps *ops, int count, int misalign)
+{
+    static const int alphas[] = { 0, 1, 128, 255, 256 };
+    for (int k = 0; k <= 5; k++)
+    {
+        char args[48];
+        int alpha = k < 5 ? alphas[k] : getRange(0, 256);
+        unsigned short pattern = getRandom();
+        resetBuffer(&dst[0], 1);
+        scalar->blendFill(getRef(&dst[0], misalign), count, pattern, alpha);
+        ops->blendFill(getOut(&dst[0], misalign), count, pattern, alpha);
+        snprintf(args, sizeof(args), "pattern %04x, alpha %d", pattern, alpha);
+        if (checkBuffer(ops, "blendFill", &dst[0], count, misalign, args) != 0)
+            return;
+    }
+}
+
+static void testDemosaicRow(const KernelOps *ops, int count, int misalign)
+{
+    // the rows are read from index -1 to count
+    for (int k = 0; k < 3; k++)
+        fillRandom16(src16[k], MAX_COUNT + MAX_MISALIGN + 2, 1023);
+    const unsigned short *above = src16[0] + 1 + misalign;
+    const unsigned short *row = src16[1] + 1 + (misalign + 1) % MAX_MISALIGN;
+    const unsigned short *below = src16[2] + 1 + (misalign + 2) % MAX_MISALIGN;
+    for (int layout = 0; layout < 8; layout++)
+    {
+        unsigned short gain[3];
+        for (int k = 0; k < 3; k++)
+            gain[k] = layout == 0 ? 256 : getRange(0, 2048);
+
+        unsigned short *ref[3], *out[3];
+        for (int k = 0; k < 3; k++)
+        {
+            resetBuffer(&dst[k], 0);
+            ref[k] = getRef(&dst[k], misalign * 2);
+            out[k] = getOut(&dst[k], misalign * 2);
+        }
+        scalar->demosaicRow(ref[0], ref[1], ref[2], above, row, below, count, layout, gain);
+        ops->demosaicRow(out[0], out[1], out[2], above, row, below, count, layout, gain);
+
+        char args[64];
+        snprintf(args, sizeof(args), "layout %d, gain %d %d %d", layout, gain[0], gain[1], gain[2]);
+        for (int k = 0; k < 3; k++)
+        {
+            if (checkBuffer(ops, "demosaicRow", &dst[k], count, misalign, args) != 0)
+                return;
+        }
+    }
+}
+
+static void testQuantizeRow(const KernelOps *ops, int count, int misalign)
+{
+    fillRandom16(src16[0], MAX_COUNT + MAX_MISALIGN, 1023);
+    for (int k = 0; k < 8; k++)
+    {
+        int is_signed = k & 1;
+        int shift = getRange(0, 16);
+        int scale = getRange(-32768, 32767);
+        // the sum stays within 32 bits: |src * scale| < 2^25
+        int offset = getRange(-(1 << 28), 1 << 28);
+        char args[64];
+        resetBuffer(&dst[0], 0);
+        scalar->quantizeRow(getRef(&dst[0], misalign), src16[0] + misalign, count, scale, offset, shift, is_signed);
+        ops->quantizeRow(getOut(&dst[0], misalign), src16[0] + misalign, count, scale, offset, shift, is_signed);
+        snprintf(args, sizeof(args), "scale %d, offset %d, shift %d, signed %d", scale, offset, shift, is_signed);
+        if (checkBuffer(ops, "quantizeRow", &dst[0], count, misalign, args) != 0)
+            return;
+    }
+}
+
+static void testUnpackUV(const KernelOps *ops, int count, int misalign)
+{
+    fillRandom8(src8[0], (MAX_COUNT + MAX_MISALIGN) * 2);
+    for (int shift = 0; shift <= 8; shift += 2)
+    {
+        char args[32];
+        resetBuffer(&dst[0], 0);
+        resetBuffer(&dst[1], 0);
+        scalar->unpackUV(getRef(&dst[0], misalign * 2), getRef(&dst[1], (misalign + 1) % MAX_MISALIGN * 2),
+                         src8[0] + misalign, count, shift);
+        ops->unpackUV(getOut(&dst[0], misalign * 2), getOut(&dst[1], (misalign + 1) % MAX_MISALIGN * 2),
+                      src8[0] + misalign, count, shift);
+        snprintf(args, sizeof(args), "shift %d", shift);
+        if (checkBuffer(ops, "unpackUV", &dst[0], count, misalign, args) != 0 ||
+            checkBuffer(ops, "unpackUV", &dst[1], count, misalign, args) != 0)
+            return;
+    }
+}
+
+static void testInterleave3(const KernelOps *ops, int count, int misalign)
+{
+    for (int k = 0; k < 3; k++)
+        fillRandom8(src8[k], MAX_COUNT + MAX_MISALIGN);
+    resetBuffer(&dst[0], 0);
+    scalar->interleave3(getRef(&dst[0], misalign), src8[0] + misalign, src8[1] + (misalign + 1) % MAX_MISALIGN,
+                        src8[2] + (misalign + 2) % MAX_MISALIGN, count);
+    ops->interleave3(getOut(&dst[0], misalign), src8[0] + misalign, src8[1] + (misalign + 1) % MAX_MISALIGN,
+                     src8[2] + (misalign + 2) % MAX_MISALIGN, count);
+    checkBuffer(ops, "interleave3", &dst[0], count, misalign, NULL);
+}
+
+static void testStreamRow(const KernelOps *ops, int count, int misalign)
+{
+    fillRandom8(src8[0], MAX_COUNT + MAX_MISALIGN);
+    resetBuffer(&dst[0], 0);
+    scalar->streamRow(getRef(&dst[0], misalign), src8[0] + (misalign + 1) % MAX_MISALIGN, count);
+    ops->streamRow(getOut(&dst[0], misalign), src8[0] + (misalign + 1) % MAX_MISALIGN, count);
+    checkBuffer(ops, "streamRow", &dst[0], count, misalign, NULL);
+}
+
+static void testInterpolateRow(const KernelOps *ops, int count, int misalign)
+{
+    int *ofs = allocBuffer((count + 1) * sizeof(int));
+    unsigned short *coef = allocBuffer((count + 1) * sizeof(unsigned short));
+    for (int step = 1; step <= MAX_STEP; step++)
+    {
+        // a row of blendRows, with the pixel past the end the scaler keeps readable
+        int pixels = MAX_COUNT / MAX_STEP;
+        fillRandom16(src16[0], MAX_COUNT + MAX_MISALIGN, 255 * 256);
+        for (int i = 0; i < count; i++)
+        {
+            ofs[i] = getRange(0, pixels - 2) * step + i % step;
+            coef[i] = getRange(0, 256);
+        }
+
+        char args[32];
+        resetBuffer(&dst[0], 0);
+        scalar->interpolateRow(getRef(&dst[0], misalign), src16[0] + misalign, ofs, coef, count, step);
+        ops->interpolateRow(getOut(&dst[0], misalign), src16[0] + misalign, ofs, coef, count, step);
+        snprintf(args, sizeof(args), "step %d", step);
+        if (checkBuffer(ops, "interpolateRow", &dst[0], count, misalign, args) != 0)
+            break;
+    }
+    free(ofs);
+    free(coef);
+}
+
+static void testAverageRow(const KernelOps *ops, int count, int misalign)
+{
+    int *ofs = allocBuffer((count + 1) * sizeof(int));
+    int *len = allocBuffer((count + 1) * sizeof(int));
+    unsigned int *sum = allocBuffer((MAX_COUNT + MAX_STEP + MAX_MISALIGN) * sizeof(unsigned int));
+    for (int step = 1; step <= MAX_STEP; step++)
+    {
+        // running totals of a row of accumulateRow over rows rows, the first pixel is 0, all below 2^24
+        int rows = getRange(1, 200);
+        int pixels = MAX_COUNT / MAX_STEP;
+        unsigned int *row = sum + misalign;
+        memset(row, 0, step * sizeof(unsigned int));
+        for (int i = step; i < (pixels + 1) * step; i++)
+            row[i] = row[i - step] + getRange(0, 255 * rows);
+        for (int i = 0; i < count; i++)
+        {
+            len[i] = getRange(1, MAX_SPAN);
+            ofs[i] = getRange(0, pixels - len[i]) * step + i % step;
+        }
+
+        char args[32];
+        resetBuffer(&dst[0], 0);
+        scalar->averageRow(getRef(&dst[0], misalign), row, ofs, len, count, step, rows);
+        ops->averageRow(getOut(&dst[0], misalign), row, ofs, len, count, step, rows);
+        snprintf(args, sizeof(args), "step %d, rows %d", step, rows);
+        if (checkBuffer(ops, "averageRow", &dst[0], count, misalign, args) != 0)
+            break;
+    }
+    free(ofs);
+    free(len);
+    free(sum);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Fixed vectors: the scalar kernels too are checked against known outputs */
+
+/* Compare count bytes with the expected ones. Returns 0 when they match. */
+static int checkBytes(const char *name, const char *kernel, const unsigned char *out, const unsigned char *expected,
+                      int count, const char *args)
+{
+    checks++;
+    for (int i = 0; i < count; i++)
+    {
+        if (out[i] != expected[i])
+        {
+            failures++;
+            printf("[KERNEL] %s %s: byte %d is %d instead of %d (%s)\n", name, kernel, i, out[i], expected[i], args);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int checkValues(const char *kernel, const int *out, const int *expected, int count, const char *args)
+{
+    checks++;
+    for (int i = 0; i < count; i++)
+    {
+        if (out[i] != expected[i])
+        {
+            failures++;
+            printf("[KERNEL] %s: value %d is %d instead of %d (%s)\n", kernel, i, out[i], expected[i], args);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The row loop of stitchOneFrame for P010 and Raw inputs before the kernels were shared, kept as it was:
+ * pack16to8 must stay bit-exact with it. Writes whole groups of 4 pixels. */
+static void baselinePack16to8(unsigned char *dst, const unsigned short *src, int width, int shift)
+{
+    unsigned int temp[4];
+    unsigned int *dst32 = (unsigned int *)dst;
+    const unsigned short *src16 = src;
+    for (int w = 0; w < width; w+=4)
+    {
+        temp[0] = ((unsigned int)(src16[w+0] >> shift) & 0xFF);
+        temp[1] = ((unsigned int)(src16[w+1] >> shift) & 0xFF) << 8;
+        temp[2] = ((unsigned int)(src16[w+2] >> shift) & 0xFF) << 16;
+        temp[3] = ((unsigned int)(src16[w+3] >> shift) & 0xFF) << 24;
+        dst32[w>>2] = temp[0] | temp[1] | temp[2] | temp[3];
+    }
+}
+
+static void testFixedPack16to8(const KernelOps *ops)
+{
+    static const unsigned short src[12] =
+    {
+        0x0000, 0x0001, 0x0003, 0x0004, 0x00FF, 0x0155, 0x0200, 0x03FF, 0x0ABC, 0x0FFF, 0xFFC0, 0xFFFF
+    };
+    // P010 shifts by 2, Raw10 and Raw12 by 4
+    static const unsigned char expected2[12] = { 0x00, 0x00, 0x00, 0x01, 0x3F, 0x55, 0x80, 0xFF, 0xAF, 0xFF, 0xF0, 0xFF };
+    static const unsigned char expected4[12] = { 0x00, 0x00, 0x00, 0x00, 0x0F, 0x15, 0x20, 0x3F, 0xAB, 0xFF, 0xFC, 0xFF };
+    unsigned char out[12];
+
+    ops->pack16to8(out, src, 12, 2);
+    checkBytes(ops->name, "pack16to8", out, expected2, 12, "fixed, shift 2");
+    ops->pack16to8(out, src, 12, 4);
+    checkBytes(ops->name, "pack16to8", out, expected4, 12, "fixed, shift 4");
+
+    // random rows of every width the baseline loop handled, a multiple of 4
+    unsigned char *ref = getRef(&dst[0], 0);
+    unsigned char *res = getOut(&dst[0], 0);
+    for (int count = 4; count <= MAX_COUNT; count = count < 64 ? count + 4 : count * 2)
+    {
+        for (int shift = 2; shift <= 4; shift += 2)
+        {
+            char args[64];
+            fillRandom16(src16[0], count, 0xFFFF);
+            baselinePack16to8(ref, src16[0], count, shift);
+            ops->pack16to8(res, src16[0], count, shift);
+            snprintf(args, sizeof(args), "baseline, count %d, shift %d", count, shift);
+            if (checkBytes(ops->name, "pack16to8", res, ref, count, args) != 0)
+                return;
+        }
+    }
+}
+
+static void testFixedConvertColor(const KernelOps *ops)
+{
+    // BT.601 limited range: black, white and red, both ways
+    static const unsigned short yuv[3][3] = { { 64, 940, 326 }, { 512, 512, 361 }, { 512, 512, 960 } };
+    static const unsigned short rgb[3][3] = { { 0, 1023, 1023 }, { 0, 1023, 0 }, { 0, 1023, 0 } };
+    KernelColorMatrix matrix;
+    unsigned short c[3][3];
+    int out[9], expected[9];
+    char kernel[64];
+    snprintf(kernel, sizeof(kernel), "%s convertColor", ops->name);
+
+    KERNEL_initColorMatrix(&matrix, KERNEL_COLOR_BT601, 0, 1);
+    memcpy(c, yuv, sizeof(c));
+    ops->convertColor(c[0], c[1], c[2], 2, &matrix);
+    for (int k = 0; k < 3; k++)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            out[k * 2 + i] = c[k][i];
+            expected[k * 2 + i] = rgb[k][i];
+        }
+    }
+    checkValues(kernel, out, expected, 6, "BT.601 limited range to RGB");
+
+    KERNEL_initColorMatrix(&matrix, KERNEL_COLOR_BT601, 0, 0);
+    memcpy(c, rgb, sizeof(c));
+    ops->convertColor(c[0], c[1], c[2], 3, &matrix);
+    for (int k = 0; k < 3; k++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            out[k * 3 + i] = c[k][i];
+            expected[k * 3 + i] = yuv[k][i];
+        }
+    }
+    checkValues(kernel, out, expected, 9, "RGB to BT.601 limited range");
+}
+
+static void testFixedColorMatrix()
+{
+    // R = Y + 1.402 V, G = Y - 0.344136 U - 0.714136 V, B = Y + 1.772 U, in 1/4096, U and V centered on 512
+    static const int bt601_full[12] =
+    {
+        4096, 0, 5743, -2938368,
+        4096, -1410, -2925, 2221568,
+        4096, 7258, 0, -3714048,
+    };
+    // BT.709 limited range: luma scaled by 1023 / 876 and chroma by 1023 / 896
+    static const int bt709_coef[9] =
+    {
+        4783, 0, 7365,
+        4783, -876, -2189,
+        4783, 8678, 0,
+    };
+    KernelColorMatrix matrix;
+    int out[12];
+
+    KERNEL_initColorMatrix(&matrix, KERNEL_COLOR_BT601, 1, 1);
+    for (int k = 0; k < 3; k++)
+    {
+        for (int j = 0; j < 3; j++)
+            out[k * 4 + j] = matrix.coef[k][j];
+        out[k * 4 + 3] = matrix.offset[k];
+    }
+    checkValues("KERNEL_initColorMatrix", out, bt601_full, 12, "BT.601 full range to RGB");
+
+    KERNEL_initColorMatrix(&matrix, KERNEL_COLOR_BT709, 0, 1);
+    for (int k = 0; k < 3; k++)
+    {
+        for (int j = 0; j < 3; j++)
+            out[k * 3 + j] = matrix.coef[k][j];
+    }
+    checkValues("KERNEL_initColorMatrix", out, bt709_coef, 9, "BT.709 limited range to RGB");
+}
+
+/* Scale src to dst_width x dst_height with the kernels selected for the CPU and compare with expected */
+static void checkScaler(KernelScaleMode mode, const unsigned char *src, int src_width, int src_height,
+                        const unsigned char *expected, int dst_width, int dst_height, int channels, const char *args)
+{
+    KernelScaler scaler;
+    unsigned char out[64];
+    if (KERNEL_initScaler(&scaler, mode, src_width, src_height, dst_width, dst_height, channels) != 0)
+    {
+        checks++;
+        failures++;
+        printf("[KERNEL] KERNEL_initScaler failed (%s)\n", args);
+        return;
+    }
+    void *scratch = allocBuffer(KERNEL_getScratchSize(&scaler));
+    KERNEL_scaleRows(&scaler, out, dst_width * channels, src, src_width * channels, 0, dst_height, scratch);
+    checkBytes(KERNEL_get()->name, "KERNEL_scaleRows", out, expected, dst_width * dst_height * channels, args);
+    free(scratch);
+    KERNEL_freeScaler(&scaler);
+}
+
+static void testFixedScaler()
+{
+    // bilinear samples at the centers of the output pixels, clamped to the edges of the source
+    static const unsigned char row[4] = { 0, 100, 200, 40 };
+    static const unsigned char half[2] = { 50, 120 };
+    static const unsigned char square[4] = { 0, 200, 100, 100 };
+    static const unsigned char twice[16] =
+    {
+        0, 50, 150, 200,
+        25, 63, 138, 175,
+        75, 88, 113, 125,
+        100, 100, 100, 100,
+    };
+    // area averages the covered pixels, rounded to nearest; interleaved UV per channel
+    static const unsigned char nine[9] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+    static const unsigned char center[1] = { 5 };
+    static const unsigned char uv[8] = { 10, 200, 20, 100, 30, 0, 41, 255 };
+    static const unsigned char uv_half[4] = { 15, 150, 36, 128 };
+
+    checkScaler(KERNEL_SCALE_Bilinear, row, 4, 1, half, 2, 1, 1, "bilinear 4x1 to 2x1");
+    checkScaler(KERNEL_SCALE_Bilinear, square, 2, 2, twice, 4, 4, 1, "bilinear 2x2 to 4x4");
+    checkScaler(KERNEL_SCALE_Area, nine, 3, 3, center, 1, 1, 1, "area 3x3 to 1x1");
+    checkScaler(KERNEL_SCALE_Area, uv, 4, 1, uv_half, 2, 1, 2, "area 4x1 to 2x1, 2 channels");
+}
+
+typedef void (*TestFunc)(const KernelOps *ops, int count, int misalign);
+
+static const TestFunc tests[] =
+{
+    testPack16to8, testBlendRows, testAccumulateRow, testUnpack8to16, testConvertColor, testDetileRow,
+    testBlendFill, testDemosaicRow, testQuantizeRow, testUnpackUV, testInterleave3, testStreamRow,
+    testInterpolateRow, testAverageRow,
+};
+
+static int getNextCount(int count)
+{
+    // every length around the vector widths, then a few longer odd ones
+    if (count < 70)
+        return count + 1;
+    return count < 1000 ? count * 2 + 1 : MAX_COUNT + 1;
+}
+
+int main(int argc, char **argv)
+{
+    int option;
+    int rounds = 2;
+    while ((option = getopt(argc, argv, "s:n:h")) != -1)
+    {
+        switch (option)
+        {
+        case 's':
+            seed = atoi(optarg) != 0 ? atoi(optarg) : 1;
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        default:
+            printUsage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+
+    const KernelOps *tables[MAX_NUM_OF_TABLES];
+    int num = KERNEL_getSupported(tables, MAX_NUM_OF_TABLES);
+    scalar = tables[0];
+
+    for (int k = 0; k < 3; k++)
+    {
+        src8[k] = allocBuffer((MAX_COUNT + MAX_MISALIGN) * 2);
+        src16[k] = allocBuffer((MAX_COUNT + MAX_MISALIGN + 2) * sizeof(unsigned short));
+        // 3 bytes of interleave3 for each sample
+        initBuffer(&dst[k], (MAX_COUNT + MAX_MISALIGN) * 3);
+    }
+
+    int before = failures;
+    testFixedColorMatrix();
+    testFixedScaler();
+    for (int t = 0; t < num; t++)
+    {
+        testFixedPack16to8(tables[t]);
+        testFixedConvertColor(tables[t]);
+    }
+    printf("[KERNEL] Fixed vectors: %s\n", failures == before ? "OK" : "FAILED");
+
+    if (num < 2)
+        printf("[KERNEL] Only the %s kernels are supported, nothing to compare\n", scalar->name);
+    for (int t = 1; t < num; t++)
+    {
+        int before = failures;
+        for (int f = 0; f < (int)(sizeof(tests) / sizeof(tests[0])); f++)
+        {
+            for (int count = 0; count <= MAX_COUNT; count = getNextCount(count))
+            {
+                for (int misalign = 0; misalign < MAX_MISALIGN; misalign++)
+                {
+                    for (int r = 0; r < rounds; r++)
+                        tests[f](tables[t], count, misalign);
+                }
+            }
+        }
+        printf("[KERNEL] %s: %s\n", tables[t]->name, failures == before ? "OK" : "FAILED");
+    }
+    printf("[KERNEL] %d checks, %d failed\n", checks, failures);
+
+    for (int k = 0; k < 3; k++)
+    {
+        free(src8[k]);
+        free(src16[k]);
+        freeBuffer(&dst[k]);
+    }
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,651 @@
+/*
+ * Copyright (c) 2022 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <memory.h>
+#include <libgen.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define MAX_NUM_OF_PRODUCERS    16
+#define MAX_NUM_OF_CONSUMERS    3   /* plink server accepts up to 3 connections */
+#define APP_START_TIMEOUT_MS    5000    /* time for plinkstitcher to create its server */
+#define APP_EXIT_TIMEOUT_S      30      /* the applications are killed this long after the end of the run */
+#define MAX_NUM_OF_APPS         (MAX_NUM_OF_PRODUCERS + 1 + MAX_NUM_OF_CONSUMERS)
+#define MAX_NUM_OF_ARGS         32
+#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
+                        } while (0)
+
+typedef enum _PipeRole
+{
+    PIPE_ROLE_Producer = 0,
+    PIPE_ROLE_Aggregator,
+    PIPE_ROLE_Consumer,
+    PIPE_ROLE_Max
+} PipeRole;
+
+typedef struct _PipelineParams
+{
+    char *prefix;
+    int producers;
+    int consumers;
+    int width;
+    int height;
+    int fps;
+    int duration;
+    int deadline_ms;
+    int max_age;
+    int mailbox;
+    int decimation;
+    int max_fps;
+    int metadata;
+    int sweep;
+} PipelineParams;
+
+/* Result of one process, read from the summary it printed at exit */
+typedef struct _PipeStats
+{
+    PipeRole role;
+    int index;
+    int frames;
+    int dropped;
+    int late;
+    int skipped;
+    double seconds;
+    double cpu;
+    double lat_p50;
+    double lat_p99;
+    double lat_max;
+    double wall;        /* lifetime of the process, the CPU load is relative to it */
+} PipeStats;
+
+typedef struct _PipeResults
+{
+    PipeStats stats[MAX_NUM_OF_APPS];
+} PipeResults;
+
+/* Arguments of an application, built up option by option */
+typedef struct _AppArgs
+{
+    char *argv[MAX_NUM_OF_ARGS + 1];
+    char values[MAX_NUM_OF_ARGS][256];
+    int argc;
+} AppArgs;
+
+static void printUsage(char *name)
+{
+    printf("usage: %s [options]\n"
+           "\n"
+           "  Run N plinkserver producers -> plinkstitcher -> M plinkclient consumers with generated NV12 frames,\n"
+           "  the sample applications found next to %s\n"
+           "  Available options:\n"
+           "    -l      plink file name prefix (default: /tmp/plink.pipe)\n"
+           "    -n      number of producers (default: 2, max %d)\n"
+           "    -m      number of consumers (default: 1, max %d)\n"
+           "    -w      video width (default: 1920)\n"
+           "    -h      video height (default: 1080)\n"
+           "    -r      producer frame rate (default: 30)\n"
+           "    -t      duration in seconds (default: 10)\n"
+           "    -d      latency deadline in ms, later frames are counted as late (default: 2 frame periods)\n"
+           "    -b      consumers receive in mailbox mode (latest frame only)\n"
+           "    -a      stitcher and consumers drop frames older than this many ms (default: 0, disabled)\n"
+           "    -e      consumers subscribe to every Nth frame only (default: 0, disabled)\n"
+           "    -f      consumers subscribe to at most this many frames per second (default: 0, disabled)\n"
+           "    -o      consumers subscribe to frame metadata only, without picture buffers\n"
+           "    -S      sweep all topologies from 1x1 up to NxM\n"
+           "    --help  print this message\n"
+           "\n", name, name, MAX_NUM_OF_PRODUCERS, MAX_NUM_OF_CONSUMERS);
+}
+
+static void parseParams(int argc, char **argv, PipelineParams *params)
+{
+    int i = 1;
+    memset(params, 0, sizeof(*params));
+    params->prefix = "/tmp/plink.pipe";
+    params->producers = 2;
+    params->consumers = 1;
+    params->width = 1920;
+    params->height = 1080;
+    params->fps = 30;
+    params->duration = 10;
+    while (i < argc)
+    {
+        if (argv[i][0] != '-' || strlen(argv[i]) < 2)
+        {
+            i++;
+            continue;
+        }
+
+        if (argv[i][1] == 'l')
+        {
+            if (++i < argc)
+                params->prefix = argv[i++];
+        }
+        else if (argv[i][1] == 'n')
+        {
+            if (++i < argc)
+                params->producers = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'm')
+        {
+            if (++i < argc)
+                params->consumers = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'w')
+        {
+            if (++i < argc)
+                params->width = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'h')
+        {
+            if (++i < argc)
+                params->height = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'r')
+        {
+            if (++i < argc)
+                params->fps = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 't')
+        {
+            if (++i < argc)
+                params->duration = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'd')
+        {
+            if (++i < argc)
+                params->deadline_ms = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'a')
+        {
+            if (++i < argc)
+                params->max_age = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'e')
+        {
+            if (++i < argc)
+                params->decimation = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'f')
+        {
+            if (++i < argc)
+                params->max_fps = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'o')
+        {
+            params->metadata = 1;
+            i++;
+        }
+        else if (argv[i][1] == 'b')
+        {
+            params->mailbox = 1;
+            i++;
+        }
+        else if (argv[i][1] == 'S')
+        {
+            params->sweep = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--help") == 0)
+        {
+            params->producers = 0;
+            i++;
+        }
+        else
+            i++;
+    }
+
+    if (params->deadline_ms == 0 && params->fps > 0)
+        params->deadline_ms = 2000 / params->fps;
+}
+
+static int checkParams(PipelineParams *params)
+{
+    if (params->producers <= 0 || params->producers > MAX_NUM_OF_PRODUCERS ||
+        params->consumers <= 0 || params->consumers > MAX_NUM_OF_CONSUMERS ||
+        params->width <= 0 || params->height <= 0 ||
+        (params->width & 1) || (params->height & 1) ||
+        params->fps <= 0 || params->duration <= 0)
+        return -1;
+    return 0;
+}
+
+static int isSubscribed(PipelineParams *params)
+{
+    return params->decimation > 1 || params->max_fps > 0;
+}
+
+/* Frame rate a consumer should see with its subscription */
+static double getExpectedFps(PipelineParams *params)
+{
+    double fps = params->fps;
+    if (params->decimation > 1)
+        fps /= params->decimation;
+    if (params->max_fps > 0 && params->max_fps < fps)
+        fps = params->max_fps;
+    return fps;
+}
+
+static long long nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void initStats(PipelineParams *params, PipeResults *results)
+{
+    int total = params->producers + 1 + params->consumers;
+
+    memset(results, 0, sizeof(*results));
+    for (int i = 0; i < total; i++)
+    {
+        PipeStats *stats = &results->stats[i];
+        if (i < params->producers)
+        {
+            stats->role = PIPE_ROLE_Producer;
+            stats->index = i;
+        }
+        else if (i == params->producers)
+        {
+            stats->role = PIPE_ROLE_Aggregator;
+            stats->index = 0;
+        }
+        else
+        {
+            stats->role = PIPE_ROLE_Consumer;
+            stats->index = i - params->producers - 1;
+        }
+    }
+}
+
+static void addArg(AppArgs *args, const char *format, int value)
+{
+    if (args->argc >= MAX_NUM_OF_ARGS)
+        return;
+    snprintf(args->values[args->argc], sizeof(args->values[args->argc]), format, value);
+    args->argv[args->argc] = args->values[args->argc];
+    args->argc++;
+    args->argv[args->argc] = NULL;
+}
+
+static void addString(AppArgs *args, const char *value)
+{
+    if (args->argc >= MAX_NUM_OF_ARGS)
+        return;
+    snprintf(args->values[args->argc], sizeof(args->values[args->argc]), "%s", value);
+    args->argv[args->argc] = args->values[args->argc];
+    args->argc++;
+    args->argv[args->argc] = NULL;
+}
+
+/* Start a sample application, its output goes to the log file */
+static pid_t startApp(char *argv[], const char *log)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        errExit("fork");
+    if (pid == 0)
+    {
+        int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0)
+        {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+static int waitForFile(const char *name, int timeout_ms)
+{
+    for (int t = 0; t < timeout_ms && access(name, F_OK) != 0; t++)
+        usleep(1000);
+    return access(name, F_OK);
+}
+
+/* Fill the stats of a stage from the summary the application printed at exit */
+static void readAppLog(const char *log, PipeStats *stats)
+{
+    FILE *fp = fopen(log, "r");
+    if (fp == NULL)
+        return;
+
+    char line[512];
+    double fps = 0;
+    long long average = 0, most = 0;
+    int skipped = 0, dropped = 0, max_age = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "[SERVER] Sent %d frames in %lf s, %lf fps, dropped %d",
+                   &stats->frames, &stats->seconds, &fps, &stats->dropped) >= 2)
+            continue;
+        if (sscanf(line, "[SERVER] Paced %*d frames at %lf fps: late by %lld us on average, %lld us at most, %d frames",
+                   &fps, &average, &most, &stats->late) == 4)
+            continue;
+        // frames the channel policy or the subscription of a consumer did not let through are no drops
+        if (sscanf(line, "[STITCHER] Sent %d frames in %lf s, %lf fps, dropped %d",
+                   &stats->frames, &stats->seconds, &fps, &stats->skipped) >= 2)
+            continue;
+        if (sscanf(line, "[CLIENT] Received %d frames in %lf s", &stats->frames, &stats->seconds) == 2)
+            continue;
+        if (sscanf(line, "[CLIENT] Skipped %d frames in mailbox mode, dropped %d older than %d ms",
+                   &skipped, &dropped, &max_age) == 3)
+        {
+            stats->skipped = skipped + dropped;
+            continue;
+        }
+        sscanf(line, "[CLIENT] Latency from capture: p50 %lf ms, p99 %lf ms, max %lf ms, %d frames late",
+               &stats->lat_p50, &stats->lat_p99, &stats->lat_max, &stats->late);
+    }
+    fclose(fp);
+}
+
+/* Run the topology with plinkserver -g producers, plinkstitcher and plinkclient consumers, the binaries
+ * being measured. Without the video-memory driver, plinkserver and plinkstitcher allocate their buffers
+ * with memfd. */
+static int runApplications(PipelineParams *params, PipeResults *results)
+{
+    int total = params->producers + 1 + params->consumers;
+    int aggregator = params->producers;
+    pid_t pids[MAX_NUM_OF_APPS];
+    char logs[MAX_NUM_OF_APPS][256];
+    char names[MAX_NUM_OF_PRODUCERS][256];
+    char bindir[256], server[300], stitcher[300], client[300], out[256];
+
+    initStats(params, results);
+    ssize_t len = readlink("/proc/self/exe", bindir, sizeof(bindir) - 1);
+    if (len <= 0)
+        return -1;
+    bindir[len] = '\0';
+    dirname(bindir);
+    snprintf(server, sizeof(server), "%s/plinkserver", bindir);
+    snprintf(stitcher, sizeof(stitcher), "%s/plinkstitcher", bindir);
+    snprintf(client, sizeof(client), "%s/plinkclient", bindir);
+    snprintf(out, sizeof(out), "%s.out", params->prefix);
+    for (int i = 0; i < total; i++)
+    {
+        static const char *roles[PIPE_ROLE_Max] = {"producer", "aggregator", "consumer"};
+        PipeStats *stats = &results->stats[i];
+        snprintf(logs[i], sizeof(logs[i]), "%s.%s%d.log", params->prefix, roles[stats->role], stats->index);
+    }
+
+    // the stitcher first: its inputs connect to the producers whenever they are up
+    AppArgs args = {0};
+    addString(&args, stitcher);
+    addString(&args, "-n");
+    addArg(&args, "%d", params->producers);
+    addString(&args, "-o");
+    addString(&args, out);
+    addString(&args, "-w");
+    addArg(&args, "%d", params->width);
+    addString(&args, "-h");
+    addArg(&args, "%d", params->height);
+    addString(&args, "-C");
+    addArg(&args, "%d", params->consumers);
+    addString(&args, "-A");
+    addArg(&args, "%d", params->max_age);
+    for (int i = 0; i < params->producers; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "%s.in%d", params->prefix, i);
+        addArg(&args, "-i%d", i);
+        addString(&args, names[i]);
+    }
+    unlink(out);
+    long long start = nowUs();
+    pids[aggregator] = startApp(args.argv, logs[aggregator]);
+
+    for (int i = 0; i < params->producers; i++)
+    {
+        AppArgs producer = {0};
+        addString(&producer, server);
+        addString(&producer, "-l");
+        addString(&producer, names[i]);
+        addString(&producer, "-g");
+        addArg(&producer, "%d", i % 3);
+        addString(&producer, "-w");
+        addArg(&producer, "%d", params->width);
+        addString(&producer, "-h");
+        addArg(&producer, "%d", params->height);
+        addString(&producer, "-t");
+        addArg(&producer, "%d", params->fps);
+        addString(&producer, "-n");
+        addArg(&producer, "%d", params->fps * params->duration);
+        pids[i] = startApp(producer.argv, logs[i]);
+    }
+
+    int ret = 0;
+    if (waitForFile(out, APP_START_TIMEOUT_MS) != 0)
+    {
+        fprintf(stderr, "[PIPELINE] ERROR: %s did not create %s\n", stitcher, out);
+        for (int c = aggregator + 1; c < total; c++)
+            pids[c] = -1;
+        ret = -1;
+    }
+    else
+    {
+        for (int c = aggregator + 1; c < total; c++)
+        {
+            // the stitcher may send a few more frames than one producer, e.g. when input 0 leaves first
+            AppArgs consumer = {0};
+            addString(&consumer, client);
+            addArg(&consumer, "%d", params->fps * params->duration * 2);
+            addString(&consumer, out);
+            addString(&consumer, "");
+            addString(&consumer, "0");
+            addArg(&consumer, "%d", params->deadline_ms);
+            if (params->mailbox)
+                addString(&consumer, "-b");
+            if (params->max_age > 0)
+            {
+                addString(&consumer, "-a");
+                addArg(&consumer, "%d", params->max_age);
+            }
+            if (params->decimation > 1)
+            {
+                addString(&consumer, "-e");
+                addArg(&consumer, "%d", params->decimation);
+            }
+            if (params->max_fps > 0)
+            {
+                addString(&consumer, "-f");
+                addArg(&consumer, "%d", params->max_fps);
+            }
+            if (params->metadata)
+                addString(&consumer, "-o");
+            pids[c] = startApp(consumer.argv, logs[c]);
+        }
+    }
+
+    // a stalled application must not hang the sweep
+    long long deadline_us = start + (params->duration + APP_EXIT_TIMEOUT_S) * 1000000LL;
+    int running = 0;
+    for (int i = 0; i < total; i++)
+        running += pids[i] > 0;
+    while (running > 0)
+    {
+        int status = 0;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WNOHANG, &usage);
+        if (pid <= 0)
+        {
+            if (nowUs() > deadline_us)
+            {
+                for (int i = 0; i < total; i++)
+                {
+                    if (pids[i] > 0)
+                        kill(pids[i], SIGKILL);
+                }
+                deadline_us = ~0ULL >> 1;
+                ret = -1;
+            }
+            usleep(10000);
+            continue;
+        }
+        for (int i = 0; i < total; i++)
+        {
+            if (pids[i] != pid)
+                continue;
+            PipeStats *stats = &results->stats[i];
+            stats->wall = (nowUs() - start) / 1e6;
+            stats->cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+                ret = -1;
+            pids[i] = 0;
+            running--;
+        }
+    }
+
+    for (int i = 0; i < total; i++)
+        readAppLog(logs[i], &results->stats[i]);
+    // a consumer misses the frames the stitcher sent which it neither received nor skipped on purpose;
+    // gaps are expected when subscribed to a lower rate
+    for (int c = aggregator + 1; c < total && !isSubscribed(params); c++)
+    {
+        PipeStats *consumer = &results->stats[c];
+        int missed = results->stats[aggregator].frames - consumer->frames - consumer->skipped;
+        if (missed > 0)
+            consumer->dropped = missed;
+    }
+    return ret;
+}
+
+static double getFps(PipeStats *stats)
+{
+    return stats->seconds > 0 ? stats->frames / stats->seconds : 0;
+}
+
+static double getCpuLoad(PipeStats *stats)
+{
+    double seconds = stats->wall > 0 ? stats->wall : stats->seconds;
+    return seconds > 0 ? stats->cpu * 100 / seconds : 0;
+}
+
+static void printReport(PipelineParams *params, PipeResults *results)
+{
+    static const char *roles[PIPE_ROLE_Max] = {"producer", "aggregator", "consumer"};
+    int total = params->producers + 1 + params->consumers;
+
+    printf("[PIPELINE] %d producer(s) -> 1 aggregator -> %d consumer(s), %dx%d@%dfps, %ds\n",
+           params->producers, params->consumers,
+           params->width, params->height, params->fps, params->duration);
+    printf("[PIPELINE] %-12s %8s %8s %8s %8s %8s %8s %10s %10s %10s\n",
+           "stage", "frames", "fps", "dropped", "skipped", "late", "cpu%", "p50(ms)", "p99(ms)", "max(ms)");
+    for (int i = 0; i < total; i++)
+    {
+        PipeStats *stats = &results->stats[i];
+        char stage[32];
+        snprintf(stage, sizeof(stage), "%s%d", roles[stats->role], stats->index);
+        printf("[PIPELINE] %-12s %8d %8.2f %8d %8d %8d %8.1f", stage,
+               stats->frames, getFps(stats), stats->dropped, stats->skipped, stats->late, getCpuLoad(stats));
+        if (stats->role == PIPE_ROLE_Consumer)
+            printf(" %10.2f %10.2f %10.2f\n", stats->lat_p50, stats->lat_p99, stats->lat_max);
+        else
+            printf(" %10s %10s %10s\n", "-", "-", "-");
+    }
+}
+
+static void printSweepHeader()
+{
+    printf("[PIPELINE] %3s %3s %9s %9s %9s %8s %8s %9s %9s %8s %s\n",
+           "N", "M", "prod fps", "aggr fps", "cons fps", "dropped", "late",
+           "p99(ms)", "max(ms)", "aggr cpu", "status");
+}
+
+static void printSweepRow(PipelineParams *params, PipeResults *results)
+{
+    PipeStats *aggregator = &results->stats[params->producers];
+    double prod_fps = 0, cons_fps = 0, p99 = 0, max = 0;
+    int dropped = 0, late = 0;
+    for (int i = 0; i < params->producers; i++)
+    {
+        prod_fps += getFps(&results->stats[i]);
+        dropped += results->stats[i].dropped;
+    }
+    prod_fps /= params->producers;
+    dropped += aggregator->dropped;
+    for (int i = 0; i < params->consumers; i++)
+    {
+        PipeStats *stats = &results->stats[params->producers + 1 + i];
+        if (i == 0 || getFps(stats) < cons_fps)
+            cons_fps = getFps(stats);
+        dropped += stats->dropped;
+        late += stats->late;
+        if (stats->lat_p99 > p99)
+            p99 = stats->lat_p99;
+        if (stats->lat_max > max)
+            max = stats->lat_max;
+    }
+
+    int keepup = cons_fps >= getExpectedFps(params) * 0.95 && dropped == 0;
+    printf("[PIPELINE] %3d %3d %9.2f %9.2f %9.2f %8d %8d %9.2f %9.2f %7.1f%% %s\n",
+           params->producers, params->consumers,
+           prod_fps, getFps(aggregator), cons_fps, dropped, late,
+           p99, max, getCpuLoad(aggregator), keepup ? "ok" : "FALLING BEHIND");
+}
+
+int main(int argc, char **argv) {
+    PipelineParams params;
+    static PipeResults results;
+
+    parseParams(argc, argv, &params);
+    if (checkParams(&params) != 0)
+    {
+        printUsage(argv[0]);
+        return 0;
+    }
+
+    if (params.sweep)
+    {
+        PipelineParams run = params;
+        printSweepHeader();
+        for (run.producers = 1; run.producers <= params.producers; run.producers++)
+        {
+            for (run.consumers = 1; run.consumers <= params.consumers; run.consumers++)
+            {
+                if (runApplications(&run, &results) != 0)
+                    fprintf(stderr, "[PIPELINE] ERROR: %dx%d topology did not complete\n",
+                            run.producers, run.consumers);
+                printSweepRow(&run, &results);
+            }
+        }
+    }
+    else
+    {
+        if (runApplications(&params, &results) != 0)
+            fprintf(stderr, "[PIPELINE] ERROR: pipeline did not complete\n");
+        printReport(&params, &results);
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -16,6 +16,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -24,14 +25,24 @@
 #include <pthread.h>
 #include <memory.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include "process_linker_types.h"
 #include "video_mem.h"
+#include "plink_kernels.h"
 
 #ifndef NULL
 #define NULL    ((void *)0)
 #endif
 
 #define NUM_OF_BUFFERS  5
+#define PREFETCH_FRAMES 2   // frames of the mapped input file read ahead
+#define MAX_FILE_SPAN   0xFFFFF000LL    // bytes of the input file the 32-bit offsets of -r can address
+#define PATTERN_SPEED   4   // pixels the test patterns move per frame, even
+#define PATTERN_SQUARE  64  // size of the squares of the checkerboard in pixels, even
+#define COUNTER_BITS    32  // of the frame number burned into the test patterns
+#define COUNTER_BLOCK   16  // size of the block of one bit in pixels
 #define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
                         } while (0)
 
@@ -40,10 +51,20 @@ typedef struct _ServerParams
     char *plinkname;
     char *inputfile;
     PlinkColorFormat format;
+    PlinkBayerPattern pattern;
     int width;
     int height;
     int stride;
     int frames;
+    int max_age;
+    int zerocopy;
+    int mapped;
+    int filebacked;
+    double fps;
+    int jitter;             // ms
+    int stall_period;       // frames
+    int stall;              // ms
+    int testpattern;        // -1: frames read from the input file
 } ServerParams;
 
 typedef struct _PlinkChannel
@@ -65,23 +86,138 @@ typedef struct _PictureBuffer
   int fd;
 } PictureBuffer;
 
+/* Rows of one plane, packed in the input file and padded to the stride in the buffer */
+typedef struct _FramePlane
+{
+    unsigned int offset;    // in the buffer
+    int rows;
+    int bytes;              // per row
+    int stride;             // of the buffer
+} FramePlane;
+
+/* Input file mapped in memory, see -m */
+typedef struct _MappedInput
+{
+    int fd;
+    unsigned char *data;
+    long long size;
+    long long frame_size;   // bytes of one frame in the file
+    long long next;         // offset of the next frame
+    int planes;
+    FramePlane plane[3];
+} MappedInput;
+
+/* Input file sent as the buffer of the frames, see -r */
+typedef struct _FileFrames
+{
+    int fd;
+    long long frame_size;
+    int frames;             // in the file, within MAX_FILE_SPAN
+    int next;
+} FileFrames;
+
+typedef enum _TestPattern
+{
+    TEST_PATTERN_Bars = 0,
+    TEST_PATTERN_Gradient,
+    TEST_PATTERN_Checkerboard,
+    TEST_PATTERN_Max
+} TestPattern;
+
+typedef enum _PatternComponent
+{
+    PATTERN_Y = 0,
+    PATTERN_UV,         // interleaved, one pair for 2 pixels
+    PATTERN_U,          // one sample for 2 pixels
+    PATTERN_V,
+    PATTERN_Bayer       // the color of the filter of each site
+} PatternComponent;
+
+/* One plane of the generated frames. Each row is copied from a template row wider than the plane,
+ * starting at an offset which moves with the frames. */
+typedef struct _PatternPlane
+{
+    PatternComponent component;
+    unsigned int offset;        // in the buffer
+    int rows;
+    int bytes;                  // per row
+    int stride;
+    int subsample;              // rows of pixels per row of the plane
+    int unit;                   // bytes per 2 pixels
+    unsigned char *row[2];      // templates of the even and the odd rows
+    unsigned char *counter[2];  // frame counter of the current frame, for the even and the odd rows
+} PatternPlane;
+
+/* Test pattern generator, see -g */
+typedef struct _PatternGenerator
+{
+    TestPattern pattern;
+    PlinkBayerPattern bayer;
+    int period;                 // pixels after which the pattern repeats horizontally, even
+    int shift;                  // 16-bit samples hold the 8-bit values shifted left by this, 0 for 8-bit samples
+    int bits;                   // of the frame counter, as many as fit in the width
+    int tile_width;             // tiled formats, 0 when linear
+    int tile_height;
+    unsigned char (*rgb)[3];    // colors of the pixels of a template or of the counter
+    unsigned char *line;        // 8-bit samples before they are widened
+    int planes;
+    PatternPlane plane[3];
+} PatternGenerator;
+
+/* Emission of the frames on an absolute schedule, see -t */
+typedef struct _Pacer
+{
+    int fd;                 // timerfd
+    long long start;        // schedule of the first frame, us of CLOCK_MONOTONIC
+    double period;          // us
+    unsigned int seed;      // of the jitter
+    long long scheduled;    // capture time of the current frame
+    long long emission;     // when the current frame is due, after jitter and stall
+    int frames;
+    int missed;             // frames sent more than a period late
+    long long late_sum;
+    long long late_max;
+    long long waited_sum;   // waiting for a free buffer
+    long long waited_max;
+} Pacer;
+
 void printUsage(char *name)
 {
     printf("usage: %s [options]\n"
            "\n"
            "  Available options:\n"
            "    -l      plink file name (default: /tmp/plink.test)\n"
-           "    -i      input YUV file name (mandatory)\n"
+           "    -i      input YUV file name (mandatory, unless -g)\n"
            "    -f      input color format (default: 3)\n"
            "                2 - I420\n"
            "                3 - NV12\n"
            "                4 - P010\n"
            "                14 - Bayer Raw 10bit\n"
            "                15 - Bayer Raw 12bit\n"
+           "    -p      Bayer pattern of Raw formats (default: 0)\n"
+           "                0 - RGGB\n"
+           "                1 - BGGR\n"
+           "                2 - GRBG\n"
+           "                3 - GBRG\n"
            "    -w      video width (mandatory)\n"
            "    -h      video height (mandatory)\n"
            "    -s      video buffer stride in bytes (default: video width)\n"
            "    -n      number of frames to send (default: 10)\n"
+           "    -a      drop frames older than this many ms at send time (default: 0, disabled);\n"
+           "            a frame is as old as the time since its schedule with -t, or since its read started\n"
+           "    -z      zero-copy: render into NV12 windows of buffers provided by the client, e.g. plinkstitcher -z\n"
+           "    -m      map the input file in memory and read ahead; its rows are not padded to the stride,\n"
+           "            and it is replayed from the start when all the frames are sent\n"
+           "    -r      send the frames straight from the input file, without copy and without video memory;\n"
+           "            the file is replayed from the start when all the frames are sent\n"
+           "    -t      send the frames at this frame rate on an absolute schedule (default: 0, as fast as buffers are returned)\n"
+           "    -j      pacing: delay each frame by a random time up to this many ms (default: 0)\n"
+           "    -d      pacing: delay every <n>th frame by <ms>, the next frames keep their schedule, as <n>,<ms>\n"
+           "    -g      generate a moving test pattern instead of reading the input file, with the frame number\n"
+           "            burned into the top and the bottom rows\n"
+           "                0 - color bars\n"
+           "                1 - gradient\n"
+           "                2 - checkerboard\n"
            "\n", name);
 }
 
@@ -92,6 +228,7 @@ void parseParams(int argc, char **argv, ServerParams *params)
     params->plinkname = "/tmp/plink.test";
     params->format = PLINK_COLOR_FormatYUV420SemiPlanar;
     params->frames = 10;
+    params->testpattern = -1;
     while (i < argc)
     {
         if (argv[i][0] != '-' || strlen(argv[i]) < 2)
@@ -121,6 +258,13 @@ void parseParams(int argc, char **argv, ServerParams *params)
                 params->format = atoi(argv[i++]);
             }
         }
+        else if (argv[i][1] == 'p')
+        {
+            if (++i < argc)
+            {
+                params->pattern = atoi(argv[i++]);
+            }
+        }
         else if (argv[i][1] == 'w')
         {
             if (++i < argc)
@@ -149,6 +293,57 @@ void parseParams(int argc, char **argv, ServerParams *params)
                 params->frames = atoi(argv[i++]);
             }
         }
+        else if (argv[i][1] == 'a')
+        {
+            if (++i < argc)
+            {
+                params->max_age = atoi(argv[i++]);
+            }
+        }
+        else if (argv[i][1] == 'z')
+        {
+            params->zerocopy = 1;
+            i++;
+        }
+        else if (argv[i][1] == 'm')
+        {
+            params->mapped = 1;
+            i++;
+        }
+        else if (argv[i][1] == 'r')
+        {
+            params->filebacked = 1;
+            i++;
+        }
+        else if (argv[i][1] == 'g')
+        {
+            if (++i < argc)
+            {
+                params->testpattern = atoi(argv[i++]);
+            }
+        }
+        else if (argv[i][1] == 't')
+        {
+            if (++i < argc)
+            {
+                params->fps = atof(argv[i++]);
+            }
+        }
+        else if (argv[i][1] == 'j')
+        {
+            if (++i < argc)
+            {
+                params->jitter = atoi(argv[i++]);
+            }
+        }
+        else if (argv[i][1] == 'd')
+        {
+            if (++i < argc)
+            {
+                if (sscanf(argv[i++], "%d,%d", &params->stall_period, &params->stall) != 2)
+                    params->stall_period = -1;
+            }
+        }
     }
 
     if ((params->format == PLINK_COLOR_FormatYUV420SemiPlanarP010 ||
@@ -167,12 +362,25 @@ void parseParams(int argc, char **argv, ServerParams *params)
 int checkParams(ServerParams *params)
 {
     if (params->plinkname == NULL ||
-        params->inputfile == NULL ||
+        (params->inputfile == NULL && params->testpattern < 0) ||
+        params->testpattern >= TEST_PATTERN_Max ||
         params->format == PLINK_COLOR_FormatUnused ||
+        params->pattern < 0 || params->pattern >= PLINK_BAYER_PATTERN_MAX ||
         params->width == 0 ||
         params->height == 0 ||
         params->stride == 0)
         return -1;
+    if (params->zerocopy &&
+        params->format != PLINK_COLOR_FormatYUV420SemiPlanar &&
+        params->format != PLINK_COLOR_FormatYUV420SemiPlanarP010 &&
+        params->format != PLINK_COLOR_FormatRawBayer10bit &&
+        params->format != PLINK_COLOR_FormatRawBayer12bit)
+        return -1;
+    if (params->zerocopy + params->mapped + params->filebacked + (params->testpattern >= 0) > 1)
+        return -1;
+    if (params->fps < 0 || params->jitter < 0 || params->stall_period < 0 || params->stall < 0 ||
+        (params->fps > 0 && params->zerocopy))
+        return -1;
     return 0;
 }
 
@@ -183,21 +391,31 @@ int getBufferSize(ServerParams *params)
     {
         case PLINK_COLOR_FormatYUV420Planar:
         case PLINK_COLOR_FormatYUV420SemiPlanar:
-            size = params->stride * params->height * 3 / 2;
-            break;
         case PLINK_COLOR_FormatYUV420SemiPlanarP010:
-            size = params->stride * params->height * 3;
+            size = params->stride * params->height * 3 / 2;
             break;
         case PLINK_COLOR_FormatRawBayer10bit:
         case PLINK_COLOR_FormatRawBayer12bit:
             size = params->stride * params->height;
             break;
+        case PLINK_COLOR_FormatYUV420SemiPlanarTile4x4:
+        case PLINK_COLOR_FormatYUV420SemiPlanarTile8x4:
+        case PLINK_COLOR_FormatYUV420SemiPlanarTile64x32:
+        {
+            // both planes are padded to whole rows of tiles
+            int tile_height = params->format == PLINK_COLOR_FormatYUV420SemiPlanarTile64x32 ? 32 : 4;
+            int rows = (params->height + tile_height - 1) / tile_height * tile_height;
+            int rows_uv = (params->height / 2 + tile_height - 1) / tile_height * tile_height;
+            size = params->stride * (rows + rows_uv);
+            break;
+        }
         default:
             size = 0;
     }
     return size;
 }
 
+/* Without video memory (vmem is NULL) the buffers are shared memory of memfd_create, which the clients map with mmap */
 void AllocateBuffers(PictureBuffer picbuffers[NUM_OF_BUFFERS], unsigned int size, void *vmem)
 {
     unsigned int buffer_size = (size + 0xFFF) & ~0xFFF;
@@ -207,6 +425,19 @@ void AllocateBuffers(PictureBuffer picbuffers[NUM_OF_BUFFERS], unsigned int size
     for (int i = 0; i < NUM_OF_BUFFERS; i++)
     {
         params.fd = 0;
+        if (vmem == NULL)
+        {
+            int fd = memfd_create("plinkserver", MFD_CLOEXEC);
+            if (fd < 0 || ftruncate(fd, buffer_size) != 0)
+                errExit("memfd_create");
+            picbuffers[i].virtual_address = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (picbuffers[i].virtual_address == MAP_FAILED)
+                errExit("mmap");
+            picbuffers[i].bus_address = 0;
+            picbuffers[i].size = buffer_size;
+            picbuffers[i].fd = fd;
+            continue;
+        }
         VMEM_allocate(vmem, &params);
         VMEM_mmap(vmem, &params);
         VMEM_export(vmem, &params);
@@ -229,7 +460,10 @@ void FreeBuffers(PictureBuffer picbuffers[NUM_OF_BUFFERS], void *vmem)
         params.size = picbuffers[i].size;
         params.vir_address = picbuffers[i].virtual_address;
         params.phy_address = picbuffers[i].bus_address;
-        VMEM_free(vmem, &params);
+        if (vmem == NULL)
+            munmap(params.vir_address, params.size);
+        else
+            VMEM_free(vmem, &params);
     }
 }
 
@@ -243,6 +477,555 @@ void ProcessOneFrame(void *virtual_address, FILE *fp, int size)
     }
 }
 
+/* Planes of a frame in the buffer, tiled formats are copied as a whole */
+int getFramePlanes(ServerParams *params, FramePlane plane[3])
+{
+    int height = params->height;
+    int stride = params->stride;
+    int bytes = params->width;
+    switch (params->format)
+    {
+        case PLINK_COLOR_FormatYUV420Planar:
+            plane[0] = (FramePlane){ 0, height, bytes, stride };
+            plane[1] = (FramePlane){ stride * height, height / 2, bytes / 2, stride / 2 };
+            plane[2] = (FramePlane){ stride * height + stride / 2 * (height / 2), height / 2, bytes / 2, stride / 2 };
+            return 3;
+        case PLINK_COLOR_FormatYUV420SemiPlanarP010:
+            bytes *= 2;
+            // fall through
+        case PLINK_COLOR_FormatYUV420SemiPlanar:
+            plane[0] = (FramePlane){ 0, height, bytes, stride };
+            plane[1] = (FramePlane){ stride * height, height / 2, bytes, stride };
+            return 2;
+        case PLINK_COLOR_FormatRawBayer10bit:
+        case PLINK_COLOR_FormatRawBayer12bit:
+            plane[0] = (FramePlane){ 0, height, bytes * 2, stride };
+            return 1;
+        default:
+            plane[0] = (FramePlane){ 0, 1, getBufferSize(params), 0 };
+            return 1;
+    }
+}
+
+int MapInputFile(MappedInput *input, ServerParams *params)
+{
+    struct stat st;
+    memset(input, 0, sizeof(*input));
+    input->fd = open(params->inputfile, O_RDONLY);
+    if (input->fd < 0 || fstat(input->fd, &st) != 0)
+        return -1;
+
+    input->planes = getFramePlanes(params, input->plane);
+    for (int i = 0; i < input->planes; i++)
+        input->frame_size += (long long)input->plane[i].rows * input->plane[i].bytes;
+    input->size = st.st_size;
+    if (input->frame_size == 0 || input->size < input->frame_size)
+    {
+        fprintf(stderr, "[SERVER] ERROR: %s is smaller than one frame of %lld bytes\n",
+                params->inputfile, input->frame_size);
+        return -1;
+    }
+
+    input->data = mmap(NULL, input->size, PROT_READ, MAP_SHARED, input->fd, 0);
+    if (input->data == MAP_FAILED)
+    {
+        input->data = NULL;
+        return -1;
+    }
+    printf("[SERVER] Mapped %lld frames of %lld bytes from %s\n",
+            input->size / input->frame_size, input->frame_size, params->inputfile);
+    return 0;
+}
+
+void UnmapInputFile(MappedInput *input)
+{
+    if (input->data != NULL)
+        munmap(input->data, input->size);
+    if (input->fd >= 0)
+        close(input->fd);
+}
+
+/* Offset of the frame after the one at offset, back to the first frame at the end of the file */
+long long nextFrameOffset(MappedInput *input, long long offset)
+{
+    offset += input->frame_size;
+    return offset + input->frame_size <= input->size ? offset : 0;
+}
+
+/* Ask the kernel to read the next frames into the page cache, in the background */
+void PrefetchFrames(MappedInput *input)
+{
+    long long offset = input->next;
+    for (int i = 0; i < PREFETCH_FRAMES; i++)
+    {
+        long long start = offset & ~4095LL;
+        madvise(input->data + start, offset + input->frame_size - start, MADV_WILLNEED);
+        offset = nextFrameOffset(input, offset);
+    }
+}
+
+/* Copy the next frame of the mapped file, padding the rows to the stride of the buffer */
+void CopyOneFrame(void *virtual_address, MappedInput *input)
+{
+    const KernelOps *kernels = KERNEL_get();
+    const unsigned char *src = input->data + input->next;
+    for (int i = 0; i < input->planes; i++)
+    {
+        FramePlane *plane = &input->plane[i];
+        unsigned char *dst = (unsigned char *)virtual_address + plane->offset;
+        for (int h = 0; h < plane->rows; h++)
+        {
+            kernels->streamRow(dst, src, plane->bytes);
+            dst += plane->stride;
+            src += plane->bytes;
+        }
+    }
+    input->next = nextFrameOffset(input, input->next);
+    PrefetchFrames(input);
+}
+
+int OpenFileFrames(FileFrames *file, ServerParams *params)
+{
+    struct stat st;
+    memset(file, 0, sizeof(*file));
+    file->fd = open(params->inputfile, O_RDONLY);
+    if (file->fd < 0 || fstat(file->fd, &st) != 0)
+        return -1;
+
+    // frames are laid out in the file as in a buffer
+    file->frame_size = getBufferSize(params);
+    long long span = st.st_size < MAX_FILE_SPAN ? st.st_size : MAX_FILE_SPAN;
+    file->frames = file->frame_size > 0 ? span / file->frame_size : 0;
+    if (file->frames == 0)
+    {
+        fprintf(stderr, "[SERVER] ERROR: %s is smaller than one frame of %lld bytes\n",
+                params->inputfile, file->frame_size);
+        return -1;
+    }
+    printf("[SERVER] Sending %d frames of %lld bytes from %s\n", file->frames, file->frame_size, params->inputfile);
+    return 0;
+}
+
+/* Offset of the next frame in the file, whose following frames are read ahead */
+unsigned int NextFileFrame(FileFrames *file)
+{
+    unsigned int offset = file->next * file->frame_size;
+    file->next = (file->next + 1) % file->frames;
+    for (int i = 0, next = file->next; i < PREFETCH_FRAMES; i++, next = (next + 1) % file->frames)
+        posix_fadvise(file->fd, next * file->frame_size, file->frame_size, POSIX_FADV_WILLNEED);
+    return offset;
+}
+
+/* Point the descriptor at the frame in the file, there is no bus address */
+void setYuvOffsets(PlinkYuvInfo *info, ServerParams *params, unsigned int offset)
+{
+    FramePlane plane[3];
+    int planes = getFramePlanes(params, plane);
+    info->offset_y = offset;
+    info->offset_u = planes > 1 ? offset + plane[1].offset : 0;
+    info->offset_v = planes > 2 ? offset + plane[2].offset : 0;
+    info->bus_address_y = 0;
+    info->bus_address_u = 0;
+    info->bus_address_v = 0;
+}
+
+/* Colors of the test pattern, x from 0 to the period */
+void getPatternColor(PatternGenerator *gen, int x, unsigned char rgb[3])
+{
+    switch (gen->pattern)
+    {
+        case TEST_PATTERN_Bars:
+        {
+            // white, yellow, cyan, green, magenta, red, blue, black
+            int bar = x * 8 / gen->period;
+            rgb[0] = bar & 2 ? 0 : 255;
+            rgb[1] = bar & 4 ? 0 : 255;
+            rgb[2] = bar & 1 ? 0 : 255;
+            break;
+        }
+        case TEST_PATTERN_Gradient:
+            rgb[0] = x;
+            rgb[1] = 255 - x;
+            rgb[2] = 128;
+            break;
+        default:
+            rgb[0] = rgb[1] = rgb[2] = (x / PATTERN_SQUARE) & 1 ? 255 : 0;
+    }
+}
+
+/* Offset of the row in the templates, in pixels, even to keep the chroma pairs and the Bayer sites */
+int getPatternOffset(PatternGenerator *gen, int y, int frame)
+{
+    int move = frame * PATTERN_SPEED;
+    switch (gen->pattern)
+    {
+        case TEST_PATTERN_Bars:
+            return move % gen->period;
+        case TEST_PATTERN_Gradient:
+            return (y / 2 * 2 + move) % gen->period;
+        default:
+            return ((y / PATTERN_SQUARE) % 2 * PATTERN_SQUARE + move) % gen->period;
+    }
+}
+
+/* Samples of the plane for the count pixels of gen->rgb, count even, in BT.601 limited range */
+void fillTemplate(PatternGenerator *gen, PatternPlane *plane, unsigned char *dst, int count, int parity)
+{
+    // color of the sites of each Bayer pattern, 0 red, 1 green, 2 blue
+    static const int sites[PLINK_BAYER_PATTERN_MAX][2][2] =
+        { { {0, 1}, {1, 2} }, { {2, 1}, {1, 0} }, { {1, 0}, {2, 1} }, { {1, 2}, {0, 1} } };
+    unsigned char *out = gen->shift > 0 ? gen->line : dst;
+    int samples = 0;
+    for (int i = 0; i < count; i += 2)
+    {
+        const unsigned char *c = gen->rgb[i];
+        switch (plane->component)
+        {
+            case PATTERN_Y:
+                for (int k = 0; k < 2; k++, c = gen->rgb[i + 1])
+                    out[samples++] = ((66 * c[0] + 129 * c[1] + 25 * c[2] + 128) >> 8) + 16;
+                break;
+            case PATTERN_UV:
+                out[samples++] = ((-38 * c[0] - 74 * c[1] + 112 * c[2] + 128) >> 8) + 128;
+                out[samples++] = ((112 * c[0] - 94 * c[1] - 18 * c[2] + 128) >> 8) + 128;
+                break;
+            case PATTERN_U:
+                out[samples++] = ((-38 * c[0] - 74 * c[1] + 112 * c[2] + 128) >> 8) + 128;
+                break;
+            case PATTERN_V:
+                out[samples++] = ((112 * c[0] - 94 * c[1] - 18 * c[2] + 128) >> 8) + 128;
+                break;
+            case PATTERN_Bayer:
+                out[samples++] = c[sites[gen->bayer][parity][0]];
+                out[samples++] = gen->rgb[i + 1][sites[gen->bayer][parity][1]];
+                break;
+        }
+    }
+    if (gen->shift > 0)
+        KERNEL_get()->unpack8to16((unsigned short *)dst, gen->line, samples, gen->shift);
+}
+
+int InitGenerator(PatternGenerator *gen, ServerParams *params)
+{
+    FramePlane frame[3];
+    memset(gen, 0, sizeof(*gen));
+    gen->pattern = params->testpattern;
+    gen->bayer = params->pattern;
+    gen->period = gen->pattern == TEST_PATTERN_Bars ? (params->width + 1) & ~1 :
+                  gen->pattern == TEST_PATTERN_Gradient ? 256 : 2 * PATTERN_SQUARE;
+    gen->bits = params->width / COUNTER_BLOCK < COUNTER_BITS ? params->width / COUNTER_BLOCK : COUNTER_BITS;
+    gen->planes = getFramePlanes(params, frame);
+
+    switch (params->format)
+    {
+        case PLINK_COLOR_FormatYUV420Planar:
+            gen->plane[0] = (PatternPlane){ PATTERN_Y, .subsample = 1, .unit = 2 };
+            gen->plane[1] = (PatternPlane){ PATTERN_U, .subsample = 2, .unit = 1 };
+            gen->plane[2] = (PatternPlane){ PATTERN_V, .subsample = 2, .unit = 1 };
+            break;
+        case PLINK_COLOR_FormatYUV420SemiPlanar:
+        case PLINK_COLOR_FormatYUV420SemiPlanarP010:
+            gen->shift = params->format == PLINK_COLOR_FormatYUV420SemiPlanarP010 ? 2 : 0;
+            gen->plane[0] = (PatternPlane){ PATTERN_Y, .subsample = 1, .unit = gen->shift ? 4 : 2 };
+            gen->plane[1] = (PatternPlane){ PATTERN_UV, .subsample = 2, .unit = gen->shift ? 4 : 2 };
+            break;
+        case PLINK_COLOR_FormatRawBayer10bit:
+        case PLINK_COLOR_FormatRawBayer12bit:
+            gen->shift = 4;
+            gen->plane[0] = (PatternPlane){ PATTERN_Bayer, .subsample = 1, .unit = 4 };
+            break;
+        case PLINK_COLOR_FormatYUV420SemiPlanarTile4x4:
+        case PLINK_COLOR_FormatYUV420SemiPlanarTile8x4:
+        case PLINK_COLOR_FormatYUV420SemiPlanarTile64x32:
+        {
+            // linear rows stored tile by tile, the planes are padded to whole rows of tiles
+            gen->tile_width = params->format == PLINK_COLOR_FormatYUV420SemiPlanarTile4x4 ? 4 :
+                              params->format == PLINK_COLOR_FormatYUV420SemiPlanarTile8x4 ? 8 : 64;
+            gen->tile_height = params->format == PLINK_COLOR_FormatYUV420SemiPlanarTile64x32 ? 32 : 4;
+            int rows = (params->height + gen->tile_height - 1) / gen->tile_height * gen->tile_height;
+            gen->planes = 2;
+            frame[0] = (FramePlane){ 0, params->height, params->width, params->stride };
+            frame[1] = (FramePlane){ params->stride * rows, params->height / 2, params->width, params->stride };
+            gen->plane[0] = (PatternPlane){ PATTERN_Y, .subsample = 1, .unit = 2 };
+            gen->plane[1] = (PatternPlane){ PATTERN_UV, .subsample = 2, .unit = 2 };
+            break;
+        }
+        default:
+            return -1;
+    }
+
+    // templates: the width plus one period, whole tiles included
+    int count = (params->width + 1) / 2 * 2 + gen->period;
+    gen->rgb = malloc(count * sizeof(gen->rgb[0]));
+    gen->line = malloc(count);
+    if (gen->rgb == NULL || gen->line == NULL)
+        return -1;
+    for (int i = 0; i < count; i++)
+        getPatternColor(gen, i % gen->period, gen->rgb[i]);
+
+    for (int p = 0; p < gen->planes; p++)
+    {
+        PatternPlane *plane = &gen->plane[p];
+        plane->offset = frame[p].offset;
+        plane->rows = frame[p].rows;
+        plane->bytes = frame[p].bytes;
+        plane->stride = frame[p].stride;
+        int parities = plane->component == PATTERN_Bayer ? 2 : 1;
+        for (int k = 0; k < parities; k++)
+        {
+            plane->row[k] = malloc(count / 2 * plane->unit);
+            plane->counter[k] = malloc(COUNTER_BITS * COUNTER_BLOCK / 2 * plane->unit);
+            if (plane->row[k] == NULL || plane->counter[k] == NULL)
+                return -1;
+            fillTemplate(gen, plane, plane->row[k], count, k);
+        }
+        if (parities == 1)
+        {
+            plane->row[1] = plane->row[0];
+            plane->counter[1] = plane->counter[0];
+        }
+    }
+    return 0;
+}
+
+void FreeGenerator(PatternGenerator *gen)
+{
+    for (int p = 0; p < gen->planes; p++)
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            if (k == 0 || gen->plane[p].row[1] != gen->plane[p].row[0])
+            {
+                free(gen->plane[p].row[k]);
+                free(gen->plane[p].counter[k]);
+            }
+        }
+    }
+    free(gen->rgb);
+    free(gen->line);
+}
+
+/* Store count bytes of one row of the plane, tile by tile in tiled formats */
+void storePatternRow(PatternGenerator *gen, PatternPlane *plane, unsigned char *base, int row,
+                     const unsigned char *src, int count)
+{
+    unsigned char *dst = base + plane->offset;
+    if (gen->tile_width == 0)
+    {
+        KERNEL_get()->streamRow(dst + row * plane->stride, src, count);
+        return;
+    }
+    int tile_width = gen->tile_width;
+    int tile_size = tile_width * gen->tile_height;
+    int whole = count / tile_width * tile_width;
+    int x = 0;
+    dst += (row / gen->tile_height) * plane->stride * gen->tile_height + (row % gen->tile_height) * tile_width;
+    // copies of a constant size are inlined
+    if (tile_width == 4)
+        for (; x < whole; x += 4, dst += tile_size)
+            memcpy(dst, src + x, 4);
+    else if (tile_width == 8)
+        for (; x < whole; x += 8, dst += tile_size)
+            memcpy(dst, src + x, 8);
+    else
+        for (; x < whole; x += tile_width, dst += tile_size)
+            memcpy(dst, src + x, tile_width);
+    memcpy(dst, src + x, count - x);
+}
+
+/* Generate the frame: the moving pattern, and the frame number in the first and the last
+ * COUNTER_BLOCK rows, bit i (from the lowest) as a block at x = i * COUNTER_BLOCK, white for 1, black for 0.
+ * A consumer reading different numbers at the top and the bottom got a torn frame. */
+void GenerateOneFrame(void *virtual_address, PatternGenerator *gen, unsigned int frame)
+{
+    int counter = gen->bits * COUNTER_BLOCK;
+    for (int i = 0; i < counter; i++)
+        memset(gen->rgb[i], (frame >> (i / COUNTER_BLOCK)) & 1 ? 255 : 0, 3);
+
+    for (int p = 0; p < gen->planes; p++)
+    {
+        PatternPlane *plane = &gen->plane[p];
+        fillTemplate(gen, plane, plane->counter[0], counter, 0);
+        if (plane->counter[1] != plane->counter[0])
+            fillTemplate(gen, plane, plane->counter[1], counter, 1);
+
+        int counter_rows = COUNTER_BLOCK / plane->subsample;
+        for (int r = 0; r < plane->rows; r++)
+        {
+            int y = r * plane->subsample;
+            int offset = getPatternOffset(gen, y, frame);
+            storePatternRow(gen, plane, virtual_address, r, plane->row[y & 1] + offset / 2 * plane->unit, plane->bytes);
+            if (r < counter_rows || r >= plane->rows - counter_rows)
+                storePatternRow(gen, plane, virtual_address, r, plane->counter[y & 1], counter / 2 * plane->unit);
+        }
+    }
+}
+
+long long getTimeUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int InitPacer(Pacer *pacer, ServerParams *params)
+{
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (pacer->fd < 0)
+        return -1;
+    pacer->period = 1000000.0 / params->fps;
+    pacer->seed = 1;
+    return 0;
+}
+
+/* Sleep until the frame is due. The schedule starts with the first frame and never drifts:
+ * a late frame is sent at once, the next ones are due at their own time. A frame delayed by the
+ * jitter or a stall holds back the following ones, which are then due right after it.
+ * Returns how late the frame is sent. */
+long long WaitForSchedule(Pacer *pacer, ServerParams *params, int frame)
+{
+    if (frame == 0)
+        pacer->start = getTimeUs();
+    pacer->scheduled = pacer->start + (long long)(frame * pacer->period);
+    long long emission = pacer->scheduled;
+    if (params->jitter > 0)
+        emission += rand_r(&pacer->seed) % (params->jitter * 1000 + 1);
+    if (params->stall_period > 0 && frame % params->stall_period == params->stall_period - 1)
+        emission += params->stall * 1000LL;
+    if (emission > pacer->emission)
+        pacer->emission = emission;
+
+    struct itimerspec due = {{0, 0}, {pacer->emission / 1000000, pacer->emission % 1000000 * 1000}};
+    unsigned long long expirations;
+    timerfd_settime(pacer->fd, TFD_TIMER_ABSTIME, &due, NULL);
+    while (read(pacer->fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR)
+        ;
+
+    long long late = getTimeUs() - pacer->emission;
+    pacer->frames++;
+    pacer->late_sum += late;
+    if (late > pacer->late_max)
+        pacer->late_max = late;
+    if (late > pacer->period)
+        pacer->missed++;
+    return late;
+}
+
+void ClosePacer(Pacer *pacer, ServerParams *params)
+{
+    if (pacer->frames > 0)
+    {
+        printf("[SERVER] Paced %d frames at %.2f fps: late by %lld us on average, %lld us at most, %d frames by more than a period\n",
+                pacer->frames, params->fps, pacer->late_sum / pacer->frames, pacer->late_max, pacer->missed);
+        printf("[SERVER] Waited for a free buffer %lld us on average, %lld us at most\n",
+                pacer->waited_sum / pacer->frames, pacer->waited_max);
+    }
+    close(pacer->fd);
+}
+
+/* Read rows of the input file into an NV12 window, converting 16-bit samples to 8-bit */
+void RenderRows(void *dst, int dst_stride, int rows, int width, FILE *fp, ServerParams *params, int shift, void *line)
+{
+    const KernelOps *kernels = KERNEL_get();
+    for (int h = 0; h < rows; h++)
+    {
+        if (shift == 0 && fread(dst, width, 1, fp) == 1)
+            fseek(fp, params->stride - width, SEEK_CUR);
+        else if (shift > 0 && fread(line, params->stride, 1, fp) == 1)
+            kernels->pack16to8(dst, line, width, shift);
+        dst += dst_stride;
+    }
+}
+
+/* Zero-copy: render one frame straight into the window of the client buffer */
+void RenderOneFrame(void *base, PlinkYuvInfo *win, FILE *fp, ServerParams *params, void *line)
+{
+    int width = (int)win->pic_width;
+    int height = (int)win->pic_height;
+    if (width > params->width)
+        width = params->width;
+    if (height > params->height)
+        height = params->height;
+    long frame_start = ftell(fp);
+    int shift = 0;
+
+    if (params->format == PLINK_COLOR_FormatYUV420SemiPlanarP010)
+        shift = 2;
+    else if (params->format == PLINK_COLOR_FormatRawBayer10bit ||
+             params->format == PLINK_COLOR_FormatRawBayer12bit)
+        shift = 4;
+
+    long luma_size = (long)params->stride * params->height;
+    RenderRows(base + win->offset_y, win->stride_y, height, width, fp, params, shift, line);
+    if (params->format == PLINK_COLOR_FormatYUV420SemiPlanar ||
+        params->format == PLINK_COLOR_FormatYUV420SemiPlanarP010)
+    {
+        fseek(fp, frame_start + luma_size, SEEK_SET);
+        RenderRows(base + win->offset_u, win->stride_u, height / 2, width, fp, params, shift, line);
+        fseek(fp, frame_start + luma_size * 3 / 2, SEEK_SET);
+    }
+    else // no chroma
+    {
+        for (int h = 0; h < height / 2; h++)
+            memset(base + win->offset_u + h * win->stride_u, 0x80, width);
+        fseek(fp, frame_start + luma_size, SEEK_SET);
+    }
+}
+
+/* Zero-copy: wait for a window from the client, render into it and hand it back */
+int RenderToClient(PlinkHandle plink, PlinkChannel *channel, FILE *fp, ServerParams *params, void *vmem, void *line)
+{
+    PlinkStatus sts = PLINK_recv_ex(plink, channel->id, &channel->pkt, 60000);
+    if (sts != PLINK_STATUS_OK && sts != PLINK_STATUS_MORE_DATA)
+        return -1;
+
+    int rendered = 0;
+    PlinkPacket *pkt = &channel->pkt;
+    for (int i = 0; i < pkt->num; i++)
+    {
+        PlinkDescHdr *hdr = (PlinkDescHdr *)(pkt->list[i]);
+        if (hdr->type == PLINK_TYPE_MESSAGE && ((PlinkMsg *)hdr)->msg == PLINK_EXIT_CODE)
+            channel->exit = 1;
+        if (hdr->type != PLINK_TYPE_2D_YUV || pkt->fd == PLINK_INVALID_FD)
+            continue;
+
+        PlinkYuvInfo *win = (PlinkYuvInfo *)hdr;
+        VmemParams params_vmem;
+        memset(&params_vmem, 0, sizeof(params_vmem));
+        params_vmem.fd = pkt->fd;
+        if (win->format == PLINK_COLOR_FormatYUV420SemiPlanar &&
+            VMEM_import(vmem, &params_vmem) == VMEM_STATUS_OK &&
+            VMEM_mmap(vmem, &params_vmem) == VMEM_STATUS_OK)
+        {
+            RenderOneFrame(params_vmem.vir_address, win, fp, params, line);
+            VMEM_release(vmem, &params_vmem);
+            printf("[SERVER] Rendered frame into window %d: %dx%d at offset %d/%d, stride %d\n",
+                    win->header.id, win->pic_width, win->pic_height,
+                    win->offset_y, win->offset_u, win->stride_y);
+        }
+        else
+            fprintf(stderr, "[SERVER] ERROR: Failed to map window %d\n", win->header.id);
+        close(pkt->fd);
+
+        // tell the client the window is filled
+        PlinkMsg msg;
+        PlinkPacket reply = {0};
+        msg.header.type = PLINK_TYPE_MESSAGE;
+        msg.header.size = DATA_SIZE(PlinkMsg);
+        msg.header.id = 0;
+        msg.msg = win->header.id;
+        reply.list[0] = &msg;
+        reply.num = 1;
+        reply.fd = PLINK_INVALID_FD;
+        PLINK_send(plink, channel->id, &reply);
+        rendered++;
+        break;
+    }
+
+    return rendered;
+}
+
 void constructYuvInfo(PlinkYuvInfo *info, ServerParams *params, unsigned int bus_address, int id)
 {
     int size_y = params->width * params->stride;
@@ -277,12 +1060,24 @@ void constructRawInfo(PlinkRawInfo *info, ServerParams *params, unsigned int bus
     info->header.id = id + 1;
 
     info->format = params->format;
+    info->pattern = params->pattern;
     info->bus_address = bus_address;
     info->img_width = params->width;
     info->img_height = params->height;
     info->stride = params->stride;
 }
 
+void constructTimeInfo(PlinkTimeInfo *info, long long capture_us)
+{
+    info->header.type = PLINK_TYPE_TIME;
+    info->header.size = DATA_SIZE(*info);
+    info->header.id = 0;
+
+    info->type = PLINK_TIME_CAPTURE;
+    info->seconds = capture_us / 1000000;
+    info->useconds = capture_us % 1000000;
+}
+
 int getBufferCount(PlinkPacket *pkt)
 {
     int ret = 0;
@@ -322,6 +1117,16 @@ void retreiveSentBuffers(PlinkHandle plink, PlinkChannel *channel)
 }
 
 
+/* Why PLINK_send returned PLINK_STATUS_DROPPED, from the statistics of the channel */
+static const char *getDropReason(PlinkStats *before, PlinkStats *after)
+{
+    if (after->dropped > before->dropped)
+        return "older than the max age";
+    if (after->decimated > before->decimated)
+        return "filtered by the subscription of the client";
+    return "sent without buffer, the client subscribed to metadata only";
+}
+
 int main(int argc, char **argv) {
     PlinkStatus sts = PLINK_STATUS_OK;
     ServerParams params;
@@ -329,6 +1134,7 @@ int main(int argc, char **argv) {
     PlinkHandle plink = NULL;
     PlinkYuvInfo pic = {0};
     PlinkRawInfo img = {0};
+    PlinkTimeInfo time = {0};
     PlinkMsg msg;
 
     parseParams(argc, argv, &params);
@@ -338,13 +1144,23 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    FILE *fp = fopen(params.inputfile, "rb");
-    if (fp == NULL)
-        errExit("fopen");
+    FILE *fp = NULL;
+    if (params.testpattern < 0)
+    {
+        fp = fopen(params.inputfile, "rb");
+        if (fp == NULL)
+            errExit("fopen");
+    }
 
     void *vmem = NULL;
-    if (VMEM_create(&vmem) != VMEM_STATUS_OK)
-        errExit("Failed to create VMEM.");
+    if (params.filebacked == 0 && VMEM_create(&vmem) != VMEM_STATUS_OK)
+    {
+        // the client windows of zero-copy mode can only be imported as video memory
+        if (params.zerocopy)
+            errExit("Failed to create VMEM.");
+        vmem = NULL;
+        printf("[SERVER] No video memory, buffers are allocated with memfd\n");
+    }
 
     int width = params.width;
     int height = params.height;
@@ -354,30 +1170,83 @@ int main(int argc, char **argv) {
     if (size == 0)
         errExit("Wrong format or wrong resolution.");
     PictureBuffer picbuffers[NUM_OF_BUFFERS];
-    AllocateBuffers(picbuffers, size, vmem);
+    if (params.filebacked == 0)
+        AllocateBuffers(picbuffers, size, vmem);
 
     sts = PLINK_create(&plink, params.plinkname, PLINK_MODE_SERVER);
 
     memset(&channel[0], 0, sizeof(channel[0]));
     channel[0].available_bufs = NUM_OF_BUFFERS;
     sts = PLINK_connect(plink, &channel[0].id);
+    if (params.max_age > 0)
+        PLINK_setOption(plink, channel[0].id, PLINK_OPTION_MAX_AGE, params.max_age);
+
+    MappedInput input = { .fd = -1 };
+    if (params.mapped)
+    {
+        if (MapInputFile(&input, &params) != 0)
+            errExit("Failed to map the input file.");
+        PrefetchFrames(&input);
+    }
+    FileFrames file = { .fd = -1 };
+    if (params.filebacked && OpenFileFrames(&file, &params) != 0)
+        errExit("Failed to open the input file.");
+    PatternGenerator generator = { .planes = 0 };
+    if (params.testpattern >= 0 && InitGenerator(&generator, &params) != 0)
+        errExit("Failed to create the test pattern generator.");
+    Pacer pacer = { .fd = -1 };
+    if (params.fps > 0 && InitPacer(&pacer, &params) != 0)
+        errExit("Failed to create the timer.");
+    long long waited = 0;
+    int sent = 0;
+    int dropped = 0;
+    long long first_us = 0;
+    long long last_us = 0;
 
     int frmcnt = 0;
+    if (params.zerocopy)
+    {
+        // no buffer of our own is sent, the client provides the windows to render into
+        void *line = malloc(params.stride);
+        while (channel[0].exit == 0 && frmcnt < frames)
+        {
+            int rendered = RenderToClient(plink, &channel[0], fp, &params, vmem, line);
+            if (rendered < 0)
+                break;
+            frmcnt += rendered;
+        }
+        free(line);
+        goto cleanup;
+    }
+
     do {
         int sendid = channel[0].sendid;
-        ProcessOneFrame(picbuffers[sendid].virtual_address, fp, size);
+        unsigned int offset = 0;
+        // without a schedule the frame is captured when its buffer is acquired, so its age includes the read
+        long long capture_us = getTimeUs();
+        if (params.filebacked)
+            offset = NextFileFrame(&file);
+        else if (params.mapped)
+            CopyOneFrame(picbuffers[sendid].virtual_address, &input);
+        else if (params.testpattern >= 0)
+            GenerateOneFrame(picbuffers[sendid].virtual_address, &generator, frmcnt);
+        else
+            ProcessOneFrame(picbuffers[sendid].virtual_address, fp, size);
         if (params.format == PLINK_COLOR_FormatRawBayer8bit ||
             params.format == PLINK_COLOR_FormatRawBayer10bit ||
             params.format == PLINK_COLOR_FormatRawBayer12bit)
         {
-            constructRawInfo(&img, &params, picbuffers[sendid].bus_address, sendid);
+            constructRawInfo(&img, &params, params.filebacked ? 0 : picbuffers[sendid].bus_address, sendid);
+            img.offset = offset;
             printf("[SERVER] Processed frame %d 0x%010llx: %dx%d, stride %d\n", 
                     sendid, img.bus_address, img.img_width, img.img_height, img.stride);
             channel[0].pkt.list[0] = &img;
         }
         else // YUV
         {
-            constructYuvInfo(&pic, &params, picbuffers[sendid].bus_address, sendid);
+            constructYuvInfo(&pic, &params, params.filebacked ? 0 : picbuffers[sendid].bus_address, sendid);
+            if (params.filebacked)
+                setYuvOffsets(&pic, &params, offset);
             printf("[SERVER] Processed frame %d 0x%010llx: %dx%d, stride = luma %d, chroma %d\n", 
                     sendid, pic.bus_address_y, 
                     pic.pic_width, pic.pic_height,
@@ -385,17 +1254,48 @@ int main(int argc, char **argv) {
             channel[0].pkt.list[0] = &pic;
         }
 
-        channel[0].pkt.num = 1;
-        channel[0].pkt.fd = picbuffers[sendid].fd;
+        if (params.fps > 0)
+        {
+            // the frame is stamped with its scheduled capture time, whatever the delays
+            long long late = WaitForSchedule(&pacer, &params, frmcnt);
+            capture_us = pacer.scheduled;
+            pacer.waited_sum += waited;
+            if (waited > pacer.waited_max)
+                pacer.waited_max = waited;
+            printf("[SERVER] Frame %d scheduled at %lld us, due at %lld us: sent %lld us late, waited %lld us for a buffer\n",
+                    frmcnt, pacer.scheduled - pacer.start, pacer.emission - pacer.start, late, waited);
+        }
+        constructTimeInfo(&time, capture_us);
+        channel[0].pkt.list[1] = &time;
+        channel[0].pkt.num = 2;
+        channel[0].pkt.fd = params.filebacked ? file.fd : picbuffers[sendid].fd;
+        PlinkStats before, after;
+        PLINK_getStats(plink, channel[0].id, &before);
         sts = PLINK_send(plink, channel[0].id, &channel[0].pkt);
-        channel[0].sendid = (channel[0].sendid + 1) % NUM_OF_BUFFERS;
-        channel[0].available_bufs -= 1;
+        if (sts == PLINK_STATUS_DROPPED)
+        {
+            // the buffer is not passed to client, reuse it for the next frame
+            PLINK_getStats(plink, channel[0].id, &after);
+            printf("[SERVER] Dropped frame %d: %s\n", sendid, getDropReason(&before, &after));
+            dropped++;
+        }
+        else
+        {
+            channel[0].sendid = (channel[0].sendid + 1) % NUM_OF_BUFFERS;
+            channel[0].available_bufs -= 1;
+            last_us = getTimeUs();
+            if (sent++ == 0)
+                first_us = last_us;
+        }
 
         int timeout = 0;
         if (channel[0].available_bufs == 0)
             timeout = 60000; // wait up to 60 seconds if buffers are used up
 
-        if (PLINK_wait(plink, channel[0].id, timeout) == PLINK_STATUS_OK)
+        long long begin = getTimeUs();
+        sts = PLINK_wait(plink, channel[0].id, timeout);
+        waited = timeout > 0 ? getTimeUs() - begin : 0;
+        if (sts == PLINK_STATUS_OK)
         {
             do
             {
@@ -411,6 +1311,12 @@ int main(int argc, char **argv) {
     } while (channel[0].exit == 0 && frmcnt < frames);
 
 cleanup:
+    if (sent > 0)
+    {
+        double seconds = (last_us - first_us) / 1e6;
+        printf("[SERVER] Sent %d frames in %.2f s, %.2f fps, dropped %d\n",
+                sent, seconds, seconds > 0 ? (sent - 1) / seconds : 0, dropped);
+    }
     msg.header.type = PLINK_TYPE_MESSAGE;
     msg.header.size = DATA_SIZE(PlinkMsg);
     msg.msg = PLINK_EXIT_CODE;
@@ -421,10 +1327,17 @@ cleanup:
     retreiveSentBuffers(plink, &channel[0]);
     PLINK_recv_ex(plink, channel[0].id, &channel[0].pkt, 1000);
     //sleep(1); // Sleep one second to make sure client is ready for exit
-    if (vmem)
+    if (params.filebacked == 0)
         FreeBuffers(picbuffers, vmem);
     PLINK_close(plink, PLINK_CLOSE_ALL);
-    VMEM_destroy(vmem);
+    if (vmem)
+        VMEM_destroy(vmem);
+    UnmapInputFile(&input);
+    if (file.fd >= 0)
+        close(file.fd);
+    if (pacer.fd >= 0)
+        ClosePacer(&pacer, &params);
+    FreeGenerator(&generator);
     if (fp != NULL)
         fclose(fp);
     exit(EXIT_SUCCESS);
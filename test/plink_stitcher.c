@@ -19,23 +19,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <memory.h>
+#include <time.h>
+#include <signal.h>
 #include "process_linker_types.h"
-#include "video_mem.h"
+#include "plink_node.h"
+#include "plink_kernels.h"
 
 #ifndef NULL
 #define NULL    ((void *)0)
 #endif
 
-#define MAX_NUM_OF_INPUTS   4
+#define MAX_NUM_OF_INPUTS   32
+#define DEFAULT_NUM_OF_INPUTS   4
+#define MAX_NUM_OF_THREADS  16
+#define MAX_NUM_OF_JOBS     (2 * 2 * MAX_NUM_OF_THREADS)
+#define MIN_BAND_HEIGHT     16
 #define NUM_OF_BUFFERS      5
+#define DEFAULT_LATENCY_MS  50
+#define MAX_NUM_OF_OBJECTS  64  // detections drawn per input
+#define OVERLAY_LINE_WIDTH  2   // boxes, in output pixels
+#define OVERLAY_POINT_SIZE  4   // landmarks, in output pixels
+#define OVERLAY_BOX_COLOR   (145 | 54 << 8 | 34 << 16)  // green, Y | U << 8 | V << 16 in BT.601 limited range
+#define OVERLAY_POINT_COLOR (82 | 90 << 8 | 240 << 16)  // red
 #define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
                         } while (0)
 #define STITCHER_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define STITCHER_MAX(a, b) ((a) > (b) ? (a) : (b))
 
 
 typedef enum _StitchLayout
@@ -43,11 +54,46 @@ typedef enum _StitchLayout
     STITCH_LAYOUT_Vertical = 0,
     STITCH_LAYOUT_Horizontal,
     STITCH_LAYOUT_Matrix,
+    STITCH_LAYOUT_File,
     STITCH_LAYOUT_Max
 } StitchLayout;
 
+typedef enum _StitchPlane
+{
+    STITCH_PLANE_Luma = 0,
+    STITCH_PLANE_Chroma,
+} StitchPlane;
+
+typedef enum _StitchScale
+{
+    STITCH_SCALE_Crop = 0,      // show the top-left corner of the picture
+    STITCH_SCALE_Bilinear,      // resize the picture to fit the region
+    STITCH_SCALE_Area,
+    STITCH_SCALE_Max
+} StitchScale;
+
+typedef enum _StitchColor
+{
+    STITCH_COLOR_BT601 = 0,     // limited range
+    STITCH_COLOR_BT601Full,
+    STITCH_COLOR_BT709,
+    STITCH_COLOR_BT709Full,
+    STITCH_COLOR_Max
+} StitchColor;
+
+typedef enum _StitchDemosaic
+{
+    STITCH_DEMOSAIC_None = 0,   // show the mosaic as monochrome
+    STITCH_DEMOSAIC_Bilinear,
+    STITCH_DEMOSAIC_EdgeAware,  // bilinear, with green interpolated along edges
+    STITCH_DEMOSAIC_Max
+} StitchDemosaic;
+
 typedef struct _StitherRegion
 {
+    int x;
+    int y;
+    int z;          // regions with higher z are drawn on top
     int width;
     int height;
     int offset_uv;
@@ -58,57 +104,145 @@ typedef struct _StitcherParams
 {
     char *in_name[MAX_NUM_OF_INPUTS];
     char *out_name;
+    int inputs;
     StitchLayout layout;
+    char *layout_file;
+    StitcherRegion regions[MAX_NUM_OF_INPUTS];  // from the layout file, width 0 if not placed
+    StitchScale scale;
+    StitchColor color;
     PlinkColorFormat format;
     int width;
     int height;
     int stride;
+    int threads;
+    int zerocopy;
+    int fps;            // sync mode: output frame rate, 0 to follow input 0
+    int latency;        // sync mode: latency budget in ms
+    int keep;           // keep running when all the inputs have left
+    int consumers;      // of the output, all sent the same buffers
+    int max_age;        // ms, frames captured longer ago are not sent
+    int alpha;          // opacity of the detection overlay, 0 to 255
+    StitchDemosaic demosaic;
+    float gain[3];      // Raw inputs: red, green and blue gains, 0 to 8
 } StitcherParams;
 
 typedef struct _StitcherPort
 {
     char *name;
-    int index;
-    PlinkChannelID id;
-    PlinkHandle plink;
-    int sendid;
-    int backid;
-    int *exit;
+    int slot;               // number of the input in the options, e.g. -i<n>
+    int index;              // order of connection
+    int connected;
+    unsigned int joined;        // changed by the node whenever a producer connects
     int available_bufs;
-    void *vmem;
-    pthread_mutex_t pic_mutex;
-    pthread_mutex_t *count_mutex;
-    sem_t *sem_ready;
-    sem_t *sem_done;
+    unsigned int generation;    // changed with the picture to show
+    unsigned int shown_joined;  // the picture shown: producer and number of the frame
+    unsigned int shown_sequence;
     StitchLayout layout;
+    StitchScale scale;
     PlinkColorFormat format;
-    void *buffer;
+    unsigned char *buffer;
     int width;
     int height;
     int stride;
-    int offset;
-    int offset_uv;
-    int *in_count;
+    int offset;             // luma, or red
+    int offset_uv;          // chroma, the U plane when planar, or green
+    int offset_v;           // V plane, or blue
+    int stride_uv;
+    int tile_width;         // tiled formats: size of a tile in bytes x rows, 0 when linear
+    int tile_height;
+    PlinkBayerPattern pattern;  // Raw formats
+    KernelScaler scaler[2];     // scaling: luma and chroma, for the resolution below
+    int scale_width;            // scaling: resolution of the picture when the scalers were computed
+    int scale_height;
+    int fit_x;                  // scaling: area of the region covered by the resized picture
+    int fit_y;
+    int fit_width;
+    int fit_height;
+    KernelColorMatrix to_rgb;   // output: color conversion of the inputs
+    KernelColorMatrix to_yuv;
+    int alpha;                  // output: opacity of the detection overlay, 0 to 256
+    StitchDemosaic demosaic;    // output: Raw inputs
+    unsigned short gain[3];     // output: gains of the Raw inputs, in 1/256
+    pthread_mutex_t object_mutex;
+    PlinkObjectDetect received_objects[MAX_NUM_OF_OBJECTS];  // detections, written by the input thread under object_mutex
+    int num_received_objects;
+    unsigned int objects_seq;   // changed with received_objects
+    PlinkObjectDetect objects[MAX_NUM_OF_OBJECTS];  // detections drawn by the output thread
+    int num_objects;
+    unsigned int shown_objects_seq;
 } StitcherPort;
 
+/* Region of one connected input, computed when the topology changes */
+typedef struct _StitcherTile
+{
+    StitcherPort *in;
+    StitcherRegion region;
+    int height;     // rows composed in this frame, in luma rows
+    int scaled;
+    int converted;  // converted into the output format, instead of copied as NV12
+    int dirty;      // the region in the output buffer is not current
+} StitcherTile;
+
+/* One horizontal band of one plane of the output, composed input by input in z-order */
+typedef struct _StitcherBand
+{
+    StitchPlane plane;
+    int first;
+    int rows;
+} StitcherBand;
+
+/* The part of one input inside a band */
+typedef struct _StitcherJob
+{
+    StitcherPort *in;
+    StitcherRegion region;
+    StitchPlane plane;
+    int first;      // first row of the band, in rows of the plane
+    int rows;
+    int scaled;     // resize the picture with in->scaler instead of cropping it
+} StitcherJob;
+
+/* What an output buffer holds, to compose only the regions changed since it was last used */
+typedef struct _StitcherBufferState
+{
+    unsigned int topology;
+    unsigned int generation[MAX_NUM_OF_INPUTS];     // of each input, by slot
+} StitcherBufferState;
+
+/* Memory of one band, so that composing allocates nothing */
+typedef struct _StitcherWorker
+{
+    void *scratch;      // of the scalers, see reserveScratch
+    unsigned short *convert;    // of composeConvertedBand, for a band as wide as the output
+} StitcherWorker;
+
 typedef struct _StitcherContext
 {
+    PlinkNode node;
     StitcherPort in[MAX_NUM_OF_INPUTS];
     StitcherPort out;
-    pthread_mutex_t count_mutex;
-    sem_t sem_ready;
-    sem_t sem_done;
-    int in_count;
-    int exitcode;
+    int inputs;
+    int in_count;                       // inputs connected
+    int threads;
+    int zerocopy;
+    unsigned int topology;              // changed when an input joins or leaves
+    StitcherRegion *layout;             // regions from the layout file
+    StitcherTile tiles[MAX_NUM_OF_INPUTS];
+    int num_tiles;
+    StitcherBufferState buffers[NUM_OF_BUFFERS];    // by id of the output buffer
+    StitcherBand jobs[MAX_NUM_OF_JOBS];
+    int num_jobs;
+    int combined;                       // the bands of the luma plane compose the chroma rows too
+    StitcherWorker workers[MAX_NUM_OF_JOBS];    // one per band
+    int num_workers;
+    int scratch_size;                   // bytes of scratch of each worker
+    unsigned long long composed;        // regions composed, and regions skipped as already current
+    unsigned long long skipped;
+    long long first_us;                 // frames sent, first and last
+    long long last_us;
 } StitcherContext;
 
-typedef struct _PictureBuffer
-{
-  unsigned int bus_address;
-  void *virtual_address;
-  unsigned int size;
-  int fd;
-} PictureBuffer;
+static PlinkNode node = NULL;
 
 static void printUsage(char *name)
 {
@@ -117,33 +251,108 @@ static void printUsage(char *name)
            "  Stitch multiple pictures to one. Maximum # of pictures to be stitched is %d\n"
            "  Available options:\n"
            "    -i<n>   plink file name of input port #n (default: /tmp/plink.stitch.in<n>). n is 0 based.\n"
+           "    -n      number of input ports (default: %d, or the highest n of -i<n> and the layout file)\n"
            "    -o      plink file name of output port (default: /tmp/plink.stitch.out)\n"
            "    -l      layout (default: 0)\n"
            "                0 - vertical\n"
            "                1 - horizontal\n"
-           "                2 - matrix\n"
+           "                2 - matrix, a grid as square as possible\n"
+           "                3 - layout file, set by -L\n"
+           "    -L      layout file, one line per input: <n> <x> <y> <width> <height> [<z>]\n"
            "    -f      output color format (default: 3)\n"
+           "                2 - I420\n"
            "                3 - NV12\n"
+           "                4 - P010\n"
+           "                6 - NV16\n"
+           "                10 - RGB888 planar\n"
+           "                12 - BGR888 planar\n"
+           "    -c      color space to convert between YUV and RGB (default: 0)\n"
+           "                0 - BT.601 limited range\n"
+           "                1 - BT.601 full range\n"
+           "                2 - BT.709 limited range\n"
+           "                3 - BT.709 full range\n"
            "    -w      output video width (default: 800)\n"
            "    -h      output video height (default: 1280)\n"
-           "    -s      output video buffer stride (default: video width)\n"
+           "    -s      output video buffer stride in bytes (default: video width, twice for P010)\n"
+           "    -t      number of threads to compose a frame (default: number of CPUs, max %d)\n"
+           "    -z      zero-copy: producers render into windows of the output buffer, e.g. plinkserver -z\n"
+           "    -r      sync mode: output frame rate driven by a timer instead of input 0 (default: 0, off)\n"
+           "    -d      sync mode: latency budget in ms, pictures captured this long before a tick are shown (default: %d)\n"
+           "    -k      keep running when all the inputs have left, waiting for new ones\n"
+           "    -C      number of consumers of the output port, sent the same buffers (default: 1, max %d)\n"
+           "    -A      drop output frames captured more than this many ms ago (default: 0, disabled)\n"
+           "    -a      opacity of the detection overlay of NV12 output, 0 to 255 (default: 255), 0 to disable\n"
+           "    -m      scale mode of NV12 inputs to NV12 output (default: 0), ignored in zero-copy mode\n"
+           "                0 - crop to the region\n"
+           "                1 - bilinear, resize to fit the region keeping the aspect ratio\n"
+           "                2 - area average, same as 1 but better for downscaling\n"
+           "    -b      demosaic of Raw inputs (default: 1)\n"
+           "                0 - none, show the mosaic as monochrome\n"
+           "                1 - bilinear\n"
+           "                2 - edge-aware, bilinear with green interpolated along edges\n"
+           "    -g      gains of Raw inputs, <red>,<green>,<blue> from 0 to 8 (default: 1,1,1)\n"
            "    --help  print this message\n"
-           "\n", name, MAX_NUM_OF_INPUTS);
+           "\n", name, MAX_NUM_OF_INPUTS, DEFAULT_NUM_OF_INPUTS, MAX_NUM_OF_THREADS, DEFAULT_LATENCY_MS,
+           PLINK_NODE_MAX_CONSUMERS);
+}
+
+/* Layout file: one line per input, "<n> <x> <y> <width> <height> [<z>]", '#' starts a comment */
+static int loadLayout(StitcherParams *params)
+{
+    FILE *fp = fopen(params->layout_file, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "[STITCHER] ERROR: Failed to open layout file %s\n", params->layout_file);
+        return -1;
+    }
+
+    char line[256];
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), fp) != NULL)
+    {
+        int id, x, y, width, height, z = 0;
+        if (line[0] == '#')
+            continue;
+        int n = sscanf(line, "%d %d %d %d %d %d", &id, &x, &y, &width, &height, &z);
+        if (n <= 0)
+            continue;
+        if (n < 5 || id < 0 || id >= MAX_NUM_OF_INPUTS || x < 0 || y < 0 || width < 2 || height < 2)
+        {
+            fprintf(stderr, "[STITCHER] ERROR: Invalid line in layout file: %s", line);
+            ret = -1;
+            break;
+        }
+
+        // chroma is subsampled by 2 in both directions
+        StitcherRegion *region = &params->regions[id];
+        region->x = x & ~1;
+        region->y = y & ~1;
+        region->z = z;
+        region->width = width & ~1;
+        region->height = height & ~1;
+        if (id >= params->inputs)
+            params->inputs = id + 1;
+    }
+    fclose(fp);
+
+    return ret;
 }
 
 static void parseParams(int argc, char **argv, StitcherParams *params)
 {
+    static char default_names[MAX_NUM_OF_INPUTS][32];
     int i = 1;
     memset(params, 0, sizeof(*params));
-    params->in_name[0] = "/tmp/plink.stitch.in0";
-    params->in_name[1] = "/tmp/plink.stitch.in1";
-    params->in_name[2] = "/tmp/plink.stitch.in2";
-    params->in_name[3] = "/tmp/plink.stitch.in3";
     params->out_name = "/tmp/plink.stitch.out";
     params->layout = STITCH_LAYOUT_Vertical;
     params->format = PLINK_COLOR_FormatYUV420SemiPlanar;
     params->width = 800;
     params->height = 1280;
+    params->latency = DEFAULT_LATENCY_MS;
+    params->alpha = 255;
+    params->consumers = 1;
+    params->demosaic = STITCH_DEMOSAIC_Bilinear;
+    params->gain[0] = params->gain[1] = params->gain[2] = 1.0f;
     while (i < argc)
     {
         if (argv[i][0] != '-' || strlen(argv[i]) < 2)
@@ -160,12 +369,35 @@ static void parseParams(int argc, char **argv, StitcherParams *params)
                 {
                     int id = atoi(argv[i-1]+2);
                     if (id < MAX_NUM_OF_INPUTS)
+                    {
                         params->in_name[id] = argv[i++];
+                        if (id >= params->inputs)
+                            params->inputs = id + 1;
+                    }
+                    else
+                        i++;
                 }
                 else
                     params->in_name[0] = argv[i++];
             }
         }
+        else if (argv[i][1] == 'n')
+        {
+            if (++i < argc)
+            {
+                int inputs = atoi(argv[i++]);
+                if (inputs > params->inputs)
+                    params->inputs = STITCHER_MIN(inputs, MAX_NUM_OF_INPUTS);
+            }
+        }
+        else if (argv[i][1] == 'L')
+        {
+            if (++i < argc)
+            {
+                params->layout_file = argv[i++];
+                params->layout = STITCH_LAYOUT_File;
+            }
+        }
         else if (argv[i][1] == 'o')
         {
             if (++i < argc)
@@ -181,6 +413,11 @@ static void parseParams(int argc, char **argv, StitcherParams *params)
             if (++i < argc)
                 params->format = atoi(argv[i++]);
         }
+        else if (argv[i][1] == 'c')
+        {
+            if (++i < argc)
+                params->color = atoi(argv[i++]);
+        }
         else if (argv[i][1] == 'w')
         {
             if (++i < argc)
@@ -196,6 +433,64 @@ static void parseParams(int argc, char **argv, StitcherParams *params)
             if (++i < argc)
                 params->stride = atoi(argv[i++]);
         }
+        else if (argv[i][1] == 't')
+        {
+            if (++i < argc)
+                params->threads = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'z')
+        {
+            params->zerocopy = 1;
+            i++;
+        }
+        else if (argv[i][1] == 'k')
+        {
+            params->keep = 1;
+            i++;
+        }
+        else if (argv[i][1] == 'C')
+        {
+            if (++i < argc)
+                params->consumers = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'A')
+        {
+            if (++i < argc)
+                params->max_age = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'r')
+        {
+            if (++i < argc)
+                params->fps = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'd')
+        {
+            if (++i < argc)
+                params->latency = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'a')
+        {
+            if (++i < argc)
+                params->alpha = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'm')
+        {
+            if (++i < argc)
+                params->scale = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'b')
+        {
+            if (++i < argc)
+                params->demosaic = atoi(argv[i++]);
+        }
+        else if (argv[i][1] == 'g')
+        {
+            if (++i < argc)
+            {
+                if (sscanf(argv[i++], "%f,%f,%f", &params->gain[0], &params->gain[1], &params->gain[2]) != 3)
+                    params->gain[0] = -1.0f;
+            }
+        }
         else if (strcmp(argv[i], "--help") == 0)
         {
             params->layout = STITCH_LAYOUT_Max;
@@ -203,26 +498,45 @@ static void parseParams(int argc, char **argv, StitcherParams *params)
         }
     }
 
+    if (params->layout_file != NULL && loadLayout(params) != 0)
+        params->layout = STITCH_LAYOUT_Max;
+    if (params->inputs <= 0)
+        params->inputs = DEFAULT_NUM_OF_INPUTS;
+    for (int n = 0; n < params->inputs; n++)
+    {
+        if (params->in_name[n] != NULL)
+            continue;
+        snprintf(default_names[n], sizeof(default_names[n]), "/tmp/plink.stitch.in%d", n);
+        params->in_name[n] = default_names[n];
+    }
+
     if (params->stride == 0)
-        params->stride = params->width;
+        params->stride = params->format == PLINK_COLOR_FormatYUV420SemiPlanarP010 ? params->width * 2 : params->width;
+    if (params->threads <= 0)
+        params->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (params->threads > MAX_NUM_OF_THREADS)
+        params->threads = MAX_NUM_OF_THREADS;
 
-    printf("[STITCHER] Input 0 Name         : %s\n", params->in_name[0]);
-    printf("[STITCHER] Input 1 Name         : %s\n", params->in_name[1]);
-    printf("[STITCHER] Input 2 Name         : %s\n", params->in_name[2]);
-    printf("[STITCHER] Input 3 Name         : %s\n", params->in_name[3]);
+    for (int n = 0; n < params->inputs; n++)
+        printf("[STITCHER] Input %-2d Name        : %s\n", n, params->in_name[n]);
     printf("[STITCHER] Output Name          : %s\n", params->out_name);
     printf("[STITCHER] Output Layout        : %d\n", params->layout);
     printf("[STITCHER] Output Format        : %d\n", params->format);
+    printf("[STITCHER] Color Space          : %d\n", params->color);
     printf("[STITCHER] Output Resolution    : %dx%d\n", params->width, params->height);
     printf("[STITCHER] Output Stride        : %d\n", params->stride);
-}
-
-static int checkParams(StitcherParams *params)
-{
-    if (params->format != PLINK_COLOR_FormatYUV420SemiPlanar ||
-        params->layout >= STITCH_LAYOUT_Max)
-        return -1;
-    return 0;
+    printf("[STITCHER] Compose Threads      : %d\n", params->threads);
+    printf("[STITCHER] Zero-copy            : %d\n", params->zerocopy);
+    printf("[STITCHER] Scale Mode           : %d\n", params->scale);
+    printf("[STITCHER] Keep Running         : %d\n", params->keep);
+    printf("[STITCHER] Output Consumers     : %d\n", params->consumers);
+    printf("[STITCHER] Output Max Age       : %dms\n", params->max_age);
+    printf("[STITCHER] Overlay Opacity      : %d\n", params->alpha);
+    printf("[STITCHER] Demosaic             : %d\n", params->demosaic);
+    printf("[STITCHER] Raw Gains            : %.2f,%.2f,%.2f\n", params->gain[0], params->gain[1], params->gain[2]);
+    printf("[STITCHER] Sync Frame Rate      : %d\n", params->fps);
+    if (params->fps > 0)
+        printf("[STITCHER] Latency Budget       : %dms\n", params->latency);
 }
 
 static int getBufferSize(StitcherParams *params)
@@ -232,117 +546,276 @@ static int getBufferSize(StitcherParams *params)
     {
         case PLINK_COLOR_FormatYUV420Planar:
         case PLINK_COLOR_FormatYUV420SemiPlanar:
+        case PLINK_COLOR_FormatYUV420SemiPlanarP010:
             size = params->stride * params->height * 3 / 2;
             break;
+        case PLINK_COLOR_FormatYUV422SemiPlanar:
+            size = params->stride * params->height * 2;
+            break;
+        case PLINK_COLOR_Format24BitRGB888Planar:
+        case PLINK_COLOR_Format24BitBGR888Planar:
+            size = params->stride * params->height * 3;
+            break;
         default:
             size = 0;
     }
     return size;
 }
 
-static void AllocateBuffers(PictureBuffer picbuffers[NUM_OF_BUFFERS], unsigned int size, void *vmem)
-{
-    unsigned int buffer_size = (size + 0xFFF) & ~0xFFF;
-    VmemParams params;
-    params.size = buffer_size;
-    params.flags = VMEM_FLAG_CONTIGUOUS | VMEM_FLAG_4GB_ADDR;
-    for (int i = 0; i < NUM_OF_BUFFERS; i++)
-    {
-        params.fd = 0;
-        VMEM_allocate(vmem, &params);
-        VMEM_mmap(vmem, &params);
-        VMEM_export(vmem, &params);
-        printf("[STITCHER] mmap %p from %x with size %d, dma-buf fd %d\n", 
-                params.vir_address, params.phy_address, params.size, params.fd);
-        picbuffers[i].virtual_address = params.vir_address;
-        picbuffers[i].bus_address = params.phy_address;
-        picbuffers[i].size = buffer_size;
-        picbuffers[i].fd = params.fd;
-    }
-}
-
-static void FreeBuffers(PictureBuffer picbuffers[NUM_OF_BUFFERS], void *vmem)
+static int checkParams(StitcherParams *params)
 {
-    VmemParams params;
-    memset(&params, 0, sizeof(params));
-    for (int i = 0; i < NUM_OF_BUFFERS; i++)
-    {
-        close(picbuffers[i].fd);
-        params.size = picbuffers[i].size;
-        params.vir_address = picbuffers[i].virtual_address;
-        params.phy_address = picbuffers[i].bus_address;
-        VMEM_free(vmem, &params);
-    }
+    if (getBufferSize(params) == 0 ||
+        params->color < 0 || params->color >= STITCH_COLOR_Max ||
+        params->alpha < 0 || params->alpha > 255 ||
+        params->demosaic < 0 || params->demosaic >= STITCH_DEMOSAIC_Max ||
+        params->gain[0] < 0 || params->gain[0] > 8 ||
+        params->gain[1] < 0 || params->gain[1] > 8 ||
+        params->gain[2] < 0 || params->gain[2] > 8 ||
+        (params->zerocopy && params->format != PLINK_COLOR_FormatYUV420SemiPlanar) ||
+        params->layout >= STITCH_LAYOUT_Max ||
+        (params->layout == STITCH_LAYOUT_File && params->layout_file == NULL) ||
+        params->scale >= STITCH_SCALE_Max ||
+        params->fps < 0 || params->latency < 0 ||
+        (params->fps > 0 && params->zerocopy) ||
+        params->consumers < 1 || params->consumers > PLINK_NODE_MAX_CONSUMERS || params->max_age < 0)
+        return -1;
+    return 0;
 }
 
 static void getRegion(StitcherPort *out, int index, int in_count, StitcherRegion *region)
 {
-    region->offset_uv = 0; //out->stride * out->height;
+    region->z = 0;
     if (out->layout == STITCH_LAYOUT_Horizontal)
     {
         int width = (out->width / in_count + 1) & ~1;
-        region->offset_y = width * index;
-        region->offset_uv += width * index;
+        region->x = width * index;
+        region->y = 0;
         region->width = width;
         region->height = out->height;
     }
     else if (out->layout == STITCH_LAYOUT_Matrix && in_count >= 3)
     {
-        int y = index >> 1;
-        int x = index & 1;
-        int width = (out->width / 2 + 1) & ~1;
-        int height = (out->height / 2 + 1) & ~1;
-        region->offset_y = out->stride * (height * y);
-        region->offset_y += width * x;
-        region->offset_uv += out->stride * (height * y / 2);
-        region->offset_uv += width * x;
+        int cols = 2;
+        while (cols * cols < in_count)
+            cols++;
+        int rows = (in_count + cols - 1) / cols;
+        int width = (out->width / cols + 1) & ~1;
+        int height = (out->height / rows + 1) & ~1;
+        region->x = width * (index % cols);
+        region->y = height * (index / cols);
         region->width = width;
         region->height = height;
     }
     else // (out->layout == STITCH_LAYOUT_Vertical)
     {
         int height = (out->height / in_count + 1) & ~1;
-        region->offset_y = out->stride * (height * index);
-        region->offset_uv += out->stride * (height * index / 2);
+        region->x = 0;
+        region->y = height * index;
         region->width = out->width;
         region->height = height;
     }
 }
 
-static int stitchOneFrame(StitcherContext *ctx)
+/* Keep the region inside the output picture, the regions are rounded up to even sizes
+ * and start at even positions, so they share no chroma sample */
+static void clipRegion(StitcherPort *out, StitcherRegion *region)
+{
+    region->x &= ~1;
+    region->y &= ~1;
+    region->width = STITCHER_MIN(region->width, (out->width - region->x) & ~1);
+    region->height = STITCHER_MIN(region->height, (out->height - region->y) & ~1);
+    region->offset_y = out->stride * region->y + region->x;
+    region->offset_uv = out->stride * (region->y / 2) + region->x;
+}
+
+/* Hot-plug: follow the inputs joining and leaving, as of the frames given by the node.
+ * The inputs which joined later move up when one leaves, so the layout has no hole.
+ * Returns 1 when the topology changed. */
+static int updateInputs(StitcherContext *ctx)
+{
+    int changed = 0;
+    ctx->in_count = 0;
+    for (int i = 0; i < ctx->inputs; i++)
+    {
+        StitcherPort *in = &ctx->in[i];
+        PlinkNodeInput state;
+        PLINK_NODE_getInput(ctx->node, i, &state);
+        int left = in->connected && (state.connected == 0 || state.joined != in->joined);
+        int joined = state.connected && (in->connected == 0 || state.joined != in->joined);
+        if (left)
+            printf("[STITCHER] Input%d: Left from %s\n", in->index, in->name);
+        if (joined)
+            printf("[STITCHER] Input%d: Joined from %s\n", state.order, in->name);
+        if (left || joined || (state.connected && state.order != in->index))
+            changed = 1;
+        in->connected = state.connected;
+        in->joined = state.joined;
+        if (state.connected)
+        {
+            in->index = state.order;
+            ctx->in_count++;
+        }
+    }
+    return changed;
+}
+
+/* Compute the regions of the connected inputs and sort them by z-order.
+ * Only done again when an input joins or leaves. */
+static void updateTiles(StitcherContext *ctx)
 {
-    StitcherPort *in = NULL;
     StitcherPort *out = &ctx->out;
-    int in_count = 0;
-    do
+
+    if (updateInputs(ctx) == 0)
+        return;
+
+    ctx->topology++;
+    ctx->num_tiles = 0;
+    for (int i = 0; i < ctx->inputs; i++)
     {
-        pthread_mutex_lock(out->count_mutex);
-        in_count = ctx->in_count;
-        pthread_mutex_unlock(out->count_mutex);
-        if (in_count > 0)
-            break;
+        StitcherPort *in = &ctx->in[i];
+        StitcherTile *tile = &ctx->tiles[ctx->num_tiles];
+        if (in->connected == 0)
+            continue;
+        if (out->layout == STITCH_LAYOUT_File)
+            tile->region = ctx->layout[in->slot];
         else
-            sleep(1);
-    } while (1);
-
-    for (int i = 0; i < in_count; i++)
-    {
-        in = &ctx->in[i];
-        if (in->index == 0)
-        {
-            sem_wait(&ctx->sem_ready); // wait for picture from input port0.
-            if (ctx->exitcode == 1)
-                return 1;
-        }
-        StitcherRegion region;
-        getRegion(out, in->index, in_count, &region);
-        pthread_mutex_lock(&in->pic_mutex);
-        int width = STITCHER_MIN(region.width, in->width);
-        int height = STITCHER_MIN(region.height, in->height);
-        void *dst = out->buffer + out->offset + region.offset_y;
-        void *src = in->buffer + in->offset;
-        //fprintf(stderr, "%d: %p, %d, %d, %p, %d\n", in->index, out->buffer, out->offset, region.offset_y, in->buffer, in->offset);
-        //fprintf(stderr, "%d: %dx%d, %d, %d\n", in->index, width, height, in->stride, out->stride);
+            getRegion(out, in->index, ctx->in_count, &tile->region);
+        clipRegion(out, &tile->region);
+        if (tile->region.width <= 0 || tile->region.height <= 0)
+            continue;
+        tile->in = in;
+
+        // insertion sort, stable for equal z
+        int n = ctx->num_tiles++;
+        StitcherTile added = *tile;
+        while (n > 0 && ctx->tiles[n - 1].region.z > added.region.z)
+        {
+            ctx->tiles[n] = ctx->tiles[n - 1];
+            n--;
+        }
+        ctx->tiles[n] = added;
+    }
+
+    for (int t = 0; t < ctx->num_tiles; t++)
+    {
+        StitcherRegion *region = &ctx->tiles[t].region;
+        printf("[STITCHER] Input%d: Region %dx%d at (%d, %d), z %d\n", ctx->tiles[t].in->index,
+                region->width, region->height, region->x, region->y, region->z);
+    }
+}
+
+/* Fit the picture into the region keeping its aspect ratio.
+ * The scale coefficients are only computed again when the resolution changes. */
+static int updateScaler(StitcherPort *in, StitcherRegion *region, StitchScale scale)
+{
+    if (in->available_bufs <= 0 || in->format != PLINK_COLOR_FormatYUV420SemiPlanar ||
+        in->width < 2 || in->height < 2)
+        return 0;
+
+    int fit_width = region->width;
+    int fit_height = region->height;
+    if ((long long)in->width * region->height > (long long)in->height * region->width)
+        fit_height = (int)((long long)in->height * region->width / in->width);
+    else
+        fit_width = (int)((long long)in->width * region->height / in->height);
+    fit_width &= ~1;
+    fit_height &= ~1;
+    if (fit_width < 2 || fit_height < 2)
+        return 0;
+    in->fit_x = ((region->width - fit_width) / 2) & ~1;
+    in->fit_y = ((region->height - fit_height) / 2) & ~1;
+
+    if (in->scaler[STITCH_PLANE_Luma].xofs != NULL &&
+        in->scale_width == in->width && in->scale_height == in->height &&
+        in->fit_width == fit_width && in->fit_height == fit_height)
+        return 1;
+
+    KernelScaleMode mode = scale == STITCH_SCALE_Area ? KERNEL_SCALE_Area : KERNEL_SCALE_Bilinear;
+    KERNEL_freeScaler(&in->scaler[STITCH_PLANE_Luma]);
+    KERNEL_freeScaler(&in->scaler[STITCH_PLANE_Chroma]);
+    if (KERNEL_initScaler(&in->scaler[STITCH_PLANE_Luma], mode,
+                          in->width, in->height, fit_width, fit_height, 1) != 0 ||
+        KERNEL_initScaler(&in->scaler[STITCH_PLANE_Chroma], mode,
+                          in->width / 2, in->height / 2, fit_width / 2, fit_height / 2, 2) != 0)
+    {
+        fprintf(stderr, "[STITCHER] ERROR: Failed to scale input %d from %dx%d to %dx%d\n",
+                in->index, in->width, in->height, fit_width, fit_height);
+        KERNEL_freeScaler(&in->scaler[STITCH_PLANE_Luma]);
+        KERNEL_freeScaler(&in->scaler[STITCH_PLANE_Chroma]);
+        return 0;
+    }
+
+    in->scale_width = in->width;
+    in->scale_height = in->height;
+    in->fit_width = fit_width;
+    in->fit_height = fit_height;
+    printf("[STITCHER] Input%d: Scale %dx%d to %dx%d at (%d, %d)\n", in->index,
+            in->width, in->height, fit_width, fit_height, in->fit_x, in->fit_y);
+    return 1;
+}
+
+/* Resize the picture into the band, and fill the borders around it */
+static void composeScaledBand(StitcherPort *out, StitcherJob *job, StitcherWorker *worker)
+{
+    StitcherPort *in = job->in;
+    StitcherRegion *region = &job->region;
+    int chroma = job->plane == STITCH_PLANE_Chroma;
+    int fill = chroma ? 0x80 : 0x00;
+    // interleaved UV has the same width in bytes as luma, and half the rows
+    int fit_x = in->fit_x;
+    int fit_width = in->fit_width;
+    int fit_y = in->fit_y >> chroma;
+    int fit_height = in->fit_height >> chroma;
+    unsigned char *dst = out->buffer;
+    const unsigned char *src = in->buffer;
+    dst += chroma ? out->offset_uv + region->offset_uv : out->offset + region->offset_y;
+    src += chroma ? in->offset_uv : in->offset;
+
+    int last = job->first + job->rows;
+    for (int h = job->first; h < last; h++)
+    {
+        unsigned char *row = dst + h * out->stride;
+        if (h < fit_y || h >= fit_y + fit_height)
+            memset(row, fill, region->width);
+        else
+        {
+            memset(row, fill, fit_x);
+            memset(row + fit_x + fit_width, fill, region->width - fit_x - fit_width);
+        }
+    }
+
+    int top = STITCHER_MAX(job->first, fit_y);
+    int bottom = STITCHER_MIN(last, fit_y + fit_height);
+    if (top < bottom)
+        KERNEL_scaleRows(&in->scaler[job->plane], dst + top * out->stride + fit_x, out->stride,
+                         src, in->stride, top - fit_y, bottom - top, worker->scratch);
+}
+
+/* Start of a row of a tiled plane in its first tile: the tiles of a row of tiles are stride * tile_height bytes */
+static const unsigned char *getTiledRow(StitcherPort *in, int offset, int row)
+{
+    return (const unsigned char *)in->buffer + offset +
+           (row / in->tile_height) * in->stride * in->tile_height + (row % in->tile_height) * in->tile_width;
+}
+
+static void composeBand(StitcherPort *out, StitcherJob *job, StitcherWorker *worker, const KernelOps *kernels)
+{
+    StitcherPort *in = job->in;
+    StitcherRegion *region = &job->region;
+    int width = STITCHER_MIN(region->width, in->width);
+    void *dst = NULL;
+    void *src = NULL;
+
+    if (job->scaled)
+    {
+        composeScaledBand(out, job, worker);
+        return;
+    }
+
+    if (job->plane == STITCH_PLANE_Luma)
+    {
+        dst = out->buffer + out->offset + region->offset_y + job->first * out->stride;
+        src = in->buffer + in->offset + job->first * in->stride;
         if (in->available_bufs > 0)
         {
             if (in->format == PLINK_COLOR_FormatYUV420SemiPlanarP010 ||
@@ -350,26 +823,26 @@ static int stitchOneFrame(StitcherContext *ctx)
                 in->format == PLINK_COLOR_FormatRawBayer12bit)
             {
                 int shift = in->format == PLINK_COLOR_FormatYUV420SemiPlanarP010 ? 2 : 4;
-                unsigned int temp[4];
-                for (int h = 0; h < height; h++)
+                for (int h = 0; h < job->rows; h++)
                 {
-                    unsigned int *dst32 = (unsigned int *)dst;
-                    unsigned short *src16 = (unsigned short *)src;
-                    for (int w = 0; w < width; w+=4)
-                    {
-                        temp[0] = ((unsigned int)(src16[w+0] >> shift) & 0xFF);
-                        temp[1] = ((unsigned int)(src16[w+1] >> shift) & 0xFF) << 8;
-                        temp[2] = ((unsigned int)(src16[w+2] >> shift) & 0xFF) << 16;
-                        temp[3] = ((unsigned int)(src16[w+3] >> shift) & 0xFF) << 24;
-                        dst32[w>>2] = temp[0] | temp[1] | temp[2] | temp[3];
-                    }
+                    kernels->pack16to8(dst, src, width, shift);
                     dst += out->stride;
                     src += in->stride;
                 }
             }
+            else if (in->tile_width > 0)
+            {
+                // straight from the tiles, no linear copy of the picture
+                for (int h = 0; h < job->rows; h++)
+                {
+                    kernels->detileRow(dst, getTiledRow(in, in->offset, job->first + h), width,
+                                       in->tile_width, in->tile_height);
+                    dst += out->stride;
+                }
+            }
             else
             {
-                for (int h = 0; h < height; h++)
+                for (int h = 0; h < job->rows; h++)
                 {
                     memcpy(dst, src, width);
                     dst += out->stride;
@@ -379,272 +852,800 @@ static int stitchOneFrame(StitcherContext *ctx)
         }
         else
         {
-            for (int h = 0; h < height; h++)
+            for (int h = 0; h < job->rows; h++)
             {
                 memset(dst, 0x00, width);
                 dst += out->stride;
             }
         }
-        dst = out->buffer + out->offset_uv + region.offset_uv;
-        src = in->buffer + in->offset_uv;
-        //fprintf(stderr, "%d: %p, %d, %d, %p, %d\n", in->index, out->buffer, out->offset_uv, region.offset_uv, in->buffer, in->offset_uv);
+    }
+    else
+    {
+        dst = out->buffer + out->offset_uv + region->offset_uv + job->first * out->stride;
+        src = in->buffer + in->offset_uv + job->first * in->stride;
         if (in->format == PLINK_COLOR_FormatYUV420SemiPlanar &&
             in->available_bufs > 0)
         {
-            for (int h = 0; h < height/2; h++)
+            for (int h = 0; h < job->rows; h++)
             {
                 memcpy(dst, src, width);
                 dst += out->stride;
                 src += in->stride;
             }
         }
+        else if (in->tile_width > 0 && in->available_bufs > 0)
+        {
+            for (int h = 0; h < job->rows; h++)
+            {
+                kernels->detileRow(dst, getTiledRow(in, in->offset_uv, job->first + h), width,
+                                   in->tile_width, in->tile_height);
+                dst += out->stride;
+            }
+        }
+        else if (in->format == PLINK_COLOR_FormatYUV420SemiPlanarP010 &&
+                 in->available_bufs > 0)
+        {
+            // interleaved 16-bit UV, converted the same way as luma
+            for (int h = 0; h < job->rows; h++)
+            {
+                kernels->pack16to8(dst, src, width, 2);
+                dst += out->stride;
+                src += in->stride;
+            }
+        }
         else // treat all the other formats as monochrome
         {
-            for (int h = 0; h < height/2; h++)
+            for (int h = 0; h < job->rows; h++)
             {
                 memset(dst, 0x80, width);
                 dst += out->stride;
             }
         }
-        pthread_mutex_unlock(&in->pic_mutex);
-        if (in->index == 0)
-            sem_post(&ctx->sem_done); // Resume input port0.
-        // !Assume output thread is fast enough, so input port0 won't be blocked for long time.
     }
+}
 
-    return 0;
+static int isRgbFormat(PlinkColorFormat format)
+{
+    return format >= PLINK_COLOR_Format32bitBGRA8888 && format <= PLINK_COLOR_Format24BitBGR888Planar;
 }
 
-static void constructYuvInfo(PlinkYuvInfo *info, StitcherParams *params, unsigned int bus_address, int id)
+static int isRawFormat(PlinkColorFormat format)
 {
-    int size_y = params->width * params->stride;
-    int size_uv = size_y / 2;
-    int size_yuv = size_y + size_uv;
-    
-    info->header.type = PLINK_TYPE_2D_YUV;
-    info->header.size = DATA_SIZE(*info);
-    info->header.id = id + 1;
+    return format >= PLINK_COLOR_FormatRawBayer8bit && format <= PLINK_COLOR_FormatRawBayer12bit;
+}
 
-    info->format = params->format;
-    info->bus_address_y = bus_address;
-    info->bus_address_u = info->bus_address_y + size_y;
-    info->bus_address_v = info->bus_address_u + (size_uv / 2);
-    info->pic_width = params->width;
-    info->pic_height = params->height;
-    info->stride_y = params->stride;
-    info->stride_u = 
-        params->format == PLINK_COLOR_FormatYUV420Planar ? 
-        params->stride/2 : params->stride;
-    info->stride_v = info->stride_u;
+/* NV12 output copies NV12 (linear or tiled), P010, monochrome and Raw inputs without demosaic as before,
+ * everything else is converted */
+static int needsConversion(StitcherPort *out, StitcherPort *in)
+{
+    if (out->format != PLINK_COLOR_FormatYUV420SemiPlanar)
+        return 1;
+    return in->available_bufs > 0 &&
+           in->tile_width == 0 &&
+           in->format != PLINK_COLOR_FormatYUV420SemiPlanar &&
+           in->format != PLINK_COLOR_FormatYUV420SemiPlanarP010 &&
+           in->format != PLINK_COLOR_FormatMonochrome &&
+           (isRawFormat(in->format) == 0 || out->demosaic != STITCH_DEMOSAIC_None);
 }
 
-int getBufferCount(PlinkPacket *pkt)
+/* Read one row of a Raw picture as 10-bit samples into dst[-1] to dst[width].
+ * The picture is mirrored by two samples at its edges, which keeps the colors of the mosaic. */
+static void fetchRawRow(StitcherPort *in, int row, int width, unsigned short *dst, const KernelOps *kernels)
 {
-    int ret = 0;
-    for (int i = 0; i < pkt->num; i++)
+    row = row < 0 ? 1 : (row >= in->height ? in->height - 2 : row);
+    row = STITCHER_MAX(STITCHER_MIN(row, in->height - 1), 0);  // pictures of a single row
+    const unsigned char *src = (const unsigned char *)in->buffer + in->offset + row * in->stride;
+
+    int count = STITCHER_MIN(width + 1, in->width);
+    if (in->format == PLINK_COLOR_FormatRawBayer8bit)
+        kernels->unpack8to16(dst, src, count, 2);
+    else
+    {
+        // same bits as the conversion to 8-bit of the NV12 output, plus 2
+        const unsigned short *src16 = (const unsigned short *)src;
+        for (int x = 0; x < count; x++)
+            dst[x] = (src16[x] >> 2) & 0x3FF;
+    }
+    for (int x = count; x <= width; x++)
+        dst[x] = dst[x >= 2 ? x - 2 : 0];
+    dst[-1] = dst[width > 1 ? 1 : 0];
+}
+
+/* Demosaic one row of a Raw picture into 10-bit RGB, with the gains of the output */
+static void demosaicRow(StitcherPort *out, StitcherPort *in, int row, int width, unsigned short *c[3],
+                        unsigned short *scratch, const KernelOps *kernels)
+{
+    unsigned short *rows[3];
+    for (int i = 0; i < 3; i++)
+    {
+        rows[i] = scratch + i * (width + 2) + 1;
+        fetchRawRow(in, row - 1 + i, width, rows[i], kernels);
+    }
+
+    // colors of the even and odd columns of the row
+    int even = (row & 1) == 0;
+    int green_first = in->pattern == PLINK_BAYER_PATTERN_GRBG || in->pattern == PLINK_BAYER_PATTERN_GBRG;
+    int blue_first = in->pattern == PLINK_BAYER_PATTERN_BGGR || in->pattern == PLINK_BAYER_PATTERN_GBRG;
+    int layout = 0;
+    if (green_first == even)
+        layout |= KERNEL_BAYER_GreenEven;
+    if (blue_first == even)
+        layout |= KERNEL_BAYER_BlueRow;
+    if (out->demosaic == STITCH_DEMOSAIC_EdgeAware)
+        layout |= KERNEL_BAYER_EdgeAware;
+    kernels->demosaicRow(c[0], c[1], c[2], rows[0], rows[1], rows[2], width, layout, out->gain);
+}
+
+/* Read one row of the picture as 10-bit components: YUV 4:4:4, or RGB for RGB and demosaiced Raw inputs.
+ * scratch holds 3 * (width + 2) samples. Returns 1 when the row is RGB. */
+static int fetchRow(StitcherPort *out, StitcherPort *in, int row, int width, unsigned short *c[3],
+                    unsigned short *scratch, const KernelOps *kernels)
+{
+    unsigned char *line = (unsigned char *)scratch;
+    const unsigned char *base = in->buffer;
+    const unsigned char *src = base + in->offset + row * in->stride;
+
+    if (in->available_bufs <= 0)
     {
-        PlinkDescHdr *hdr = (PlinkDescHdr *)(pkt->list[i]);
-        if (hdr->type == PLINK_TYPE_MESSAGE)
+        for (int x = 0; x < width; x++)
         {
-            int *data = (int *)(pkt->list[i] + DATA_HEADER_SIZE);
-            if (*data == PLINK_EXIT_CODE)
+            c[0][x] = 0;
+            c[1][x] = 512;
+            c[2][x] = 512;
+        }
+        return 0;
+    }
+
+    if (isRawFormat(in->format) && out->demosaic != STITCH_DEMOSAIC_None)
+    {
+        demosaicRow(out, in, row, width, c, scratch, kernels);
+        return 1;
+    }
+    if (in->format == PLINK_COLOR_Format24BitRGB888Planar || in->format == PLINK_COLOR_Format24BitBGR888Planar)
+    {
+        kernels->unpack8to16(c[0], src, width, 2);
+        kernels->unpack8to16(c[1], base + in->offset_uv + row * in->stride_uv, width, 2);
+        kernels->unpack8to16(c[2], base + in->offset_v + row * in->stride_uv, width, 2);
+        return 1;
+    }
+    if (isRgbFormat(in->format))
+    {
+        // bytes per pixel and position of red, green and blue in a pixel
+        int size = 3, r = 0, g = 1, b = 2;
+        if (in->format == PLINK_COLOR_Format24BitBGR888)
+            r = 2, b = 0;
+        else if (in->format == PLINK_COLOR_Format32bitBGRA8888)
+            size = 4, r = 2, b = 0;
+        else if (in->format == PLINK_COLOR_Format32bitARGB8888)
+            size = 4, r = 1, g = 2, b = 3;
+        for (int x = 0; x < width; x++)
+        {
+            c[0][x] = src[x * size + r] << 2;
+            c[1][x] = src[x * size + g] << 2;
+            c[2][x] = src[x * size + b] << 2;
+        }
+        return 1;
+    }
+
+    if (in->format == PLINK_COLOR_FormatYUV420SemiPlanarP010 ||
+        in->format == PLINK_COLOR_FormatRawBayer10bit ||
+        in->format == PLINK_COLOR_FormatRawBayer12bit)
+    {
+        // 2 bits more than the conversion to 8-bit of the NV12 output
+        const unsigned short *src16 = (const unsigned short *)src;
+        int shift = in->format == PLINK_COLOR_FormatYUV420SemiPlanarP010 ? 0 : 2;
+        for (int x = 0; x < width; x++)
+            c[0][x] = (src16[x] >> shift) & 0x3FF;
+    }
+    else if (in->tile_width > 0)
+    {
+        kernels->detileRow(line, getTiledRow(in, in->offset, row), width, in->tile_width, in->tile_height);
+        kernels->unpack8to16(c[0], line, width, 2);
+    }
+    else
+        kernels->unpack8to16(c[0], src, width, 2);
+
+    // chroma is repeated over the pixels sharing it
+    int row_uv = row;
+    if (in->format == PLINK_COLOR_FormatYUV420SemiPlanar ||
+        in->format == PLINK_COLOR_FormatYUV420SemiPlanarP010 ||
+        in->format == PLINK_COLOR_FormatYUV420Planar ||
+        in->tile_width > 0)
+        row_uv = row / 2;
+    const unsigned char *u = base + in->offset_uv + row_uv * in->stride_uv;
+    const unsigned char *v = base + in->offset_v + row_uv * in->stride_uv;
+    if (in->tile_width > 0)
+    {
+        // even width: the last pixel reads its V
+        kernels->detileRow(line, getTiledRow(in, in->offset_uv, row_uv), (width + 1) & ~1,
+                           in->tile_width, in->tile_height);
+        u = line;
+    }
+    switch (in->format)
+    {
+        case PLINK_COLOR_FormatYUV420SemiPlanar:
+        case PLINK_COLOR_FormatYUV422SemiPlanar:
+        case PLINK_COLOR_FormatYUV420SemiPlanarTile4x4:
+        case PLINK_COLOR_FormatYUV420SemiPlanarTile8x4:
+        case PLINK_COLOR_FormatYUV420SemiPlanarTile64x32:
+            for (int x = 0; x < width; x++)
             {
-                ret |= 0x80000000; // set bit 31 to 1 to indicate 'exit'
+                c[1][x] = u[x & ~1] << 2;
+                c[2][x] = u[(x & ~1) + 1] << 2;
+            }
+            break;
+        case PLINK_COLOR_FormatYUV420SemiPlanarP010:
+            for (int x = 0; x < width; x++)
+            {
+                c[1][x] = ((const unsigned short *)u)[x & ~1] & 0x3FF;
+                c[2][x] = ((const unsigned short *)u)[(x & ~1) + 1] & 0x3FF;
+            }
+            break;
+        case PLINK_COLOR_FormatYUV420Planar:
+        case PLINK_COLOR_FormatYUV422Planar:
+            for (int x = 0; x < width; x++)
+            {
+                c[1][x] = u[x / 2] << 2;
+                c[2][x] = v[x / 2] << 2;
+            }
+            break;
+        default: // monochrome and Raw
+            for (int x = 0; x < width; x++)
+            {
+                c[1][x] = 512;
+                c[2][x] = 512;
             }
-            else if (*data >= 0)
-                ret++;
-        }
     }
+    return 0;
+}
 
-    return ret;
+/* Average the chroma of two rows over pairs of pixels, and write it in the output format */
+static void writeChroma(StitcherPort *out, StitcherRegion *region, int row_uv, int width,
+                        unsigned short *top[3], unsigned short *bottom[3], unsigned short *tmp)
+{
+    int count = (width + 1) / 2;
+    unsigned short *u = tmp;
+    unsigned short *v = tmp + count;
+    for (int i = 0; i < count; i++)
+    {
+        int x0 = 2 * i;
+        int x1 = x0 + 1 < width ? x0 + 1 : x0;
+        u[i] = (top[1][x0] + top[1][x1] + bottom[1][x0] + bottom[1][x1] + 2) >> 2;
+        v[i] = (top[2][x0] + top[2][x1] + bottom[2][x0] + bottom[2][x1] + 2) >> 2;
+    }
+
+    unsigned char *base = out->buffer;
+    if (out->format == PLINK_COLOR_FormatYUV420Planar)
+    {
+        unsigned char *dst_u = base + out->offset_uv + row_uv * out->stride_uv + region->x / 2;
+        unsigned char *dst_v = base + out->offset_v + row_uv * out->stride_uv + region->x / 2;
+        for (int i = 0; i < count; i++)
+        {
+            dst_u[i] = u[i] >> 2;
+            dst_v[i] = v[i] >> 2;
+        }
+    }
+    else if (out->format == PLINK_COLOR_FormatYUV420SemiPlanarP010)
+    {
+        unsigned short *dst = (unsigned short *)(base + out->offset_uv + row_uv * out->stride_uv) + region->x;
+        for (int i = 0; i < count; i++)
+        {
+            dst[2 * i] = u[i];
+            dst[2 * i + 1] = v[i];
+        }
+    }
+    else // NV12 and NV16
+    {
+        unsigned char *dst = base + out->offset_uv + row_uv * out->stride_uv + region->x;
+        for (int i = 0; i < count; i++)
+        {
+            dst[2 * i] = u[i] >> 2;
+            dst[2 * i + 1] = v[i] >> 2;
+        }
+    }
 }
 
-static void retreiveSentBuffers(PlinkHandle plink, StitcherPort *port)
+/* Convert the picture into the output format; each pair of rows gives one row of 4:2:0 chroma */
+static void composeConvertedBand(StitcherPort *out, StitcherJob *job, StitcherWorker *worker,
+                                 const KernelOps *kernels)
 {
-    PlinkStatus sts = PLINK_STATUS_OK;
-    PlinkPacket pkt = {0};
-    while (port->available_bufs < NUM_OF_BUFFERS && sts == PLINK_STATUS_OK)
+    StitcherPort *in = job->in;
+    StitcherRegion *region = &job->region;
+    int width = STITCHER_MIN(region->width, in->width);
+    int out_rgb = isRgbFormat(out->format);
+    int pairs = out->format != PLINK_COLOR_FormatYUV422SemiPlanar && out_rgb == 0;
+    int last = job->first + job->rows;
+    if (width <= 0)
+        return;
+
+    // two rows of three components, the chroma of the output, and the scratch of fetchRow
+    unsigned short *tmp = worker->convert;
+    unsigned short *c[2][3];
+    for (int i = 0; i < 2; i++)
+        for (int k = 0; k < 3; k++)
+            c[i][k] = tmp + (i * 3 + k) * width;
+
+    for (int r = job->first; r < last; )
     {
-        do
+        int rows = pairs && r + 1 < last ? 2 : 1;
+        for (int i = 0; i < rows; i++)
         {
-            sts = PLINK_recv(plink, port->id, &pkt);
-            int count = getBufferCount(&pkt);
-            if (count > 0)
+            int y = region->y + r + i;
+            if (fetchRow(out, in, r + i, width, c[i], tmp + 7 * width, kernels) != out_rgb)
+                kernels->convertColor(c[i][0], c[i][1], c[i][2], width, out_rgb ? &out->to_rgb : &out->to_yuv);
+
+            if (out_rgb)
             {
-                port->available_bufs += count;
+                int offset[3] = { out->offset, out->offset_uv, out->offset_v };
+                for (int k = 0; k < 3; k++)
+                    kernels->pack16to8(out->buffer + offset[k] + y * out->stride + region->x, c[i][k], width, 2);
             }
-        } while (sts == PLINK_STATUS_MORE_DATA);
+            else if (out->format == PLINK_COLOR_FormatYUV420SemiPlanarP010)
+                memcpy(out->buffer + out->offset + y * out->stride + region->x * 2, c[i][0], width * 2);
+            else
+                kernels->pack16to8(out->buffer + out->offset + y * out->stride + region->x, c[i][0], width, 2);
+
+            if (out_rgb == 0 && pairs == 0)
+                writeChroma(out, region, y, width, c[i], c[i], tmp + 6 * width);
+        }
+        if (pairs)
+            writeChroma(out, region, (region->y + r) / 2, width, c[0], c[rows - 1], tmp + 6 * width);
+        r += rows;
     }
 }
 
-static void *input_thread(void *args)
+/* Blend a rectangle of output pixels [x1, x2) x [y1, y2) into rows [first, last) of the plane.
+ * color is Y | U << 8 | V << 16. */
+static void fillRect(StitcherPort *out, StitchPlane plane, int x1, int y1, int x2, int y2,
+                     int first, int last, int color, const KernelOps *kernels)
 {
-    StitcherPort *port = (StitcherPort *)args;
-    PlinkHandle plink = NULL;
-    PlinkStatus sts = PLINK_STATUS_OK;
-    void *vmem = port->vmem;
+    unsigned short pattern = color & 0xFF;
+    int offset = out->offset;
+    if (plane == STITCH_PLANE_Chroma)
+    {
+        // the UV pairs covering the pixels
+        pattern = color >> 8;
+        offset = out->offset_uv;
+        x1 &= ~1;
+        x2 = (x2 + 1) & ~1;
+        y1 /= 2;
+        y2 = (y2 + 1) / 2;
+    }
+    else
+        pattern |= pattern << 8;
 
-    pthread_mutex_init(&port->pic_mutex, NULL);
+    y1 = STITCHER_MAX(y1, first);
+    y2 = STITCHER_MIN(y2, last);
+    if (x1 >= x2)
+        return;
+    for (int y = y1; y < y2; y++)
+        kernels->blendFill(out->buffer + offset + y * out->stride + x1, x2 - x1, pattern, out->alpha);
+}
 
-    if (PLINK_create(&plink, port->name, PLINK_MODE_CLIENT) != PLINK_STATUS_OK)
-        return NULL;
+/* Draw the detections of the input over its picture, into rows [first, last) of the plane in the output.
+ * The boxes are in pixels of the input picture, mapped and clipped to the area of the region showing it. */
+static void drawObjects(StitcherPort *out, StitcherTile *tile, StitchPlane plane, int first, int last,
+                        const KernelOps *kernels)
+{
+    StitcherPort *in = tile->in;
+    if (out->format != PLINK_COLOR_FormatYUV420SemiPlanar || out->alpha == 0 ||
+        in->num_objects == 0 || in->available_bufs <= 0 || in->width <= 0 || in->height <= 0)
+        return;
 
-    do
+    int left = tile->region.x;
+    int top = tile->region.y;
+    int width = STITCHER_MIN(tile->region.width, in->width);
+    int height = tile->height;
+    float scale_x = 1.0f;
+    float scale_y = 1.0f;
+    if (tile->scaled)
     {
-        sts = PLINK_connect_ex(plink, NULL, 1000);
-    } while (sts == PLINK_STATUS_TIMEOUT && *port->exit == 0);
-    if (sts != PLINK_STATUS_OK)
+        left += in->fit_x;
+        top += in->fit_y;
+        width = in->fit_width;
+        height = in->fit_height;
+        scale_x = (float)in->fit_width / in->width;
+        scale_y = (float)in->fit_height / in->height;
+    }
+
+    for (int n = 0; n < in->num_objects; n++)
     {
-        PLINK_close(plink, 0);
-        return NULL;
+        PlinkObjectDetect *object = &in->objects[n];
+        // the box in the output, inside the area of the picture
+        int x1 = STITCHER_MAX((int)(object->box.x1 * scale_x), 0);
+        int y1 = STITCHER_MAX((int)(object->box.y1 * scale_y), 0);
+        int x2 = STITCHER_MIN((int)(object->box.x2 * scale_x + 0.5f), width);
+        int y2 = STITCHER_MIN((int)(object->box.y2 * scale_y + 0.5f), height);
+        if (x1 < x2 && y1 < y2)
+        {
+            int line = OVERLAY_LINE_WIDTH;
+            x1 += left;
+            x2 += left;
+            y1 += top;
+            y2 += top;
+            fillRect(out, plane, x1, y1, x2, STITCHER_MIN(y1 + line, y2), first, last, OVERLAY_BOX_COLOR, kernels);
+            fillRect(out, plane, x1, STITCHER_MAX(y2 - line, y1 + line), x2, y2, first, last, OVERLAY_BOX_COLOR, kernels);
+            fillRect(out, plane, x1, y1 + line, STITCHER_MIN(x1 + line, x2), y2 - line, first, last, OVERLAY_BOX_COLOR, kernels);
+            fillRect(out, plane, STITCHER_MAX(x2 - line, x1 + line), y1 + line, x2, y2 - line, first, last,
+                     OVERLAY_BOX_COLOR, kernels);
+        }
+
+        for (int k = 0; k < 5; k++)
+        {
+            // unused landmarks are left at 0
+            if (object->landmark.x[k] <= 0.0f && object->landmark.y[k] <= 0.0f)
+                continue;
+            int x = (int)(object->landmark.x[k] * scale_x) - OVERLAY_POINT_SIZE / 2;
+            int y = (int)(object->landmark.y[k] * scale_y) - OVERLAY_POINT_SIZE / 2;
+            int px1 = STITCHER_MAX(x, 0);
+            int py1 = STITCHER_MAX(y, 0);
+            int px2 = STITCHER_MIN(x + OVERLAY_POINT_SIZE, width);
+            int py2 = STITCHER_MIN(y + OVERLAY_POINT_SIZE, height);
+            if (px1 < px2 && py1 < py2)
+                fillRect(out, plane, left + px1, top + py1, left + px2, top + py2, first, last,
+                         OVERLAY_POINT_COLOR, kernels);
+        }
     }
+}
 
-    pthread_mutex_lock(port->count_mutex);
-    port->index = *(port->in_count);
-    *(port->in_count) = *(port->in_count) + 1;
-    pthread_mutex_unlock(port->count_mutex);
+/* Compose the inputs overlapping the band, the lower z first */
+static void composeOutputBand(StitcherContext *ctx, StitcherBand *band, StitcherWorker *worker,
+                              const KernelOps *kernels)
+{
+    int chroma = band->plane == STITCH_PLANE_Chroma;
+    for (int t = 0; t < ctx->num_tiles; t++)
+    {
+        StitcherTile *tile = &ctx->tiles[t];
+        if (tile->dirty == 0)
+            continue;
+        int top = tile->region.y >> chroma;
+        int first = STITCHER_MAX(band->first, top);
+        int last = STITCHER_MIN(band->first + band->rows, top + (tile->height >> chroma));
+        if (first >= last)
+            continue;
 
-    PlinkPacket sendpkt = {0};
-    PlinkPacket recvpkt = {0};
-    PlinkMsg msg = {0};
-    VmemParams params;
-    int exitcode = 0;
-    do {
-        sts = PLINK_recv(plink, 0, &recvpkt);
-        if (sts == PLINK_STATUS_ERROR)
-            break;
+        StitcherJob job;
+        job.in = tile->in;
+        job.region = tile->region;
+        job.plane = band->plane;
+        job.first = first - top;
+        job.rows = last - first;
+        job.scaled = tile->scaled;
+        if (tile->converted)
+        {
+            composeConvertedBand(&ctx->out, &job, worker, kernels);
+            drawObjects(&ctx->out, tile, STITCH_PLANE_Luma, first, last, kernels);
+            drawObjects(&ctx->out, tile, STITCH_PLANE_Chroma, first / 2, (last + 1) / 2, kernels);
+            continue;
+        }
+        composeBand(&ctx->out, &job, worker, kernels);
+        drawObjects(&ctx->out, tile, band->plane, first, last, kernels);
 
-        for (int i = 0; i < recvpkt.num; i++)
+        // the bands are even, so these are the chroma rows under the luma rows
+        if (ctx->combined)
         {
-            PlinkDescHdr *hdr = (PlinkDescHdr *)(recvpkt.list[i]);
-            if (hdr->type == PLINK_TYPE_2D_YUV || 
-                hdr->type == PLINK_TYPE_2D_RAW)
-            {
-                // return previous buffer to source
-                if (sendpkt.num > 0)
-                {
-                    if (port->index == 0)
-                        sem_wait(port->sem_done);
-                    pthread_mutex_lock(&port->pic_mutex);
-                    if (VMEM_release(vmem, &params) != VMEM_STATUS_OK)
-                        fprintf(stderr, "[STITCHER] ERROR: Failed to release buffer.\n");
-                    sts = PLINK_send(plink, 0, &sendpkt);
-                    if (sts == PLINK_STATUS_ERROR)
-                        break;
-                    if (sendpkt.fd != PLINK_INVALID_FD)
-                        close(sendpkt.fd);
-                    port->available_bufs--;
-                    sendpkt.num = 0;
-                }
-                else
-                    pthread_mutex_lock(&port->pic_mutex);
+            job.plane = STITCH_PLANE_Chroma;
+            job.first = (first - top) / 2;
+            job.rows = STITCHER_MIN((last - top + 1) / 2, tile->height >> 1) - job.first;
+            composeBand(&ctx->out, &job, worker, kernels);
+            drawObjects(&ctx->out, tile, STITCH_PLANE_Chroma, top / 2 + job.first, top / 2 + job.first + job.rows, kernels);
+        }
+    }
+}
 
-                memset(&params, 0, sizeof(params));
-                if (recvpkt.fd != PLINK_INVALID_FD)
-                {
-                    params.fd = recvpkt.fd;
-                    if (VMEM_import(vmem, &params) != VMEM_STATUS_OK)
-                        break;
-                    if (VMEM_mmap(vmem, &params) != VMEM_STATUS_OK)
-                        break;
-                }
+/* A band of the frame, run by the threads of the node */
+static void composeJob(int job, void *arg)
+{
+    StitcherContext *ctx = (StitcherContext *)arg;
+    composeOutputBand(ctx, &ctx->jobs[job], &ctx->workers[job], KERNEL_get());
+}
 
-                if (port->index == 0)
-                    sem_post(port->sem_ready); // signal output thread that one picture is ready
-            }
+/* Size of StitcherWorker.convert for bands up to width pixels */
+#define CONVERT_SCRATCH_SIZE(width)     (((width) * 7 + 3 * ((width) + 2)) * sizeof(unsigned short))
 
-            if (hdr->type == PLINK_TYPE_2D_YUV)
-            {
-                PlinkYuvInfo *pic = (PlinkYuvInfo *)(recvpkt.list[i]);
-                printf("[STITCHER] Input%d: Received YUV frame %d 0x%010llx from %s: fd %d, %dx%d, stride = luma %d, chroma %d\n", 
-                        port->index, pic->header.id, pic->bus_address_y, port->name, recvpkt.fd,
-                        pic->pic_width, pic->pic_height,
-                        pic->stride_y, pic->stride_u);
-
-                port->buffer = params.vir_address;
-                port->format = pic->format;
-                port->width = pic->pic_width;
-                port->height = pic->pic_height;
-                port->stride = pic->stride_y;
-                port->offset = pic->offset_y;
-                port->offset_uv = pic->offset_u > 0 ? pic->offset_u : (pic->offset_y + pic->pic_height*pic->stride_y);
-            }
-            else if (hdr->type == PLINK_TYPE_2D_RAW)
-            {
-                PlinkRawInfo *img = (PlinkRawInfo *)(recvpkt.list[i]);
-                printf("[STITCHER] Input%d: Received RAW frame %d 0x%010llx from %s: fd %d, %dx%d, stride %d\n", 
-                        port->index, img->header.id, img->bus_address, port->name, recvpkt.fd,
-                        img->img_width, img->img_height, img->stride);
-
-                port->buffer = params.vir_address;
-                port->format = img->format;
-                port->width = img->img_width;
-                port->height = img->img_height;
-                port->stride = img->stride;
-                port->offset = img->offset;
-            }
-            else if (hdr->type == PLINK_TYPE_MESSAGE)
-            {
-                PlinkMsg *msg = (PlinkMsg *)(recvpkt.list[i]);
-                if (msg->msg == PLINK_EXIT_CODE)
-                {
-                    exitcode = 1;
-                    printf("[STITCHER] Input %d: Exit\n", port->index);
-                    break;
-                }
-            }
+/* One worker per band, at most two bands of each plane for each thread */
+static int initWorkers(StitcherContext *ctx)
+{
+    ctx->num_workers = STITCHER_MIN(ctx->threads * 2 * 2, MAX_NUM_OF_JOBS);
+    ctx->scratch_size = 0;
+    // the bands are at most as wide as the output
+    for (int i = 0; i < ctx->num_workers; i++)
+    {
+        ctx->workers[i].convert = malloc(CONVERT_SCRATCH_SIZE(ctx->out.width));
+        if (ctx->workers[i].convert == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+static void freeWorkers(StitcherContext *ctx)
+{
+    for (int i = 0; i < MAX_NUM_OF_JOBS; i++)
+    {
+        free(ctx->workers[i].scratch);
+        free(ctx->workers[i].convert);
+        ctx->workers[i].scratch = NULL;
+        ctx->workers[i].convert = NULL;
+    }
+}
+
+/* Grow the scratch of the workers to size bytes, between frames.
+ * It only happens when an input is scaled from a larger resolution than before. */
+static int reserveScratch(StitcherContext *ctx, int size)
+{
+    if (size <= ctx->scratch_size)
+        return 0;
+    for (int i = 0; i < ctx->num_workers; i++)
+    {
+        free(ctx->workers[i].scratch);
+        ctx->workers[i].scratch = malloc(size);
+        if (ctx->workers[i].scratch == NULL)
+        {
+            ctx->scratch_size = 0;
+            return -1;
+        }
+    }
+    ctx->scratch_size = size;
+    return 0;
+}
+
+/* Split one plane of the output into bands, about two for each thread to balance uneven bands */
+static void addJobs(StitcherContext *ctx, StitchPlane plane, int height)
+{
+    int bands = STITCHER_MIN(ctx->threads * 2, height / MIN_BAND_HEIGHT);
+    if (bands < 1)
+        bands = 1;
+    // even, so a band of luma rows covers whole rows of 4:2:0 chroma
+    int rows = ((height + bands - 1) / bands + 1) & ~1;
+    for (int first = 0; first < height; first += rows)
+    {
+        StitcherBand *band = &ctx->jobs[ctx->num_jobs++];
+        band->plane = plane;
+        band->first = first;
+        band->rows = STITCHER_MIN(rows, height - first);
+    }
+}
+
+static long long getTimeUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-            if (hdr->type == PLINK_TYPE_2D_YUV ||
-                hdr->type == PLINK_TYPE_2D_RAW)
+/* Show the frame the node gives for the input; the region is only composed again when it is a new one.
+ * Without a frame, before the first one of the producer, the input is shown as black. */
+static void showPicture(StitcherPort *in, PlinkNodeFrame *frame)
+{
+    if (frame == NULL || frame->data == NULL)
+    {
+        if (in->available_bufs > 0)
+        {
+            in->available_bufs = 0;
+            in->generation++;
+        }
+        return;
+    }
+    if (in->available_bufs > 0 && in->shown_joined == in->joined && in->shown_sequence == frame->sequence)
+        return;
+
+    printf("[STITCHER] Input%d: Received frame %u %d from %s: format %d, %dx%d, stride %u\n",
+            in->index, frame->sequence, frame->id, in->name, frame->format, frame->width, frame->height, frame->stride[0]);
+    in->shown_joined = in->joined;
+    in->shown_sequence = frame->sequence;
+    in->buffer = frame->data;
+    in->format = frame->format;
+    in->width = frame->width;
+    in->height = frame->height;
+    in->stride = frame->stride[0];
+    in->offset = frame->offset[0];
+    in->offset_uv = frame->offset[1];
+    in->offset_v = frame->offset[2];
+    in->stride_uv = frame->stride[1];
+    in->tile_width = frame->tile_width;
+    in->tile_height = frame->tile_height;
+    in->pattern = frame->pattern;
+    in->available_bufs = 1;
+    in->generation++;
+}
+
+/* Take the detections received since the last frame; the region is composed again to draw them */
+static void acquireObjects(StitcherPort *in)
+{
+    pthread_mutex_lock(&in->object_mutex);
+    if (in->objects_seq != in->shown_objects_seq)
+    {
+        in->shown_objects_seq = in->objects_seq;
+        in->num_objects = in->num_received_objects;
+        memcpy(in->objects, in->received_objects, in->num_objects * sizeof(PlinkObjectDetect));
+        in->generation++;
+    }
+    pthread_mutex_unlock(&in->object_mutex);
+}
+
+static int isOverlapped(StitcherRegion *a, StitcherRegion *b)
+{
+    return a->x < b->x + b->width && b->x < a->x + a->width &&
+           a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/* Find the regions of the buffer which are not current: the input has a new picture since the buffer was composed,
+ * or a region below it in z-order is composed again */
+static void markDirtyTiles(StitcherContext *ctx, StitcherBufferState *state)
+{
+    int changed = state->topology != ctx->topology;
+    for (int t = 0; t < ctx->num_tiles; t++)
+    {
+        StitcherTile *tile = &ctx->tiles[t];
+        tile->dirty = changed || state->generation[tile->in->slot] != tile->in->generation;
+        for (int u = 0; u < t && tile->dirty == 0; u++)
+        {
+            if (ctx->tiles[u].dirty && isOverlapped(&ctx->tiles[u].region, &tile->region))
+                tile->dirty = 1;
+        }
+
+        state->generation[tile->in->slot] = tile->in->generation;
+        if (tile->dirty)
+            ctx->composed++;
+        else
+            ctx->skipped++;
+    }
+    state->topology = ctx->topology;
+}
+
+/* Paint the buffer black, the areas no input covers would otherwise keep the pictures of an older layout */
+static void clearPicture(StitcherPort *out)
+{
+    unsigned char *buffer = out->buffer;
+    int size = out->stride * out->height;
+    if (isRgbFormat(out->format))
+    {
+        memset(buffer, 0, size * 3);
+        return;
+    }
+
+    memset(buffer + out->offset, 0, size);
+    if (out->format == PLINK_COLOR_FormatYUV420SemiPlanarP010)
+    {
+        unsigned short *chroma = (unsigned short *)(buffer + out->offset_uv);
+        for (int i = 0; i < size / 4; i++)
+            chroma[i] = 512;
+    }
+    else
+        memset(buffer + out->offset_uv, 0x80, out->format == PLINK_COLOR_FormatYUV422SemiPlanar ? size : size / 2);
+}
+
+/* Compose the pictures of the inputs into the buffer, in bands on the threads of the node */
+static void composeFrame(StitcherContext *ctx, PlinkNodeFrame *inputs[], StitcherBufferState *state)
+{
+    StitcherPort *out = &ctx->out;
+
+    for (int t = 0; t < ctx->num_tiles; t++)
+    {
+        StitcherTile *tile = &ctx->tiles[t];
+        StitcherPort *in = tile->in;
+        showPicture(in, inputs[in->slot]);
+        acquireObjects(in);
+        tile->scaled = 0;
+        tile->converted = needsConversion(out, in);
+        if (out->scale != STITCH_SCALE_Crop && tile->converted == 0 && in->tile_width == 0)
+            tile->scaled = updateScaler(in, &tile->region, out->scale);
+        tile->height = tile->scaled ? tile->region.height : STITCHER_MIN(tile->region.height, in->height);
+        if (tile->scaled)
+        {
+            int size = STITCHER_MAX(KERNEL_getScratchSize(&in->scaler[STITCH_PLANE_Luma]),
+                                    KERNEL_getScratchSize(&in->scaler[STITCH_PLANE_Chroma]));
+            if (reserveScratch(ctx, size) != 0)
             {
-                port->available_bufs++;
-                pthread_mutex_unlock(&port->pic_mutex);
-
-                msg.header.type = PLINK_TYPE_MESSAGE;
-                msg.header.size = DATA_SIZE(PlinkMsg);
-                msg.msg = hdr->id;
-                sendpkt.list[0] = &msg;
-                sendpkt.num = 1;
-                sendpkt.fd = recvpkt.fd;
+                fprintf(stderr, "[STITCHER] ERROR: Failed to allocate the scratch to scale input %d\n", in->index);
+                tile->scaled = 0;
+                tile->height = STITCHER_MIN(tile->region.height, in->height);
             }
         }
-    } while (exitcode == 0 && *port->exit == 0 && sts != PLINK_STATUS_ERROR);
+    }
+    if (state->topology != ctx->topology)
+        clearPicture(out);
+    markDirtyTiles(ctx, state);
+
+    ctx->num_jobs = 0;
+    // the converted inputs are composed by rows of all the planes, the others follow the same z-order
+    ctx->combined = 0;
+    for (int t = 0; t < ctx->num_tiles; t++)
+        ctx->combined |= ctx->tiles[t].converted;
+    addJobs(ctx, STITCH_PLANE_Luma, out->height);
+    if (ctx->combined == 0)
+        addJobs(ctx, STITCH_PLANE_Chroma, out->height / 2);
+
+    // the frame is complete when all the bands are done
+    PLINK_NODE_parallel(ctx->node, ctx->num_jobs, composeJob, ctx);
+}
+
+/* Processing callback of the node: compose the pictures of the inputs into the output buffer,
+ * or in zero-copy mode give each producer its window of the buffer to render into */
+static int stitchFrame(PlinkNode node, PlinkNodeFrame *inputs[], PlinkNodeFrame *outputs[], void *arg)
+{
+    StitcherContext *ctx = (StitcherContext *)arg;
+    StitcherPort *out = &ctx->out;
+    PlinkNodeFrame *frame = outputs[0];
 
-    if (sendpkt.num > 0)
+    out->buffer = frame->data;
+    updateTiles(ctx);
+    if (ctx->zerocopy)
     {
-        pthread_mutex_lock(&port->pic_mutex);
-        if (VMEM_release(vmem, &params) != VMEM_STATUS_OK)
-            fprintf(stderr, "[STITCHER] ERROR: Failed to release buffer.\n");
-        sts = PLINK_send(plink, 0, &sendpkt);
-        port->available_bufs--;
-        pthread_mutex_unlock(&port->pic_mutex);
+        for (int t = 0; t < ctx->num_tiles; t++)
+        {
+            StitcherRegion *region = &ctx->tiles[t].region;
+            PLINK_NODE_setWindow(node, ctx->tiles[t].in->slot, region->x, region->y, region->width, region->height);
+        }
     }
+    else
+        composeFrame(ctx, inputs, &ctx->buffers[frame->id - 1]);
+
+    if (isRgbFormat(frame->format))
+        printf("[STITCHER] Processed frame %d 0x%010llx: %dx%d, stride %u\n",
+                frame->id - 1, frame->bus_address + frame->offset[0], frame->width, frame->height, frame->stride[0]);
+    else
+        printf("[STITCHER] Processed frame %d 0x%010llx: %dx%d, stride = luma %u, chroma %u\n",
+                frame->id - 1, frame->bus_address + frame->offset[0], frame->width, frame->height,
+                frame->stride[0], frame->stride[1]);
+    ctx->last_us = getTimeUs();
+    if (ctx->first_us == 0)
+        ctx->first_us = ctx->last_us;
+    return 0;
+}
+
+/* Receive callback of the node: keep the detections of a PLINK_TYPE_OBJECT descriptor, drawn over
+ * the input from the next frame on. The PlinkObjectDetect array follows the descriptor, or is at the start
+ * of the buffer of a packet without picture. Called with pkt NULL when a new producer connects. */
+static void receiveObjects(int input, PlinkPacket *pkt, const void *data, unsigned int size, void *arg)
+{
+    StitcherContext *ctx = (StitcherContext *)arg;
+    StitcherPort *port = &ctx->in[input];
+    PlinkObjectInfo *info = NULL;
+    const PlinkObjectDetect *objects = NULL;
+    int count = 0;
 
-    if (port->index == 0)
+    if (pkt != NULL)
     {
-        *port->exit = 1;
-        sem_post(port->sem_ready);
+        for (int i = 0; i < pkt->num; i++)
+        {
+            PlinkDescHdr *hdr = (PlinkDescHdr *)(pkt->list[i]);
+            if (hdr->type == PLINK_TYPE_OBJECT)
+                info = (PlinkObjectInfo *)(pkt->list[i]);
+        }
+        if (info == NULL)
+            return;
+
+        count = STITCHER_MIN(info->object_cnt, MAX_NUM_OF_OBJECTS);
+        if (info->header.size >= DATA_SIZE(PlinkObjectInfo) + count * sizeof(PlinkObjectDetect))
+            objects = (const PlinkObjectDetect *)(info + 1);
+        else if (data != NULL && size >= count * sizeof(PlinkObjectDetect))
+            objects = (const PlinkObjectDetect *)data;
+        if (objects == NULL)
+            count = 0;
+        printf("[STITCHER] Input %d: Received %d objects from %s\n", input, count, port->name);
     }
-    msg.header.type = PLINK_TYPE_MESSAGE;
-    msg.header.size = DATA_SIZE(PlinkMsg);
-    msg.msg = PLINK_EXIT_CODE;
-    sendpkt.list[0] = &msg;
-    sendpkt.num = 1;
-    sendpkt.fd = PLINK_INVALID_FD;
-    sts = PLINK_send(plink, 0, &sendpkt);
-    PLINK_close(plink, 0);
-    pthread_mutex_destroy(&port->pic_mutex);
-    return NULL;
+
+    // the detections of the previous producer do not apply
+    pthread_mutex_lock(&port->object_mutex);
+    port->num_received_objects = count;
+    if (count > 0)
+        memcpy(port->received_objects, objects, count * sizeof(PlinkObjectDetect));
+    port->objects_seq++;
+    pthread_mutex_unlock(&port->object_mutex);
+}
+
+static void onSignal(int signo)
+{
+    (void)signo;
+    PLINK_NODE_stop(node);
 }
 
 int main(int argc, char **argv) {
-    PlinkStatus sts = PLINK_STATUS_OK;
     StitcherParams params;
     StitcherContext ctx;
-    PlinkHandle plink = NULL;
-    PlinkPacket pkt = {0};
-    PlinkYuvInfo pic;
-    PlinkMsg msg;
+    PlinkNodeFrame frame;
+    PlinkNodeStats stats;
 
     parseParams(argc, argv, &params);
     if (checkParams(&params) != 0)
@@ -653,114 +1654,88 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    memset(&ctx, 0, sizeof(ctx));
+    signal(SIGPIPE, SIG_IGN); // a producer or the consumer may leave while a message is sent
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
 
-    void *vmem = NULL;
-    if (VMEM_create(&vmem) != VMEM_STATUS_OK)
-        errExit("Failed to create VMEM.");
-
-    int width = params.width;
-    int height = params.height;
-    int stride = params.stride;
-    StitchLayout layout = params.layout;
-    int size = getBufferSize(&params);
-    if (size == 0)
-        errExit("Wrong format or wrong resolution.");
-    PictureBuffer picbuffers[NUM_OF_BUFFERS];
-    AllocateBuffers(picbuffers, size, vmem);
-
-    sem_init(&ctx.sem_ready, 0, 0);
-    sem_init(&ctx.sem_done, 0, 0);
-    pthread_mutex_init(&ctx.count_mutex, NULL);
-
-    pthread_t thread_in[MAX_NUM_OF_INPUTS];
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    for (int i = 0; i < MAX_NUM_OF_INPUTS; i++)
+    memset(&ctx, 0, sizeof(ctx));
+    // only the configured inputs get a thread
+    ctx.inputs = params.inputs;
+    ctx.threads = params.threads;
+    ctx.zerocopy = params.zerocopy;
+    ctx.layout = params.regions;
+    for (int i = 0; i < ctx.inputs; i++)
     {
         ctx.in[i].name = params.in_name[i];
-        ctx.in[i].count_mutex = &ctx.count_mutex;
-        ctx.in[i].sem_ready = &ctx.sem_ready;
-        ctx.in[i].sem_done = &ctx.sem_done;
-        ctx.in[i].in_count = &ctx.in_count;
-        ctx.in[i].exit = &ctx.exitcode;
-        ctx.in[i].vmem = vmem;
-        if (pthread_create(&thread_in[i], &attr, input_thread, &ctx.in[i]) != 0)
-            fprintf(stderr, "[STITCHER] ERROR: Failed to create thread for input %d\n", i);
+        ctx.in[i].slot = i;
+        pthread_mutex_init(&ctx.in[i].object_mutex, NULL);
     }
 
-    sts = PLINK_create(&plink, params.out_name, PLINK_MODE_SERVER);
+    if (PLINK_NODE_create(&node, stitchFrame, &ctx) != PLINK_STATUS_OK ||
+        PLINK_NODE_initFrame(&frame, params.format, params.width, params.height, params.stride) != PLINK_STATUS_OK ||
+        PLINK_NODE_addOutput(node, params.out_name, &frame, NUM_OF_BUFFERS) != PLINK_STATUS_OK)
+    {
+        fprintf(stderr, "[STITCHER] ERROR: Failed to create the node\n");
+        if (node != NULL)
+            PLINK_NODE_destroy(node);
+        return 1;
+    }
+    for (int i = 0; i < ctx.inputs; i++)
+    {
+        if (PLINK_NODE_addInput(node, params.in_name[i]) != PLINK_STATUS_OK)
+            fprintf(stderr, "[STITCHER] ERROR: Failed to add input %d\n", i);
+    }
+    ctx.node = node;
+    PLINK_NODE_setReceive(node, receiveObjects);
+    PLINK_NODE_setOption(node, PLINK_NODE_OPTION_THREADS, params.threads);
+    PLINK_NODE_setOption(node, PLINK_NODE_OPTION_KEEP, params.keep);
+    PLINK_NODE_setOption(node, PLINK_NODE_OPTION_RATE, params.fps);
+    PLINK_NODE_setOption(node, PLINK_NODE_OPTION_LATENCY, params.latency);
+    PLINK_NODE_setOption(node, PLINK_NODE_OPTION_WINDOWS, params.zerocopy);
+    PLINK_NODE_setOption(node, PLINK_NODE_OPTION_CONSUMERS, params.consumers);
+    PLINK_NODE_setOption(node, PLINK_NODE_OPTION_MAX_AGE, params.max_age);
 
     StitcherPort *out = &ctx.out;
-    out->available_bufs = NUM_OF_BUFFERS;
-    out->count_mutex = &ctx.count_mutex;
-    out->sem_ready = &ctx.sem_ready;
-    out->sem_done = &ctx.sem_done;
     out->format = params.format;
     out->layout = params.layout;
-    out->width = params.width;
-    out->height = params.height;
-    out->stride = params.stride;
-    out->offset = 0;
-    out->offset_uv = params.height * params.stride;
-    out->exit = &ctx.exitcode;
-    sts = PLINK_connect(plink, &out->id);
-
-    int exitcode = 0;
-    do {
-        int sendid = out->sendid;
-        out->buffer = picbuffers[sendid].virtual_address;
-        if (stitchOneFrame(&ctx) != 0)
-            break;
-        constructYuvInfo(&pic, &params, picbuffers[sendid].bus_address, sendid);
-        printf("[STITCHER] Processed frame %d 0x%010llx: %dx%d, stride = luma %d, chroma %d\n", 
-                sendid, pic.bus_address_y, 
-                pic.pic_width, pic.pic_height,
-                pic.stride_y, pic.stride_u);
-
-        pkt.list[0] = &pic;
-        pkt.num = 1;
-        pkt.fd = picbuffers[sendid].fd;
-        sts = PLINK_send(plink, out->id, &pkt);
-        out->sendid = (out->sendid + 1) % NUM_OF_BUFFERS;
-        out->available_bufs -= 1;
-
-        int timeout = out->available_bufs == 0 ? 100 : 0;
-        if (PLINK_wait(plink, out->id, timeout) == PLINK_STATUS_OK)
-        {
-            do
-            {
-                sts = PLINK_recv(plink, out->id, &pkt);
-                int count = getBufferCount(&pkt);
-                if (count < 0)
-                    exitcode = 1;
-                out->available_bufs += count;
-            } while (sts == PLINK_STATUS_MORE_DATA);
-        }
-    } while (exitcode == 0);
-
-cleanup:
-    ctx.exitcode = 1;
-    sem_post(&ctx.sem_done);
-    msg.header.type = PLINK_TYPE_MESSAGE;
-    msg.header.size = DATA_SIZE(PlinkMsg);
-    msg.msg = PLINK_EXIT_CODE;
-    pkt.list[0] = &msg;
-    pkt.num = 1;
-    pkt.fd = PLINK_INVALID_FD;
-    sts = PLINK_send(plink, out->id, &pkt);
-    retreiveSentBuffers(plink, out);
-    PLINK_recv_ex(plink, out->id, &pkt, 1000);
-    for (int i = 0; i < MAX_NUM_OF_INPUTS; i++)
-        pthread_join(thread_in[i], NULL);
-    //sleep(1); // Sleep one second to make sure client is ready for exit
-    if (vmem)
-        FreeBuffers(picbuffers, vmem);
-    PLINK_close(plink, PLINK_CLOSE_ALL);
-    VMEM_destroy(vmem);
-    pthread_mutex_destroy(&ctx.count_mutex);
-    sem_destroy(&ctx.sem_ready);
-    sem_destroy(&ctx.sem_done);
-    exit(EXIT_SUCCESS);
-}
+    out->scale = params.scale;
+    out->alpha = params.alpha + (params.alpha >> 7);   // 255 is opaque
+    out->demosaic = params.demosaic;
+    for (int k = 0; k < 3; k++)
+        out->gain[k] = (unsigned short)(params.gain[k] * 256 + 0.5f);
+    out->width = frame.width;
+    out->height = frame.height;
+    // offset, offset_uv and offset_v are red, green and blue for RGB output
+    out->stride = frame.stride[0];
+    out->stride_uv = frame.stride[1];
+    out->offset = frame.offset[0];
+    out->offset_uv = frame.offset[1];
+    out->offset_v = frame.offset[2];
+    KernelColorSpace space = params.color >= STITCH_COLOR_BT709 ? KERNEL_COLOR_BT709 : KERNEL_COLOR_BT601;
+    int full_range = params.color == STITCH_COLOR_BT601Full || params.color == STITCH_COLOR_BT709Full;
+    KERNEL_initColorMatrix(&out->to_rgb, space, full_range, 1);
+    KERNEL_initColorMatrix(&out->to_yuv, space, full_range, 0);
+    if (initWorkers(&ctx) != 0)
+        errExit("Failed to allocate the scratch of the workers.");
 
+    PlinkStatus sts = PLINK_NODE_run(node);
+
+    PLINK_NODE_getStats(node, &stats);
+    if (params.zerocopy == 0)
+        printf("[STITCHER] Composed %llu regions, skipped %llu already current\n", ctx.composed, ctx.skipped);
+    if (stats.sent > 0)
+    {
+        double seconds = (ctx.last_us - ctx.first_us) / 1e6;
+        printf("[STITCHER] Sent %d frames in %.2f s, %.2f fps, dropped %d\n", (int)stats.sent,
+                seconds, seconds > 0 ? (stats.sent - 1) / seconds : 0, (int)stats.dropped);
+    }
+    PLINK_NODE_destroy(node);
+    freeWorkers(&ctx);
+    for (int i = 0; i < ctx.inputs; i++)
+    {
+        KERNEL_freeScaler(&ctx.in[i].scaler[STITCH_PLANE_Luma]);
+        KERNEL_freeScaler(&ctx.in[i].scaler[STITCH_PLANE_Chroma]);
+        pthread_mutex_destroy(&ctx.in[i].object_mutex);
+    }
+    return sts == PLINK_STATUS_OK ? 0 : 1;
+}